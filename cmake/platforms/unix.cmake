@@ -116,6 +116,7 @@ endfunction()
 
 add_optional_system_lib(m pow)
 add_optional_system_lib(rt clock_gettime)
+add_optional_system_lib(pthread pthread_create)
 add_optional_system_lib(xnet socket)
 
 set(extra_dirs charset)
@@ -170,6 +170,12 @@ CONF_ENUM(log_to_existing_file,
     VALUE(LGXF_ASK, -1),
 )
 
+CONF_ENUM(log_overflow,
+    VALUE(LGOV_BLOCK, 0),
+    VALUE(LGOV_DROP, 1),
+    VALUE(LGOV_GROW, 2),
+)
+
 CONF_ENUM(bold_style,
     VALUE(BOLD_STYLE_FONT, 0),
     VALUE(BOLD_STYLE_COLOUR, 1),
@@ -707,6 +707,11 @@ CONF_OPTION(savelines,
     DEFAULT_INT(2000),
     SAVE_KEYWORD("ScrollbackLines"),
 )
+CONF_OPTION(scrollback_max_kb, /* 0 means limited only by savelines */
+    VALUE_TYPE(INT),
+    DEFAULT_INT(0),
+    SAVE_KEYWORD("ScrollbackMaxKB"),
+)
 CONF_OPTION(dec_om,
     VALUE_TYPE(BOOL),
     DEFAULT_BOOL(false),
@@ -797,6 +802,11 @@ CONF_OPTION(resize_action,
     SAVE_KEYWORD("LockSize"),
     STORAGE_ENUM(resize_effect),
 )
+CONF_OPTION(reflow_on_resize,
+    VALUE_TYPE(BOOL),
+    DEFAULT_BOOL(false),
+    SAVE_KEYWORD("ReflowOnResize"),
+)
 CONF_OPTION(bce,
     VALUE_TYPE(BOOL),
     DEFAULT_BOOL(true),
@@ -853,6 +863,17 @@ CONF_OPTION(logflush,
     DEFAULT_BOOL(true),
     SAVE_KEYWORD("LogFlush"),
 )
+CONF_OPTION(logoverflow, /* what to do if the log file can't keep up */
+    VALUE_TYPE(INT),
+    DEFAULT_INT(LGOV_BLOCK),
+    SAVE_KEYWORD("LogOverflow"),
+    STORAGE_ENUM(log_overflow),
+)
+CONF_OPTION(logsyncinterval, /* seconds between syncs to disk; 0 = never */
+    VALUE_TYPE(INT),
+    DEFAULT_INT(0),
+    SAVE_KEYWORD("LogSyncInterval"),
+)
 CONF_OPTION(logheader,
     VALUE_TYPE(BOOL),
     DEFAULT_BOOL(true),
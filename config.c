@@ -2000,6 +2000,15 @@ void setup_config_box(struct controlbox *b, bool midsession,
     ctrl_checkbox(s, "Flush log file frequently", 'u',
                   HELPCTX(logging_flush),
                   conf_checkbox_handler, I(CONF_logflush));
+    ctrl_radiobuttons(s, "What to do if the log file can't keep up:", 'c', 1,
+                      HELPCTX(logging_overflow),
+                      conf_radiobutton_handler, I(CONF_logoverflow),
+                      "Wait for it to catch up", I(LGOV_BLOCK),
+                      "Leave data out of the log", I(LGOV_DROP),
+                      "Keep the data in memory", I(LGOV_GROW));
+    ctrl_editbox(s, "Seconds between syncs to disk (0 to turn off)", 'y', 20,
+                 HELPCTX(logging_syncinterval),
+                 conf_editbox_handler, I(CONF_logsyncinterval), ED_INT);
     ctrl_checkbox(s, "Include header", 'i',
                   HELPCTX(logging_header),
                   conf_checkbox_handler, I(CONF_logheader));
@@ -2225,6 +2234,9 @@ void setup_config_box(struct controlbox *b, bool midsession,
                          conf_editbox_handler, I(CONF_height),ED_INT);
         c->column = 1;
         ctrl_columns(s, 1, 100);
+        ctrl_checkbox(s, "Rewrap lines when the width changes", 'w',
+                      HELPCTX(window_reflow),
+                      conf_checkbox_handler, I(CONF_reflow_on_resize));
     }
 
     s = ctrl_getset(b, "Window", "scrollback",
@@ -2232,6 +2244,9 @@ void setup_config_box(struct controlbox *b, bool midsession,
     ctrl_editbox(s, "Lines of scrollback", 's', 50,
                  HELPCTX(window_scrollback),
                  conf_editbox_handler, I(CONF_savelines), ED_INT);
+    ctrl_editbox(s, "Scrollback memory limit in KB (0 = none)", 'y', 50,
+                 HELPCTX(window_scrollback),
+                 conf_editbox_handler, I(CONF_scrollback_max_kb), ED_INT);
     ctrl_checkbox(s, "Display scrollbar", 'd',
                   HELPCTX(window_scrollback),
                   conf_checkbox_handler, I(CONF_scrollbar));
@@ -337,5 +337,18 @@ NI_ENC_DEC(128)
 NI_ENC_DEC(192)
 NI_ENC_DEC(256)
 
+bool aes_ni_gcm_state(ssh_cipher *ciph, const void **keysched,
+                      size_t *rounds, void **counter)
+{
+    if (ciph->vt->next_message != aes_ni_next_message_gcm)
+        return false;
+
+    aes_ni_context *ctx = container_of(ciph, aes_ni_context, ciph);
+    *keysched = ctx->keysched_e;
+    *rounds = ctx->ciph.vt->real_keybits / 32 + 6;
+    *counter = &ctx->iv;
+    return true;
+}
+
 AES_EXTRA(_ni);
 AES_ALL_VTABLES(_ni, "AES-NI accelerated");
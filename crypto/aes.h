@@ -2,6 +2,9 @@
  * Definitions likely to be helpful to multiple AES implementations.
  */
 
+#ifndef PUTTY_AES_H
+#define PUTTY_AES_H
+
 /*
  * The 'extra' structure used by AES implementations is used to
  * include information about how to check if a given implementation is
@@ -46,6 +49,19 @@ static inline void aes_encrypt_ecb_block(ssh_cipher *ciph, void *blk)
     extra->encrypt_ecb_block(ciph, blk);
 }
 
+/*
+ * Extra API function provided by the AES-NI implementation, so that
+ * the stitched x86 AES-GCM MACs can generate its GCM keystream
+ * themselves, in the same pass as evaluating the polynomial. If
+ * 'ciph' is an AES-NI GCM cipher, this returns its encryption key
+ * schedule and number of rounds, and a pointer to its counter block,
+ * which is a 16-byte vector holding the IV in reverse byte order (so
+ * that the 32-bit block counter is the low word). Otherwise it
+ * returns false.
+ */
+bool aes_ni_gcm_state(ssh_cipher *ciph, const void **keysched,
+                      size_t *rounds, void **counter);
+
 /*
  * Macros to define vtables for AES variants. There are a lot of
  * these, because of the cross product between cipher modes, key
@@ -158,3 +174,5 @@ extern const uint8_t aes_key_setup_round_constants[10];
  * The largest number of round keys ever needed.
  */
 #define MAXROUNDKEYS 15
+
+#endif /* PUTTY_AES_H */
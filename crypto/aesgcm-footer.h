@@ -89,6 +89,19 @@
  *    // Zero out the state structure to avoid information leaks if the
  *    // memory is reused, and then free it.
  *    static void aesgcm_foo_free(aesgcm_foo *ctx);
+ *
+ *  - if the implementation can run the cipher's keystream itself in
+ *    the same pass as evaluating the polynomial, then #define
+ *    SPECIAL_CRYPT and define this additional function:
+ *
+ *    // Encrypt or decrypt 'nblocks' whole 16-byte blocks in place
+ *    // using ctx->cipher, folding each block of ciphertext into the
+ *    // accumulator as coeff() would. Return the number of blocks
+ *    // processed, which may be zero if ctx->cipher isn't a cipher
+ *    // implementation this function knows how to drive.
+ *    static size_t aesgcm_foo_crypt_blocks(
+ *        aesgcm_foo *ctx, unsigned char *blk, size_t nblocks,
+ *        bool encrypt);
  */
 
 #ifndef AESGCM_FLAVOUR
@@ -272,6 +285,51 @@ static void PREFIX(mac_BinarySink_write)(
     }
 }
 
+/*
+ * Encrypt or decrypt some ciphertext and fold it in to the MAC. This
+ * is equivalent to calling the cipher and then put_data (in whichever
+ * order makes the MAC see the ciphertext), but if the implementation
+ * provides crypt_blocks() and we're at a block boundary in the
+ * ciphertext, it can do the whole blocks in one pass.
+ */
+static void PREFIX(mac_crypt_and_update)(
+    ssh2_mac *mac, void *vblk, int len, bool encrypt)
+{
+    CONTEXT *ctx = container_of(mac, CONTEXT, mac);
+    unsigned char *blk = (unsigned char *)vblk;
+
+#ifdef SPECIAL_CRYPT
+    if (ctx->skipgot == ctx->skiplen && ctx->aadgot == ctx->aadlen &&
+        ctx->partlen == 0) {
+        size_t done = 16 * PREFIX(crypt_blocks)(ctx, blk, len / 16, encrypt);
+        blk += done;
+        len -= done;
+        ctx->ciphertextlen += done;
+    }
+#endif
+
+    if (len == 0)
+        return;
+
+    if (encrypt) {
+        ssh_cipher_encrypt(ctx->cipher, blk, len);
+        put_data(ctx, blk, len);
+    } else {
+        put_data(ctx, blk, len);
+        ssh_cipher_decrypt(ctx->cipher, blk, len);
+    }
+}
+
+static void PREFIX(mac_encrypt_and_update)(ssh2_mac *mac, void *blk, int len)
+{
+    PREFIX(mac_crypt_and_update)(mac, blk, len, true);
+}
+
+static void PREFIX(mac_decrypt_and_update)(ssh2_mac *mac, void *blk, int len)
+{
+    PREFIX(mac_crypt_and_update)(mac, blk, len, false);
+}
+
 static void PREFIX(mac_genresult)(ssh2_mac *mac, unsigned char *output)
 {
     CONTEXT *ctx = container_of(mac, CONTEXT, mac);
@@ -360,6 +418,8 @@ const ssh2_macalg CAT(ssh2_aesgcm_mac_, AESGCM_FLAVOUR) = {
     .genresult = PREFIX(mac_genresult),
     .next_message = PREFIX(mac_next_message),
     .text_name = PREFIX(mac_text_name),
+    .encrypt_and_update = PREFIX(mac_encrypt_and_update),
+    .decrypt_and_update = PREFIX(mac_decrypt_and_update),
     .name = "",
     .etm_name = "", /* Not selectable independently */
     .len = 16,
@@ -0,0 +1,287 @@
+/*
+ * Implementation of AES-GCM for x86 which stitches together the
+ * AES-NI keystream generation and a CLMUL evaluation of the
+ * polynomial hash, so that bulk packet data only makes one pass
+ * through the CPU, and the two kinds of arithmetic can proceed in
+ * parallel on different execution units.
+ *
+ * The polynomial is evaluated eight blocks at a time, by multiplying
+ * each block by the appropriate power of the variable, and only doing
+ * the modular reduction once for the whole batch. The representation
+ * of field elements is the same as in aesgcm-clmul.c, which see.
+ *
+ * The stitching only applies when the cipher is AES-NI as well. With
+ * any other AES implementation, this behaves like the plain CLMUL MAC.
+ */
+
+#include <wmmintrin.h>
+#include <smmintrin.h>
+
+#if defined(__clang__) || defined(__GNUC__)
+#include <cpuid.h>
+#define GET_CPU_ID(out) __cpuid(1, (out)[0], (out)[1], (out)[2], (out)[3])
+#else
+#define GET_CPU_ID(out) __cpuid(out, 1)
+#endif
+
+#include "ssh.h"
+#include "aes.h"
+#include "aesgcm.h"
+
+#define NI_BLOCKS 8
+
+typedef struct aesgcm_ni {
+    AESGCM_COMMON_FIELDS;
+    /* hpow[i] is the variable raised to the power NI_BLOCKS-i, so
+     * that the last n entries are the multipliers for a batch of n */
+    __m128i hpow[NI_BLOCKS];
+    __m128i acc, mask;
+    void *ptr_to_free;
+} aesgcm_ni;
+
+static bool aesgcm_ni_available(void)
+{
+    /*
+     * Determine if AES, CLMUL and SSE4.1 are all available on this CPU.
+     */
+    unsigned int CPUInfo[4];
+    GET_CPU_ID(CPUInfo);
+    return (CPUInfo[2] & (1 << 25)) && (CPUInfo[2] & (1 << 19)) &&
+        (CPUInfo[2] & (1 << 1));
+}
+
+/*
+ * __m128i has to be aligned to 16 bytes, so allocate the same way as
+ * aesgcm-clmul.c.
+ */
+#define SPECIAL_ALLOC
+static aesgcm_ni *aesgcm_ni_alloc(void)
+{
+    char *p = smalloc(sizeof(aesgcm_ni) + 15);
+    uintptr_t ip = (uintptr_t)p;
+    ip = (ip + 15) & ~15;
+    aesgcm_ni *ctx = (aesgcm_ni *)ip;
+    memset(ctx, 0, sizeof(aesgcm_ni));
+    ctx->ptr_to_free = p;
+    return ctx;
+}
+
+#define SPECIAL_FREE
+static void aesgcm_ni_free(aesgcm_ni *ctx)
+{
+    void *ptf = ctx->ptr_to_free;
+    smemclr(ctx, sizeof(*ctx));
+    sfree(ptf);
+}
+
+static inline __m128i mm_byteswap(__m128i vec)
+{
+    const __m128i reverse = _mm_set_epi64x(
+        0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    return _mm_shuffle_epi8(vec, reverse);
+}
+
+static inline __m128i mm_load_be(const void *p)
+{
+    return mm_byteswap(_mm_loadu_si128(p));
+}
+static inline void mm_store_be(void *p, __m128i vec)
+{
+    _mm_storeu_si128(p, mm_byteswap(vec));
+}
+
+/*
+ * Convert a field element given in AES byte order into the form used
+ * as the second operand of a multiplication, exactly as
+ * aesgcm_clmul_setkey_impl does.
+ */
+static __m128i aesgcm_ni_multiplier(const unsigned char *var)
+{
+    uint64_t hi = GET_64BIT_MSB_FIRST(var);
+    uint64_t lo = GET_64BIT_MSB_FIRST(var + 8);
+
+    uint64_t bit = 1 & (hi >> 63);
+    hi = (hi << 1) ^ (lo >> 63);
+    lo = (lo << 1) ^ bit;
+    hi ^= 0xC200000000000000 & -bit;
+
+    return _mm_set_epi64x(hi, lo);
+}
+
+/*
+ * Multiply a by the multiplier v, and XOR the unreduced 256-bit
+ * product into three accumulators: lo and hi for the outer words, and
+ * md for the middle one, which overlaps both.
+ */
+static inline void aesgcm_ni_mul(__m128i *lo, __m128i *md, __m128i *hi,
+                                 __m128i a, __m128i v)
+{
+    *lo = _mm_xor_si128(*lo, _mm_clmulepi64_si128(a, v, 0x00));
+    *hi = _mm_xor_si128(*hi, _mm_clmulepi64_si128(a, v, 0x11));
+    *md = _mm_xor_si128(*md, _mm_xor_si128(
+                            _mm_clmulepi64_si128(a, v, 0x01),
+                            _mm_clmulepi64_si128(a, v, 0x10)));
+}
+
+/*
+ * Reduce a sum of products from aesgcm_ni_mul. This is the reduction
+ * stage of aesgcm_clmul_coeff, with the masking simplified.
+ */
+static inline __m128i aesgcm_ni_reduce(__m128i lo, __m128i md, __m128i hi)
+{
+    const __m128i poly = _mm_set_epi64x(0, 0xC200000000000000);
+
+    lo = _mm_xor_si128(lo, _mm_slli_si128(md, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(md, 8));
+
+    __m128i r1 = _mm_clmulepi64_si128(poly, lo, 0x00);
+    r1 = _mm_xor_si128(_mm_shuffle_epi32(r1, 0x4E), lo);
+    __m128i r2 = _mm_clmulepi64_si128(poly, r1, 0x10);
+    return _mm_xor_si128(hi, _mm_xor_si128(r1, r2));
+}
+
+/*
+ * Fold n <= NI_BLOCKS consecutive blocks of ciphertext into the
+ * accumulator, with a single reduction.
+ */
+static inline __m128i aesgcm_ni_hash(__m128i acc, const __m128i *hpow,
+                                     const unsigned char *blk, size_t n)
+{
+    __m128i lo = _mm_setzero_si128(), md = lo, hi = lo;
+    hpow += NI_BLOCKS - n;
+    for (size_t i = 0; i < n; i++) {
+        __m128i x = mm_load_be(blk + 16*i);
+        if (i == 0)
+            x = _mm_xor_si128(x, acc);
+        aesgcm_ni_mul(&lo, &md, &hi, x, hpow[i]);
+    }
+    return aesgcm_ni_reduce(lo, md, hi);
+}
+
+static void aesgcm_ni_setkey_impl(aesgcm_ni *ctx, const unsigned char *var)
+{
+    /*
+     * Work out the powers of the variable by repeatedly multiplying
+     * by it in the ordinary way, and convert each one into a
+     * multiplier via its byte representation.
+     */
+    unsigned char buf[16];
+    __m128i h = aesgcm_ni_multiplier(var), power = mm_load_be(var);
+
+    ctx->hpow[NI_BLOCKS - 1] = h;
+    for (size_t i = 2; i <= NI_BLOCKS; i++) {
+        __m128i lo = _mm_setzero_si128(), md = lo, hi = lo;
+        aesgcm_ni_mul(&lo, &md, &hi, power, h);
+        power = aesgcm_ni_reduce(lo, md, hi);
+        mm_store_be(buf, power);
+        ctx->hpow[NI_BLOCKS - i] = aesgcm_ni_multiplier(buf);
+    }
+
+    smemclr(buf, sizeof(buf));
+}
+
+static inline void aesgcm_ni_setup(aesgcm_ni *ctx, const unsigned char *mask)
+{
+    ctx->mask = mm_load_be(mask);
+    ctx->acc = _mm_set_epi64x(0, 0);
+}
+
+static inline void aesgcm_ni_coeff(aesgcm_ni *ctx, const unsigned char *coeff)
+{
+    ctx->acc = aesgcm_ni_hash(ctx->acc, ctx->hpow, coeff, 1);
+}
+
+static inline void aesgcm_ni_output(aesgcm_ni *ctx, unsigned char *output)
+{
+    mm_store_be(output, _mm_xor_si128(ctx->acc, ctx->mask));
+    smemclr(&ctx->acc, 16);
+    smemclr(&ctx->mask, 16);
+}
+
+/*
+ * The per-block steps of the kernel, written out for each block in
+ * full, so that the compiler reliably keeps the batch in registers.
+ */
+#define FOR_EACH_BLOCK(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7)
+#define NI_START(i) s[i] = _mm_xor_si128(mm_byteswap(                   \
+            _mm_add_epi32(ctr, _mm_setr_epi32(i, 0, 0, 0))), rk);
+#define NI_ROUND(i) s[i] = _mm_aesenc_si128(s[i], rk);
+#define NI_LAST_ROUND(i) s[i] = _mm_aesenclast_si128(s[i], rk);
+#define NI_OUTPUT(i) if (i < n) {                                       \
+        __m128i *q = (__m128i *)(p + 16*i);                             \
+        _mm_storeu_si128(q, _mm_xor_si128(_mm_loadu_si128(q), s[i]));   \
+    }
+
+/*
+ * The stitched kernel. Each batch of up to NI_BLOCKS blocks is run
+ * through AES with one multiplication of the polynomial evaluation
+ * slotted in after each round. When decrypting, the multiplications
+ * are for the same batch's ciphertext, which we already have; when
+ * encrypting, they're for the previous batch, which we've only just
+ * finished generating, so the final batch is hashed on its own at the
+ * end.
+ */
+#define SPECIAL_CRYPT
+static size_t aesgcm_ni_crypt_blocks(aesgcm_ni *ctx, unsigned char *blk,
+                                     size_t nblocks, bool encrypt)
+{
+    const void *vkeysched;
+    void *vcounter;
+    size_t rounds;
+    if (!aes_ni_gcm_state(ctx->cipher, &vkeysched, &rounds, &vcounter))
+        return 0;
+    const __m128i *keysched = (const __m128i *)vkeysched;
+    __m128i *counter = (__m128i *)vcounter;
+
+    __m128i ctr = *counter, acc = ctx->acc;
+    const unsigned char *prev = NULL;
+    size_t nprev = 0;
+
+    for (size_t done = 0; done < nblocks; done += NI_BLOCKS) {
+        unsigned char *p = blk + 16*done;
+        size_t n = nblocks - done;
+        if (n > NI_BLOCKS)
+            n = NI_BLOCKS;
+
+        const unsigned char *hsrc = encrypt ? prev : p;
+        size_t hn = encrypt ? nprev : n;
+        const __m128i *hpow = ctx->hpow + (NI_BLOCKS - hn);
+        __m128i lo = _mm_setzero_si128(), md = lo, hi = lo;
+
+        __m128i s[NI_BLOCKS], rk = keysched[0];
+        FOR_EACH_BLOCK(NI_START);
+
+        for (size_t r = 1; r < rounds; r++) {
+            rk = keysched[r];
+            FOR_EACH_BLOCK(NI_ROUND);
+            if (r <= hn) {
+                __m128i x = mm_load_be(hsrc + 16*(r-1));
+                if (r == 1)
+                    x = _mm_xor_si128(x, acc);
+                aesgcm_ni_mul(&lo, &md, &hi, x, hpow[r-1]);
+            }
+        }
+        rk = keysched[rounds];
+        FOR_EACH_BLOCK(NI_LAST_ROUND);
+
+        if (hn)
+            acc = aesgcm_ni_reduce(lo, md, hi);
+
+        FOR_EACH_BLOCK(NI_OUTPUT);
+
+        ctr = _mm_add_epi32(ctr, _mm_setr_epi32(n, 0, 0, 0));
+        prev = p;
+        nprev = n;
+    }
+
+    if (encrypt && nprev)
+        acc = aesgcm_ni_hash(acc, ctx->hpow, prev, nprev);
+
+    *counter = ctr;
+    ctx->acc = acc;
+    return nblocks;
+}
+
+#define AESGCM_FLAVOUR ni
+#define AESGCM_NAME "AES-NI stitched"
+#include "aesgcm-footer.h"
@@ -5,6 +5,12 @@ static ssh2_mac *aesgcm_mac_selector_new(const ssh2_macalg *alg,
                                          ssh_cipher *cipher)
 {
     static const ssh2_macalg *const real_algs[] = {
+#if HAVE_VAES
+        &ssh2_aesgcm_mac_vaes,
+#endif
+#if HAVE_AESGCM_NI
+        &ssh2_aesgcm_mac_ni,
+#endif
 #if HAVE_CLMUL
         &ssh2_aesgcm_mac_clmul,
 #endif
@@ -0,0 +1,348 @@
+/*
+ * Implementation of AES-GCM for x86 using the VAES and VPCLMULQDQ
+ * extensions, which do the same job as AES-NI and CLMUL on both
+ * halves of a 256-bit AVX register at once.
+ *
+ * This works just like aesgcm-ni.c, except that each batch is sixteen
+ * blocks, held in pairs. Each pair of ciphertext blocks is multiplied
+ * by the corresponding pair of powers of the variable, and the two
+ * halves of the sum are only combined at the end of the batch, before
+ * the reduction.
+ */
+
+#include "ssh.h"
+#include "aes.h"
+#include "aesgcm.h"
+
+#include <immintrin.h>
+
+#if defined(__clang__) || defined(__GNUC__)
+#include <cpuid.h>
+#define GET_CPU_ID_0(out)                               \
+    __cpuid(0, (out)[0], (out)[1], (out)[2], (out)[3])
+#define GET_CPU_ID_1(out)                               \
+    __cpuid(1, (out)[0], (out)[1], (out)[2], (out)[3])
+#define GET_CPU_ID_7(out)                                       \
+    __cpuid_count(7, 0, (out)[0], (out)[1], (out)[2], (out)[3])
+static inline uint64_t get_xcr0(void)
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+    return lo | ((uint64_t)hi << 32);
+}
+#else
+#define GET_CPU_ID_0(out) __cpuid(out, 0)
+#define GET_CPU_ID_1(out) __cpuid(out, 1)
+#define GET_CPU_ID_7(out) __cpuidex(out, 7, 0)
+#define get_xcr0() _xgetbv(0)
+#endif
+
+#define VAES_BLOCKS 16
+
+typedef struct aesgcm_vaes {
+    AESGCM_COMMON_FIELDS;
+    /* hpow[i] is the variable raised to the power VAES_BLOCKS-i, as
+     * in aesgcm-ni.c. The extra zero entry at the end pairs up with
+     * the last block of a batch with an odd number of blocks. */
+    __m128i hpow[VAES_BLOCKS + 1];
+    __m128i acc, mask;
+    void *ptr_to_free;
+} aesgcm_vaes;
+
+static bool aesgcm_vaes_available(void)
+{
+    unsigned int CPUInfo[4];
+    GET_CPU_ID_0(CPUInfo);
+    if (CPUInfo[0] < 7)
+        return false;
+
+    GET_CPU_ID_1(CPUInfo);
+    if (!(CPUInfo[2] & (1 << 25)) ||   /* AES */
+        !(CPUInfo[2] & (1 << 19)) ||   /* SSE4.1 */
+        !(CPUInfo[2] & (1 << 1)))      /* CLMUL */
+        return false;
+
+    /* The OS must be saving the YMM registers across context switches */
+    if (!(CPUInfo[2] & (1 << 27)))     /* OSXSAVE */
+        return false;
+    if ((get_xcr0() & 6) != 6)         /* XMM and YMM state */
+        return false;
+
+    GET_CPU_ID_7(CPUInfo);
+    return (CPUInfo[1] & (1 << 5)) &&  /* AVX2 */
+        (CPUInfo[2] & (1 << 9)) &&     /* VAES */
+        (CPUInfo[2] & (1 << 10));      /* VPCLMULQDQ */
+}
+
+/*
+ * __m128i has to be aligned to 16 bytes, so allocate the same way as
+ * aesgcm-clmul.c. (The 256-bit accesses to hpow are all unaligned
+ * loads anyway.)
+ */
+#define SPECIAL_ALLOC
+static aesgcm_vaes *aesgcm_vaes_alloc(void)
+{
+    char *p = smalloc(sizeof(aesgcm_vaes) + 15);
+    uintptr_t ip = (uintptr_t)p;
+    ip = (ip + 15) & ~15;
+    aesgcm_vaes *ctx = (aesgcm_vaes *)ip;
+    memset(ctx, 0, sizeof(aesgcm_vaes));
+    ctx->ptr_to_free = p;
+    return ctx;
+}
+
+#define SPECIAL_FREE
+static void aesgcm_vaes_free(aesgcm_vaes *ctx)
+{
+    void *ptf = ctx->ptr_to_free;
+    smemclr(ctx, sizeof(*ctx));
+    sfree(ptf);
+}
+
+static inline __m128i mm_byteswap(__m128i vec)
+{
+    const __m128i reverse = _mm_set_epi64x(
+        0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    return _mm_shuffle_epi8(vec, reverse);
+}
+
+static inline __m256i mm256_byteswap(__m256i vec)
+{
+    const __m256i reverse = _mm256_set_epi64x(
+        0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL,
+        0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL);
+    return _mm256_shuffle_epi8(vec, reverse);
+}
+
+static inline __m128i mm_load_be(const void *p)
+{
+    return mm_byteswap(_mm_loadu_si128(p));
+}
+static inline void mm_store_be(void *p, __m128i vec)
+{
+    _mm_storeu_si128(p, mm_byteswap(vec));
+}
+
+/*
+ * Load a pair of blocks with each one byte-reversed, or just one
+ * block, with zero in the upper half, if that's all there is.
+ */
+static inline __m256i mm256_load_be(const unsigned char *p, size_t avail)
+{
+    if (avail >= 2)
+        return mm256_byteswap(_mm256_loadu_si256((const __m256i *)p));
+    else
+        return _mm256_inserti128_si256(
+            _mm256_setzero_si256(), mm_load_be(p), 0);
+}
+
+/* See aesgcm_ni_multiplier */
+static __m128i aesgcm_vaes_multiplier(const unsigned char *var)
+{
+    uint64_t hi = GET_64BIT_MSB_FIRST(var);
+    uint64_t lo = GET_64BIT_MSB_FIRST(var + 8);
+
+    uint64_t bit = 1 & (hi >> 63);
+    hi = (hi << 1) ^ (lo >> 63);
+    lo = (lo << 1) ^ bit;
+    hi ^= 0xC200000000000000 & -bit;
+
+    return _mm_set_epi64x(hi, lo);
+}
+
+/* See aesgcm_ni_mul; this does two independent products at once */
+static inline void aesgcm_vaes_mul(__m256i *lo, __m256i *md, __m256i *hi,
+                                   __m256i a, __m256i v)
+{
+    *lo = _mm256_xor_si256(*lo, _mm256_clmulepi64_epi128(a, v, 0x00));
+    *hi = _mm256_xor_si256(*hi, _mm256_clmulepi64_epi128(a, v, 0x11));
+    *md = _mm256_xor_si256(*md, _mm256_xor_si256(
+                               _mm256_clmulepi64_epi128(a, v, 0x01),
+                               _mm256_clmulepi64_epi128(a, v, 0x10)));
+}
+
+static inline __m128i mm256_fold(__m256i v)
+{
+    return _mm_xor_si128(_mm256_castsi256_si128(v),
+                         _mm256_extracti128_si256(v, 1));
+}
+
+/*
+ * Add together the two halves of each accumulator, and reduce the
+ * result as in aesgcm_ni_reduce.
+ */
+static inline __m128i aesgcm_vaes_reduce(__m256i lo256, __m256i md256,
+                                         __m256i hi256)
+{
+    const __m128i poly = _mm_set_epi64x(0, 0xC200000000000000);
+    __m128i lo = mm256_fold(lo256), md = mm256_fold(md256);
+    __m128i hi = mm256_fold(hi256);
+
+    lo = _mm_xor_si128(lo, _mm_slli_si128(md, 8));
+    hi = _mm_xor_si128(hi, _mm_srli_si128(md, 8));
+
+    __m128i r1 = _mm_clmulepi64_si128(poly, lo, 0x00);
+    r1 = _mm_xor_si128(_mm_shuffle_epi32(r1, 0x4E), lo);
+    __m128i r2 = _mm_clmulepi64_si128(poly, r1, 0x10);
+    return _mm_xor_si128(hi, _mm_xor_si128(r1, r2));
+}
+
+/*
+ * Fold n <= VAES_BLOCKS consecutive blocks of ciphertext into the
+ * accumulator, with a single reduction.
+ */
+static inline __m128i aesgcm_vaes_hash(__m128i acc, const __m128i *hpow,
+                                       const unsigned char *blk, size_t n)
+{
+    __m256i lo = _mm256_setzero_si256(), md = lo, hi = lo;
+    hpow += VAES_BLOCKS - n;
+    for (size_t i = 0; i < n; i += 2) {
+        __m256i x = mm256_load_be(blk + 16*i, n - i);
+        if (i == 0)
+            x = _mm256_xor_si256(x, _mm256_inserti128_si256(
+                                     _mm256_setzero_si256(), acc, 0));
+        aesgcm_vaes_mul(&lo, &md, &hi, x,
+                        _mm256_loadu_si256((const __m256i *)(hpow + i)));
+    }
+    return aesgcm_vaes_reduce(lo, md, hi);
+}
+
+static void aesgcm_vaes_setkey_impl(aesgcm_vaes *ctx,
+                                    const unsigned char *var)
+{
+    /* Work out the powers of the variable as in aesgcm_ni_setkey_impl */
+    unsigned char buf[16];
+    __m128i h = aesgcm_vaes_multiplier(var), power = mm_load_be(var);
+
+    ctx->hpow[VAES_BLOCKS - 1] = h;
+    for (size_t i = 2; i <= VAES_BLOCKS; i++) {
+        __m256i x = _mm256_inserti128_si256(
+            _mm256_setzero_si256(), power, 0);
+        __m256i v = _mm256_inserti128_si256(_mm256_setzero_si256(), h, 0);
+        __m256i lo = _mm256_setzero_si256(), md = lo, hi = lo;
+        aesgcm_vaes_mul(&lo, &md, &hi, x, v);
+        power = aesgcm_vaes_reduce(lo, md, hi);
+        mm_store_be(buf, power);
+        ctx->hpow[VAES_BLOCKS - i] = aesgcm_vaes_multiplier(buf);
+    }
+    ctx->hpow[VAES_BLOCKS] = _mm_setzero_si128();
+
+    smemclr(buf, sizeof(buf));
+}
+
+static inline void aesgcm_vaes_setup(aesgcm_vaes *ctx,
+                                     const unsigned char *mask)
+{
+    ctx->mask = mm_load_be(mask);
+    ctx->acc = _mm_set_epi64x(0, 0);
+}
+
+static inline void aesgcm_vaes_coeff(aesgcm_vaes *ctx,
+                                     const unsigned char *coeff)
+{
+    ctx->acc = aesgcm_vaes_hash(ctx->acc, ctx->hpow, coeff, 1);
+}
+
+static inline void aesgcm_vaes_output(aesgcm_vaes *ctx,
+                                      unsigned char *output)
+{
+    mm_store_be(output, _mm_xor_si128(ctx->acc, ctx->mask));
+    smemclr(&ctx->acc, 16);
+    smemclr(&ctx->mask, 16);
+}
+
+/*
+ * The per-pair steps of the kernel, written out in full as in
+ * aesgcm-ni.c.
+ */
+#define FOR_EACH_PAIR(X) X(0) X(1) X(2) X(3) X(4) X(5) X(6) X(7)
+#define VAES_START(i) s[i] = _mm256_xor_si256(mm256_byteswap(           \
+            _mm256_add_epi32(ctr, _mm256_setr_epi32(                    \
+                                 2*i, 0, 0, 0, 2*i+1, 0, 0, 0))), rk);
+#define VAES_ROUND(i) s[i] = _mm256_aesenc_epi128(s[i], rk);
+#define VAES_LAST_ROUND(i) s[i] = _mm256_aesenclast_epi128(s[i], rk);
+#define VAES_OUTPUT(i) if (2*i + 1 < n) {                               \
+        __m256i *q = (__m256i *)(p + 32*i);                             \
+        _mm256_storeu_si256(q, _mm256_xor_si256(                        \
+                                _mm256_loadu_si256(q), s[i]));          \
+    } else if (2*i < n) {                                               \
+        __m128i *q = (__m128i *)(p + 32*i);                             \
+        _mm_storeu_si128(q, _mm_xor_si128(                              \
+                             _mm_loadu_si128(q),                        \
+                             _mm256_castsi256_si128(s[i])));            \
+    }
+
+/*
+ * The stitched kernel, organised as in aesgcm_ni_crypt_blocks, but
+ * with one pair of multiplications after each AES round.
+ */
+#define SPECIAL_CRYPT
+static size_t aesgcm_vaes_crypt_blocks(aesgcm_vaes *ctx, unsigned char *blk,
+                                       size_t nblocks, bool encrypt)
+{
+    const void *vkeysched;
+    void *vcounter;
+    size_t rounds;
+    if (!aes_ni_gcm_state(ctx->cipher, &vkeysched, &rounds, &vcounter))
+        return 0;
+    const __m128i *keysched = (const __m128i *)vkeysched;
+    __m128i *counter = (__m128i *)vcounter;
+
+    /* Both halves of ctr hold the counter for the start of the batch */
+    __m256i ctr = _mm256_broadcastsi128_si256(*counter);
+    __m128i acc = ctx->acc;
+    const unsigned char *prev = NULL;
+    size_t nprev = 0;
+
+    for (size_t done = 0; done < nblocks; done += VAES_BLOCKS) {
+        unsigned char *p = blk + 16*done;
+        size_t n = nblocks - done;
+        if (n > VAES_BLOCKS)
+            n = VAES_BLOCKS;
+
+        const unsigned char *hsrc = encrypt ? prev : p;
+        size_t hn = encrypt ? nprev : n;
+        const __m128i *hpow = ctx->hpow + (VAES_BLOCKS - hn);
+        __m256i lo = _mm256_setzero_si256(), md = lo, hi = lo;
+
+        __m256i s[VAES_BLOCKS / 2];
+        __m256i rk = _mm256_broadcastsi128_si256(keysched[0]);
+        FOR_EACH_PAIR(VAES_START);
+
+        for (size_t r = 1; r < rounds; r++) {
+            rk = _mm256_broadcastsi128_si256(keysched[r]);
+            FOR_EACH_PAIR(VAES_ROUND);
+            size_t j = 2 * (r-1);
+            if (j < hn) {
+                __m256i x = mm256_load_be(hsrc + 16*j, hn - j);
+                if (j == 0)
+                    x = _mm256_xor_si256(x, _mm256_inserti128_si256(
+                                             _mm256_setzero_si256(), acc, 0));
+                aesgcm_vaes_mul(&lo, &md, &hi, x, _mm256_loadu_si256(
+                                    (const __m256i *)(hpow + j)));
+            }
+        }
+        rk = _mm256_broadcastsi128_si256(keysched[rounds]);
+        FOR_EACH_PAIR(VAES_LAST_ROUND);
+
+        if (hn)
+            acc = aesgcm_vaes_reduce(lo, md, hi);
+
+        FOR_EACH_PAIR(VAES_OUTPUT);
+
+        ctr = _mm256_add_epi32(ctr, _mm256_setr_epi32(n, 0, 0, 0, n, 0, 0, 0));
+        prev = p;
+        nprev = n;
+    }
+
+    if (encrypt && nprev)
+        acc = aesgcm_vaes_hash(acc, ctx->hpow, prev, nprev);
+
+    *counter = _mm256_castsi256_si128(ctr);
+    ctx->acc = acc;
+    return nblocks;
+}
+
+#define AESGCM_FLAVOUR vaes
+#define AESGCM_NAME "VAES stitched"
+#include "aesgcm-footer.h"
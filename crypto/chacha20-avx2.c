@@ -0,0 +1,416 @@
+/*
+ * Implementation of ChaCha20-Poly1305 using x86 AVX2: the keystream
+ * eight blocks at a time, and Poly1305 four message blocks at a time.
+ *
+ * The keystream works just like the SSE2 version in chacha20-sse2.c,
+ * only with twice as many blocks per register.
+ */
+
+#include "ssh.h"
+#include "chacha20.h"
+
+#include <immintrin.h>
+
+#if defined(__clang__) || defined(__GNUC__)
+#include <cpuid.h>
+#define GET_CPU_ID_0(out)                               \
+    __cpuid(0, (out)[0], (out)[1], (out)[2], (out)[3])
+#define GET_CPU_ID_1(out)                               \
+    __cpuid(1, (out)[0], (out)[1], (out)[2], (out)[3])
+#define GET_CPU_ID_7(out)                                       \
+    __cpuid_count(7, 0, (out)[0], (out)[1], (out)[2], (out)[3])
+static inline uint64_t get_xcr0(void)
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+    return lo | ((uint64_t)hi << 32);
+}
+#else
+#define GET_CPU_ID_0(out) __cpuid(out, 0)
+#define GET_CPU_ID_1(out) __cpuid(out, 1)
+#define GET_CPU_ID_7(out) __cpuidex(out, 7, 0)
+#define get_xcr0() _xgetbv(0)
+#endif
+
+bool chacha20_avx2_available(void)
+{
+    unsigned int CPUInfo[4];
+    GET_CPU_ID_0(CPUInfo);
+    if (CPUInfo[0] < 7)
+        return false;
+
+    /* The OS must be saving the YMM registers across context switches */
+    GET_CPU_ID_1(CPUInfo);
+    if (!(CPUInfo[2] & (1 << 27)))     /* OSXSAVE */
+        return false;
+    if ((get_xcr0() & 6) != 6)         /* XMM and YMM state */
+        return false;
+
+    GET_CPU_ID_7(CPUInfo);
+    return CPUInfo[1] & (1 << 5);      /* AVX2 */
+}
+
+/* ----------------------------------------------------------------------
+ * ChaCha20.
+ */
+
+#define ROTL(x, n) \
+    _mm256_or_si256(_mm256_slli_epi32(x, n), _mm256_srli_epi32(x, 32 - (n)))
+
+/* Rotations by whole bytes can be done in one byte shuffle */
+#define ROTL_BYTES(x, shuf) _mm256_shuffle_epi8(x, shuf)
+
+#define QUARTER(a, b, c, d)                                             \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a);             \
+    d = ROTL_BYTES(d, rot16);                                           \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c);             \
+    b = ROTL(b, 12);                                                    \
+    a = _mm256_add_epi32(a, b); d = _mm256_xor_si256(d, a);             \
+    d = ROTL_BYTES(d, rot8);                                            \
+    c = _mm256_add_epi32(c, d); b = _mm256_xor_si256(b, c);             \
+    b = ROTL(b, 7)
+
+static inline void xor_256(unsigned char *p, __m256i v)
+{
+    __m256i *q = (__m256i *)p;
+    _mm256_storeu_si256(q, _mm256_xor_si256(_mm256_loadu_si256(q), v));
+}
+
+/*
+ * Generate eight blocks of keystream from words 0-11 of the given
+ * state, with words 12-15 of block j taken from lanes[0..3][j], and
+ * XOR them into the 512 bytes at 'blk'.
+ */
+static inline void chacha20_avx2_core(const uint32_t *state,
+                                      const uint32_t (*lanes)[8],
+                                      unsigned char *blk)
+{
+    const __m256i rot16 = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+        2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13));
+    const __m256i rot8 = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+        3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14));
+
+    __m256i in[16], x[16];
+
+    for (size_t i = 0; i < 12; i++)
+        in[i] = _mm256_set1_epi32(state[i]);
+    for (size_t i = 0; i < 4; i++)
+        in[12 + i] = _mm256_loadu_si256((const __m256i *)lanes[i]);
+
+    for (size_t i = 0; i < 16; i++)
+        x[i] = in[i];
+
+    for (size_t i = 0; i < 20; i += 2) {
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+
+    for (size_t i = 0; i < 16; i++)
+        x[i] = _mm256_add_epi32(x[i], in[i]);
+
+    /*
+     * Transpose each group of four words within the 128-bit lanes.
+     * Afterwards, b[g][j] holds words 4g..4g+3 of block j in its low
+     * lane, and the same words of block j+4 in its high lane.
+     */
+    __m256i b[4][4];
+    for (size_t g = 0; g < 4; g++) {
+        __m256i t0 = _mm256_unpacklo_epi32(x[4*g], x[4*g+1]);
+        __m256i t1 = _mm256_unpacklo_epi32(x[4*g+2], x[4*g+3]);
+        __m256i t2 = _mm256_unpackhi_epi32(x[4*g], x[4*g+1]);
+        __m256i t3 = _mm256_unpackhi_epi32(x[4*g+2], x[4*g+3]);
+
+        b[g][0] = _mm256_unpacklo_epi64(t0, t1);
+        b[g][1] = _mm256_unpackhi_epi64(t0, t1);
+        b[g][2] = _mm256_unpacklo_epi64(t2, t3);
+        b[g][3] = _mm256_unpackhi_epi64(t2, t3);
+    }
+
+    /* Then pair up the lanes to make whole halves of blocks. */
+    for (size_t j = 0; j < 4; j++) {
+        unsigned char *lo = blk + 64*j, *hi = blk + 64*(j+4);
+        xor_256(lo, _mm256_permute2x128_si256(b[0][j], b[1][j], 0x20));
+        xor_256(lo + 32, _mm256_permute2x128_si256(b[2][j], b[3][j], 0x20));
+        xor_256(hi, _mm256_permute2x128_si256(b[0][j], b[1][j], 0x31));
+        xor_256(hi + 32, _mm256_permute2x128_si256(b[2][j], b[3][j], 0x31));
+    }
+}
+
+/* Fill in the lanes for consecutive blocks starting at the state's
+ * own counter */
+static inline void chacha20_avx2_lanes(const uint32_t *state,
+                                       uint32_t (*lanes)[8])
+{
+    uint64_t ctr = state[12] | ((uint64_t)state[13] << 32);
+    for (size_t j = 0; j < 8; j++) {
+        lanes[0][j] = (uint32_t)(ctr + j);
+        lanes[1][j] = (uint32_t)((ctr + j) >> 32);
+        lanes[2][j] = state[14];
+        lanes[3][j] = state[15];
+    }
+}
+
+/*
+ * Run the core over a trailing part-batch, by generating a whole
+ * batch into a buffer and using the start of it.
+ */
+static void chacha20_avx2_partial(const uint32_t *state,
+                                  const uint32_t (*lanes)[8],
+                                  unsigned char *blk, size_t nblocks)
+{
+    unsigned char buf[512];
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, blk, 64 * nblocks);
+    chacha20_avx2_core(state, lanes, buf);
+    memcpy(blk, buf, 64 * nblocks);
+    smemclr(buf, sizeof(buf));
+}
+
+void chacha20_avx2_xor_blocks(uint32_t *state, unsigned char *blk,
+                              size_t nblocks)
+{
+    uint32_t lanes[4][8];
+
+    for (; nblocks >= 8; nblocks -= 8, blk += 512) {
+        chacha20_avx2_lanes(state, lanes);
+        chacha20_avx2_core(state, lanes, blk);
+        chacha20_advance_counter(state, 8);
+    }
+
+    if (nblocks) {
+        chacha20_avx2_lanes(state, lanes);
+        chacha20_avx2_partial(state, lanes, blk, nblocks);
+        chacha20_advance_counter(state, nblocks);
+    }
+}
+
+void chacha20_avx2_xor_blocks_multi(
+    const uint32_t *state, const uint32_t *ctrnonce, unsigned char *blk,
+    size_t nblocks)
+{
+    uint32_t lanes[4][8];
+
+    while (nblocks) {
+        size_t n = nblocks < 8 ? nblocks : 8;
+        memset(lanes, 0, sizeof(lanes));
+        for (size_t j = 0; j < n; j++)
+            for (size_t i = 0; i < 4; i++)
+                lanes[i][j] = ctrnonce[4*j + i];
+
+        if (n == 8)
+            chacha20_avx2_core(state, lanes, blk);
+        else
+            chacha20_avx2_partial(state, lanes, blk, n);
+
+        ctrnonce += 4*n;
+        blk += 64*n;
+        nblocks -= n;
+    }
+}
+
+/* ----------------------------------------------------------------------
+ * Poly1305.
+ *
+ * Numbers mod p = 2^130-5 are kept as five 26-bit limbs, so that
+ * _mm256_mul_epu32 can multiply a limb of one number by a limb of
+ * another (or by 5 times one, which is how the wraparound past 2^130
+ * is folded back in) without losing anything, and the sum of five
+ * such products still fits comfortably in 64 bits.
+ *
+ * To use all four lanes, we split the message into four interleaved
+ * streams: lane j accumulates message blocks j, j+4, j+8, ..., with
+ * a multiplier of r^4 between them. At the end, lane j is multiplied
+ * by r^(4-j) instead, which lines every block up with the power of r
+ * it would have got from the serial algorithm, and the lanes are
+ * added together.
+ */
+
+#define MASK26 0x3ffffff
+
+/* Scalar multiplication mod p, for computing the powers of r. */
+static void poly1305_mul26(uint32_t *out, const uint32_t *a, const uint32_t *b)
+{
+    uint64_t s1 = 5 * (uint64_t)b[1], s2 = 5 * (uint64_t)b[2];
+    uint64_t s3 = 5 * (uint64_t)b[3], s4 = 5 * (uint64_t)b[4];
+    uint64_t d[5], c;
+
+    d[0] = (uint64_t)a[0] * b[0] + a[1] * s4 + a[2] * s3 + a[3] * s2 +
+        a[4] * s1;
+    d[1] = (uint64_t)a[0] * b[1] + (uint64_t)a[1] * b[0] + a[2] * s4 +
+        a[3] * s3 + a[4] * s2;
+    d[2] = (uint64_t)a[0] * b[2] + (uint64_t)a[1] * b[1] +
+        (uint64_t)a[2] * b[0] + a[3] * s4 + a[4] * s3;
+    d[3] = (uint64_t)a[0] * b[3] + (uint64_t)a[1] * b[2] +
+        (uint64_t)a[2] * b[1] + (uint64_t)a[3] * b[0] + a[4] * s4;
+    d[4] = (uint64_t)a[0] * b[4] + (uint64_t)a[1] * b[3] +
+        (uint64_t)a[2] * b[2] + (uint64_t)a[3] * b[1] +
+        (uint64_t)a[4] * b[0];
+
+    for (size_t i = 0; i < 4; i++) {
+        c = d[i] >> 26;
+        d[i] &= MASK26;
+        d[i+1] += c;
+    }
+    c = d[4] >> 26;
+    d[4] &= MASK26;
+    d[0] += 5 * c;
+    c = d[0] >> 26;
+    d[0] &= MASK26;
+    d[1] += c;
+
+    for (size_t i = 0; i < 5; i++)
+        out[i] = d[i];
+}
+
+/* Vector multiplication mod p, of four numbers at once. */
+static inline void poly1305_avx2_mul(__m256i *a, const __m256i *r,
+                                     const __m256i *s)
+{
+    const __m256i mask = _mm256_set1_epi64x(MASK26);
+    __m256i d[5], c;
+
+#define MUL(x, y) _mm256_mul_epu32(x, y)
+#define ADD(x, y) _mm256_add_epi64(x, y)
+    d[0] = ADD(ADD(ADD(ADD(MUL(a[0], r[0]), MUL(a[1], s[4])),
+                       MUL(a[2], s[3])), MUL(a[3], s[2])), MUL(a[4], s[1]));
+    d[1] = ADD(ADD(ADD(ADD(MUL(a[0], r[1]), MUL(a[1], r[0])),
+                       MUL(a[2], s[4])), MUL(a[3], s[3])), MUL(a[4], s[2]));
+    d[2] = ADD(ADD(ADD(ADD(MUL(a[0], r[2]), MUL(a[1], r[1])),
+                       MUL(a[2], r[0])), MUL(a[3], s[4])), MUL(a[4], s[3]));
+    d[3] = ADD(ADD(ADD(ADD(MUL(a[0], r[3]), MUL(a[1], r[2])),
+                       MUL(a[2], r[1])), MUL(a[3], r[0])), MUL(a[4], s[4]));
+    d[4] = ADD(ADD(ADD(ADD(MUL(a[0], r[4]), MUL(a[1], r[3])),
+                       MUL(a[2], r[2])), MUL(a[3], r[1])), MUL(a[4], r[0]));
+
+    for (size_t i = 0; i < 4; i++) {
+        c = _mm256_srli_epi64(d[i], 26);
+        d[i] = _mm256_and_si256(d[i], mask);
+        d[i+1] = ADD(d[i+1], c);
+    }
+    c = _mm256_srli_epi64(d[4], 26);
+    d[4] = _mm256_and_si256(d[4], mask);
+    d[0] = ADD(d[0], ADD(c, _mm256_slli_epi64(c, 2)));
+    c = _mm256_srli_epi64(d[0], 26);
+    d[0] = _mm256_and_si256(d[0], mask);
+    d[1] = ADD(d[1], c);
+#undef MUL
+#undef ADD
+
+    for (size_t i = 0; i < 5; i++)
+        a[i] = d[i];
+}
+
+void poly1305_avx2_blocks(unsigned char *hbytes, const unsigned char *rbytes,
+                          const unsigned char *msg, size_t nblocks)
+{
+    const __m256i mask = _mm256_set1_epi64x(MASK26);
+    const __m256i hibit = _mm256_set1_epi64x(1 << 24);
+    uint32_t rp[4][5], h[5];
+    uint64_t lo, hi, c;
+
+    /* Split r into limbs, and compute its powers up to r^4. */
+    lo = GET_64BIT_LSB_FIRST(rbytes);
+    hi = GET_64BIT_LSB_FIRST(rbytes + 8);
+    rp[0][0] = lo & MASK26;
+    rp[0][1] = (lo >> 26) & MASK26;
+    rp[0][2] = ((lo >> 52) | (hi << 12)) & MASK26;
+    rp[0][3] = (hi >> 14) & MASK26;
+    rp[0][4] = hi >> 40;
+    poly1305_mul26(rp[1], rp[0], rp[0]);
+    poly1305_mul26(rp[2], rp[1], rp[0]);
+    poly1305_mul26(rp[3], rp[1], rp[1]);
+
+    /* Split the accumulator into limbs, folding down its top bits. */
+    lo = GET_64BIT_LSB_FIRST(hbytes);
+    hi = GET_64BIT_LSB_FIRST(hbytes + 8);
+    h[0] = lo & MASK26;
+    h[1] = (lo >> 26) & MASK26;
+    h[2] = ((lo >> 52) | (hi << 12)) & MASK26;
+    h[3] = (hi >> 14) & MASK26;
+    c = (hi >> 40) | ((uint64_t)hbytes[16] << 24);
+    h[4] = c & MASK26;
+    c = h[0] + 5 * (c >> 26);
+    h[0] = c & MASK26;
+    h[1] += c >> 26;
+
+    /*
+     * Multipliers: r^4 in every lane for all but the final group of
+     * blocks, and (r^4, r^3, r^2, r) for the final one.
+     */
+    __m256i rmid[5], smid[5], rfin[5], sfin[5], a[5];
+    for (size_t i = 0; i < 5; i++) {
+        rmid[i] = _mm256_set1_epi64x(rp[3][i]);
+        smid[i] = _mm256_set1_epi64x(5 * (uint64_t)rp[3][i]);
+        rfin[i] = _mm256_setr_epi64x(rp[3][i], rp[2][i], rp[1][i], rp[0][i]);
+        sfin[i] = _mm256_setr_epi64x(
+            5 * (uint64_t)rp[3][i], 5 * (uint64_t)rp[2][i],
+            5 * (uint64_t)rp[1][i], 5 * (uint64_t)rp[0][i]);
+        a[i] = _mm256_setr_epi64x(h[i], 0, 0, 0);
+    }
+
+    while (true) {
+        /*
+         * Load four blocks, and rearrange them so that each register
+         * holds the low or high 64 bits of each block in turn.
+         */
+        __m256i v0 = _mm256_loadu_si256((const __m256i *)msg);
+        __m256i v1 = _mm256_loadu_si256((const __m256i *)(msg + 32));
+        __m256i mlo = _mm256_permute4x64_epi64(
+            _mm256_unpacklo_epi64(v0, v1), 0xd8);
+        __m256i mhi = _mm256_permute4x64_epi64(
+            _mm256_unpackhi_epi64(v0, v1), 0xd8);
+
+        a[0] = _mm256_add_epi64(a[0], _mm256_and_si256(mlo, mask));
+        a[1] = _mm256_add_epi64(a[1], _mm256_and_si256(
+                                    _mm256_srli_epi64(mlo, 26), mask));
+        a[2] = _mm256_add_epi64(a[2], _mm256_and_si256(
+                                    _mm256_or_si256(_mm256_srli_epi64(mlo, 52),
+                                                    _mm256_slli_epi64(mhi, 12)),
+                                    mask));
+        a[3] = _mm256_add_epi64(a[3], _mm256_and_si256(
+                                    _mm256_srli_epi64(mhi, 14), mask));
+        a[4] = _mm256_add_epi64(a[4], _mm256_or_si256(
+                                    _mm256_srli_epi64(mhi, 40), hibit));
+
+        msg += 64;
+        nblocks -= 4;
+        if (!nblocks)
+            break;
+
+        poly1305_avx2_mul(a, rmid, smid);
+    }
+
+    poly1305_avx2_mul(a, rfin, sfin);
+
+    /*
+     * Add up the lanes, and carry so that each limb but the top one
+     * is 26 bits again. The top one is left at up to 28 bits, which
+     * still fits in the output without folding it down mod p.
+     */
+    uint64_t d[5];
+    for (size_t i = 0; i < 5; i++) {
+        uint64_t lanes[4];
+        _mm256_storeu_si256((__m256i *)lanes, a[i]);
+        d[i] = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    }
+    for (size_t i = 0; i < 4; i++) {
+        d[i+1] += d[i] >> 26;
+        d[i] &= MASK26;
+    }
+
+    lo = d[0] | (d[1] << 26) | (d[2] << 52);
+    hi = (d[2] >> 12) | (d[3] << 14) | (d[4] << 40);
+    PUT_64BIT_LSB_FIRST(hbytes, lo);
+    PUT_64BIT_LSB_FIRST(hbytes + 8, hi);
+    hbytes[16] = d[4] >> 24;
+
+    smemclr(rp, sizeof(rp));
+    smemclr(h, sizeof(h));
+    smemclr(d, sizeof(d));
+}
@@ -0,0 +1,209 @@
+/*
+ * Implementation of the ChaCha20 keystream using x86 AVX-512, working
+ * on sixteen blocks at a time.
+ *
+ * This works just like the SSE2 and AVX2 versions, except that
+ * AVX-512 can rotate a 32-bit word in a single instruction, and
+ * transposing the output takes an extra step. Poly1305 is left to the
+ * AVX2 code, since any CPU with AVX-512 has AVX2 as well.
+ */
+
+#include "ssh.h"
+#include "chacha20.h"
+
+#include <immintrin.h>
+
+#if defined(__clang__) || defined(__GNUC__)
+#include <cpuid.h>
+#define GET_CPU_ID_0(out)                               \
+    __cpuid(0, (out)[0], (out)[1], (out)[2], (out)[3])
+#define GET_CPU_ID_1(out)                               \
+    __cpuid(1, (out)[0], (out)[1], (out)[2], (out)[3])
+#define GET_CPU_ID_7(out)                                       \
+    __cpuid_count(7, 0, (out)[0], (out)[1], (out)[2], (out)[3])
+static inline uint64_t get_xcr0(void)
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+    return lo | ((uint64_t)hi << 32);
+}
+#else
+#define GET_CPU_ID_0(out) __cpuid(out, 0)
+#define GET_CPU_ID_1(out) __cpuid(out, 1)
+#define GET_CPU_ID_7(out) __cpuidex(out, 7, 0)
+#define get_xcr0() _xgetbv(0)
+#endif
+
+bool chacha20_avx512_available(void)
+{
+    unsigned int CPUInfo[4];
+    GET_CPU_ID_0(CPUInfo);
+    if (CPUInfo[0] < 7)
+        return false;
+
+    /* The OS must be saving the ZMM and opmask registers */
+    GET_CPU_ID_1(CPUInfo);
+    if (!(CPUInfo[2] & (1 << 27)))     /* OSXSAVE */
+        return false;
+    if ((get_xcr0() & 0xE6) != 0xE6)   /* XMM, YMM, opmask and ZMM state */
+        return false;
+
+    GET_CPU_ID_7(CPUInfo);
+    return (CPUInfo[1] & (1 << 16)) && /* AVX512F */
+        (CPUInfo[1] & (1 << 5));       /* AVX2, for the Poly1305 */
+}
+
+#define QUARTER(a, b, c, d)                                             \
+    a = _mm512_add_epi32(a, b); d = _mm512_xor_si512(d, a);             \
+    d = _mm512_rol_epi32(d, 16);                                        \
+    c = _mm512_add_epi32(c, d); b = _mm512_xor_si512(b, c);             \
+    b = _mm512_rol_epi32(b, 12);                                        \
+    a = _mm512_add_epi32(a, b); d = _mm512_xor_si512(d, a);             \
+    d = _mm512_rol_epi32(d, 8);                                         \
+    c = _mm512_add_epi32(c, d); b = _mm512_xor_si512(b, c);             \
+    b = _mm512_rol_epi32(b, 7)
+
+static inline void xor_512(unsigned char *p, __m512i v)
+{
+    _mm512_storeu_si512(p, _mm512_xor_si512(_mm512_loadu_si512(p), v));
+}
+
+/*
+ * Generate sixteen blocks of keystream from words 0-11 of the given
+ * state, with words 12-15 of block j taken from lanes[0..3][j], and
+ * XOR them into the 1024 bytes at 'blk'.
+ */
+static inline void chacha20_avx512_core(const uint32_t *state,
+                                        const uint32_t (*lanes)[16],
+                                        unsigned char *blk)
+{
+    __m512i in[16], x[16];
+
+    for (size_t i = 0; i < 12; i++)
+        in[i] = _mm512_set1_epi32(state[i]);
+    for (size_t i = 0; i < 4; i++)
+        in[12 + i] = _mm512_loadu_si512(lanes[i]);
+
+    for (size_t i = 0; i < 16; i++)
+        x[i] = in[i];
+
+    for (size_t i = 0; i < 20; i += 2) {
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+
+    for (size_t i = 0; i < 16; i++)
+        x[i] = _mm512_add_epi32(x[i], in[i]);
+
+    /*
+     * Transpose each group of four words within the 128-bit lanes.
+     * Afterwards, lane L of b[g][j] holds words 4g..4g+3 of block
+     * j+4L.
+     */
+    __m512i b[4][4];
+    for (size_t g = 0; g < 4; g++) {
+        __m512i t0 = _mm512_unpacklo_epi32(x[4*g], x[4*g+1]);
+        __m512i t1 = _mm512_unpacklo_epi32(x[4*g+2], x[4*g+3]);
+        __m512i t2 = _mm512_unpackhi_epi32(x[4*g], x[4*g+1]);
+        __m512i t3 = _mm512_unpackhi_epi32(x[4*g+2], x[4*g+3]);
+
+        b[g][0] = _mm512_unpacklo_epi64(t0, t1);
+        b[g][1] = _mm512_unpackhi_epi64(t0, t1);
+        b[g][2] = _mm512_unpacklo_epi64(t2, t3);
+        b[g][3] = _mm512_unpackhi_epi64(t2, t3);
+    }
+
+    /*
+     * Then transpose the 4x4 matrix of lanes b[0..3][j], so that each
+     * output register holds a whole block.
+     */
+    for (size_t j = 0; j < 4; j++) {
+        __m512i u0 = _mm512_shuffle_i32x4(b[0][j], b[1][j], 0x44);
+        __m512i u1 = _mm512_shuffle_i32x4(b[0][j], b[1][j], 0xee);
+        __m512i u2 = _mm512_shuffle_i32x4(b[2][j], b[3][j], 0x44);
+        __m512i u3 = _mm512_shuffle_i32x4(b[2][j], b[3][j], 0xee);
+
+        xor_512(blk + 64*j, _mm512_shuffle_i32x4(u0, u2, 0x88));
+        xor_512(blk + 64*(j+4), _mm512_shuffle_i32x4(u0, u2, 0xdd));
+        xor_512(blk + 64*(j+8), _mm512_shuffle_i32x4(u1, u3, 0x88));
+        xor_512(blk + 64*(j+12), _mm512_shuffle_i32x4(u1, u3, 0xdd));
+    }
+}
+
+/* Fill in the lanes for consecutive blocks starting at the state's
+ * own counter */
+static inline void chacha20_avx512_lanes(const uint32_t *state,
+                                         uint32_t (*lanes)[16])
+{
+    uint64_t ctr = state[12] | ((uint64_t)state[13] << 32);
+    for (size_t j = 0; j < 16; j++) {
+        lanes[0][j] = (uint32_t)(ctr + j);
+        lanes[1][j] = (uint32_t)((ctr + j) >> 32);
+        lanes[2][j] = state[14];
+        lanes[3][j] = state[15];
+    }
+}
+
+/*
+ * Run the core over a trailing part-batch, by generating a whole
+ * batch into a buffer and using the start of it.
+ */
+static void chacha20_avx512_partial(const uint32_t *state,
+                                    const uint32_t (*lanes)[16],
+                                    unsigned char *blk, size_t nblocks)
+{
+    unsigned char buf[1024];
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, blk, 64 * nblocks);
+    chacha20_avx512_core(state, lanes, buf);
+    memcpy(blk, buf, 64 * nblocks);
+    smemclr(buf, sizeof(buf));
+}
+
+void chacha20_avx512_xor_blocks(uint32_t *state, unsigned char *blk,
+                                size_t nblocks)
+{
+    uint32_t lanes[4][16];
+
+    for (; nblocks >= 16; nblocks -= 16, blk += 1024) {
+        chacha20_avx512_lanes(state, lanes);
+        chacha20_avx512_core(state, lanes, blk);
+        chacha20_advance_counter(state, 16);
+    }
+
+    if (nblocks) {
+        chacha20_avx512_lanes(state, lanes);
+        chacha20_avx512_partial(state, lanes, blk, nblocks);
+        chacha20_advance_counter(state, nblocks);
+    }
+}
+
+void chacha20_avx512_xor_blocks_multi(
+    const uint32_t *state, const uint32_t *ctrnonce, unsigned char *blk,
+    size_t nblocks)
+{
+    uint32_t lanes[4][16];
+
+    while (nblocks) {
+        size_t n = nblocks < 16 ? nblocks : 16;
+        memset(lanes, 0, sizeof(lanes));
+        for (size_t j = 0; j < n; j++)
+            for (size_t i = 0; i < 4; i++)
+                lanes[i][j] = ctrnonce[4*j + i];
+
+        if (n == 16)
+            chacha20_avx512_core(state, lanes, blk);
+        else
+            chacha20_avx512_partial(state, lanes, blk, n);
+
+        ctrnonce += 4*n;
+        blk += 64*n;
+        nblocks -= n;
+    }
+}
@@ -31,6 +31,7 @@
 
 #include "ssh.h"
 #include "mpint_i.h"
+#include "chacha20.h"
 
 #ifndef INLINE
 #define INLINE
@@ -50,15 +51,18 @@ struct chacha20 {
     unsigned char current[64];
     /* The index of the above currently used to allow a true streaming cipher */
     int currentIndex;
+    /* Bulk XOR of whole blocks, from the implementation's ccp_extra */
+    void (*xor_blocks)(uint32_t *state, unsigned char *blk, size_t nblocks);
 };
 
-static INLINE void chacha20_round(struct chacha20 *ctx)
+/* Generate one block of keystream from the state, without changing it */
+static INLINE void chacha20_block(const uint32_t *state, unsigned char *out)
 {
     int i;
     uint32_t copy[16];
 
     /* Take a copy */
-    memcpy(copy, ctx->state, sizeof(copy));
+    memcpy(copy, state, sizeof(copy));
 
     /* A circular rotation for a 32bit number */
 #define rotl(x, shift) x = ((x << shift) | (x >> (32 - shift)))
@@ -97,19 +101,23 @@ static INLINE void chacha20_round(struct chacha20 *ctx)
 
     /* Add the initial state */
     for (i = 0; i < 16; ++i) {
-        copy[i] += ctx->state[i];
+        copy[i] += state[i];
     }
 
-    /* Update the content of the xor buffer */
+    /* Write out the keystream */
     for (i = 0; i < 16; ++i) {
-        ctx->current[i * 4 + 0] = copy[i] >> 0;
-        ctx->current[i * 4 + 1] = copy[i] >> 8;
-        ctx->current[i * 4 + 2] = copy[i] >> 16;
-        ctx->current[i * 4 + 3] = copy[i] >> 24;
+        PUT_32BIT_LSB_FIRST(out + i * 4, copy[i]);
     }
+    smemclr(copy, sizeof(copy));
+}
+
+static INLINE void chacha20_round(struct chacha20 *ctx)
+{
+    /* Update the content of the xor buffer */
+    chacha20_block(ctx->state, ctx->current);
+
     /* State full, reset pointer to beginning */
     ctx->currentIndex = 0;
-    smemclr(copy, sizeof(copy));
 
     /* Increment round counter */
     ++ctx->state[12];
@@ -155,8 +163,55 @@ static void chacha20_iv(struct chacha20 *ctx, const unsigned char *iv)
     ctx->currentIndex = 64;
 }
 
+/* Portable version of the bulk XOR in struct ccp_extra */
+static void chacha20_sw_xor_blocks(uint32_t *state, unsigned char *blk,
+                                   size_t nblocks)
+{
+    unsigned char keystream[64];
+
+    for (; nblocks; nblocks--, blk += 64) {
+        chacha20_block(state, keystream);
+        for (size_t i = 0; i < 64; i++)
+            blk[i] ^= keystream[i];
+        chacha20_advance_counter(state, 1);
+    }
+
+    smemclr(keystream, sizeof(keystream));
+}
+
+/* Portable version of the multi-block XOR in struct ccp_extra */
+static void chacha20_sw_xor_blocks_multi(
+    const uint32_t *state, const uint32_t *ctrnonce, unsigned char *blk,
+    size_t nblocks)
+{
+    uint32_t copy[16];
+    memcpy(copy, state, sizeof(copy));
+
+    for (; nblocks; nblocks--, blk += 64, ctrnonce += 4) {
+        memcpy(copy + 12, ctrnonce, 4 * sizeof(uint32_t));
+        chacha20_sw_xor_blocks(copy, blk, 1);
+    }
+
+    smemclr(copy, sizeof(copy));
+}
+
 static void chacha20_encrypt(struct chacha20 *ctx, unsigned char *blk, int len)
 {
+    /* Use up whatever is left of the current block of keystream */
+    while (ctx->currentIndex < 64 && len) {
+        *blk++ ^= ctx->current[ctx->currentIndex++];
+        --len;
+    }
+
+    /* Do as many whole blocks as we can in bulk */
+    if (len >= 64) {
+        size_t nblocks = len / 64;
+        ctx->xor_blocks(ctx->state, blk, nblocks);
+        blk += 64 * nblocks;
+        len -= 64 * nblocks;
+    }
+
+    /* And stream the rest */
     while (len) {
         /* If we don't have any state left, then cycle to the next */
         if (ctx->currentIndex >= 64) {
@@ -760,6 +815,11 @@ struct poly1305 {
     bigval r;
     bigval h;
 
+    /* Bulk version of the above, from the implementation's ccp_extra */
+    void (*blocks)(unsigned char *h, const unsigned char *r,
+                   const unsigned char *msg, size_t nblocks);
+    unsigned char r_bytes[16];
+
     /* Buffer in case we get less that a multiple of 16 bytes */
     unsigned char buffer[16];
     int bufferIndex;
@@ -790,6 +850,7 @@ static void poly1305_key(struct poly1305 *ctx, ptrlen key)
     key_copy[8] &= 0xfc;
     key_copy[12] &= 0xfc;
     bigval_import_le(&ctx->r, key_copy, 16);
+    memcpy(ctx->r_bytes, key_copy, 16);
     smemclr(key_copy, sizeof(key_copy));
 
     /* Use second 128 bits as the nonce */
@@ -824,6 +885,19 @@ static void poly1305_feed(struct poly1305 *ctx,
         }
     }
 
+    /* Process as many whole chunks as we can in bulk */
+    if (ctx->blocks && len >= 16 * POLY1305_BULK_BLOCKS) {
+        size_t nblocks = len / (16 * POLY1305_BULK_BLOCKS) *
+            POLY1305_BULK_BLOCKS;
+        unsigned char h[POLY1305_ACC_BYTES];
+        bigval_export_le(&ctx->h, h, sizeof(h));
+        ctx->blocks(h, ctx->r_bytes, buf, nblocks);
+        bigval_import_le(&ctx->h, h, sizeof(h));
+        smemclr(h, sizeof(h));
+        len -= 16 * nblocks;
+        buf += 16 * nblocks;
+    }
+
     /* Process 16 byte whole chunks */
     while (len >= 16) {
         poly1305_feed_chunk(ctx, buf, 16);
@@ -975,9 +1049,16 @@ const ssh2_macalg ssh2_poly1305 = {
 
 static ssh_cipher *ccp_new(const ssh_cipheralg *alg)
 {
+    const struct ccp_extra *extra = (const struct ccp_extra *)alg->extra;
+    if (!check_ccp_availability(extra))
+        return NULL;
+
     struct ccp_context *ctx = snew(struct ccp_context);
     BinarySink_INIT(ctx, poly_BinarySink_write);
     poly1305_init(&ctx->mac);
+    ctx->a_cipher.xor_blocks = extra->xor_blocks;
+    ctx->b_cipher.xor_blocks = extra->xor_blocks;
+    ctx->mac.blocks = extra->poly1305_blocks;
     ctx->ciph.vt = alg;
     ctx->ciph_allocated = true;
     ctx->mac_allocated = false;
@@ -1053,27 +1134,153 @@ static void ccp_decrypt_length(ssh_cipher *cipher, void *blk, int len,
     chacha20_decrypt(&ctx->a_cipher, blk, len);
 }
 
-const ssh_cipheralg ssh2_chacha20_poly1305 = {
-    .new = ccp_new,
-    .free = ccp_free,
-    .setiv = ccp_iv,
-    .setkey = ccp_key,
-    .encrypt = ccp_encrypt,
-    .decrypt = ccp_decrypt,
-    .encrypt_length = ccp_encrypt_length,
-    .decrypt_length = ccp_decrypt_length,
-    .next_message = nullcipher_next_message,
-    .ssh2_id = "chacha20-poly1305@openssh.com",
-    .blksize = 1,
-    .real_keybits = 512,
-    .padded_keybytes = 64,
-    .flags = SSH_CIPHER_SEPARATE_LENGTH,
-    .text_name = "ChaCha20",
-    .required_mac = &ssh2_poly1305,
-};
+/*
+ * Encrypt and MAC a batch of whole outgoing packets.
+ *
+ * For each packet, we need one block of the length cipher's
+ * keystream, the first block of the main keystream (which keys
+ * Poly1305), and then enough of the main keystream to cover the
+ * rest of the packet. Each packet's keystream depends only on its
+ * sequence number, so for a batch of short packets we can generate
+ * all of it together with xor_blocks_multi, which fills the SIMD
+ * lanes with blocks from different packets. Done one packet at a
+ * time, most of that keystream would come a block at a time from
+ * the portable code, because each piece of it is so short.
+ *
+ * A packet too long to be worth that has its body encrypted in the
+ * ordinary way, since xor_blocks already parallelises it.
+ */
+#define CCP_BATCH_PACKETS 16
+#define CCP_BATCH_BODY_BLOCKS 4
 
-static const ssh_cipheralg *const ccp_list[] = {
-    &ssh2_chacha20_poly1305
-};
+static void ccp_encrypt_packets(ssh_cipher *cipher, ssh_cipher_packet *pkts,
+                                size_t npkts)
+{
+    struct ccp_context *ctx = container_of(cipher, struct ccp_context, ciph);
+    const struct ccp_extra *extra = (const struct ccp_extra *)cipher->vt->extra;
+
+    enum { MAXBLOCKS = CCP_BATCH_PACKETS * (1 + CCP_BATCH_BODY_BLOCKS) };
+    uint32_t a_ctrnonce[4 * CCP_BATCH_PACKETS], b_ctrnonce[4 * MAXBLOCKS];
+    unsigned char a_ks[64 * CCP_BATCH_PACKETS], b_ks[64 * MAXBLOCKS];
+    size_t b_index[CCP_BATCH_PACKETS];
+
+    while (npkts > 0) {
+        size_t n = npkts < CCP_BATCH_PACKETS ? npkts : CCP_BATCH_PACKETS;
+        size_t nb = 0;
+
+        for (size_t i = 0; i < n; i++) {
+            /* The same nonce that ccp_length_op sets up */
+            unsigned char iv[4];
+            PUT_32BIT_LSB_FIRST(iv, pkts[i].seq);
+            uint32_t nonce = GET_32BIT_MSB_FIRST(iv);
+
+            uint32_t *w = a_ctrnonce + 4*i;
+            w[0] = w[1] = w[2] = 0;
+            w[3] = nonce;
+
+            size_t bodyblocks = (pkts[i].len - 4 + 63) / 64;
+            if (bodyblocks > CCP_BATCH_BODY_BLOCKS)
+                bodyblocks = 0;        /* just the Poly1305 key, then */
+
+            b_index[i] = nb;
+            for (size_t k = 0; k <= bodyblocks; k++, nb++) {
+                w = b_ctrnonce + 4*nb;
+                w[0] = k;
+                w[1] = w[2] = 0;
+                w[3] = nonce;
+            }
+        }
+
+        memset(a_ks, 0, 64 * n);
+        memset(b_ks, 0, 64 * nb);
+        extra->xor_blocks_multi(ctx->a_cipher.state, a_ctrnonce, a_ks, n);
+        extra->xor_blocks_multi(ctx->b_cipher.state, b_ctrnonce, b_ks, nb);
+
+        for (size_t i = 0; i < n; i++) {
+            unsigned char *data = pkts[i].data;
+            int bodylen = pkts[i].len - 4;
+            const unsigned char *ks = b_ks + 64 * b_index[i];
+
+            memxor(data, data, a_ks + 64*i, 4);
+            if (bodylen <= 64 * CCP_BATCH_BODY_BLOCKS) {
+                memxor(data + 4, data + 4, ks + 64, bodylen);
+            } else {
+                ccp_length_op(ctx, data, 4, pkts[i].seq);
+                chacha20_encrypt(&ctx->b_cipher, data + 4, bodylen);
+            }
+
+            poly1305_init(&ctx->mac);
+            poly1305_key(&ctx->mac, make_ptrlen(ks, 32));
+            poly1305_feed(&ctx->mac, data, pkts[i].len);
+            poly1305_finalise(&ctx->mac, data + pkts[i].len);
+        }
 
-const ssh2_ciphers ssh2_ccp = { lenof(ccp_list), ccp_list };
+        pkts += n;
+        npkts -= n;
+    }
+
+    smemclr(a_ks, sizeof(a_ks));
+    smemclr(b_ks, sizeof(b_ks));
+}
+
+static bool ccp_sw_available(void)
+{
+    /* Software implementation is always available */
+    return true;
+}
+
+#define CCP_VTABLE(impl_c, impl_display, avail_fn, xor_fn, multi_fn,   \
+                   poly_fn)                                             \
+    static struct ccp_extra_mutable ccp_ ## impl_c ## _extra_mut;       \
+    static const struct ccp_extra ccp_ ## impl_c ## _extra = {          \
+        .check_available = avail_fn,                                    \
+        .mut = &ccp_ ## impl_c ## _extra_mut,                           \
+        .xor_blocks = xor_fn,                                           \
+        .xor_blocks_multi = multi_fn,                                   \
+        .poly1305_blocks = poly_fn,                                     \
+    };                                                                  \
+    const ssh_cipheralg ssh2_chacha20_poly1305_ ## impl_c = {           \
+        .new = ccp_new,                                                 \
+        .free = ccp_free,                                               \
+        .setiv = ccp_iv,                                                \
+        .setkey = ccp_key,                                              \
+        .encrypt = ccp_encrypt,                                         \
+        .decrypt = ccp_decrypt,                                         \
+        .encrypt_length = ccp_encrypt_length,                           \
+        .decrypt_length = ccp_decrypt_length,                           \
+        .next_message = nullcipher_next_message,                        \
+        .encrypt_packets = ccp_encrypt_packets,                         \
+        .ssh2_id = "chacha20-poly1305@openssh.com",                     \
+        .blksize = 1,                                                   \
+        .real_keybits = 512,                                            \
+        .padded_keybytes = 64,                                          \
+        .flags = SSH_CIPHER_SEPARATE_LENGTH,                            \
+        .text_name = "ChaCha20 (" impl_display ")",                     \
+        .required_mac = &ssh2_poly1305,                                 \
+        .extra = &ccp_ ## impl_c ## _extra,                             \
+    }
+
+/*
+ * One vtable per implementation. The accelerated ones live in their
+ * own source files, because they need special compiler flags; see
+ * chacha20.h for what they provide. ssh2_chacha20_poly1305 itself is
+ * the selector in chacha20-select.c.
+ */
+CCP_VTABLE(sw, "unaccelerated", ccp_sw_available,
+           chacha20_sw_xor_blocks, chacha20_sw_xor_blocks_multi,
+           NULL);
+#if HAVE_SSE2
+CCP_VTABLE(sse2, "SSE2 accelerated", chacha20_sse2_available,
+           chacha20_sse2_xor_blocks, chacha20_sse2_xor_blocks_multi,
+           NULL);
+#endif
+#if HAVE_AVX2
+CCP_VTABLE(avx2, "AVX2 accelerated", chacha20_avx2_available,
+           chacha20_avx2_xor_blocks, chacha20_avx2_xor_blocks_multi,
+           poly1305_avx2_blocks);
+#endif
+#if HAVE_AVX512
+CCP_VTABLE(avx512, "AVX-512 accelerated", chacha20_avx512_available,
+           chacha20_avx512_xor_blocks, chacha20_avx512_xor_blocks_multi,
+           poly1305_avx2_blocks);
+#endif
@@ -0,0 +1,57 @@
+/*
+ * Top-level vtable to select a ChaCha20-Poly1305 implementation.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+
+#include "putty.h"
+#include "ssh.h"
+#include "chacha20.h"
+
+static ssh_cipher *ccp_select(const ssh_cipheralg *alg)
+{
+    static const ssh_cipheralg *const real_algs[] = {
+#if HAVE_AVX512
+        &ssh2_chacha20_poly1305_avx512,
+#endif
+#if HAVE_AVX2
+        &ssh2_chacha20_poly1305_avx2,
+#endif
+#if HAVE_SSE2
+        &ssh2_chacha20_poly1305_sse2,
+#endif
+        &ssh2_chacha20_poly1305_sw,
+        NULL,
+    };
+
+    for (size_t i = 0; real_algs[i]; i++) {
+        const ssh_cipheralg *alg = real_algs[i];
+        const struct ccp_extra *alg_extra =
+            (const struct ccp_extra *)alg->extra;
+        if (check_ccp_availability(alg_extra))
+            return ssh_cipher_new(alg);
+    }
+
+    /* We should never reach the NULL at the end of the list, because
+     * the last non-NULL entry should be software-only ChaCha20, which
+     * is always available. */
+    unreachable("ccp_select ran off the end of its list");
+}
+
+const ssh_cipheralg ssh2_chacha20_poly1305 = {
+    .new = ccp_select,
+    .ssh2_id = "chacha20-poly1305@openssh.com",
+    .blksize = 1,
+    .real_keybits = 512,
+    .padded_keybytes = 64,
+    .flags = SSH_CIPHER_SEPARATE_LENGTH,
+    .text_name = "ChaCha20 (dummy selector vtable)",
+    .required_mac = &ssh2_poly1305,
+};
+
+static const ssh_cipheralg *const ccp_list[] = {
+    &ssh2_chacha20_poly1305
+};
+
+const ssh2_ciphers ssh2_ccp = { lenof(ccp_list), ccp_list };
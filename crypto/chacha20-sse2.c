@@ -0,0 +1,169 @@
+/*
+ * Implementation of the ChaCha20 keystream using x86 SSE2, working on
+ * four blocks at a time.
+ *
+ * Each 128-bit register holds the same word of the state for four
+ * consecutive blocks, so that the rounds are just the scalar
+ * algorithm done four times over, and the only cross-lane work is
+ * transposing the result back into byte order at the end.
+ */
+
+#include "ssh.h"
+#include "chacha20.h"
+
+#include <emmintrin.h>
+
+#if defined(__clang__) || defined(__GNUC__)
+#include <cpuid.h>
+#define GET_CPU_ID(out) __cpuid(1, (out)[0], (out)[1], (out)[2], (out)[3])
+#else
+#define GET_CPU_ID(out) __cpuid(out, 1)
+#endif
+
+bool chacha20_sse2_available(void)
+{
+    unsigned int CPUInfo[4];
+    GET_CPU_ID(CPUInfo);
+    return CPUInfo[3] & (1 << 26);
+}
+
+#define ROTL(x, n) \
+    _mm_or_si128(_mm_slli_epi32(x, n), _mm_srli_epi32(x, 32 - (n)))
+
+#define QUARTER(a, b, c, d)                                     \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a);           \
+    d = ROTL(d, 16);                                            \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c);           \
+    b = ROTL(b, 12);                                            \
+    a = _mm_add_epi32(a, b); d = _mm_xor_si128(d, a);           \
+    d = ROTL(d, 8);                                             \
+    c = _mm_add_epi32(c, d); b = _mm_xor_si128(b, c);           \
+    b = ROTL(b, 7)
+
+/*
+ * Generate four blocks of keystream from words 0-11 of the given
+ * state, with words 12-15 of block j taken from lanes[0..3][j], and
+ * XOR them into the 256 bytes at 'blk'.
+ */
+static inline void chacha20_sse2_core(const uint32_t *state,
+                                      const uint32_t (*lanes)[4],
+                                      unsigned char *blk)
+{
+    __m128i in[16], x[16];
+
+    for (size_t i = 0; i < 12; i++)
+        in[i] = _mm_set1_epi32(state[i]);
+    for (size_t i = 0; i < 4; i++)
+        in[12 + i] = _mm_loadu_si128((const __m128i *)lanes[i]);
+
+    for (size_t i = 0; i < 16; i++)
+        x[i] = in[i];
+
+    for (size_t i = 0; i < 20; i += 2) {
+        QUARTER(x[0], x[4], x[8], x[12]);
+        QUARTER(x[1], x[5], x[9], x[13]);
+        QUARTER(x[2], x[6], x[10], x[14]);
+        QUARTER(x[3], x[7], x[11], x[15]);
+        QUARTER(x[0], x[5], x[10], x[15]);
+        QUARTER(x[1], x[6], x[11], x[12]);
+        QUARTER(x[2], x[7], x[8], x[13]);
+        QUARTER(x[3], x[4], x[9], x[14]);
+    }
+
+    for (size_t i = 0; i < 16; i++)
+        x[i] = _mm_add_epi32(x[i], in[i]);
+
+    /*
+     * Transpose each group of four words, so that we have words
+     * 4g..4g+3 of each block in one register, and XOR them in.
+     */
+    for (size_t g = 0; g < 4; g++) {
+        __m128i t0 = _mm_unpacklo_epi32(x[4*g], x[4*g+1]);
+        __m128i t1 = _mm_unpacklo_epi32(x[4*g+2], x[4*g+3]);
+        __m128i t2 = _mm_unpackhi_epi32(x[4*g], x[4*g+1]);
+        __m128i t3 = _mm_unpackhi_epi32(x[4*g+2], x[4*g+3]);
+
+        __m128i b[4];
+        b[0] = _mm_unpacklo_epi64(t0, t1);
+        b[1] = _mm_unpackhi_epi64(t0, t1);
+        b[2] = _mm_unpacklo_epi64(t2, t3);
+        b[3] = _mm_unpackhi_epi64(t2, t3);
+
+        for (size_t j = 0; j < 4; j++) {
+            __m128i *p = (__m128i *)(blk + 64*j + 16*g);
+            _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), b[j]));
+        }
+    }
+}
+
+/* Fill in the lanes for consecutive blocks starting at the state's
+ * own counter */
+static inline void chacha20_sse2_lanes(const uint32_t *state,
+                                       uint32_t (*lanes)[4])
+{
+    uint64_t ctr = state[12] | ((uint64_t)state[13] << 32);
+    for (size_t j = 0; j < 4; j++) {
+        lanes[0][j] = (uint32_t)(ctr + j);
+        lanes[1][j] = (uint32_t)((ctr + j) >> 32);
+        lanes[2][j] = state[14];
+        lanes[3][j] = state[15];
+    }
+}
+
+/*
+ * Run the core over a trailing part-batch, by generating a whole
+ * batch into a buffer and using the start of it.
+ */
+static void chacha20_sse2_partial(const uint32_t *state,
+                                  const uint32_t (*lanes)[4],
+                                  unsigned char *blk, size_t nblocks)
+{
+    unsigned char buf[256];
+    memset(buf, 0, sizeof(buf));
+    memcpy(buf, blk, 64 * nblocks);
+    chacha20_sse2_core(state, lanes, buf);
+    memcpy(blk, buf, 64 * nblocks);
+    smemclr(buf, sizeof(buf));
+}
+
+void chacha20_sse2_xor_blocks(uint32_t *state, unsigned char *blk,
+                              size_t nblocks)
+{
+    uint32_t lanes[4][4];
+
+    for (; nblocks >= 4; nblocks -= 4, blk += 256) {
+        chacha20_sse2_lanes(state, lanes);
+        chacha20_sse2_core(state, lanes, blk);
+        chacha20_advance_counter(state, 4);
+    }
+
+    if (nblocks) {
+        chacha20_sse2_lanes(state, lanes);
+        chacha20_sse2_partial(state, lanes, blk, nblocks);
+        chacha20_advance_counter(state, nblocks);
+    }
+}
+
+void chacha20_sse2_xor_blocks_multi(
+    const uint32_t *state, const uint32_t *ctrnonce, unsigned char *blk,
+    size_t nblocks)
+{
+    uint32_t lanes[4][4];
+
+    while (nblocks) {
+        size_t n = nblocks < 4 ? nblocks : 4;
+        memset(lanes, 0, sizeof(lanes));
+        for (size_t j = 0; j < n; j++)
+            for (size_t i = 0; i < 4; i++)
+                lanes[i][j] = ctrnonce[4*j + i];
+
+        if (n == 4)
+            chacha20_sse2_core(state, lanes, blk);
+        else
+            chacha20_sse2_partial(state, lanes, blk, n);
+
+        ctrnonce += 4*n;
+        blk += 64*n;
+        nblocks -= n;
+    }
+}
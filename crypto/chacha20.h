@@ -0,0 +1,106 @@
+/*
+ * Definitions shared between the ChaCha20-Poly1305 implementations.
+ *
+ * Most of the cipher (the streaming logic, the key and IV setup, and
+ * the linkage between the cipher and the MAC) is common to all of
+ * them, and lives in chacha20-poly1305.c. An accelerated
+ * implementation only has to supply the bulk operations: generating
+ * and XORing in several blocks of keystream at once, and optionally
+ * absorbing several blocks of message into Poly1305.
+ */
+
+/*
+ * The 'extra' structure used by ChaCha20-Poly1305 implementations is
+ * used to include information about how to check if a given
+ * implementation is available at run time, and whether we've already
+ * checked; and to point at the bulk operations.
+ */
+struct ccp_extra_mutable;
+struct ccp_extra {
+    /* Function to check availability. Might be expensive, so we don't
+     * want to call it more than once. */
+    bool (*check_available)(void);
+
+    /* Point to a writable substructure. */
+    struct ccp_extra_mutable *mut;
+
+    /*
+     * XOR 'nblocks' consecutive 64-byte blocks of keystream into
+     * 'blk', starting at the block counter in state[12] and
+     * state[13], and advance the counter past them.
+     */
+    void (*xor_blocks)(uint32_t *state, unsigned char *blk, size_t nblocks);
+
+    /*
+     * The same, except that the blocks needn't be consecutive: block
+     * i takes state[12..15] (its counter and nonce) from
+     * ctrnonce[4*i .. 4*i+3] instead. 'state' itself is left alone.
+     * This lets us generate keystream for several packets at once.
+     */
+    void (*xor_blocks_multi)(const uint32_t *state, const uint32_t *ctrnonce,
+                             unsigned char *blk, size_t nblocks);
+
+    /*
+     * Absorb 'nblocks' 16-byte blocks of message into a Poly1305
+     * accumulator, where 'nblocks' is a nonzero multiple of
+     * POLY1305_BULK_BLOCKS. The accumulator is passed in and out as
+     * POLY1305_ACC_BYTES little-endian bytes, not necessarily fully
+     * reduced; 'r' is the 16-byte clamped multiplier.
+     *
+     * May be NULL, in which case the portable Poly1305 is used for
+     * everything.
+     */
+    void (*poly1305_blocks)(unsigned char *h, const unsigned char *r,
+                            const unsigned char *msg, size_t nblocks);
+};
+struct ccp_extra_mutable {
+    bool checked_availability;
+    bool is_available;
+};
+static inline bool check_ccp_availability(const struct ccp_extra *extra)
+{
+    if (!extra->mut->checked_availability) {
+        extra->mut->is_available = extra->check_available();
+        extra->mut->checked_availability = true;
+    }
+
+    return extra->mut->is_available;
+}
+
+#define POLY1305_BULK_BLOCKS 4
+#define POLY1305_ACC_BYTES 17
+
+/*
+ * Advance the 64-bit block counter held in state[12] and state[13].
+ */
+static inline void chacha20_advance_counter(uint32_t *state, size_t n)
+{
+    uint64_t ctr = state[12] | ((uint64_t)state[13] << 32);
+    ctr += n;
+    state[12] = (uint32_t)ctr;
+    state[13] = (uint32_t)(ctr >> 32);
+}
+
+/*
+ * Entry points of the accelerated implementations.
+ */
+bool chacha20_sse2_available(void);
+void chacha20_sse2_xor_blocks(uint32_t *state, unsigned char *blk,
+                              size_t nblocks);
+void chacha20_sse2_xor_blocks_multi(
+    const uint32_t *state, const uint32_t *ctrnonce, unsigned char *blk,
+    size_t nblocks);
+bool chacha20_avx2_available(void);
+void chacha20_avx2_xor_blocks(uint32_t *state, unsigned char *blk,
+                              size_t nblocks);
+void chacha20_avx2_xor_blocks_multi(
+    const uint32_t *state, const uint32_t *ctrnonce, unsigned char *blk,
+    size_t nblocks);
+void poly1305_avx2_blocks(unsigned char *h, const unsigned char *r,
+                          const unsigned char *msg, size_t nblocks);
+bool chacha20_avx512_available(void);
+void chacha20_avx512_xor_blocks(uint32_t *state, unsigned char *blk,
+                                size_t nblocks);
+void chacha20_avx512_xor_blocks_multi(
+    const uint32_t *state, const uint32_t *ctrnonce, unsigned char *blk,
+    size_t nblocks);
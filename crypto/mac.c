@@ -41,3 +41,44 @@ bool ssh2_mac_verify(
     ssh2_mac_prepare(mac, blk, len, seq);
     return ssh2_mac_verresult(mac, (const unsigned char *)blk + len);
 }
+
+void ssh2_mac_encrypt_and_generate(ssh2_mac *mac, ssh_cipher *cipher,
+                                   void *blk, int len, int clearlen,
+                                   unsigned long seq)
+{
+    unsigned char *p = (unsigned char *)blk;
+
+    if (!mac->vt->encrypt_and_update) {
+        if (cipher)
+            ssh_cipher_encrypt(cipher, p + clearlen, len - clearlen);
+        ssh2_mac_generate(mac, blk, len, seq);
+        return;
+    }
+
+    ssh2_mac_start(mac);
+    put_uint32(mac, seq);
+    put_data(mac, p, clearlen);
+    mac->vt->encrypt_and_update(mac, p + clearlen, len - clearlen);
+    ssh2_mac_genresult(mac, p + len);
+}
+
+bool ssh2_mac_verify_and_decrypt(ssh2_mac *mac, ssh_cipher *cipher,
+                                 void *blk, int len, int clearlen,
+                                 unsigned long seq)
+{
+    unsigned char *p = (unsigned char *)blk;
+
+    if (!mac->vt->decrypt_and_update) {
+        if (!ssh2_mac_verify(mac, blk, len, seq))
+            return false;
+        if (cipher)
+            ssh_cipher_decrypt(cipher, p + clearlen, len - clearlen);
+        return true;
+    }
+
+    ssh2_mac_start(mac);
+    put_uint32(mac, seq);
+    put_data(mac, p, clearlen);
+    mac->vt->decrypt_and_update(mac, p + clearlen, len - clearlen);
+    return ssh2_mac_verresult(mac, p + len);
+}
@@ -0,0 +1,303 @@
+/*
+ * Implementation of SHA-512 using x86 AVX2.
+ *
+ * There's no x86 instruction that does a SHA-512 round that we can
+ * count on having, so the rounds themselves are still done in scalar
+ * code. What AVX2 buys us is the message schedule: it doesn't depend
+ * on the hash state, so we can expand two consecutive blocks at once,
+ * one in each 128-bit lane, two words of each per step. The round
+ * constants are added in at the same time, so the rounds only have to
+ * look up one word each.
+ */
+
+#include "ssh.h"
+#include "sha512.h"
+
+#include <immintrin.h>
+
+#if defined(__clang__) || defined(__GNUC__)
+#include <cpuid.h>
+#define GET_CPU_ID_0(out)                               \
+    __cpuid(0, (out)[0], (out)[1], (out)[2], (out)[3])
+#define GET_CPU_ID_1(out)                               \
+    __cpuid(1, (out)[0], (out)[1], (out)[2], (out)[3])
+#define GET_CPU_ID_7(out)                                       \
+    __cpuid_count(7, 0, (out)[0], (out)[1], (out)[2], (out)[3])
+static inline uint64_t get_xcr0(void)
+{
+    uint32_t lo, hi;
+    __asm__ __volatile__("xgetbv" : "=a" (lo), "=d" (hi) : "c" (0));
+    return lo | ((uint64_t)hi << 32);
+}
+#else
+#define GET_CPU_ID_0(out) __cpuid(out, 0)
+#define GET_CPU_ID_1(out) __cpuid(out, 1)
+#define GET_CPU_ID_7(out) __cpuidex(out, 7, 0)
+#define get_xcr0() _xgetbv(0)
+#endif
+
+static bool sha512_avx2_available(void)
+{
+    unsigned int CPUInfo[4];
+    GET_CPU_ID_0(CPUInfo);
+    if (CPUInfo[0] < 7)
+        return false;
+
+    /* The OS must be saving the YMM registers across context switches */
+    GET_CPU_ID_1(CPUInfo);
+    if (!(CPUInfo[2] & (1 << 27)))     /* OSXSAVE */
+        return false;
+    if ((get_xcr0() & 6) != 6)         /* XMM and YMM state */
+        return false;
+
+    GET_CPU_ID_7(CPUInfo);
+    return CPUInfo[1] & (1 << 5);      /* AVX2 */
+}
+
+/* ----------------------------------------------------------------------
+ * Message schedule.
+ */
+
+static inline __m256i ror_256(__m256i x, unsigned y)
+{
+    return _mm256_or_si256(_mm256_srli_epi64(x, y),
+                           _mm256_slli_epi64(x, 64 - y));
+}
+
+static inline __m256i sigma_0_256(__m256i x)
+{
+    return _mm256_xor_si256(_mm256_xor_si256(ror_256(x, 1), ror_256(x, 8)),
+                            _mm256_srli_epi64(x, 7));
+}
+
+static inline __m256i sigma_1_256(__m256i x)
+{
+    return _mm256_xor_si256(_mm256_xor_si256(ror_256(x, 19), ror_256(x, 61)),
+                            _mm256_srli_epi64(x, 6));
+}
+
+/*
+ * Expand the schedules of two blocks, and write each one out with
+ * the round constants added.
+ *
+ * w[i] holds words 2i and 2i+1 of the first block's schedule in its
+ * low lane, and the same words of the second block's in its high
+ * lane. So each step computes words t and t+1 from t-16 .. t-1, which
+ * is fine because the nearest words they need are t-2 and t-1.
+ */
+static inline void sha512_avx2_schedule(
+    uint64_t *wk0, uint64_t *wk1, const uint8_t *block0, const uint8_t *block1)
+{
+    const __m256i bswap = _mm256_broadcastsi128_si256(_mm_setr_epi8(
+        7, 6, 5, 4, 3, 2, 1, 0, 15, 14, 13, 12, 11, 10, 9, 8));
+    __m256i w[SHA512_ROUNDS / 2];
+
+    for (size_t i = 0; i < 8; i++) {
+        __m128i lo = _mm_loadu_si128((const __m128i *)(block0 + 16*i));
+        __m128i hi = _mm_loadu_si128((const __m128i *)(block1 + 16*i));
+        w[i] = _mm256_shuffle_epi8(
+            _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1),
+            bswap);
+    }
+
+    for (size_t i = 8; i < SHA512_ROUNDS / 2; i++) {
+        /* Words t-15,t-14 and t-7,t-6 straddle two vectors each */
+        __m256i w15 = _mm256_alignr_epi8(w[i-7], w[i-8], 8);
+        __m256i w7 = _mm256_alignr_epi8(w[i-3], w[i-4], 8);
+        w[i] = _mm256_add_epi64(
+            _mm256_add_epi64(w[i-8], sigma_0_256(w15)),
+            _mm256_add_epi64(w7, sigma_1_256(w[i-1])));
+    }
+
+    for (size_t i = 0; i < SHA512_ROUNDS / 2; i++) {
+        __m256i k = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+            (const __m128i *)(sha512_round_constants + 2*i)));
+        __m256i v = _mm256_add_epi64(w[i], k);
+        _mm_storeu_si128((__m128i *)(wk0 + 2*i), _mm256_castsi256_si128(v));
+        _mm_storeu_si128((__m128i *)(wk1 + 2*i),
+                         _mm256_extracti128_si256(v, 1));
+    }
+
+    smemclr(w, sizeof(w));
+}
+
+/* ----------------------------------------------------------------------
+ * Rounds.
+ */
+
+static inline uint64_t ror(uint64_t x, unsigned y)
+{
+    return (x << (63 & -y)) | (x >> (63 & y));
+}
+
+static inline uint64_t Ch(uint64_t ctrl, uint64_t if1, uint64_t if0)
+{
+    return if0 ^ (ctrl & (if1 ^ if0));
+}
+
+static inline uint64_t Maj(uint64_t x, uint64_t y, uint64_t z)
+{
+    return (x & y) | (z & (x | y));
+}
+
+static inline uint64_t Sigma_0(uint64_t x)
+{
+    return ror(x,28) ^ ror(x,34) ^ ror(x,39);
+}
+
+static inline uint64_t Sigma_1(uint64_t x)
+{
+    return ror(x,14) ^ ror(x,18) ^ ror(x,41);
+}
+
+static inline void sha512_avx2_round(
+    unsigned round_index, const uint64_t *wk,
+    uint64_t *a, uint64_t *b, uint64_t *c, uint64_t *d,
+    uint64_t *e, uint64_t *f, uint64_t *g, uint64_t *h)
+{
+    uint64_t t1 = *h + Sigma_1(*e) + Ch(*e,*f,*g) + wk[round_index];
+    uint64_t t2 = Sigma_0(*a) + Maj(*a,*b,*c);
+
+    *d += t1;
+    *h = t1 + t2;
+}
+
+static void sha512_avx2_rounds(uint64_t *core, const uint64_t *wk)
+{
+    uint64_t a,b,c,d,e,f,g,h;
+
+    a = core[0]; b = core[1]; c = core[2]; d = core[3];
+    e = core[4]; f = core[5]; g = core[6]; h = core[7];
+
+    for (unsigned t = 0; t < SHA512_ROUNDS; t+=8) {
+        sha512_avx2_round(t+0, wk, &a,&b,&c,&d,&e,&f,&g,&h);
+        sha512_avx2_round(t+1, wk, &h,&a,&b,&c,&d,&e,&f,&g);
+        sha512_avx2_round(t+2, wk, &g,&h,&a,&b,&c,&d,&e,&f);
+        sha512_avx2_round(t+3, wk, &f,&g,&h,&a,&b,&c,&d,&e);
+        sha512_avx2_round(t+4, wk, &e,&f,&g,&h,&a,&b,&c,&d);
+        sha512_avx2_round(t+5, wk, &d,&e,&f,&g,&h,&a,&b,&c);
+        sha512_avx2_round(t+6, wk, &c,&d,&e,&f,&g,&h,&a,&b);
+        sha512_avx2_round(t+7, wk, &b,&c,&d,&e,&f,&g,&h,&a);
+    }
+
+    core[0] += a; core[1] += b; core[2] += c; core[3] += d;
+    core[4] += e; core[5] += f; core[6] += g; core[7] += h;
+}
+
+/*
+ * Process one or two blocks. If block1 is NULL, only block0 is
+ * hashed (its schedule is expanded twice, and one copy discarded).
+ */
+static void sha512_avx2_blocks(uint64_t *core, const uint8_t *block0,
+                               const uint8_t *block1)
+{
+    uint64_t wk0[SHA512_ROUNDS], wk1[SHA512_ROUNDS];
+
+    sha512_avx2_schedule(wk0, wk1, block0, block1 ? block1 : block0);
+    sha512_avx2_rounds(core, wk0);
+    if (block1)
+        sha512_avx2_rounds(core, wk1);
+
+    smemclr(wk0, sizeof(wk0));
+    smemclr(wk1, sizeof(wk1));
+}
+
+/* ----------------------------------------------------------------------
+ * Top-level API.
+ */
+
+typedef struct sha512_avx2 {
+    uint64_t core[8];
+    sha512_block blk;
+
+    /* A whole block waiting for a partner to be hashed alongside */
+    uint8_t pending[128];
+    bool have_pending;
+
+    BinarySink_IMPLEMENTATION;
+    ssh_hash hash;
+} sha512_avx2;
+
+static void sha512_avx2_write(BinarySink *bs, const void *vp, size_t len);
+
+static ssh_hash *sha512_avx2_new(const ssh_hashalg *alg)
+{
+    const struct sha512_extra *extra = (const struct sha512_extra *)alg->extra;
+    if (!check_availability(extra))
+        return NULL;
+
+    sha512_avx2 *s = snew(sha512_avx2);
+
+    s->hash.vt = alg;
+    BinarySink_INIT(s, sha512_avx2_write);
+    BinarySink_DELEGATE_INIT(&s->hash, s);
+    return &s->hash;
+}
+
+static void sha512_avx2_reset(ssh_hash *hash)
+{
+    sha512_avx2 *s = container_of(hash, sha512_avx2, hash);
+    const struct sha512_extra *extra =
+        (const struct sha512_extra *)hash->vt->extra;
+
+    memcpy(s->core, extra->initial_state, sizeof(s->core));
+    sha512_block_setup(&s->blk);
+    s->have_pending = false;
+}
+
+static void sha512_avx2_copyfrom(ssh_hash *hcopy, ssh_hash *horig)
+{
+    sha512_avx2 *copy = container_of(hcopy, sha512_avx2, hash);
+    sha512_avx2 *orig = container_of(horig, sha512_avx2, hash);
+
+    memcpy(copy, orig, sizeof(*copy));
+    BinarySink_COPIED(copy);
+    BinarySink_DELEGATE_INIT(&copy->hash, copy);
+}
+
+static void sha512_avx2_free(ssh_hash *hash)
+{
+    sha512_avx2 *s = container_of(hash, sha512_avx2, hash);
+
+    smemclr(s, sizeof(*s));
+    sfree(s);
+}
+
+static void sha512_avx2_write(BinarySink *bs, const void *vp, size_t len)
+{
+    sha512_avx2 *s = BinarySink_DOWNCAST(bs, sha512_avx2);
+
+    while (len > 0) {
+        if (sha512_block_write(&s->blk, &vp, &len)) {
+            if (s->have_pending) {
+                sha512_avx2_blocks(s->core, s->pending, s->blk.block);
+                s->have_pending = false;
+            } else {
+                memcpy(s->pending, s->blk.block, sizeof(s->pending));
+                s->have_pending = true;
+            }
+        }
+    }
+}
+
+static void sha512_avx2_digest(ssh_hash *hash, uint8_t *digest)
+{
+    sha512_avx2 *s = container_of(hash, sha512_avx2, hash);
+
+    sha512_block_pad(&s->blk, BinarySink_UPCAST(s));
+    if (s->have_pending) {
+        sha512_avx2_blocks(s->core, s->pending, NULL);
+        s->have_pending = false;
+    }
+    for (size_t i = 0; i < hash->vt->hlen / 8; i++)
+        PUT_64BIT_MSB_FIRST(digest + 8*i, s->core[i]);
+}
+
+/*
+ * This implementation doesn't need separate digest methods for
+ * SHA-384 and SHA-512, because the above implementation reads the
+ * hash length out of the vtable.
+ */
+#define sha384_avx2_digest sha512_avx2_digest
+
+SHA512_VTABLES(avx2, "AVX2 accelerated");
@@ -12,6 +12,9 @@
 static const ssh_hashalg *const real_sha512_algs[] = {
 #if HAVE_NEON_SHA512
     &ssh_sha512_neon,
+#endif
+#if HAVE_AVX2
+    &ssh_sha512_avx2,
 #endif
     &ssh_sha512_sw,
     NULL,
@@ -20,6 +23,9 @@ static const ssh_hashalg *const real_sha512_algs[] = {
 static const ssh_hashalg *const real_sha384_algs[] = {
 #if HAVE_NEON_SHA512
     &ssh_sha384_neon,
+#endif
+#if HAVE_AVX2
+    &ssh_sha384_avx2,
 #endif
     &ssh_sha384_sw,
     NULL,
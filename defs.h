@@ -183,6 +183,7 @@ typedef struct ssh2_macalg ssh2_macalg;
 typedef struct ssh2_mac ssh2_mac;
 typedef struct ssh_cipheralg ssh_cipheralg;
 typedef struct ssh_cipher ssh_cipher;
+typedef struct ssh_cipher_packet ssh_cipher_packet;
 typedef struct ssh2_ciphers ssh2_ciphers;
 typedef struct dh_ctx dh_ctx;
 typedef struct ecdh_key ecdh_key;
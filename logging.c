@@ -11,6 +11,16 @@
 
 #include "putty.h"
 
+/*
+ * Output to an open log file is collected into blocks of this size,
+ * and each full block is handed to a writer thread. So a slow file
+ * system holds up the writer thread and not the session. If the
+ * writer thread falls more than LOG_BACKLOG bytes behind, what
+ * happens next depends on CONF_logoverflow.
+ */
+#define LOG_BLOCK_SIZE 65536
+#define LOG_BACKLOG (64 * LOG_BLOCK_SIZE)
+
 /* log session to file stuff ... */
 struct LogContext {
     FILE *lgfp;
@@ -20,12 +30,213 @@ struct LogContext {
     LogPolicy *lp;
     Conf *conf;
     int logtype;                       /* cached out of conf */
+    int overflow, syncinterval;        /* cached out of conf */
+
+    strbuf *block;                     /* block being filled */
+    size_t dropped;                    /* bytes lost since the last block */
+    WorkerThread *writer;              /* NULL if writing directly */
+
+    /*
+     * Blocks waiting for the writer thread, in a circular buffer, the
+     * total number of bytes in them, and requests to it. These are
+     * shared with the writer thread and only touched with its lock
+     * held.
+     */
+    strbuf **ring;
+    size_t ring_start, ring_count, ring_size, ring_bytes;
+    bool flush_wanted, stopping, write_failed;
+
+    LogContext *next_writing;          /* in the writing_logs list */
 };
 
+/*
+ * Every LogContext with a writer thread running. Front ends don't
+ * all call log_free before they exit, and the data the writer thread
+ * hasn't got to yet isn't in the FILE for exit() to flush, so an
+ * atexit handler finishes the job for anything left in this list.
+ */
+static LogContext *writing_logs;
+
 static Filename *xlatlognam(const Filename *s,
                             const char *hostname, int port,
                             const struct tm *tm);
 
+/*
+ * The writer thread. It writes out blocks as they arrive, and
+ * flushes the file (and syncs it, if it's been long enough since
+ * the last time) when asked to.
+ */
+static void log_writer_thread(void *vctx)
+{
+    LogContext *ctx = (LogContext *)vctx;
+    time_t last_sync = time(NULL);
+
+    worker_lock(ctx->writer);
+    while (true) {
+        if (ctx->ring_count) {
+            strbuf *sb = ctx->ring[ctx->ring_start];
+            ctx->ring_start = (ctx->ring_start + 1) % ctx->ring_size;
+            ctx->ring_count--;
+            ctx->ring_bytes -= sb->len;
+            bool failed = ctx->write_failed;
+            worker_unlock(ctx->writer);
+
+            if (!failed && fwrite(sb->u, 1, sb->len, ctx->lgfp) < sb->len)
+                failed = true;
+            strbuf_free(sb);
+
+            worker_lock(ctx->writer);
+            ctx->write_failed = failed;
+            worker_wake(ctx->writer);  /* there's room in the ring now */
+        } else if (ctx->flush_wanted) {
+            int syncinterval = ctx->syncinterval;
+            ctx->flush_wanted = false;
+            worker_unlock(ctx->writer);
+
+            fflush(ctx->lgfp);
+            if (syncinterval > 0 && time(NULL) - last_sync >= syncinterval) {
+                file_sync(ctx->lgfp);
+                last_sync = time(NULL);
+            }
+
+            worker_lock(ctx->writer);
+        } else if (ctx->stopping) {
+            break;
+        } else {
+            worker_wait(ctx->writer);
+        }
+    }
+    worker_unlock(ctx->writer);
+}
+
+static void log_close_all_at_exit(void)
+{
+    while (writing_logs)
+        logfclose(writing_logs);       /* removes it from the list */
+}
+
+static void log_writer_start(LogContext *ctx)
+{
+    static bool atexit_registered = false;
+
+    ctx->ring = NULL;
+    ctx->ring_start = ctx->ring_count = ctx->ring_size = 0;
+    ctx->ring_bytes = 0;
+    ctx->flush_wanted = ctx->stopping = ctx->write_failed = false;
+    ctx->dropped = 0;
+
+    ctx->writer = worker_thread_new();
+    if (!worker_thread_start(ctx->writer, log_writer_thread, ctx)) {
+        /* Fall back to writing the file ourselves */
+        worker_thread_free(ctx->writer);
+        ctx->writer = NULL;
+        return;
+    }
+
+    if (!atexit_registered) {
+        atexit(log_close_all_at_exit);
+        atexit_registered = true;
+    }
+    ctx->next_writing = writing_logs;
+    writing_logs = ctx;
+}
+
+/*
+ * Is there room in the ring for another len bytes? An empty ring
+ * always has room, so that one oversized block can't wedge it.
+ */
+static bool log_ring_has_room(LogContext *ctx, size_t len)
+{
+    return ctx->ring_count == 0 || ctx->ring_bytes + len <= LOG_BACKLOG;
+}
+
+/*
+ * Hand the current block to the writer thread. A partial block (from
+ * a flush) is added to the end of the last block in the ring if it
+ * fits, so that frequent flushes don't fill the ring with small
+ * blocks. Returns false if the writer thread has had a write fail.
+ */
+static bool log_send_block(LogContext *ctx, bool closing)
+{
+    strbuf *sb = ctx->block;
+    bool ok;
+
+    ctx->block = NULL;
+    if (closing && ctx->dropped && !sb)
+        sb = strbuf_new();             /* to carry the last marker */
+
+    worker_lock(ctx->writer);
+    if (sb && (sb->len || ctx->dropped)) {
+        if (!log_ring_has_room(ctx, sb->len) && !ctx->write_failed &&
+            (ctx->overflow == LGOV_BLOCK || closing)) {
+            while (!log_ring_has_room(ctx, sb->len) && !ctx->write_failed)
+                worker_wait(ctx->writer);
+        }
+
+        if (!log_ring_has_room(ctx, sb->len) &&
+            ctx->overflow == LGOV_DROP && !closing) {
+            ctx->dropped += sb->len;
+            strbuf_free(sb);
+            sb = NULL;
+        } else if (ctx->dropped) {
+            /* Say where the gap in the log is */
+            strbuf *marker = strbuf_new();
+            put_fmt(marker, "\r\n=~=~=~=~= %"SIZEu" bytes of log data "
+                    "dropped =~=~=~=~=\r\n", ctx->dropped);
+            put_datapl(marker, ptrlen_from_strbuf(sb));
+            strbuf_free(sb);
+            sb = marker;
+            ctx->dropped = 0;
+        }
+
+        strbuf *tail = NULL;
+        if (sb && ctx->ring_count)
+            tail = ctx->ring[(ctx->ring_start + ctx->ring_count - 1) %
+                             ctx->ring_size];
+
+        if (sb && tail && tail->len + sb->len <= LOG_BLOCK_SIZE) {
+            /* The writer hasn't taken the tail block yet, so extend it */
+            put_datapl(tail, ptrlen_from_strbuf(sb));
+            ctx->ring_bytes += sb->len;
+            strbuf_free(sb);
+            worker_wake(ctx->writer);
+        } else if (sb) {
+            if (ctx->ring_count == ctx->ring_size) {
+                /* Make the ring bigger, unrolling it as we go */
+                size_t newsize = ctx->ring_size ? ctx->ring_size * 2 :
+                    LOG_BACKLOG / LOG_BLOCK_SIZE;
+                strbuf **newring = snewn(newsize, strbuf *);
+                for (size_t i = 0; i < ctx->ring_count; i++)
+                    newring[i] = ctx->ring[(ctx->ring_start + i) %
+                                           ctx->ring_size];
+                sfree(ctx->ring);
+                ctx->ring = newring;
+                ctx->ring_size = newsize;
+                ctx->ring_start = 0;
+            }
+            ctx->ring[(ctx->ring_start + ctx->ring_count) %
+                      ctx->ring_size] = sb;
+            ctx->ring_count++;
+            ctx->ring_bytes += sb->len;
+            worker_wake(ctx->writer);
+        }
+    } else if (sb) {
+        strbuf_free(sb);
+    }
+    ok = !ctx->write_failed;
+    worker_unlock(ctx->writer);
+
+    return ok;
+}
+
+static void log_write_failed(LogContext *ctx)
+{
+    logfclose(ctx);
+    ctx->state = L_ERROR;
+    lp_eventlog(ctx->lp, "Disabled writing session log "
+                "due to error while writing");
+}
+
 /*
  * Internal wrapper function which must be called for _all_ output
  * to the log file. It takes care of opening the log file if it
@@ -44,14 +255,25 @@ static void logwrite(LogContext *ctx, ptrlen data)
 
     if (ctx->state == L_OPENING) {
         bufchain_add(&ctx->queue, data.ptr, data.len);
+    } else if (ctx->state == L_OPEN && ctx->writer) {
+        while (data.len) {
+            if (!ctx->block)
+                ctx->block = strbuf_new();
+            size_t len = LOG_BLOCK_SIZE - ctx->block->len;
+            if (len > data.len)
+                len = data.len;
+            put_data(ctx->block, data.ptr, len);
+            data = make_ptrlen((const char *)data.ptr + len, data.len - len);
+            if (ctx->block->len >= LOG_BLOCK_SIZE &&
+                !log_send_block(ctx, false)) {
+                log_write_failed(ctx);
+                return;
+            }
+        }
     } else if (ctx->state == L_OPEN) {
         assert(ctx->lgfp);
-        if (fwrite(data.ptr, 1, data.len, ctx->lgfp) < data.len) {
-            logfclose(ctx);
-            ctx->state = L_ERROR;
-            lp_eventlog(ctx->lp, "Disabled writing session log "
-                        "due to error while writing");
-        }
+        if (fwrite(data.ptr, 1, data.len, ctx->lgfp) < data.len)
+            log_write_failed(ctx);
     }                                  /* else L_ERROR, so ignore the write */
 }
 
@@ -77,9 +299,19 @@ static PRINTF_LIKE(2, 3) void logprintf(LogContext *ctx, const char *fmt, ...)
  */
 void logflush(LogContext *ctx)
 {
-    if (ctx->logtype > 0)
-        if (ctx->state == L_OPEN)
+    if (ctx->logtype > 0 && ctx->state == L_OPEN) {
+        if (ctx->writer) {
+            bool ok = log_send_block(ctx, false);
+            worker_lock(ctx->writer);
+            ctx->flush_wanted = true;
+            worker_wake(ctx->writer);
+            worker_unlock(ctx->writer);
+            if (!ok)
+                log_write_failed(ctx);
+        } else {
             fflush(ctx->lgfp);
+        }
+    }
 }
 
 LogPolicy *log_get_policy(LogContext *ctx)
@@ -102,6 +334,7 @@ static void logfopen_callback(void *vctx, int mode)
         ctx->lgfp = f_open(ctx->currlogfilename, fmode, false);
         if (ctx->lgfp) {
             ctx->state = L_OPEN;
+            log_writer_start(ctx);
         } else {
             ctx->state = L_ERROR;
             shout = true;
@@ -195,6 +428,36 @@ void logfopen(LogContext *ctx)
 
 void logfclose(LogContext *ctx)
 {
+    if (ctx->writer) {
+        /* Let the writer thread finish off everything we've sent it */
+        log_send_block(ctx, true);
+        worker_lock(ctx->writer);
+        ctx->stopping = true;
+        worker_wake(ctx->writer);
+        worker_unlock(ctx->writer);
+        worker_thread_free(ctx->writer);
+        ctx->writer = NULL;
+
+        LogContext **p = &writing_logs;
+        while (*p != ctx)
+            p = &(*p)->next_writing;
+        *p = ctx->next_writing;
+
+        /* Anything still here is left over from a failed write */
+        while (ctx->ring_count) {
+            strbuf_free(ctx->ring[ctx->ring_start]);
+            ctx->ring_start = (ctx->ring_start + 1) % ctx->ring_size;
+            ctx->ring_count--;
+        }
+        sfree(ctx->ring);
+        ctx->ring = NULL;
+        ctx->ring_size = ctx->ring_bytes = 0;
+
+        if (ctx->lgfp && ctx->syncinterval > 0) {
+            fflush(ctx->lgfp);
+            file_sync(ctx->lgfp);
+        }
+    }
     if (ctx->lgfp) {
         fclose(ctx->lgfp);
         ctx->lgfp = NULL;
@@ -213,6 +476,15 @@ void logtraffic(LogContext *ctx, unsigned char c, int logmode)
     }
 }
 
+void logtraffic_data(LogContext *ctx, const void *data, size_t len,
+                     int logmode)
+{
+    if (ctx->logtype > 0) {
+        if (ctx->logtype == logmode)
+            logwrite(ctx, make_ptrlen(data, len));
+    }
+}
+
 static void logevent_internal(LogContext *ctx, const char *event)
 {
     if (ctx->logtype == LGTYP_PACKETS || ctx->logtype == LGTYP_SSHRAW) {
@@ -387,7 +659,14 @@ LogContext *log_init(LogPolicy *lp, Conf *conf)
     ctx->lp = lp;
     ctx->conf = conf_copy(conf);
     ctx->logtype = conf_get_int(ctx->conf, CONF_logtype);
+    ctx->overflow = conf_get_int(ctx->conf, CONF_logoverflow);
+    ctx->syncinterval = conf_get_int(ctx->conf, CONF_logsyncinterval);
     ctx->currlogfilename = NULL;
+    ctx->block = NULL;
+    ctx->writer = NULL;
+    ctx->ring = NULL;
+    ctx->ring_size = ctx->ring_count = ctx->ring_start = 0;
+    ctx->ring_bytes = 0;
     bufchain_init(&ctx->queue);
     return ctx;
 }
@@ -421,6 +700,12 @@ void log_reconfig(LogContext *ctx, Conf *conf)
     ctx->conf = conf_copy(conf);
 
     ctx->logtype = conf_get_int(ctx->conf, CONF_logtype);
+    if (ctx->writer)
+        worker_lock(ctx->writer);
+    ctx->overflow = conf_get_int(ctx->conf, CONF_logoverflow);
+    ctx->syncinterval = conf_get_int(ctx->conf, CONF_logsyncinterval);
+    if (ctx->writer)
+        worker_unlock(ctx->writer);
 
     if (reset_logging)
         logfopen(ctx);
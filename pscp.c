@@ -143,9 +143,15 @@ static PRINTF_LIKE(2, 3) void tell_user(FILE *stream, const char *fmt, ...)
  * To do this, we repeatedly call the SSH protocol module, with our
  * own pscp_output() function to catch the data that comes back. We do
  * this until we have enough data.
+ *
+ * As in psftp, a waiting ssh_scp_recv leaves its destination buffer
+ * in received_dest, so that incoming data can be copied straight
+ * there when nothing is already queued ahead of it.
  */
 
 static bufchain received_data;
+static char *received_dest;
+static size_t received_dest_len;
 static BinarySink *stderr_bs;
 static size_t pscp_output(
     Seat *seat, SeatOutputType type, const void *data, size_t len)
@@ -160,6 +166,15 @@ static size_t pscp_output(
         return 0;
     }
 
+    if (received_dest_len && bufchain_size(&received_data) == 0) {
+        size_t got = len < received_dest_len ? len : received_dest_len;
+        memcpy(received_dest, data, got);
+        received_dest += got;
+        received_dest_len -= got;
+        data = (const char *)data + got;
+        len -= got;
+    }
+
     bufchain_add(&received_data, data, len);
     return 0;
 }
@@ -180,16 +195,16 @@ static bool pscp_eof(Seat *seat)
 static bool ssh_scp_recv(void *vbuf, size_t len)
 {
     char *buf = (char *)vbuf;
-    while (len > 0) {
-        while (bufchain_size(&received_data) == 0) {
-            if (backend_exitcode(backend) >= 0 ||
-                ssh_sftp_loop_iteration() < 0)
-                return false;          /* doom */
+    size_t got = bufchain_fetch_consume_up_to(&received_data, buf, len);
+    received_dest = buf + got;
+    received_dest_len = len - got;
+
+    while (received_dest_len > 0) {
+        if (backend_exitcode(backend) >= 0 ||
+            ssh_sftp_loop_iteration() < 0) {
+            received_dest_len = 0;
+            return false;              /* doom */
         }
-
-        size_t got = bufchain_fetch_consume_up_to(&received_data, buf, len);
-        buf += got;
-        len -= got;
     }
 
     return true;
@@ -1513,7 +1528,6 @@ int scp_recv_filedata(char *data, int len)
             if (actuallen <= 0) {
                 tell_user(stderr, "pscp: end of file while reading");
                 errs++;
-                sfree(vbuf);
                 return -1;
             }
             /*
@@ -1524,7 +1538,6 @@ int scp_recv_filedata(char *data, int len)
              */
             assert(actuallen <= len);
             memcpy(data, vbuf, actuallen);
-            sfree(vbuf);
         } else
             actuallen = 0;
 
@@ -1561,8 +1574,7 @@ int scp_finish_filerecv(void)
                 errs++;
                 return -1;
             }
-            if (xfer_download_data(scp_sftp_xfer, &vbuf, &len))
-                sfree(vbuf);
+            xfer_download_data(scp_sftp_xfer, &vbuf, &len);
         }
         xfer_cleanup(scp_sftp_xfer);
 
@@ -509,8 +509,6 @@ bool sftp_get_file(char *fname, char *outfname, bool recurse, bool restart)
                 toret = false;
                 xfer_set_error(xfer);
             }
-
-            sfree(vbuf);
         }
     }
 
@@ -2463,8 +2461,15 @@ void ldisc_check_sendok(Ldisc *ldisc) { }
  * To do this, we repeatedly call the SSH protocol module, with our
  * own psftp_output() function to catch the data that comes back. We
  * do this until we have enough data.
+ *
+ * While sftp_recvdata is waiting, it leaves its destination buffer
+ * in received_dest, so that psftp_output can copy incoming data
+ * straight there instead of going via received_data. Anything that
+ * doesn't fit goes in the bufchain as usual.
  */
 static bufchain received_data;
+static char *received_dest;
+static size_t received_dest_len;
 static BinarySink *stderr_bs;
 static size_t psftp_output(
     Seat *seat, SeatOutputType type, const void *data, size_t len)
@@ -2479,6 +2484,15 @@ static size_t psftp_output(
         return 0;
     }
 
+    if (received_dest_len && bufchain_size(&received_data) == 0) {
+        size_t got = len < received_dest_len ? len : received_dest_len;
+        memcpy(received_dest, data, got);
+        received_dest += got;
+        received_dest_len -= got;
+        data = (const char *)data + got;
+        len -= got;
+    }
+
     bufchain_add(&received_data, data, len);
     return 0;
 }
@@ -2499,16 +2513,16 @@ static bool psftp_eof(Seat *seat)
 
 bool sftp_recvdata(char *buf, size_t len)
 {
-    while (len > 0) {
-        while (bufchain_size(&received_data) == 0) {
-            if (backend_exitcode(backend) >= 0 ||
-                ssh_sftp_loop_iteration() < 0)
-                return false;          /* doom */
+    size_t got = bufchain_fetch_consume_up_to(&received_data, buf, len);
+    received_dest = buf + got;
+    received_dest_len = len - got;
+
+    while (received_dest_len > 0) {
+        if (backend_exitcode(backend) >= 0 ||
+            ssh_sftp_loop_iteration() < 0) {
+            received_dest_len = 0;
+            return false;              /* doom */
         }
-
-        size_t got = bufchain_fetch_consume_up_to(&received_data, buf, len);
-        buf += got;
-        len -= got;
     }
 
     return true;
@@ -285,6 +285,9 @@ struct unicode_data {
 #define LGTYP_DEBUG 2                  /* logmode: all chars of traffic */
 #define LGTYP_PACKETS 3                /* logmode: SSH data packets */
 #define LGTYP_SSHRAW 4                 /* logmode: SSH raw data */
+#define LGOV_BLOCK 0                   /* slow log file: wait for it */
+#define LGOV_DROP  1                   /* slow log file: drop data */
+#define LGOV_GROW  2                   /* slow log file: buffer in memory */
 
 /* Platform-generic function to set up a struct unicode_data. This is
  * only likely to be useful to test programs; real clients will want
@@ -1648,6 +1651,13 @@ struct TermWinVtable {
      * authentication spoofing) */
     void (*draw_trust_sigil)(TermWin *, int x, int y);
     int (*char_width)(TermWin *, int uc);
+    /* Move the displayed contents of lines topline to botline
+     * (inclusive) up by 'lines' lines, or down if it's negative,
+     * without redrawing them. The lines left exposed are redrawn by
+     * the terminal afterwards. Returns false if the front end can't
+     * do this, in which case the terminal just redraws all the lines
+     * that moved. */
+    bool (*scroll)(TermWin *, int topline, int botline, int lines);
     void (*free_draw_ctx)(TermWin *);
 
     void (*set_cursor_pos)(TermWin *, int x, int y);
@@ -1733,6 +1743,9 @@ static inline void win_draw_trust_sigil(TermWin *win, int x, int y)
 { win->vt->draw_trust_sigil(win, x, y); }
 static inline int win_char_width(TermWin *win, int uc)
 { return win->vt->char_width(win, uc); }
+static inline bool win_scroll(TermWin *win, int topline, int botline,
+                              int lines)
+{ return win->vt->scroll(win, topline, botline, lines); }
 static inline void win_free_draw_ctx(TermWin *win)
 { win->vt->free_draw_ctx(win); }
 static inline void win_set_cursor_pos(TermWin *win, int x, int y)
@@ -2035,6 +2048,7 @@ void term_resize_request_completed(Terminal *);
 void term_paint(Terminal *, int, int, int, int, bool);
 void term_scroll(Terminal *, int, int);
 void term_scroll_to_selection(Terminal *, int);
+bool term_search(Terminal *, const wchar_t *pattern, int dir);
 void term_pwron(Terminal *, bool);
 void term_clrsb(Terminal *);
 void term_mouse(Terminal *, Mouse_Button, Mouse_Button, Mouse_Action,
@@ -2047,8 +2061,12 @@ void term_update(Terminal *);
 void term_invalidate(Terminal *);
 void term_blink(Terminal *, bool set_cursor);
 void term_do_paste(Terminal *, const wchar_t *, size_t);
+void term_do_paste_utf8(Terminal *, const char *, size_t);
 void term_nopaste(Terminal *);
+bool term_paste_progress(Terminal *, size_t *done, size_t *total);
+void term_backend_sent(Terminal *, size_t bufsize);
 void term_copyall(Terminal *, const int *, int);
+void term_export_text(Terminal *, BinarySink *, bool all);
 void term_pre_reconfig(Terminal *, Conf *);
 void term_reconfig(Terminal *, Conf *);
 void term_request_copy(Terminal *, const int *clipboards, int n_clipboards);
@@ -2070,6 +2088,22 @@ void term_notify_palette_changed(Terminal *term);
 void term_notify_window_pos(Terminal *term, int x, int y);
 void term_notify_window_size_pixels(Terminal *term, int x, int y);
 void term_palette_override(Terminal *term, unsigned osc4_index, rgb rgb);
+void term_set_refresh_rate(Terminal *term, int hz);
+void term_set_output_timeslice(Terminal *term, int ticks);
+
+/*
+ * Statistics on the terminal's window updates, for front ends that
+ * want to show them. Times are in ticks (TICKSPERSEC to the second).
+ * 'Echo latency' is the time from a keypress to the end of the first
+ * update after some output arrived in response to it.
+ */
+typedef struct TermUpdateStats {
+    unsigned long frames;              /* window updates performed */
+    unsigned long frames_deferred;     /* put off because input was queued */
+    unsigned long last_frame_time, max_frame_time;
+    unsigned long last_echo_latency, max_echo_latency;
+} TermUpdateStats;
+void term_get_update_stats(Terminal *term, TermUpdateStats *stats);
 
 typedef enum SmallKeypadKey {
     SKK_HOME, SKK_END, SKK_INSERT, SKK_DELETE, SKK_PGUP, SKK_PGDN,
@@ -2160,6 +2194,8 @@ void log_reconfig(LogContext *logctx, Conf *conf);
 void logfopen(LogContext *logctx);
 void logfclose(LogContext *logctx);
 void logtraffic(LogContext *logctx, unsigned char c, int logmode);
+void logtraffic_data(LogContext *logctx, const void *data, size_t len,
+                     int logmode);
 void logflush(LogContext *logctx);
 LogPolicy *log_get_policy(LogContext *logctx);
 void logevent(LogContext *logctx, const char *event);
@@ -2593,6 +2629,30 @@ char *get_username(void);              /* return value needs freeing */
 char *get_random_data(int bytes, const char *device); /* used in cmdgen.c */
 char filename_char_sanitise(char c);   /* rewrite special pathname chars */
 bool open_for_write_would_lose_data(const Filename *fn);
+bool file_sync(FILE *fp);     /* flush an open file through to the disk */
+
+/*
+ * A minimal thread API, for the few jobs that must not hold up the
+ * main event loop even though they can block, such as writing a
+ * session log to a slow file system.
+ *
+ * Each WorkerThread comes with one lock and one condition, shared by
+ * the thread and whoever started it. worker_wait must be called with
+ * the lock held; it releases it while waiting for somebody else to
+ * call worker_wake. Only one thread may wait at a time, and a wait
+ * can return early, so callers must re-check what they're waiting for
+ * in a loop. worker_thread_start returns false if the thread
+ * couldn't be started, in which case the caller should do the job
+ * itself; worker_thread_free waits for the thread to finish first.
+ */
+typedef struct WorkerThread WorkerThread;
+WorkerThread *worker_thread_new(void);
+bool worker_thread_start(WorkerThread *wt, void (*fn)(void *), void *ctx);
+void worker_thread_free(WorkerThread *wt);
+void worker_lock(WorkerThread *wt);
+void worker_unlock(WorkerThread *wt);
+void worker_wait(WorkerThread *wt);
+void worker_wake(WorkerThread *wt);
 
 /*
  * Exports and imports from timing.c.
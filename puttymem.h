@@ -114,6 +114,15 @@ void *safegrowarray(void *array, size_t *size, size_t eltsize,
  */
 NORETURN void out_of_memory(void);
 
+#ifdef COUNT_ALLOCATIONS
+/*
+ * If memory.c is compiled with COUNT_ALLOCATIONS defined, it counts
+ * every call to safemalloc and saferealloc here. Used by benchmark
+ * programs that want to know how much allocation a workload costs.
+ */
+extern size_t allocation_count;
+#endif
+
 #ifdef MINEFIELD
 /*
  * Definitions for Minefield, PuTTY's own Windows-specific malloc
@@ -650,6 +650,16 @@ struct ssh_cipher {
     const ssh_cipheralg *vt;
 };
 
+/* One outgoing SSH-2 packet, in a batch passed to encrypt_packets.
+ * 'data' points at the length field; 'len' bytes from there are
+ * encrypted and authenticated, and the MAC is written just after
+ * them. */
+struct ssh_cipher_packet {
+    unsigned char *data;
+    int len;
+    unsigned long seq;
+};
+
 struct ssh_cipheralg {
     ssh_cipher *(*new)(const ssh_cipheralg *alg);
     void (*free)(ssh_cipher *);
@@ -687,6 +697,16 @@ struct ssh_cipheralg {
     /* If set, this takes priority over other MAC. */
     const ssh2_macalg *required_mac;
 
+    /* Optional method for a cipher with a required_mac that runs in
+     * ETM mode: do everything to a run of consecutive outgoing
+     * packets that encrypt_length, ssh2_mac_encrypt_and_generate and
+     * next_message would do to each one in turn. A cipher whose
+     * keystream depends only on the sequence number can then
+     * generate it for the whole batch at once. NULL if the cipher
+     * doesn't offer that. */
+    void (*encrypt_packets)(ssh_cipher *, ssh_cipher_packet *pkts,
+                            size_t npkts);
+
     /* Pointer to any extra data used by a particular implementation. */
     const void *extra;
 };
@@ -711,6 +731,9 @@ static inline void ssh_cipher_decrypt_length(
 { c->vt->decrypt_length(c, blk, len, seq); }
 static inline void ssh_cipher_next_message(ssh_cipher *c)
 { c->vt->next_message(c); }
+static inline void ssh_cipher_encrypt_packets(
+    ssh_cipher *c, ssh_cipher_packet *pkts, size_t npkts)
+{ c->vt->encrypt_packets(c, pkts, npkts); }
 static inline const struct ssh_cipheralg *ssh_cipher_alg(ssh_cipher *c)
 { return c->vt; }
 
@@ -738,6 +761,13 @@ struct ssh2_macalg {
     const char *name, *etm_name;
     int len, keylen;
 
+    /* Optional methods for a MAC that is tied to its cipher (as
+     * AES-GCM is), which encrypt or decrypt the ciphertext part of
+     * the MAC input in place, in the same pass as folding it into
+     * the MAC. NULL if the MAC doesn't offer that. */
+    void (*encrypt_and_update)(ssh2_mac *, void *blk, int len);
+    void (*decrypt_and_update)(ssh2_mac *, void *blk, int len);
+
     /* Pointer to any extra data used by a particular implementation. */
     const void *extra;
 };
@@ -767,6 +797,18 @@ bool ssh2_mac_verresult(ssh2_mac *, const void *);
 void ssh2_mac_generate(ssh2_mac *, void *, int, unsigned long seq);
 bool ssh2_mac_verify(ssh2_mac *, const void *, int, unsigned long seq);
 
+/* Encrypt-then-MAC versions of the above, for OpenSSH's ETM packet
+ * format: the first 'clearlen' bytes of the data are authenticated
+ * but not encrypted, and the rest is encrypted by 'cipher' (or
+ * decrypted, after checking the MAC). If the MAC supports it, both
+ * are done in a single pass over the data; in that case a packet
+ * that fails verification is left decrypted, so the caller must
+ * discard it. */
+void ssh2_mac_encrypt_and_generate(ssh2_mac *, ssh_cipher *, void *, int,
+                                   int clearlen, unsigned long seq);
+bool ssh2_mac_verify_and_decrypt(ssh2_mac *, ssh_cipher *, void *, int,
+                                 int clearlen, unsigned long seq);
+
 void nullmac_next_message(ssh2_mac *m);
 
 /* Use a MAC in its raw form, outside SSH-2 context, to MAC a given
@@ -1148,6 +1190,10 @@ extern const ssh_cipheralg ssh_blowfish_ssh2;
 extern const ssh_cipheralg ssh_arcfour256_ssh2;
 extern const ssh_cipheralg ssh_arcfour128_ssh2;
 extern const ssh_cipheralg ssh2_chacha20_poly1305;
+extern const ssh_cipheralg ssh2_chacha20_poly1305_sw;
+extern const ssh_cipheralg ssh2_chacha20_poly1305_sse2;
+extern const ssh_cipheralg ssh2_chacha20_poly1305_avx2;
+extern const ssh_cipheralg ssh2_chacha20_poly1305_avx512;
 extern const ssh2_ciphers ssh2_3des;
 extern const ssh2_ciphers ssh2_des;
 extern const ssh2_ciphers ssh2_aes;
@@ -1166,9 +1212,11 @@ extern const ssh_hashalg ssh_sha256_neon;
 extern const ssh_hashalg ssh_sha256_sw;
 extern const ssh_hashalg ssh_sha384;
 extern const ssh_hashalg ssh_sha384_neon;
+extern const ssh_hashalg ssh_sha384_avx2;
 extern const ssh_hashalg ssh_sha384_sw;
 extern const ssh_hashalg ssh_sha512;
 extern const ssh_hashalg ssh_sha512_neon;
+extern const ssh_hashalg ssh_sha512_avx2;
 extern const ssh_hashalg ssh_sha512_sw;
 extern const ssh_hashalg ssh_sha3_224;
 extern const ssh_hashalg ssh_sha3_256;
@@ -1232,6 +1280,8 @@ extern const ssh2_macalg ssh2_aesgcm_mac_sw;
 extern const ssh2_macalg ssh2_aesgcm_mac_ref_poly;
 extern const ssh2_macalg ssh2_aesgcm_mac_clmul;
 extern const ssh2_macalg ssh2_aesgcm_mac_neon;
+extern const ssh2_macalg ssh2_aesgcm_mac_ni;
+extern const ssh2_macalg ssh2_aesgcm_mac_vaes;
 extern const ssh_compression_alg ssh_zlib;
 
 /* Special constructor: BLAKE2b can be instantiated with any hash
@@ -9,6 +9,9 @@
 #include "bpp.h"
 #include "sshcr.h"
 
+/* Amount of outgoing data we'll collect before encrypting it */
+#define SSH2_BPP_MAX_BATCH 65536
+
 struct ssh2_bpp_direction {
     unsigned long sequence;
     ssh_cipher *cipher;
@@ -34,6 +37,13 @@ struct ssh2_bpp_state {
     ssh_decompressor *in_decomp;
     ssh_compressor *out_comp;
 
+    /* Outgoing packets that have been formatted but not yet
+     * encrypted, laid end to end (each with space for its MAC) in
+     * out_batch. See ssh2_bpp_flush_batch. */
+    strbuf *out_batch;
+    ssh_cipher_packet *out_batch_pkts;
+    size_t out_batch_npkts, out_batch_pktsize;
+
     bool is_server;
     bool pending_newkeys;
     bool pending_compression, seen_userauth_success;
@@ -67,6 +77,7 @@ BinaryPacketProtocol *ssh2_bpp_new(
     s->bpp.logctx = logctx;
     s->stats = stats;
     s->is_server = is_server;
+    s->out_batch = strbuf_new_nm();
     ssh_bpp_common_setup(&s->bpp);
     return &s->bpp;
 }
@@ -98,6 +109,8 @@ static void ssh2_bpp_free(BinaryPacketProtocol *bpp)
     sfree(s->buf);
     ssh2_bpp_free_outgoing_crypto(s);
     ssh2_bpp_free_incoming_crypto(s);
+    strbuf_free(s->out_batch);
+    sfree(s->out_batch_pkts);
     sfree(s->pktin);
     sfree(s);
 }
@@ -418,7 +431,8 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
             /*
              * Allocate the packet to return, now we know its length.
              */
-            s->pktin = snew_plus(PktIn, OUR_V2_PACKETLIMIT + s->maclen);
+            s->maxlen = s->packetlen + s->maclen;
+            s->pktin = snew_plus(PktIn, s->maxlen);
             s->pktin->qnode.prev = s->pktin->qnode.next = NULL;
             s->pktin->type = 0;
             s->pktin->qnode.on_free_queue = false;
@@ -431,18 +445,17 @@ static void ssh2_bpp_handle_input(BinaryPacketProtocol *bpp)
             BPP_READ(s->data + 4, s->packetlen + s->maclen - 4);
 
             /*
-             * Check the MAC.
+             * Check the MAC, and decrypt everything between the
+             * length field and the MAC. (Possibly in the same pass,
+             * in which case a packet with a bad MAC is left
+             * decrypted, but we abandon it immediately.)
              */
-            if (s->in.mac && !ssh2_mac_verify(
-                    s->in.mac, s->data, s->len + 4, s->in.sequence)) {
+            if (!ssh2_mac_verify_and_decrypt(
+                    s->in.mac, s->in.cipher, s->data, s->len + 4, 4,
+                    s->in.sequence)) {
                 ssh_sw_abort(s->bpp.ssh, "Incorrect MAC received on packet");
                 crStopV;
             }
-
-            /* Decrypt everything between the length field and the MAC. */
-            if (s->in.cipher)
-                ssh_cipher_decrypt(
-                    s->in.cipher, s->data + 4, s->packetlen - 4);
         } else {
             if (s->bufsize < s->cipherblk) {
                 s->bufsize = s->cipherblk;
@@ -745,7 +758,9 @@ static PktOut *ssh2_bpp_new_pktout(int pkt_type)
 
 static void ssh2_bpp_format_packet_inner(struct ssh2_bpp_state *s, PktOut *pkt)
 {
-    int origlen, cipherblk, maclen, padding, unencrypted_prefix, i;
+    int origlen, cipherblk, maclen, padding, unencrypted_prefix;
+    unsigned char *data;
+    ssh_cipher_packet *bpkt;
 
     if (s->bpp.logctx) {
         ptrlen pktdata = make_ptrlen(pkt->data + pkt->prefix,
@@ -802,48 +817,94 @@ static void ssh2_bpp_format_packet_inner(struct ssh2_bpp_state *s, PktOut *pkt)
     assert(padding <= 255);
     maclen = s->out.mac ? ssh2_mac_alg(s->out.mac)->len : 0;
     origlen = pkt->length;
-    for (i = 0; i < padding; i++)
-        put_byte(pkt, 0);              /* make space for random padding */
-    random_read(pkt->data + origlen, padding);
-    pkt->data[4] = padding;
-    PUT_32BIT_MSB_FIRST(pkt->data, origlen + padding - 4);
 
+    /*
+     * Copy the packet into the output batch, with the random padding
+     * and space for the MAC. The encryption is done later, by
+     * ssh2_bpp_flush_batch.
+     */
+    data = strbuf_append(s->out_batch, origlen + padding + maclen);
+    memcpy(data, pkt->data, origlen);
+    random_read(data + origlen, padding);
+    data[4] = padding;
+    PUT_32BIT_MSB_FIRST(data, origlen + padding - 4);
+    memset(data + origlen + padding, 0, maclen);
+
+    sgrowarray(s->out_batch_pkts, s->out_batch_pktsize, s->out_batch_npkts);
+    bpkt = &s->out_batch_pkts[s->out_batch_npkts++];
+    bpkt->data = NULL;                 /* filled in when we flush */
+    bpkt->len = origlen + padding;
+    bpkt->seq = s->out.sequence++;     /* whether or not we MAC it */
+
+    dts_consume(&s->stats->out, origlen + padding);
+}
+
+static void ssh2_bpp_encrypt_packet(struct ssh2_bpp_state *s,
+                                    ssh_cipher_packet *pkt)
+{
     /* Encrypt length if the scheme requires it */
     if (s->out.cipher &&
         (ssh_cipher_alg(s->out.cipher)->flags & SSH_CIPHER_SEPARATE_LENGTH)) {
-        ssh_cipher_encrypt_length(s->out.cipher, pkt->data, 4,
-                                  s->out.sequence);
+        ssh_cipher_encrypt_length(s->out.cipher, pkt->data, 4, pkt->seq);
     }
 
-    put_padding(pkt, maclen, 0);
-
     if (s->out.mac && s->out.etm_mode) {
         /*
          * OpenSSH-defined encrypt-then-MAC protocol.
          */
-        if (s->out.cipher)
-            ssh_cipher_encrypt(s->out.cipher,
-                               pkt->data + 4, origlen + padding - 4);
-        ssh2_mac_generate(s->out.mac, pkt->data, origlen + padding,
-                          s->out.sequence);
+        ssh2_mac_encrypt_and_generate(s->out.mac, s->out.cipher, pkt->data,
+                                      pkt->len, 4, pkt->seq);
     } else {
         /*
          * SSH-2 standard protocol.
          */
         if (s->out.mac)
-            ssh2_mac_generate(s->out.mac, pkt->data, origlen + padding,
-                              s->out.sequence);
+            ssh2_mac_generate(s->out.mac, pkt->data, pkt->len, pkt->seq);
         if (s->out.cipher)
-            ssh_cipher_encrypt(s->out.cipher, pkt->data, origlen + padding);
+            ssh_cipher_encrypt(s->out.cipher, pkt->data, pkt->len);
     }
 
-    s->out.sequence++;       /* whether or not we MACed */
     if (s->out.cipher)
         ssh_cipher_next_message(s->out.cipher);
     if (s->out.mac)
         ssh2_mac_next_message(s->out.mac);
+}
 
-    dts_consume(&s->stats->out, origlen + padding);
+/*
+ * Encrypt everything in the output batch, and pass it on to out_raw
+ * in one go. This has to happen before we return from
+ * handle_output, because the outgoing crypto might be changed as
+ * soon as we do.
+ */
+static void ssh2_bpp_flush_batch(struct ssh2_bpp_state *s)
+{
+    if (!s->out_batch_npkts)
+        return;
+
+    int maclen = s->out.mac ? ssh2_mac_alg(s->out.mac)->len : 0;
+    unsigned char *data = s->out_batch->u;
+    for (size_t i = 0; i < s->out_batch_npkts; i++) {
+        s->out_batch_pkts[i].data = data;
+        data += s->out_batch_pkts[i].len + maclen;
+    }
+
+    const ssh_cipheralg *calg =
+        s->out.cipher ? ssh_cipher_alg(s->out.cipher) : NULL;
+    if (calg && calg->encrypt_packets && s->out.etm_mode &&
+        s->out.mac && ssh2_mac_alg(s->out.mac) == calg->required_mac) {
+        /*
+         * The cipher can do the whole batch at once.
+         */
+        ssh_cipher_encrypt_packets(s->out.cipher, s->out_batch_pkts,
+                                   s->out_batch_npkts);
+    } else {
+        for (size_t i = 0; i < s->out_batch_npkts; i++)
+            ssh2_bpp_encrypt_packet(s, &s->out_batch_pkts[i]);
+    }
+
+    bufchain_add(s->bpp.out_raw, s->out_batch->u, s->out_batch->len);
+    strbuf_clear(s->out_batch);
+    s->out_batch_npkts = 0;
 }
 
 static void ssh2_bpp_format_packet(struct ssh2_bpp_state *s, PktOut *pkt)
@@ -906,13 +967,11 @@ static void ssh2_bpp_format_packet(struct ssh2_bpp_state *s, PktOut *pkt)
                 put_byte(ignore_pkt, 0);  /* make space for random padding */
             random_read(ignore_pkt->data + origlen, length);
             ssh2_bpp_format_packet_inner(s, ignore_pkt);
-            bufchain_add(s->bpp.out_raw, ignore_pkt->data, ignore_pkt->length);
             ssh_free_pktout(ignore_pkt);
         }
     }
 
     ssh2_bpp_format_packet_inner(s, pkt);
-    bufchain_add(s->bpp.out_raw, pkt->data, pkt->length);
 }
 
 static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp)
@@ -967,6 +1026,7 @@ static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp)
             pkt = ssh_bpp_new_pktout(&s->bpp, SSH2_MSG_IGNORE);
             put_stringz(pkt, "");
             ssh2_bpp_format_packet(s, pkt);
+            ssh_free_pktout(pkt);
         }
     }
 
@@ -979,6 +1039,10 @@ static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp)
         ssh2_bpp_format_packet(s, pkt);
         ssh_free_pktout(pkt);
 
+        /* Don't let a long queue build up an unbounded batch */
+        if (s->out_batch->len >= SSH2_BPP_MAX_BATCH)
+            ssh2_bpp_flush_batch(s);
+
         if (n_userauth == 0 && s->out.pending_compression && !s->is_server) {
             /*
              * This is the last userauth packet in the queue, so
@@ -988,11 +1052,13 @@ static void ssh2_bpp_handle_output(BinaryPacketProtocol *bpp)
              * until we see the reply.
              */
             s->pending_compression = true;
+            ssh2_bpp_flush_batch(s);
             return;
         } else if (type == SSH2_MSG_USERAUTH_SUCCESS && s->is_server) {
             ssh2_bpp_enable_pending_compression(s);
         }
     }
 
+    ssh2_bpp_flush_batch(s);
     ssh_sendbuffer_changed(bpp->ssh);
 }
@@ -685,29 +685,30 @@ struct sftp_request *fxp_read_send(struct fxp_handle *handle,
     return req;
 }
 
-int fxp_read_recv(struct sftp_packet *pktin, struct sftp_request *req,
-                  char *buffer, int len)
+/*
+ * Common code for fxp_read_recv and xfer_download_gotpkt. On success,
+ * *data points into pktin, which is left for the caller to free; on
+ * failure, pktin has already been freed.
+ */
+static int fxp_read_recv_data(struct sftp_packet *pktin,
+                              struct sftp_request *req, int len, ptrlen *data)
 {
     sfree(req);
     if (pktin->type == SSH_FXP_DATA) {
-        ptrlen data;
-
-        data = get_string(pktin);
+        *data = get_string(pktin);
         if (get_err(pktin)) {
             fxp_internal_error("READ returned malformed SSH_FXP_DATA packet");
             sftp_pkt_free(pktin);
             return -1;
         }
 
-        if (data.len > len) {
+        if (data->len > len) {
             fxp_internal_error("READ returned more bytes than requested");
             sftp_pkt_free(pktin);
             return -1;
         }
 
-        memcpy(buffer, data.ptr, data.len);
-        sftp_pkt_free(pktin);
-        return data.len;
+        return data->len;
     } else {
         fxp_got_status(pktin);
         sftp_pkt_free(pktin);
@@ -715,6 +716,18 @@ int fxp_read_recv(struct sftp_packet *pktin, struct sftp_request *req,
     }
 }
 
+int fxp_read_recv(struct sftp_packet *pktin, struct sftp_request *req,
+                  char *buffer, int len)
+{
+    ptrlen data;
+    int retlen = fxp_read_recv_data(pktin, req, len, &data);
+    if (retlen >= 0) {
+        memcpy(buffer, data.ptr, data.len);
+        sftp_pkt_free(pktin);
+    }
+    return retlen;
+}
+
 /*
  * Read from a directory.
  */
@@ -879,7 +892,9 @@ void fxp_set_userdata(struct sftp_request *req, void *data)
  */
 
 struct req {
-    char *buffer;
+    /* For a download, the FXP_DATA reply, and the data within it */
+    struct sftp_packet *pktin;
+    const char *buffer;
     int len, retlen, complete;
     uint64_t offset;
     struct req *next, *prev;
@@ -891,6 +906,8 @@ struct fxp_xfer {
     bool eof, err;
     struct fxp_handle *fh;
     struct req *head, *tail;
+    /* The packet whose data xfer_download_data last handed back */
+    struct sftp_packet *retpkt;
 };
 
 static struct fxp_xfer *xfer_init(struct fxp_handle *fh, uint64_t offset)
@@ -900,6 +917,7 @@ static struct fxp_xfer *xfer_init(struct fxp_handle *fh, uint64_t offset)
     xfer->fh = fh;
     xfer->offset = offset;
     xfer->head = xfer->tail = NULL;
+    xfer->retpkt = NULL;
     xfer->req_totalsize = 0;
     xfer->req_maxsize = 1048576;
     xfer->err = false;
@@ -942,7 +960,8 @@ void xfer_download_queue(struct fxp_xfer *xfer)
         rr->next = NULL;
 
         rr->len = 32768;
-        rr->buffer = snewn(rr->len, char);
+        rr->pktin = NULL;
+        rr->buffer = NULL;
         sftp_register(req = fxp_read_send(xfer->fh, rr->offset, rr->len));
         fxp_set_userdata(req, rr);
 
@@ -982,7 +1001,13 @@ int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin)
         fxp_internal_error("request ID is not part of the current download");
         return INT_MIN;                /* this packet isn't ours */
     }
-    rr->retlen = fxp_read_recv(pktin, rreq, rr->buffer, rr->len);
+    ptrlen data;
+    rr->retlen = fxp_read_recv_data(pktin, rreq, rr->len, &data);
+    if (rr->retlen >= 0) {
+        /* Keep the packet, and hand out its data without copying it */
+        rr->pktin = pktin;
+        rr->buffer = data.ptr;
+    }
 #ifdef DEBUG_DOWNLOAD
     printf("read request %p has returned [%d]\n", rr, rr->retlen);
 #endif
@@ -1053,19 +1078,28 @@ void xfer_set_error(struct fxp_xfer *xfer)
 
 bool xfer_download_data(struct fxp_xfer *xfer, void **buf, int *len)
 {
-    void *retbuf = NULL;
+    const void *retbuf = NULL;
     int retlen = 0;
+    bool found = false;
+
+    if (xfer->retpkt) {
+        sftp_pkt_free(xfer->retpkt);
+        xfer->retpkt = NULL;
+    }
 
     /*
      * Discard anything at the head of the rr queue with complete <
      * 0; return the first thing with complete > 0.
      */
-    while (xfer->head && xfer->head->complete && !retbuf) {
+    while (xfer->head && xfer->head->complete && !found) {
         struct req *rr = xfer->head;
 
         if (rr->complete > 0) {
+            /* retbuf is NULL for a zero-length read at EOF */
+            found = true;
             retbuf = rr->buffer;
             retlen = rr->retlen;
+            xfer->retpkt = rr->pktin;
 #ifdef DEBUG_DOWNLOAD
             printf("handing back data from read request %p\n", rr);
 #endif
@@ -1081,11 +1115,13 @@ bool xfer_download_data(struct fxp_xfer *xfer, void **buf, int *len)
         else
             xfer->tail = NULL;
         xfer->req_totalsize -= rr->len;
+        if (rr->pktin && rr->pktin != xfer->retpkt)
+            sftp_pkt_free(rr->pktin);
         sfree(rr);
     }
 
-    if (retbuf) {
-        *buf = retbuf;
+    if (found) {
+        *buf = (void *)retbuf;
         *len = retlen;
         return true;
     } else
@@ -1133,6 +1169,7 @@ void xfer_upload_data(struct fxp_xfer *xfer, char *buffer, int len)
     rr->next = NULL;
 
     rr->len = len;
+    rr->pktin = NULL;
     rr->buffer = NULL;
     sftp_register(req = fxp_write_send(xfer->fh, buffer, rr->offset, len));
     fxp_set_userdata(req, rr);
@@ -1197,8 +1234,11 @@ void xfer_cleanup(struct fxp_xfer *xfer)
     while (xfer->head) {
         rr = xfer->head;
         xfer->head = xfer->head->next;
-        sfree(rr->buffer);
+        if (rr->pktin)
+            sftp_pkt_free(rr->pktin);
         sfree(rr);
     }
+    if (xfer->retpkt)
+        sftp_pkt_free(xfer->retpkt);
     sfree(xfer);
 }
@@ -301,6 +301,11 @@ struct fxp_xfer;
 struct fxp_xfer *xfer_download_init(struct fxp_handle *fh, uint64_t offset);
 void xfer_download_queue(struct fxp_xfer *xfer);
 int xfer_download_gotpkt(struct fxp_xfer *xfer, struct sftp_packet *pktin);
+/*
+ * The buffer returned by xfer_download_data points into the received
+ * FXP_DATA packet. It still belongs to the xfer, and remains valid
+ * until the next call to xfer_download_data or xfer_cleanup.
+ */
 bool xfer_download_data(struct fxp_xfer *xfer, void **buf, int *len);
 
 struct fxp_xfer *xfer_upload_init(struct fxp_handle *fh, uint64_t offset);
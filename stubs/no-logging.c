@@ -6,6 +6,8 @@
 #include "putty.h"
 
 void logtraffic(LogContext *ctx, unsigned char c, int logmode) {}
+void logtraffic_data(LogContext *ctx, const void *data, size_t len,
+                     int logmode) {}
 void logflush(LogContext *ctx) {}
 void logevent(LogContext *ctx, const char *event) {}
 void log_free(LogContext *ctx) {}
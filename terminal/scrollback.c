@@ -0,0 +1,603 @@
+/*
+ * Block-compressed storage for the terminal's scrollback.
+ *
+ * terminal.c hands us each line that scrolls off the top of the
+ * screen already encoded as a string of bytes. We append those to an
+ * open 'tail' block, and once it holds SB_BLOCK_LINES lines, we
+ * compress the whole block in one go and seal it. Adjacent lines of
+ * terminal output tend to have a lot of text and nearly all of their
+ * attributes in common, so compressing a block at a time does much
+ * better than compressing each line on its own; and having one
+ * allocation per block instead of one per line saves the malloc
+ * overhead, which for short lines was most of the cost.
+ *
+ * Sealed blocks are never modified. Lines are discarded from the old
+ * end just by counting them off (headskip) until the whole of the
+ * first block has gone and it can be freed; or, if there is only the
+ * tail, until they make up half of it, when they're cut out of it.
+ * Lines are taken back off the new end (when the terminal grows
+ * taller and pulls lines back out of the scrollback) by reopening the
+ * last sealed block as the tail if the tail is empty.
+ *
+ * Reading a line out of a sealed block means decompressing the block,
+ * so we keep the few most recently used blocks in decompressed form.
+ * Anyone reading the scrollback - the display, a selection, a search
+ * - tends to read a run of consecutive lines, so this saves nearly
+ * all the repeated work.
+ *
+ * The codec is a byte-oriented LZ77 variant in the style of LZ4,
+ * chosen for decompression speed rather than compression ratio:
+ *
+ *  - each sequence starts with a token byte. Its top four bits give
+ *    the number of literal bytes and its bottom four bits the match
+ *    length minus LZ_MINMATCH. In either case 15 means the value
+ *    continues in following bytes, each of which is added on, until
+ *    one of them is less than 255.
+ *  - then the literals themselves.
+ *  - then the match offset, as a 16-bit little-endian distance back
+ *    from the current output position, followed by the continuation
+ *    bytes of the match length if any.
+ *
+ * The last sequence in a block has literals only, and ends at the end
+ * of the input.
+ *
+ * To make searching cheap, each block also carries a Bloom filter of
+ * search keys (which terminal.c derives from the text of its lines).
+ * A search can then skip over any block whose filter rules out the
+ * keys of what it's looking for, without decompressing it. Filters
+ * are only ever added to, so they stay correct, if less selective,
+ * when lines are discarded from a block or a block is reopened.
+ */
+
+#include <assert.h>
+#include <string.h>
+
+#include "putty.h"
+#include "scrollback.h"
+
+#define SB_BLOCK_LINES 128
+#define SB_HOT_BLOCKS 4
+
+#define LZ_MINMATCH 4
+#define LZ_MAXOFFSET 0xFFFF
+#define LZ_HASHBITS 12
+
+#define SB_BLOOM_BITS 8192
+#define SB_BLOOM_WORDS (SB_BLOOM_BITS / 64)
+
+typedef struct sbblock {
+    unsigned char *data;               /* compressed contents */
+    size_t len;                        /* length of data */
+    size_t rawlen;                     /* length once decompressed */
+    uint64_t bloom[SB_BLOOM_WORDS];    /* search keys of its lines */
+} sbblock;
+
+/*
+ * A block in its uncompressed form: the concatenated lines, each
+ * preceded by its length in the same 7-bits-at-a-time format that
+ * terminal.c uses for column counts, plus the position and length of
+ * each line so we don't have to walk the prefixes to find one.
+ */
+typedef struct sbraw {
+    strbuf *buf;
+    int nlines;
+    size_t starts[SB_BLOCK_LINES];
+    size_t lens[SB_BLOCK_LINES];
+} sbraw;
+
+struct sbhot {
+    sbblock *block;                    /* NULL if this slot is unused */
+    sbraw raw;
+    unsigned long lastused;
+};
+
+struct sbstore {
+    sbblock **blocks;                  /* sealed blocks, oldest first */
+    int nblocks;
+    size_t blockssize;
+
+    sbraw tail;                        /* open block after all of those */
+    uint64_t tail_bloom[SB_BLOOM_WORDS];
+
+    /*
+     * Number of lines at the start of the oldest block (or of the
+     * tail, if there are no sealed blocks) that have been discarded.
+     */
+    int headskip;
+
+    int count;                         /* lines actually present */
+    size_t sealed_bytes;
+    bool compress;
+
+    struct sbhot hot[SB_HOT_BLOCKS];
+    unsigned long clock;
+};
+
+static void lz_put_length(strbuf *out, size_t n)
+{
+    while (n >= 255) {
+        put_byte(out, 255);
+        n -= 255;
+    }
+    put_byte(out, n);
+}
+
+static size_t lz_get_length(BinarySource *src)
+{
+    size_t n = 0;
+    int byte;
+    do {
+        byte = get_byte(src);
+        n += byte;
+    } while (byte == 255 && !get_err(src));
+    return n;
+}
+
+static void lz_put_sequence(strbuf *out, const unsigned char *lit,
+                            size_t nlit, size_t offset, size_t mlen)
+{
+    size_t mcode = mlen ? mlen - LZ_MINMATCH : 0;
+
+    put_byte(out, ((nlit < 15 ? nlit : 15) << 4) |
+             (mcode < 15 ? mcode : 15));
+    if (nlit >= 15)
+        lz_put_length(out, nlit - 15);
+    put_data(out, lit, nlit);
+
+    if (mlen) {
+        put_byte(out, offset & 0xFF);
+        put_byte(out, offset >> 8);
+        if (mcode >= 15)
+            lz_put_length(out, mcode - 15);
+    }
+}
+
+static inline unsigned lz_hash(const unsigned char *p)
+{
+    return (GET_32BIT_LSB_FIRST(p) * 2654435761U) >> (32 - LZ_HASHBITS);
+}
+
+static void lz_compress(ptrlen in, strbuf *out)
+{
+    const unsigned char *p = in.ptr;
+    size_t len = in.len, pos = 0, anchor = 0;
+    /* Each entry is a position in the input plus 1, so that 0 is empty */
+    uint32_t table[1 << LZ_HASHBITS];
+
+    memset(table, 0, sizeof(table));
+
+    while (pos + LZ_MINMATCH <= len) {
+        unsigned h = lz_hash(p + pos);
+        size_t cand = table[h];
+        table[h] = pos + 1;
+
+        if (cand && pos - (cand - 1) <= LZ_MAXOFFSET &&
+            !memcmp(p + cand - 1, p + pos, LZ_MINMATCH)) {
+            size_t mpos = cand - 1, mlen = LZ_MINMATCH;
+
+            while (pos + mlen < len && p[mpos + mlen] == p[pos + mlen])
+                mlen++;
+
+            lz_put_sequence(out, p + anchor, pos - anchor, pos - mpos, mlen);
+            pos += mlen;
+            anchor = pos;
+
+            /* Make the end of the match findable by later ones */
+            if (pos + LZ_MINMATCH <= len)
+                table[lz_hash(p + pos - 1)] = pos;
+        } else {
+            pos++;
+        }
+    }
+
+    lz_put_sequence(out, p + anchor, len - anchor, 0, 0);
+}
+
+static void lz_decompress(ptrlen in, unsigned char *out, size_t outlen)
+{
+    BinarySource src[1];
+    size_t pos = 0;
+
+    BinarySource_BARE_INIT_PL(src, in);
+
+    while (true) {
+        int token = get_byte(src);
+        size_t nlit = token >> 4, mlen = token & 15, offset;
+        ptrlen lit;
+
+        if (nlit == 15)
+            nlit += lz_get_length(src);
+        lit = get_data(src, nlit);
+        assert(!get_err(src));
+        assert(lit.len <= outlen - pos);
+        memcpy(out + pos, lit.ptr, lit.len);
+        pos += lit.len;
+
+        if (!get_avail(src))
+            break;
+
+        offset = get_byte(src);
+        offset |= get_byte(src) << 8;
+        if (mlen == 15)
+            mlen += lz_get_length(src);
+        mlen += LZ_MINMATCH;
+        assert(!get_err(src));
+        assert(offset > 0 && offset <= pos);
+        assert(mlen <= outlen - pos);
+
+        /* The source and destination can overlap, so copy bytewise */
+        for (size_t i = 0; i < mlen; i++, pos++)
+            out[pos] = out[pos - offset];
+    }
+
+    assert(pos == outlen);
+}
+
+static void sbraw_clear(sbraw *raw)
+{
+    strbuf_clear(raw->buf);
+    raw->nlines = 0;
+}
+
+static void sbraw_append(sbraw *raw, ptrlen line)
+{
+    size_t n = line.len;
+
+    assert(raw->nlines < SB_BLOCK_LINES);
+
+    while (n >= 128) {
+        put_byte(raw->buf, (unsigned char)((n & 0x7F) | 0x80));
+        n >>= 7;
+    }
+    put_byte(raw->buf, (unsigned char)n);
+
+    raw->starts[raw->nlines] = raw->buf->len;
+    raw->lens[raw->nlines] = line.len;
+    raw->nlines++;
+    put_datapl(raw->buf, line);
+}
+
+/*
+ * Offset in a raw block's buffer at which line n's length prefix
+ * begins, which is where the previous line ends.
+ */
+static size_t sbraw_prefix_start(sbraw *raw, int n)
+{
+    return n ? raw->starts[n - 1] + raw->lens[n - 1] : 0;
+}
+
+/*
+ * Remove the first n lines of a raw block.
+ */
+static void sbraw_drop_head(sbraw *raw, int n)
+{
+    size_t cut = sbraw_prefix_start(raw, n);
+
+    memmove(raw->buf->u, raw->buf->u + cut, raw->buf->len - cut);
+    strbuf_shrink_to(raw->buf, raw->buf->len - cut);
+    for (int i = n; i < raw->nlines; i++) {
+        raw->starts[i - n] = raw->starts[i] - cut;
+        raw->lens[i - n] = raw->lens[i];
+    }
+    raw->nlines -= n;
+}
+
+/*
+ * Fill in the line positions of a raw block whose data has just been
+ * decompressed into its buffer.
+ */
+static void sbraw_index(sbraw *raw)
+{
+    size_t pos = 0;
+
+    raw->nlines = 0;
+    while (pos < raw->buf->len) {
+        size_t n = 0;
+        int shift = 0, byte;
+
+        assert(raw->nlines < SB_BLOCK_LINES);
+        do {
+            byte = raw->buf->u[pos++];
+            n |= (size_t)(byte & 0x7F) << shift;
+            shift += 7;
+        } while (byte & 0x80);
+
+        raw->starts[raw->nlines] = pos;
+        raw->lens[raw->nlines] = n;
+        raw->nlines++;
+        pos += n;
+    }
+    assert(pos == raw->buf->len);
+}
+
+static void sbraw_load(sbraw *raw, sbblock *block, bool compressed)
+{
+    unsigned char *out;
+
+    strbuf_clear(raw->buf);
+    out = strbuf_append(raw->buf, block->rawlen);
+    if (compressed)
+        lz_decompress(make_ptrlen(block->data, block->len),
+                      out, block->rawlen);
+    else
+        memcpy(out, block->data, block->rawlen);
+    sbraw_index(raw);
+}
+
+static void sbblock_free(sbblock *block)
+{
+    sfree(block->data);
+    sfree(block);
+}
+
+/*
+ * Forget any decompressed copy of a block that is about to go away.
+ */
+static void sbstore_unhot(sbstore *sb, sbblock *block)
+{
+    for (int i = 0; i < SB_HOT_BLOCKS; i++)
+        if (sb->hot[i].block == block)
+            sb->hot[i].block = NULL;
+}
+
+static sbraw *sbstore_hot(sbstore *sb, sbblock *block)
+{
+    struct sbhot *victim = NULL;
+
+    sb->clock++;
+    for (int i = 0; i < SB_HOT_BLOCKS; i++) {
+        struct sbhot *h = &sb->hot[i];
+        if (h->block == block) {
+            h->lastused = sb->clock;
+            return &h->raw;
+        }
+        if (!victim || !h->block ||
+            (victim->block && h->lastused < victim->lastused))
+            victim = h;
+    }
+
+    sbraw_load(&victim->raw, block, sb->compress);
+    victim->block = block;
+    victim->lastused = sb->clock;
+    return &victim->raw;
+}
+
+/*
+ * Each key sets two bits of a filter, taken from different parts of
+ * it, so the keys had better be well mixed already.
+ */
+static inline void bloom_add(uint64_t *bloom, uint32_t key)
+{
+    unsigned b1 = key % SB_BLOOM_BITS, b2 = (key >> 16) % SB_BLOOM_BITS;
+    bloom[b1 / 64] |= (uint64_t)1 << (b1 % 64);
+    bloom[b2 / 64] |= (uint64_t)1 << (b2 % 64);
+}
+
+static inline bool bloom_test(const uint64_t *bloom, uint32_t key)
+{
+    unsigned b1 = key % SB_BLOOM_BITS, b2 = (key >> 16) % SB_BLOOM_BITS;
+    return ((bloom[b1 / 64] >> (b1 % 64)) & 1) &&
+        ((bloom[b2 / 64] >> (b2 % 64)) & 1);
+}
+
+static void sbstore_seal(sbstore *sb)
+{
+    sbblock *block = snew(sbblock);
+    ptrlen raw = ptrlen_from_strbuf(sb->tail.buf);
+
+    if (sb->compress) {
+        strbuf *out = strbuf_new();
+        lz_compress(raw, out);
+        block->len = out->len;
+        block->data = snewn(out->len, unsigned char);
+        memcpy(block->data, out->u, out->len);
+        strbuf_free(out);
+    } else {
+        block->len = raw.len;
+        block->data = snewn(raw.len, unsigned char);
+        memcpy(block->data, raw.ptr, raw.len);
+    }
+    block->rawlen = raw.len;
+    memcpy(block->bloom, sb->tail_bloom, sizeof(block->bloom));
+    memset(sb->tail_bloom, 0, sizeof(sb->tail_bloom));
+
+    sgrowarray(sb->blocks, sb->blockssize, sb->nblocks);
+    sb->blocks[sb->nblocks++] = block;
+    sb->sealed_bytes += sizeof(sbblock) + block->len;
+
+    sbraw_clear(&sb->tail);
+}
+
+sbstore *sbstore_new(bool compress)
+{
+    sbstore *sb = snew(sbstore);
+
+    memset(sb, 0, sizeof(sbstore));
+    sb->compress = compress;
+    sb->tail.buf = strbuf_new();
+    for (int i = 0; i < SB_HOT_BLOCKS; i++)
+        sb->hot[i].raw.buf = strbuf_new();
+    return sb;
+}
+
+void sbstore_clear(sbstore *sb)
+{
+    for (int i = 0; i < sb->nblocks; i++)
+        sbblock_free(sb->blocks[i]);
+    sb->nblocks = 0;
+    sb->sealed_bytes = 0;
+
+    for (int i = 0; i < SB_HOT_BLOCKS; i++) {
+        sb->hot[i].block = NULL;
+        sbraw_clear(&sb->hot[i].raw);
+    }
+
+    sbraw_clear(&sb->tail);
+    memset(sb->tail_bloom, 0, sizeof(sb->tail_bloom));
+    sb->headskip = 0;
+    sb->count = 0;
+}
+
+void sbstore_free(sbstore *sb)
+{
+    sbstore_clear(sb);
+    sfree(sb->blocks);
+    strbuf_free(sb->tail.buf);
+    for (int i = 0; i < SB_HOT_BLOCKS; i++)
+        strbuf_free(sb->hot[i].raw.buf);
+    sfree(sb);
+}
+
+int sbstore_count(sbstore *sb)
+{
+    return sb->count;
+}
+
+size_t sbstore_bytes(sbstore *sb)
+{
+    size_t bytes = sb->sealed_bytes + sb->blockssize * sizeof(sbblock *) +
+        sb->tail.buf->len;
+
+    /*
+     * Lines already discarded from the oldest block don't count, even
+     * though their memory isn't given back until the rest of the
+     * block goes. For a sealed block we can only estimate their share
+     * of it. Without this, a limit smaller than one block would make
+     * the terminal throw away every line it had.
+     */
+    if (sb->nblocks > 0)
+        bytes -= sb->blocks[0]->len * sb->headskip / SB_BLOCK_LINES;
+    else
+        bytes -= sbraw_prefix_start(&sb->tail, sb->headskip);
+    return bytes;
+}
+
+void sbstore_append(sbstore *sb, ptrlen line)
+{
+    sbraw_append(&sb->tail, line);
+    sb->count++;
+    if (sb->tail.nlines == SB_BLOCK_LINES)
+        sbstore_seal(sb);
+}
+
+void sbstore_index_keys(sbstore *sb, const uint32_t *keys, size_t nkeys)
+{
+    assert(sb->tail.nlines > 0 || sb->nblocks > 0);
+
+    /* If the line just filled the tail, it's already been sealed */
+    uint64_t *bloom = sb->tail.nlines > 0 ? sb->tail_bloom :
+        sb->blocks[sb->nblocks - 1]->bloom;
+    for (size_t i = 0; i < nkeys; i++)
+        bloom_add(bloom, keys[i]);
+}
+
+int sbstore_find_candidate(sbstore *sb, int index, int dir,
+                           const uint32_t *keys, size_t nkeys)
+{
+    while (index >= 0 && index < sb->count) {
+        int blockno = (index + sb->headskip) / SB_BLOCK_LINES;
+        const uint64_t *bloom = blockno < sb->nblocks ?
+            sb->blocks[blockno]->bloom : sb->tail_bloom;
+        size_t i;
+
+        for (i = 0; i < nkeys; i++)
+            if (!bloom_test(bloom, keys[i]))
+                break;
+        if (i == nkeys)
+            return index;
+
+        /* Skip to the nearest line of the next block in direction dir */
+        if (dir > 0)
+            index = (blockno + 1) * SB_BLOCK_LINES - sb->headskip;
+        else
+            index = blockno * SB_BLOCK_LINES - sb->headskip - 1;
+    }
+    return -1;
+}
+
+void sbstore_drop_oldest(sbstore *sb)
+{
+    assert(sb->count > 0);
+    sb->count--;
+    sb->headskip++;
+
+    if (sb->nblocks > 0) {
+        if (sb->headskip == SB_BLOCK_LINES) {
+            sbblock *block = sb->blocks[0];
+            sbstore_unhot(sb, block);
+            sb->sealed_bytes -= sizeof(sbblock) + block->len;
+            sbblock_free(block);
+            sb->nblocks--;
+            memmove(sb->blocks, sb->blocks + 1,
+                    sb->nblocks * sizeof(*sb->blocks));
+            sb->headskip = 0;
+        }
+    } else if (sb->headskip == sb->tail.nlines) {
+        sbraw_clear(&sb->tail);
+        sb->headskip = 0;
+    } else if (sb->headskip * 2 >= sb->tail.nlines) {
+        /* Don't let discarded lines take up most of the tail */
+        sbraw_drop_head(&sb->tail, sb->headskip);
+        sb->headskip = 0;
+    }
+}
+
+ptrlen sbstore_get(sbstore *sb, int index)
+{
+    sbraw *raw;
+    int line, blockno;
+
+    if (index < 0 || index >= sb->count)
+        return make_ptrlen(NULL, 0);
+
+    line = index + sb->headskip;
+    blockno = line / SB_BLOCK_LINES;
+    if (blockno < sb->nblocks) {
+        raw = sbstore_hot(sb, sb->blocks[blockno]);
+        line -= blockno * SB_BLOCK_LINES;
+    } else {
+        raw = &sb->tail;
+        line -= sb->nblocks * SB_BLOCK_LINES;
+    }
+
+    assert(line < raw->nlines);
+    return make_ptrlen(raw->buf->u + raw->starts[line], raw->lens[line]);
+}
+
+ptrlen sbstore_pop_newest(sbstore *sb)
+{
+    sbraw *tail = &sb->tail;
+    size_t start, len;
+    int line;
+
+    if (sb->count == 0)
+        return make_ptrlen(NULL, 0);
+
+    if (tail->nlines == 0) {
+        /* Reopen the newest sealed block as the tail. */
+        sbblock *block;
+
+        assert(sb->nblocks > 0);
+        block = sb->blocks[--sb->nblocks];
+        sbstore_unhot(sb, block);
+        sbraw_load(tail, block, sb->compress);
+        memcpy(sb->tail_bloom, block->bloom, sizeof(sb->tail_bloom));
+        sb->sealed_bytes -= sizeof(sbblock) + block->len;
+        sbblock_free(block);
+    }
+
+    line = --tail->nlines;
+    start = tail->starts[line];
+    len = tail->lens[line];
+    sb->count--;
+
+    /*
+     * Cut the line and its length prefix off the end of the buffer.
+     * The data itself is still there until the next append, which is
+     * all our contract promises.
+     */
+    strbuf_shrink_to(tail->buf, line ? tail->starts[line - 1] +
+                     tail->lens[line - 1] : 0);
+
+    return make_ptrlen(tail->buf->u + start, len);
+}
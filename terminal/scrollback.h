@@ -0,0 +1,62 @@
+/*
+ * Header file for the terminal's block-compressed scrollback store.
+ * Not used by anything outside the terminal subsystem.
+ *
+ * The store deals only in opaque byte strings, one per line of
+ * scrollback, indexed from 0 (the oldest line) upwards. Encoding a
+ * termline into such a string and back is terminal.c's business.
+ */
+
+#ifndef PUTTY_SCROLLBACK_H
+#define PUTTY_SCROLLBACK_H
+
+typedef struct sbstore sbstore;
+
+/*
+ * If 'compress' is false, sealed blocks are stored exactly as they
+ * were written, for builds that would rather spend the memory than
+ * the CPU.
+ */
+sbstore *sbstore_new(bool compress);
+void sbstore_free(sbstore *sb);
+
+/* Remove all lines. */
+void sbstore_clear(sbstore *sb);
+
+/* Number of lines currently stored. */
+int sbstore_count(sbstore *sb);
+
+/* Approximate memory used by the stored lines, in bytes. */
+size_t sbstore_bytes(sbstore *sb);
+
+/* Add a line after all the existing ones. */
+void sbstore_append(sbstore *sb, ptrlen line);
+
+/*
+ * Record search keys for the line most recently appended. They go
+ * into a Bloom filter covering a block of lines, so they should be
+ * well-mixed hash values.
+ */
+void sbstore_index_keys(sbstore *sb, const uint32_t *keys, size_t nkeys);
+
+/*
+ * Return the first line, starting from 'index' and moving towards
+ * newer lines if dir > 0 or older ones if dir < 0, that might have
+ * had all of the given keys recorded for it; or -1 if none can have.
+ * A line returned here still has to be checked properly.
+ */
+int sbstore_find_candidate(sbstore *sb, int index, int dir,
+                           const uint32_t *keys, size_t nkeys);
+
+/* Discard the oldest line. */
+void sbstore_drop_oldest(sbstore *sb);
+
+/*
+ * Retrieve line 'index', or remove and return the newest line. The
+ * returned data belongs to the store and is only valid until the
+ * next call to any sbstore function.
+ */
+ptrlen sbstore_get(sbstore *sb, int index);
+ptrlen sbstore_pop_newest(sbstore *sb);
+
+#endif /* PUTTY_SCROLLBACK_H */
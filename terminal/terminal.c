@@ -10,6 +10,9 @@
 
 #include <time.h>
 #include <assert.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 #include "putty.h"
 #include "terminal.h"
 
@@ -38,6 +41,11 @@
 #define TM_PUTTY        (0xFFFF)
 
 #define UPDATE_DELAY    ((TICKSPERSEC+49)/50)/* ticks to defer window update */
+#define ECHO_TIMEOUT    ((TICKSPERSEC+3)/4) /* max ticks from key to echo */
+#define TIMESLICE_GRANULE 4096     /* bytes of output between clock checks */
+#define PASTE_CHUNK     4096       /* max chars of paste to send at once */
+#define PASTE_BACKLOG   32768      /* hold paste while backend buffers this */
+#define PASTE_RETRY_DELAY ((TICKSPERSEC+19)/20) /* ticks between polls */
 #define TBLINK_DELAY    ((TICKSPERSEC*9+19)/20)/* ticks between text blinks*/
 #define CBLINK_DELAY    (CURSORBLINK) /* ticks between cursor blinks */
 #define VBELL_DELAY     (VBELL_TIMEOUT) /* visual bell timeout in ticks */
@@ -93,17 +101,115 @@ static termline *lineptr(Terminal *, int, int);
 static void check_line_size(Terminal *, termline *);
 static void do_paint(Terminal *);
 static void erase_lots(Terminal *, bool, bool, bool);
-static int find_last_nonempty_line(Terminal *, tree234 *);
+static int find_last_nonempty_line(Terminal *, screenbuf *);
 static void swap_screen(Terminal *, int, bool, bool);
 static void update_sbar(Terminal *);
 static void deselect(Terminal *);
 static void term_print_finish(Terminal *);
 static void scroll(Terminal *, int, int, int, bool);
+static void discard_scrolls(Terminal *);
+static void display_scrolls(Terminal *);
 static void parse_optionalrgb(optionalrgb *out, unsigned *values);
 static void term_added_data(Terminal *term, bool);
 static void term_update_raw_mouse_mode(Terminal *term);
 static void term_out_cb(void *);
 
+static screenbuf *screenbuf_new(void)
+{
+    screenbuf *sb = snew(screenbuf);
+    sb->lines = NULL;
+    sb->size = sb->count = sb->start = 0;
+    return sb;
+}
+
+/* Frees the screenbuf itself, but not the lines still in it. */
+static void screenbuf_free(screenbuf *sb)
+{
+    sfree(sb->lines);
+    sfree(sb);
+}
+
+static inline int screenbuf_count(screenbuf *sb)
+{
+    return sb->count;
+}
+
+static inline int screenbuf_slot(screenbuf *sb, int i)
+{
+    int slot = sb->start + i;
+    return slot >= sb->size ? slot - sb->size : slot;
+}
+
+static inline termline *screenbuf_index(screenbuf *sb, int i)
+{
+    if (i < 0 || i >= sb->count)
+        return NULL;
+    return sb->lines[screenbuf_slot(sb, i)];
+}
+
+/*
+ * Insert a line so that it becomes line 'pos'. Whichever of the
+ * lines above or below it are fewer get moved out of the way, so
+ * inserting at the top or bottom costs O(1).
+ */
+static void screenbuf_insert(screenbuf *sb, termline *line, int pos)
+{
+    int i;
+
+    assert(0 <= pos && pos <= sb->count);
+
+    if (sb->count == sb->size) {
+        int newsize = sb->size < 16 ? 16 : sb->size * 2;
+        termline **newlines = snewn(newsize, termline *);
+        for (i = 0; i < sb->count; i++)
+            newlines[i] = sb->lines[screenbuf_slot(sb, i)];
+        sfree(sb->lines);
+        sb->lines = newlines;
+        sb->size = newsize;
+        sb->start = 0;
+    }
+
+    if (pos < sb->count - pos) {
+        sb->start = (sb->start == 0 ? sb->size : sb->start) - 1;
+        for (i = 0; i < pos; i++)
+            sb->lines[screenbuf_slot(sb, i)] =
+                sb->lines[screenbuf_slot(sb, i + 1)];
+    } else {
+        for (i = sb->count; i > pos; i--)
+            sb->lines[screenbuf_slot(sb, i)] =
+                sb->lines[screenbuf_slot(sb, i - 1)];
+    }
+    sb->lines[screenbuf_slot(sb, pos)] = line;
+    sb->count++;
+}
+
+/*
+ * Remove line 'pos' and return it, closing the gap from whichever
+ * side is shorter. Returns NULL if there's no such line.
+ */
+static termline *screenbuf_delete(screenbuf *sb, int pos)
+{
+    termline *line;
+    int i;
+
+    if (pos < 0 || pos >= sb->count)
+        return NULL;
+
+    line = sb->lines[screenbuf_slot(sb, pos)];
+    if (pos < sb->count - 1 - pos) {
+        for (i = pos; i > 0; i--)
+            sb->lines[screenbuf_slot(sb, i)] =
+                sb->lines[screenbuf_slot(sb, i - 1)];
+        sb->start = (sb->start + 1 == sb->size ? 0 : sb->start + 1);
+    } else {
+        for (i = pos; i < sb->count - 1; i++)
+            sb->lines[screenbuf_slot(sb, i)] =
+                sb->lines[screenbuf_slot(sb, i + 1)];
+    }
+    sb->count--;
+    return line;
+}
+
 static termline *newtermline(Terminal *term, int cols, bool bce)
 {
     termline *line;
@@ -118,6 +224,7 @@ static termline *newtermline(Terminal *term, int cols, bool bce)
     line->trusted = false;
     line->temporary = false;
     line->cc_free = 0;
+    line->gen = ++term->line_gen;
 
     return line;
 }
@@ -336,12 +443,12 @@ static bool termchars_equal_override(termchar *a, termchar *b,
                                      unsigned long bchr, unsigned long battr)
 {
     /* FULL-TERMCHAR */
-    if (!truecolour_equal(a->truecolour, b->truecolour))
-        return false;
     if (a->chr != bchr)
         return false;
     if ((a->attr &~ DATTR_MASK) != (battr &~ DATTR_MASK))
         return false;
+    if (!truecolour_equal(a->truecolour, b->truecolour))
+        return false;
     while (a->cc_next || b->cc_next) {
         if (!a->cc_next || !b->cc_next)
             return false;              /* one cc-list ends, other does not */
@@ -690,19 +797,18 @@ static void makeliteral_cc(strbuf *b, termchar *c, unsigned long *state)
     makeliteral_chr(b, &z, &zstate);
 }
 
-typedef struct compressed_scrollback_line {
-    size_t len;
-    /* compressed data follows after this */
-} compressed_scrollback_line;
-
-static termline *decompressline_no_free(compressed_scrollback_line *line);
+static termline *decompressline(ptrlen data);
 
-static compressed_scrollback_line *compressline_no_free(termline *ldata)
+/*
+ * Append the compressed form of a termline to a strbuf. The result is
+ * what we keep in the scrollback store, which further compresses
+ * whole blocks of these at a time.
+ */
+static void compressline(strbuf *b, termline *ldata)
 {
-    strbuf *b = strbuf_new();
-
-    /* Leave space for the header structure */
-    strbuf_append(b, sizeof(compressed_scrollback_line));
+#ifdef TERM_CC_DIAGS
+    size_t start = b->len;
+#endif
 
     /*
      * First, store the column count, 7 bits at a time, least
@@ -749,11 +855,6 @@ static compressed_scrollback_line *compressline_no_free(termline *ldata)
     makerle(b, ldata, makeliteral_truecolour);
     makerle(b, ldata, makeliteral_cc);
 
-    size_t linelen = b->len - sizeof(compressed_scrollback_line);
-    compressed_scrollback_line *line =
-        (compressed_scrollback_line *)strbuf_to_str(b);
-    line->len = linelen;
-
     /*
      * Diagnostics: ensure that the compressed data really does
      * decompress to the right thing.
@@ -767,13 +868,13 @@ static compressed_scrollback_line *compressline_no_free(termline *ldata)
         int i;
 
 #ifdef DIAGNOSTIC_SB_COMPRESSION
-        for (i = 0; i < b->len; i++) {
-            printf(" %02x ", b->data[i]);
+        for (i = start; i < b->len; i++) {
+            printf(" %02x ", b->u[i]);
         }
         printf("\n");
 #endif
 
-        dcl = decompressline_no_free(line);
+        dcl = decompressline(make_ptrlen(b->u + start, b->len - start));
         assert(ldata->cols == dcl->cols);
         assert(ldata->lattr == dcl->lattr);
         for (i = 0; i < ldata->cols; i++)
@@ -781,23 +882,14 @@ static compressed_scrollback_line *compressline_no_free(termline *ldata)
 
 #ifdef DIAGNOSTIC_SB_COMPRESSION
         printf("%d cols (%d bytes) -> %d bytes (factor of %g)\n",
-               ldata->cols, 4 * ldata->cols, dused,
-               (double)dused / (4 * ldata->cols));
+               ldata->cols, 4 * ldata->cols, (int)(b->len - start),
+               (double)(b->len - start) / (4 * ldata->cols));
 #endif
 
         freetermline(dcl);
     }
 #endif
 #endif /* TERM_CC_DIAGS */
-
-    return line;
-}
-
-static compressed_scrollback_line *compressline_and_free(termline *ldata)
-{
-    compressed_scrollback_line *cline = compressline_no_free(ldata);
-    freetermline(ldata);
-    return cline;
 }
 
 static void readrle(BinarySource *bs, termline *ldata,
@@ -933,13 +1025,13 @@ static void readliteral_cc(BinarySource *bs, termchar *c, termline *ldata,
     }
 }
 
-static termline *decompressline_no_free(compressed_scrollback_line *line)
+static termline *decompressline(ptrlen data)
 {
     int ncols, byte, shift;
     BinarySource bs[1];
     termline *ldata;
 
-    BinarySource_BARE_INIT(bs, line+1, line->len);
+    BinarySource_BARE_INIT_PL(bs, data);
 
     /*
      * First read in the column count.
@@ -959,6 +1051,7 @@ static termline *decompressline_no_free(compressed_scrollback_line *line)
     ldata->cols = ldata->size = ncols;
     ldata->temporary = true;
     ldata->cc_free = 0;
+    ldata->gen = 0;                    /* the caller will give it one */
 
     /*
      * We must set all the cc pointers in ldata->chars to 0 right
@@ -1000,65 +1093,282 @@ static termline *decompressline_no_free(compressed_scrollback_line *line)
     return ldata;
 }
 
-static inline void free_compressed_line(compressed_scrollback_line *cline)
+#define SCROLLBACK_COMPRESSED true
+
+#else /* NO_SCROLLBACK_COMPRESSION */
+
+/*
+ * Without compression, a line in the scrollback store is just a flat
+ * copy of the termline structure followed by its character array.
+ * (The cc_next fields are relative offsets, so the array can be
+ * copied about freely.)
+ */
+static void compressline(strbuf *b, termline *ldata)
 {
-    sfree(cline);
+    put_data(b, ldata, sizeof(termline));
+    put_data(b, ldata->chars, ldata->size * TSIZE);
 }
 
-static termline *decompressline_and_free(compressed_scrollback_line *cline)
+static termline *decompressline(ptrlen data)
 {
-    termline *ldata = decompressline_no_free(cline);
-    free_compressed_line(cline);
+    termline *ldata = snew(termline);
+
+    assert(data.len >= sizeof(termline));
+    memcpy(ldata, data.ptr, sizeof(termline));
+    assert(data.len == sizeof(termline) + ldata->size * TSIZE);
+    ldata->chars = snewn(ldata->size, termchar);
+    memcpy(ldata->chars, (const char *)data.ptr + sizeof(termline),
+           ldata->size * TSIZE);
+    ldata->temporary = true;
+    ldata->gen = 0;                    /* the caller will give it one */
     return ldata;
 }
 
-#else /* NO_SCROLLBACK_COMPRESSION */
+#define SCROLLBACK_COMPRESSED false
 
-static termline *duptermline(termline *oldline)
+#endif /* NO_SCROLLBACK_COMPRESSION */
+
+/*
+ * Scrollback lines are decompressed into a new termline every time
+ * anything looks at them, which when the user is scrolled back means
+ * every line on every repaint, and again for each step of a selection
+ * drag. So we keep the most recently used SBCACHE_LINES of them.
+ *
+ * Cached lines are marked non-temporary so that unlineptr leaves them
+ * alone; they're only freed when they drop out of the cache. Callers
+ * of lineptr only hold a line or two at a time, so nothing can be
+ * evicted from under them.
+ */
+#define SBCACHE_LINES 256
+
+static int sbcache_cmp(void *av, void *bv)
 {
-    termline *newline = snew(termline);
-    *newline = *oldline;               /* copy the POD structure fields */
-    newline->chars = snewn(newline->size, termchar);
-    for (int j = 0; j < newline->size; j++)
-        newline->chars[j] = oldline->chars[j];
-    return newline;
+    sbcache_entry *a = (sbcache_entry *)av, *b = (sbcache_entry *)bv;
+    if (a->lineno < b->lineno)
+        return -1;
+    else if (a->lineno > b->lineno)
+        return +1;
+    return 0;
 }
 
-typedef termline compressed_scrollback_line;
+static void sbcache_unlink(Terminal *term, sbcache_entry *e)
+{
+    if (e->prev)
+        e->prev->next = e->next;
+    else
+        term->sbcache_head = e->next;
+    if (e->next)
+        e->next->prev = e->prev;
+    else
+        term->sbcache_tail = e->prev;
+}
 
-static inline compressed_scrollback_line *compressline_and_free(
-    termline *ldata)
+static void sbcache_link_head(Terminal *term, sbcache_entry *e)
 {
-    return ldata;
+    e->prev = NULL;
+    e->next = term->sbcache_head;
+    if (e->next)
+        e->next->prev = e;
+    else
+        term->sbcache_tail = e;
+    term->sbcache_head = e;
 }
 
-static inline compressed_scrollback_line *compressline_no_free(termline *ldata)
+static void sbcache_remove(Terminal *term, sbcache_entry *e)
 {
-    return duptermline(ldata);
+    del234(term->sbcache, e);
+    sbcache_unlink(term, e);
+    freetermline(e->line);
+    sfree(e);
+    term->sbcache_count--;
 }
 
-static inline termline *decompressline_no_free(
-    compressed_scrollback_line *line)
+/* Forget the cached copy of one scrollback line, if there is one. */
+static void sbcache_forget(Terminal *term, size_t lineno)
 {
-    /* This will return a line without the 'temporary' flag, which
-     * means that unlineptr() is already set up to avoid freeing it */
-    return line;
+    sbcache_entry key, *e;
+
+    key.lineno = lineno;
+    if ((e = find234(term->sbcache, &key, NULL)) != NULL)
+        sbcache_remove(term, e);
 }
 
-static inline termline *decompressline_and_free(
-    compressed_scrollback_line *line)
+static void sbcache_clear(Terminal *term)
 {
-    /* Same as decompressline_no_free, because the caller will free
-     * our returned termline, and that does all the freeing necessary */
-    return line;
+    while (term->sbcache_head)
+        sbcache_remove(term, term->sbcache_head);
 }
 
-static inline void free_compressed_line(compressed_scrollback_line *line)
+/*
+ * Return line 'index' of the scrollback, decompressing it if it isn't
+ * already in the cache. Returns NULL if there's no such line.
+ */
+static termline *sb_get_line(Terminal *term, int index)
 {
-    freetermline(line);
+    sbcache_entry key, *e;
+    ptrlen cline;
+
+    key.lineno = term->sbfirst + index;
+    if ((e = find234(term->sbcache, &key, NULL)) != NULL) {
+        sbcache_unlink(term, e);
+        sbcache_link_head(term, e);
+        return e->line;
+    }
+
+    cline = sbstore_get(term->scrollback, index);
+    if (!cline.ptr)
+        return NULL;
+
+    if (term->sbcache_count == SBCACHE_LINES)
+        sbcache_remove(term, term->sbcache_tail);
+
+    e = snew(sbcache_entry);
+    e->lineno = key.lineno;
+    e->line = decompressline(cline);
+    e->line->temporary = false;
+    e->line->gen = ++term->line_gen;
+    add234(term->sbcache, e);
+    sbcache_link_head(term, e);
+    term->sbcache_count++;
+    return e->line;
 }
 
-#endif /* NO_SCROLLBACK_COMPRESSION */
+/*
+ * Discard the oldest line of the scrollback.
+ */
+static void sb_drop_oldest(Terminal *term)
+{
+    sbcache_forget(term, term->sbfirst);
+    sbstore_drop_oldest(term->scrollback);
+    term->sbfirst++;
+}
+
+/*
+ * Discard the whole of the scrollback. Line numbers carry on from
+ * where they were, so nothing stale can turn up in the cache.
+ */
+static void sb_clear(Terminal *term)
+{
+    sbcache_clear(term);
+    term->sbfirst += sbstore_count(term->scrollback);
+    sbstore_clear(term->scrollback);
+}
+
+/*
+ * Make sure the search scratch arrays can hold a line of 'cols'.
+ */
+static void search_reserve(Terminal *term, int cols)
+{
+    if (term->search_size < cols) {
+        size_t size = term->search_size;
+        sgrowarray(term->search_text, size, cols);
+        term->search_cols = sresize(term->search_cols, size, int);
+        term->search_keys = sresize(term->search_keys, size, uint32_t);
+        term->search_size = size;
+    }
+}
+
+/*
+ * Reduce a line to the text that searches look at: one Unicode
+ * character per character cell, ignoring the right halves of wide
+ * characters and any combining characters, with trailing spaces
+ * removed. Fills in term->search_text, and term->search_cols with the
+ * column each character came from, and returns how many there are.
+ */
+static size_t search_text(Terminal *term, termline *ldata)
+{
+    size_t n = 0, len = 0;
+
+    search_reserve(term, ldata->cols);
+    for (int x = 0; x < ldata->cols; x++) {
+        unsigned long c = ldata->chars[x].chr;
+
+        if (c == UCSWIDE)
+            continue;
+        switch (c & CSET_MASK) {
+          case CSET_ASCII:
+            c = term->ucsdata->unitab_line[c & 0xFF];
+            break;
+          case CSET_LINEDRW:
+            c = term->ucsdata->unitab_xterm[c & 0xFF];
+            break;
+          case CSET_SCOACS:
+            c = term->ucsdata->unitab_scoacs[c & 0xFF];
+            break;
+        }
+        switch (c & CSET_MASK) {
+          case CSET_ACP:
+            c = term->ucsdata->unitab_font[c & 0xFF];
+            break;
+          case CSET_OEMCP:
+            c = term->ucsdata->unitab_oemcp[c & 0xFF];
+            break;
+        }
+
+        term->search_text[n] = c;
+        term->search_cols[n] = x;
+        n++;
+        if (c != ' ')
+            len = n;
+    }
+    return len;
+}
+
+/*
+ * The keys we index scrollback lines by are hashes of each run of
+ * three consecutive characters. Fills in term->search_keys from the
+ * first n characters of text, and returns how many keys there are.
+ */
+static inline uint32_t search_key(const unsigned *p)
+{
+    uint32_t h = p[0] * 0x9E3779B1U;
+    h = (h ^ p[1]) * 0x85EBCA77U;
+    h = (h ^ p[2]) * 0xC2B2AE3DU;
+    return h ^ (h >> 15);
+}
+
+static size_t search_keys(Terminal *term, const unsigned *text, size_t n)
+{
+    size_t nkeys = 0;
+
+    search_reserve(term, n);
+    for (size_t i = 0; i + 2 < n; i++)
+        term->search_keys[nkeys++] = search_key(text + i);
+    return nkeys;
+}
+
+/*
+ * Add a line to the bottom of the scrollback. The line itself is left
+ * alone, so the caller can go on to reuse or free it.
+ */
+static void sb_add_line(Terminal *term, termline *line)
+{
+    size_t n, nkeys;
+
+    strbuf_clear(term->sbline);
+    compressline(term->sbline, line);
+    sbstore_append(term->scrollback, ptrlen_from_strbuf(term->sbline));
+
+    n = search_text(term, line);
+    nkeys = search_keys(term, term->search_text, n);
+    sbstore_index_keys(term->scrollback, term->search_keys, nkeys);
+}
+
+/*
+ * Remove the line at the bottom of the scrollback, and return it as a
+ * freshly allocated termline.
+ */
+static termline *sb_pop_line(Terminal *term)
+{
+    termline *line;
+
+    /* The next line added will reuse this one's number */
+    sbcache_forget(term, term->sbfirst + sbstore_count(term->scrollback) - 1);
+    line = decompressline(sbstore_pop_newest(term->scrollback));
+    line->temporary = false;
+    line->gen = ++term->line_gen;
+    return line;
+}
 
 /*
  * Resize a line to make it `cols' columns wide.
@@ -1070,6 +1380,7 @@ static void resizeline(Terminal *term, termline *line, int cols)
     if (line->cols != cols) {
 
         oldcols = line->cols;
+        line->gen = ++term->line_gen;
 
         /*
          * This line is the wrong length, which probably means it
@@ -1142,7 +1453,7 @@ static void resizeline(Terminal *term, termline *line, int cols)
  */
 static int sblines(Terminal *term)
 {
-    int sblines = count234(term->scrollback);
+    int sblines = sbstore_count(term->scrollback);
     if (term->erase_to_scrollback &&
         term->alt_which && term->alt_screen) {
         sblines += term->alt_sblines;
@@ -1150,8 +1461,41 @@ static int sblines(Terminal *term)
     return sblines;
 }
 
+/*
+ * If the scrollback has grown past its memory limit, throw away its
+ * oldest lines until it fits again. The store frees memory a whole
+ * block at a time, so this usually discards a block's worth of lines
+ * at once, and we must make sure nothing is left pointing at them.
+ */
+static void sb_trim_to_limit(Terminal *term)
+{
+    int sblen, dropped = 0;
+
+    if (!term->scrollback_max_bytes)
+        return;
+
+    while (sbstore_bytes(term->scrollback) > term->scrollback_max_bytes &&
+           sbstore_count(term->scrollback) > 0) {
+        sb_drop_oldest(term);
+        dropped++;
+    }
+    if (!dropped)
+        return;
+
+    sblen = sbstore_count(term->scrollback);
+    if (term->tempsblines > sblen)
+        term->tempsblines = sblen;
+    if (term->disptop < -sblines(term))
+        term->disptop = -sblines(term);
+    if (term->selstate != NO_SELECTION &&
+        (term->selstart.y < -sblines(term) ||
+         term->selanchor.y < -sblines(term)))
+        deselect(term);
+    term->win_scrollbar_update_pending = true;
+}
+
 static void null_line_error(Terminal *term, int y, int lineno,
-                            tree234 *whichtree, int treeindex,
+                            void *whichtree, int treeindex,
                             const char *varname)
 {
     modalfatalbox("%s==NULL in terminal.c\n"
@@ -1164,9 +1508,9 @@ static void null_line_error(Terminal *term, int y, int lineno,
                   "Please contact <putty@projects.tartarus.org> "
                   "and pass on the above information.",
                   varname, lineno, y, term->cols, term->rows,
-                  term->scrollback, count234(term->scrollback),
-                  term->screen, count234(term->screen),
-                  term->alt_screen, count234(term->alt_screen),
+                  term->scrollback, sbstore_count(term->scrollback),
+                  term->screen, screenbuf_count(term->screen),
+                  term->alt_screen, screenbuf_count(term->alt_screen),
                   term->alt_sblines, whichtree, treeindex, commitid);
 }
 
@@ -1185,10 +1529,17 @@ static inline int checkscr(int y, int lineno)
 static termline *lineptr(Terminal *term, int y, int lineno)
 {
     termline *line;
-    tree234 *whichtree;
+    void *whichtree;
     int treeindex;
 
     if (y >= 0) {
+        /*
+         * The common case, for which we don't need anything more
+         * than an array lookup.
+         */
+        line = screenbuf_index(term->screen, y);
+        if (line == NULL)
+            null_line_error(term, y, lineno, term->screen, y, "line");
         whichtree = term->screen;
         treeindex = y;
     } else {
@@ -1200,20 +1551,19 @@ static termline *lineptr(Terminal *term, int y, int lineno)
         }
         if (y < -altlines) {
             whichtree = term->scrollback;
-            treeindex = y + altlines + count234(term->scrollback);
+            treeindex = y + altlines + sbstore_count(term->scrollback);
         } else {
             whichtree = term->alt_screen;
             treeindex = y + term->alt_sblines;
-            /* treeindex = y + count234(term->alt_screen); */
+            /* treeindex = y + screenbuf_count(term->alt_screen); */
         }
     }
     if (whichtree == term->scrollback) {
-        compressed_scrollback_line *cline = index234(whichtree, treeindex);
-        if (!cline)
+        line = sb_get_line(term, treeindex);
+        if (!line)
             null_line_error(term, y, lineno, whichtree, treeindex, "cline");
-        line = decompressline_no_free(cline);
-    } else {
-        line = index234(whichtree, treeindex);
+    } else if (whichtree == term->alt_screen) {
+        line = screenbuf_index(term->alt_screen, treeindex);
     }
 
     /* We assume that we don't screw up and retrieve something out of range. */
@@ -1260,9 +1610,20 @@ static termline *lineptr(Terminal *term, int y, int lineno)
  * The 'assertion' in scrlineptr is done using a helper function that
  * returns the input column number, which allows this macro to avoid
  * double-evaluating its argument.
+ *
+ * Since scrlineptr is how term_out gets hold of a line to modify it,
+ * it also gives the line a new generation number, so that anything
+ * cached about the line's old contents (see term_bidi_cache_hit)
+ * stops matching.
  */
+static inline termline *touch_line(Terminal *term, termline *line)
+{
+    line->gen = ++term->line_gen;
+    return line;
+}
 #define lineptr(x) (lineptr)(term,x,__LINE__)
-#define scrlineptr(x) (lineptr)(term,checkscr(x,__LINE__),__LINE__)
+#define scrlineptr(x) \
+    touch_line(term, (lineptr)(term,checkscr(x,__LINE__),__LINE__))
 #define unlineptr(line) term_release_line(line)
 
 /* Wrapper for external use (e.g. tests), without the __LINE__ parameter */
@@ -1320,16 +1681,43 @@ static void term_timer(void *ctx, unsigned long now)
         term_update_callback(term);
 }
 
+static void term_start_update_cooldown(Terminal *term)
+{
+    term->window_update_cooldown = true;
+    term->window_update_cooldown_end = schedule_timer(
+        term->update_delay, term_timer, term);
+}
+
 static void term_update_callback(void *ctx)
 {
     Terminal *term = (Terminal *)ctx;
     if (!term->window_update_pending)
         return;
-    if (!term->window_update_cooldown) {
+    if (term->echo_pending && term->echo_seen) {
+        /*
+         * The server has responded to a keypress. Show the result
+         * straight away, even if we're in the cooldown period, since
+         * this is the update the user is actually waiting for.
+         */
         term_update(term);
-        term->window_update_cooldown = true;
-        term->window_update_cooldown_end = schedule_timer(
-            UPDATE_DELAY, term_timer, term);
+        term_start_update_cooldown(term);
+    } else if (!term->window_update_cooldown) {
+        if (!term->update_deferred && bufchain_size(&term->inbuf) > 0 &&
+            term->selstate != DRAGGING &&
+            term->win_resize_pending == WIN_RESIZE_NO) {
+            /*
+             * There's output waiting to be processed, so the screen
+             * we'd draw now would be out of date almost at once. Wait
+             * for one cooldown period instead - but only one, so that
+             * a continuous flood of output still gets displayed.
+             */
+            term->update_deferred = true;
+            term->update_stats.frames_deferred++;
+            term_start_update_cooldown(term);
+            return;
+        }
+        term_update(term);
+        term_start_update_cooldown(term);
     }
 }
 
@@ -1508,6 +1896,7 @@ static void power_on(Terminal *term, bool clear)
 void term_update(Terminal *term)
 {
     term->window_update_pending = false;
+    term->update_deferred = false;
 
     if (term->win_move_pending) {
         win_move(term->win, term->win_move_pending_x,
@@ -1557,17 +1946,65 @@ void term_update(Terminal *term)
     }
 
     if (win_setup_draw_ctx(term->win)) {
+        unsigned long start = GETTICKCOUNT(), now, elapsed;
+        TermUpdateStats *st = &term->update_stats;
+
         if (term->win_scrollbar_update_pending) {
             term->win_scrollbar_update_pending = false;
             update_sbar(term);
         }
+        if (term->scrollhead)
+            display_scrolls(term);
         do_paint(term);
         win_set_cursor_pos(
             term->win, term->curs.x, term->curs.y - term->disptop);
         win_free_draw_ctx(term->win);
+
+        now = GETTICKCOUNT();
+        elapsed = now - start;
+        st->frames++;
+        st->last_frame_time = elapsed;
+        if (st->max_frame_time < elapsed)
+            st->max_frame_time = elapsed;
+
+        if (term->echo_pending && term->echo_seen) {
+            elapsed = now - term->key_event_time;
+            st->last_echo_latency = elapsed;
+            if (st->max_echo_latency < elapsed)
+                st->max_echo_latency = elapsed;
+            term->echo_pending = false;
+        }
     }
 }
 
+/*
+ * Set the rate at which the front end can usefully display updates,
+ * e.g. the refresh rate of the monitor the window is on. Output
+ * arriving faster than this is batched up rather than drawn. A rate
+ * of zero restores the default.
+ */
+void term_set_refresh_rate(Terminal *term, int hz)
+{
+    if (hz <= 0)
+        term->update_delay = UPDATE_DELAY;
+    else
+        term->update_delay = (TICKSPERSEC + hz - 1) / hz;
+}
+
+/*
+ * Limit the time term_out spends on one batch of output, in ticks,
+ * or remove the limit if 'ticks' is zero.
+ */
+void term_set_output_timeslice(Terminal *term, int ticks)
+{
+    term->out_timeslice = ticks < 0 ? 0 : ticks;
+}
+
+void term_get_update_stats(Terminal *term, TermUpdateStats *stats)
+{
+    *stats = term->update_stats;
+}
+
 /*
  * Called from front end when a keypress occurs, to trigger
  * anything magical that needs to happen in that situation.
@@ -1590,6 +2027,14 @@ void term_seen_key_event(Terminal *term)
     term->beeptail = NULL;
     term->nbeeps = 0;
 
+    /*
+     * Note the time, so that the next output from the server can be
+     * treated as the echo of this key and displayed promptly.
+     */
+    term->echo_pending = true;
+    term->echo_seen = false;
+    term->key_event_time = GETTICKCOUNT();
+
     /*
      * Reset the scrollback on keypress, if we're doing that.
      */
@@ -1648,6 +2093,10 @@ static void term_copy_stuff_from_conf(Terminal *term)
     term->conf_width = conf_get_int(term->conf, CONF_width);
     term->crhaslf = conf_get_bool(term->conf, CONF_crhaslf);
     term->erase_to_scrollback = conf_get_bool(term->conf, CONF_erase_to_scrollback);
+    {
+        int kb = conf_get_int(term->conf, CONF_scrollback_max_kb);
+        term->scrollback_max_bytes = kb > 0 ? (size_t)kb * 1024 : 0;
+    }
     term->funky_type = conf_get_int(term->conf, CONF_funky_type);
     term->sharrow_type = conf_get_int(term->conf, CONF_sharrow_type);
     term->lfhascr = conf_get_bool(term->conf, CONF_lfhascr);
@@ -1665,6 +2114,8 @@ static void term_copy_stuff_from_conf(Terminal *term)
     term->no_remote_wintitle = conf_get_bool(term->conf, CONF_no_remote_wintitle);
     term->no_remote_clearscroll = conf_get_bool(term->conf, CONF_no_remote_clearscroll);
     term->rawcnp = conf_get_bool(term->conf, CONF_rawcnp);
+    term->reflow_on_resize = conf_get_bool(term->conf, CONF_reflow_on_resize);
+    term->clip_attrs = conf_get_bool(term->conf, CONF_rtf_paste);
     term->utf8linedraw = conf_get_bool(term->conf, CONF_utf8linedraw);
     term->rect_select = conf_get_bool(term->conf, CONF_rect_select);
     term->remote_qtitle_action = conf_get_int(term->conf, CONF_remote_qtitle_action);
@@ -1832,6 +2283,8 @@ void term_reconfig(Terminal *term, Conf *conf)
     term_schedule_tblink(term);
     term_schedule_cblink(term);
     term_copy_stuff_from_conf(term);
+    if (term->scrollback)
+        sb_trim_to_limit(term);
     term_update_raw_mouse_mode(term);
 }
 
@@ -1840,7 +2293,6 @@ void term_reconfig(Terminal *term, Conf *conf)
  */
 void term_clrsb(Terminal *term)
 {
-    unsigned char *line;
     int i;
 
     /*
@@ -1852,9 +2304,7 @@ void term_clrsb(Terminal *term)
     /*
      * Clear the actual scrollback.
      */
-    while ((line = delpos234(term->scrollback, 0)) != NULL) {
-        sfree(line);            /* this is compressed data, not a termline */
-    }
+    sb_clear(term);
 
     /*
      * When clearing the scrollback, we also truncate any termlines on
@@ -2063,6 +2513,7 @@ Terminal *term_init(Conf *myconf, struct unicode_data *ucsdata, TermWin *win)
     term->termstate = TOPLEVEL;
     term->selstate = NO_SELECTION;
     term->answerback = strbuf_new();
+    term->update_delay = UPDATE_DELAY;
 
     term_copy_stuff_from_conf(term);
 
@@ -2102,25 +2553,32 @@ Terminal *term_init(Conf *myconf, struct unicode_data *ucsdata, TermWin *win)
 
 void term_free(Terminal *term)
 {
-    compressed_scrollback_line *cline;
     termline *line;
     struct beeptime *beep;
     int i;
 
-    while ((cline = delpos234(term->scrollback, 0)) != NULL)
-        free_compressed_line(cline);
-    freetree234(term->scrollback);
-    while ((line = delpos234(term->screen, 0)) != NULL)
+    sbcache_clear(term);
+    freetree234(term->sbcache);
+    sbstore_free(term->scrollback);
+    strbuf_free(term->sbline);
+    sfree(term->search_text);
+    sfree(term->search_cols);
+    sfree(term->search_keys);
+    sfree(term->last_selected_text);
+    sfree(term->last_selected_attr);
+    sfree(term->last_selected_tc);
+    while ((line = screenbuf_delete(term->screen, 0)) != NULL)
         freetermline(line);
-    freetree234(term->screen);
-    while ((line = delpos234(term->alt_screen, 0)) != NULL)
+    screenbuf_free(term->screen);
+    while ((line = screenbuf_delete(term->alt_screen, 0)) != NULL)
         freetermline(line);
-    freetree234(term->alt_screen);
+    screenbuf_free(term->alt_screen);
     if (term->disptext) {
         for (i = 0; i < term->rows; i++)
             freetermline(term->disptext[i]);
     }
     sfree(term->disptext);
+    discard_scrolls(term);
     while (term->beephead) {
         beep = term->beephead;
         term->beephead = beep->next;
@@ -2130,7 +2588,8 @@ void term_free(Terminal *term)
     if (term->print_job)
         printer_finish_job(term->print_job);
     bufchain_clear(&term->printer_buf);
-    sfree(term->paste_buffer);
+    if (term->paste_data)
+        strbuf_free(term->paste_data);
     sfree(term->ltemp);
     sfree(term->wcFrom);
     sfree(term->wcTo);
@@ -2178,9 +2637,195 @@ void term_get_cursor_position(Terminal *term, int *x, int *y)
 /*
  * Set up the terminal for a given size.
  */
+static bool reflow_blank(Terminal *term, termchar *c)
+{
+    return !c->cc_next && (termchars_equal(c, &term->basic_erase_char) ||
+                           termchars_equal(c, &term->erase_char));
+}
+
+static bool reflow_blank_line(Terminal *term, termline *line)
+{
+    for (int x = 0; x < line->cols; x++)
+        if (!reflow_blank(term, &line->chars[x]))
+            return false;
+    return true;
+}
+
+/*
+ * Rewrap the main screen to a new width: runs of lines joined by
+ * LATTR_WRAPPED are treated as one logical line, and split up again
+ * at the new width, keeping the cursor on the same character. Lines
+ * that no longer fit go into the scrollback, as temporary scrollback
+ * so that widening the window again can bring them back.
+ *
+ * Any temporary scrollback from an earlier resize is taken back and
+ * rewrapped along with the screen, so that a line split by narrowing
+ * the window is joined up again when it's widened. The rest of the
+ * scrollback keeps the width each line was stored at, and lines are
+ * padded or truncated for display as before. Double-width lines and
+ * lines carrying a trust sigil are left alone.
+ */
+static void reflow_screen(Terminal *term, int newcols)
+{
+    int oldcols = term->cols, ntemp = term->tempsblines;
+    int nin = ntemp + term->rows;
+    termline **in = snewn(nin, termline *), **out = NULL, *cur, *line;
+    size_t nout = 0, outsize = 0;
+    bool *kept = snewn(nin, bool);
+    int x = 0, y;
+    size_t i;
+
+    /*
+     * Positions that need to stay on the same character: the cursor,
+     * and the saved cursors for both screens. Their rows count from
+     * the top of the input lines, which start with the temporary
+     * scrollback.
+     */
+    pos *tracked[] = { &term->curs, &term->savecurs, &term->alt_savecurs };
+    int trow[lenof(tracked)], tcol[lenof(tracked)];
+    for (i = 0; i < lenof(tracked); i++) {
+        tracked[i]->y += ntemp;
+        trow[i] = -1;
+        tcol[i] = 0;
+    }
+
+    for (y = ntemp - 1; y >= 0; y--)
+        in[y] = sb_pop_line(term);
+    term->tempsblines = 0;
+    for (y = 0; y < term->rows; y++)
+        in[ntemp + y] = screenbuf_index(term->screen, y);
+
+    cur = NULL;
+    for (y = 0; y < nin; y++) {
+        int lcols, end;
+        bool wrapped;
+
+        line = in[y];
+        kept[y] = false;
+        if ((line->lattr & LATTR_MODE) != LATTR_NORM || line->trusted) {
+            /* Carry this line over as it is */
+            cur = NULL;
+            sgrowarray(out, outsize, nout);
+            out[nout++] = line;
+            kept[y] = true;
+            for (i = 0; i < lenof(tracked); i++) {
+                if (tracked[i]->y == y) {
+                    trow[i] = nout - 1;
+                    tcol[i] = tracked[i]->x;
+                }
+            }
+            continue;
+        }
+
+        lcols = line->cols < oldcols ? line->cols : oldcols;
+        wrapped = (line->lattr & LATTR_WRAPPED) && y < nin - 1;
+        end = lcols;
+        if (wrapped) {
+            /* WRAPPED2 means the last column is padding left by a
+             * wide character that didn't fit */
+            if (line->lattr & LATTR_WRAPPED2)
+                end--;
+        } else {
+            while (end > 0 && reflow_blank(term, &line->chars[end - 1]))
+                end--;
+        }
+
+        if (!cur) {
+            cur = newtermline(term, newcols, false);
+            sgrowarray(out, outsize, nout);
+            out[nout++] = cur;
+            x = 0;
+        }
+
+        for (int j = 0; j < end; j++) {
+            termchar *c = &line->chars[j];
+            bool wide = j + 1 < lcols && line->chars[j + 1].chr == UCSWIDE;
+            int w = wide ? 2 : 1;
+
+            if (c->chr == UCSWIDE)
+                continue;              /* copied with its left half */
+
+            if (x + w > newcols) {
+                cur->lattr |= LATTR_WRAPPED;
+                if (x < newcols)
+                    cur->lattr |= LATTR_WRAPPED2;
+                cur = newtermline(term, newcols, false);
+                sgrowarray(out, outsize, nout);
+                out[nout++] = cur;
+                x = 0;
+            }
+            for (i = 0; i < lenof(tracked); i++) {
+                if (tracked[i]->y == y && (j == tracked[i]->x ||
+                                           (wide && j + 1 == tracked[i]->x))) {
+                    trow[i] = nout - 1;
+                    tcol[i] = x;
+                }
+            }
+            copy_termchar(cur, x, c);
+            if (wide)
+                copy_termchar(cur, x + 1, &line->chars[j + 1]);
+            x += w;
+        }
+
+        for (i = 0; i < lenof(tracked); i++) {
+            if (tracked[i]->y == y && trow[i] < 0) {
+                /* This position is in the blank space after the text */
+                trow[i] = nout - 1;
+                tcol[i] = x + (tracked[i]->x - end);
+                if (tcol[i] >= newcols)
+                    tcol[i] = newcols - 1;
+            }
+        }
+
+        if (!wrapped)
+            cur = NULL;
+    }
+
+    for (y = 0; y < ntemp; y++)
+        if (!kept[y])
+            freetermline(in[y]);
+    while (NULL != (line = screenbuf_delete(term->screen, 0))) {
+        if (!kept[nin - 1 - screenbuf_count(term->screen)])
+            freetermline(line);
+    }
+    sfree(kept);
+    sfree(in);
+
+    /*
+     * If the text now needs more lines than the screen has, lose
+     * blank lines from below the cursor first, then push lines off
+     * the top into the scrollback. If it needs fewer, term_size will
+     * fill the gap as it would for any change in height.
+     */
+    while ((int)nout > term->rows && (int)nout - 1 > trow[0] &&
+           reflow_blank_line(term, out[nout - 1])) {
+        freetermline(out[--nout]);
+    }
+    for (y = 0; (int)nout - y > term->rows; y++) {
+        sb_add_line(term, out[y]);
+        freetermline(out[y]);
+        term->tempsblines += 1;
+    }
+    term->alt_y += ntemp - y;
+    for (i = 0; i < lenof(tracked); i++) {
+        if (trow[i] < 0) {
+            /* Off the edge of the screen, so term_size will clamp it */
+            trow[i] = tracked[i]->y < 0 ? 0 : nout;
+            tcol[i] = tracked[i]->x;
+        }
+        tracked[i]->y = trow[i] - y;
+        tracked[i]->x = tcol[i];
+    }
+    for (; y < (int)nout; y++)
+        screenbuf_insert(term->screen, out[y], screenbuf_count(term->screen));
+    sfree(out);
+
+    term->rows = screenbuf_count(term->screen);
+}
+
 void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
 {
-    tree234 *newalt;
+    screenbuf *newalt;
     termline **newdisp, *line;
     int i, j, oldrows = term->rows;
     int sblen;
@@ -2201,9 +2846,15 @@ void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
     term->alt_t = term->marg_t = 0;
     term->alt_b = term->marg_b = newrows - 1;
 
+    if (term->reflow_on_resize && term->rows > 0 && term->cols > 0 &&
+        newcols != term->cols && newcols >= 2)
+        reflow_screen(term, newcols);
+
     if (term->rows == -1) {
-        term->scrollback = newtree234(NULL);
-        term->screen = newtree234(NULL);
+        term->scrollback = sbstore_new(SCROLLBACK_COMPRESSED);
+        term->sbcache = newtree234(sbcache_cmp);
+        term->sbline = strbuf_new();
+        term->screen = screenbuf_new();
         term->tempsblines = 0;
         term->rows = 0;
     }
@@ -2227,19 +2878,17 @@ void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
      *    amount of scrollback we actually have, we must throw some
      *    away.
      */
-    sblen = count234(term->scrollback);
+    sblen = sbstore_count(term->scrollback);
     /* Do this loop to expand the screen if newrows > rows */
-    assert(term->rows == count234(term->screen));
+    assert(term->rows == screenbuf_count(term->screen));
     while (term->rows < newrows) {
         if (term->tempsblines > 0) {
-            compressed_scrollback_line *cline;
             /* Insert a line from the scrollback at the top of the screen. */
             assert(sblen >= term->tempsblines);
-            cline = delpos234(term->scrollback, --sblen);
-            line = decompressline_and_free(cline);
-            line->temporary = false;   /* reconstituted line is now real */
+            line = sb_pop_line(term);
+            sblen--;
             term->tempsblines -= 1;
-            addpos234(term->screen, line, 0);
+            screenbuf_insert(term->screen, line, 0);
             term->curs.y += 1;
             term->savecurs.y += 1;
             term->alt_y += 1;
@@ -2247,7 +2896,8 @@ void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
         } else {
             /* Add a new blank line at the bottom of the screen. */
             line = newtermline(term, newcols, false);
-            addpos234(term->screen, line, count234(term->screen));
+            screenbuf_insert(term->screen, line,
+                             screenbuf_count(term->screen));
         }
         term->rows += 1;
     }
@@ -2255,12 +2905,14 @@ void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
     while (term->rows > newrows) {
         if (term->curs.y < term->rows - 1) {
             /* delete bottom row, unless it contains the cursor */
-            line = delpos234(term->screen, term->rows - 1);
+            line = screenbuf_delete(term->screen, term->rows - 1);
             freetermline(line);
         } else {
             /* push top row to scrollback */
-            line = delpos234(term->screen, 0);
-            addpos234(term->scrollback, compressline_and_free(line), sblen++);
+            line = screenbuf_delete(term->screen, 0);
+            sb_add_line(term, line);
+            freetermline(line);
+            sblen++;
             term->tempsblines += 1;
             term->curs.y -= 1;
             term->savecurs.y -= 1;
@@ -2270,18 +2922,22 @@ void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
         term->rows -= 1;
     }
     assert(term->rows == newrows);
-    assert(count234(term->screen) == newrows);
+    assert(screenbuf_count(term->screen) == newrows);
 
     /* Delete any excess lines from the scrollback. */
     while (sblen > newsavelines) {
-        line = delpos234(term->scrollback, 0);
-        sfree(line);
+        sb_drop_oldest(term);
         sblen--;
     }
     if (sblen < term->tempsblines)
         term->tempsblines = sblen;
-    assert(count234(term->scrollback) <= newsavelines);
-    assert(count234(term->scrollback) >= term->tempsblines);
+    assert(sbstore_count(term->scrollback) <= newsavelines);
+    assert(sbstore_count(term->scrollback) >= term->tempsblines);
+    sb_trim_to_limit(term);
+
+    /* Cached scrollback lines may have been widened to the old width */
+    if (newcols != term->cols)
+        sbcache_clear(term);
     term->disptop = 0;
 
     /* Make a new displayed text buffer. */
@@ -2298,17 +2954,18 @@ void term_size(Terminal *term, int newrows, int newcols, int newsavelines)
     sfree(term->disptext);
     term->disptext = newdisp;
     term->dispcursx = term->dispcursy = -1;
+    discard_scrolls(term);
 
     /* Make a new alternate screen. */
-    newalt = newtree234(NULL);
+    newalt = screenbuf_new();
     for (i = 0; i < newrows; i++) {
         line = newtermline(term, newcols, true);
-        addpos234(newalt, line, i);
+        screenbuf_insert(newalt, line, i);
     }
     if (term->alt_screen) {
-        while (NULL != (line = delpos234(term->alt_screen, 0)))
+        while (NULL != (line = screenbuf_delete(term->alt_screen, 0)))
             freetermline(line);
-        freetree234(term->alt_screen);
+        screenbuf_free(term->alt_screen);
     }
     term->alt_screen = newalt;
     term->alt_sblines = 0;
@@ -2382,11 +3039,11 @@ void term_provide_backend(Terminal *term, Backend *backend)
  * If only the top line has content, returns 0.
  * If no lines have content, return -1.
  */
-static int find_last_nonempty_line(Terminal *term, tree234 *screen)
+static int find_last_nonempty_line(Terminal *term, screenbuf *screen)
 {
     int i;
-    for (i = count234(screen) - 1; i >= 0; i--) {
-        termline *line = index234(screen, i);
+    for (i = screenbuf_count(screen) - 1; i >= 0; i--) {
+        termline *line = screenbuf_index(screen, i);
         int j;
         for (j = 0; j < line->cols; j++)
             if (!termchars_equal(&line->chars[j], &term->erase_char))
@@ -2410,7 +3067,7 @@ static void swap_screen(Terminal *term, int which,
     bool bt;
     pos tp;
     truecolour ttc;
-    tree234 *ttr;
+    screenbuf *ttr;
 
     if (!which)
         reset = false;                 /* do no weird resetting if which==0 */
@@ -2565,6 +3222,7 @@ static void clear_line(Terminal *term, termline *line)
     for (int i = 0; i < term->cols; i++)
         copy_termchar(line, i, &term->erase_char);
     line->lattr = LATTR_NORM;
+    line->gen = ++term->line_gen;
 }
 
 static void check_trust_status(Terminal *term, termline *line)
@@ -2581,6 +3239,134 @@ static void check_trust_status(Terminal *term, termline *line)
     }
 }
 
+/*
+ * Throw away the list of scrolls not yet shown on the display.
+ */
+static void discard_scrolls(Terminal *term)
+{
+    while (term->scrollhead) {
+        struct scrollregion *sr = term->scrollhead;
+        term->scrollhead = sr->next;
+        sfree(sr);
+    }
+    term->scrolltail = NULL;
+    term->nscrolls = 0;
+}
+
+/*
+ * Remember a scroll of the screen, so that the next repaint can ask
+ * the front end to move that part of the display rather than redraw
+ * it. Consecutive scrolls of the same region are merged.
+ */
+static void save_scroll(Terminal *term, int topline, int botline, int lines)
+{
+    struct scrollregion *sr;
+
+    if (term->scrolltail &&
+        term->scrolltail->topline == topline &&
+        term->scrolltail->botline == botline) {
+        term->scrolltail->lines += lines;
+        return;
+    }
+
+    if (term->nscrolls >= MAX_PENDING_SCROLLS) {
+        /*
+         * Something is scrolling lots of different regions between
+         * repaints. Replaying them all isn't likely to save anything,
+         * so give up and let the repaint redraw whatever moved.
+         */
+        discard_scrolls(term);
+        return;
+    }
+
+    sr = snew(struct scrollregion);
+    sr->next = NULL;
+    sr->topline = topline;
+    sr->botline = botline;
+    sr->lines = lines;
+    if (term->scrolltail)
+        term->scrolltail->next = sr;
+    else
+        term->scrollhead = sr;
+    term->scrolltail = sr;
+    term->nscrolls++;
+}
+
+/*
+ * Ask the front end to move part of the display, and if it can,
+ * move our record of what's on the display to match. The lines
+ * scrolled into view are invalidated so that do_paint redraws them.
+ *
+ * This is safe whatever the display currently shows, because the
+ * display and disptext are always moved together; the worst that
+ * can happen is that do_paint ends up redrawing the lines anyway.
+ */
+static bool scroll_display(Terminal *term, int topline, int botline,
+                           int lines)
+{
+    int distance = lines > 0 ? lines : -lines;
+    int nlines = botline - topline + 1 - distance;
+    termline **moved;
+    int i, j, exposed;
+
+    if (nlines <= 0)
+        return true;       /* nothing visible survives the scroll */
+    if (!win_scroll(term->win, topline, botline, lines))
+        return false;
+
+    moved = snewn(distance, termline *);
+    if (lines > 0) {
+        memcpy(moved, term->disptext + topline,
+               distance * sizeof(termline *));
+        memmove(term->disptext + topline, term->disptext + topline + distance,
+                nlines * sizeof(termline *));
+        memcpy(term->disptext + topline + nlines, moved,
+               distance * sizeof(termline *));
+        exposed = topline + nlines;
+        if (term->dispcursy >= topline + distance &&
+            term->dispcursy <= botline)
+            term->dispcursy -= distance;
+    } else {
+        memcpy(moved, term->disptext + topline + nlines,
+               distance * sizeof(termline *));
+        memmove(term->disptext + topline + distance, term->disptext + topline,
+                nlines * sizeof(termline *));
+        memcpy(term->disptext + topline, moved,
+               distance * sizeof(termline *));
+        exposed = topline;
+        if (term->dispcursy >= topline && term->dispcursy < topline + nlines)
+            term->dispcursy += distance;
+    }
+    sfree(moved);
+
+    for (i = exposed; i < exposed + distance; i++)
+        for (j = 0; j < term->cols; j++)
+            term->disptext[i]->chars[j].attr |= ATTR_INVALID;
+
+    return true;
+}
+
+/*
+ * Pass on to the front end all the scrolls made since the last
+ * repaint. Called with a drawing context active, just before
+ * do_paint.
+ */
+static void display_scrolls(Terminal *term)
+{
+    struct scrollregion *sr;
+
+    /*
+     * If the user has scrolled back since, the display no longer
+     * shows the lines these scrolls moved, so don't bother.
+     */
+    if (term->disptop == 0) {
+        for (sr = term->scrollhead; sr; sr = sr->next)
+            if (!scroll_display(term, sr->topline, sr->botline, sr->lines))
+                break;
+    }
+    discard_scrolls(term);
+}
+
 /*
  * Scroll the screen. (`lines' is +ve for scrolling forward, -ve
  * for backward.) `sb' is true if the scrolling is permitted to
@@ -2590,22 +3376,25 @@ static void scroll(Terminal *term, int topline, int botline,
                    int lines, bool sb)
 {
     termline *line;
-    int seltop, scrollwinsize;
+    int seltop, scrollwinsize, shift, olddisptop;
 
     if (topline != 0 || term->alt_which != 0)
         sb = false;
 
     scrollwinsize = botline - topline + 1;
+    shift = (lines < -scrollwinsize ? -scrollwinsize :
+             lines > scrollwinsize ? scrollwinsize : lines);
+    olddisptop = term->disptop;
 
     if (lines < 0) {
         lines = -lines;
         if (lines > scrollwinsize)
             lines = scrollwinsize;
         while (lines-- > 0) {
-            line = delpos234(term->screen, botline);
+            line = screenbuf_delete(term->screen, botline);
             resizeline(term, line, term->cols);
             clear_line(term, line);
-            addpos234(term->screen, line, topline);
+            screenbuf_insert(term->screen, line, topline);
 
             if (term->selstart.y >= topline && term->selstart.y <= botline) {
                 term->selstart.y++;
@@ -2626,27 +3415,23 @@ static void scroll(Terminal *term, int topline, int botline,
         if (lines > scrollwinsize)
             lines = scrollwinsize;
         while (lines-- > 0) {
-            line = delpos234(term->screen, topline);
+            line = screenbuf_delete(term->screen, topline);
 #ifdef TERM_CC_DIAGS
             cc_check(line);
 #endif
             if (sb && term->savelines > 0) {
-                int sblen = count234(term->scrollback);
+                int sblen = sbstore_count(term->scrollback);
                 /*
                  * We must add this line to the scrollback. We'll
                  * remove a line from the top of the scrollback if
                  * the scrollback is full.
                  */
-                if (sblen == term->savelines) {
-                    compressed_scrollback_line *cline;
-
-                    sblen--;
-                    cline = delpos234(term->scrollback, 0);
-                    free_compressed_line(cline);
-                } else
+                if (sblen == term->savelines)
+                    sb_drop_oldest(term);
+                else
                     term->tempsblines += 1;
 
-                addpos234(term->scrollback, compressline_no_free(line), sblen);
+                sb_add_line(term, line);
 
                 /* now `line' itself can be reused as the bottom line */
 
@@ -2676,7 +3461,7 @@ static void scroll(Terminal *term, int topline, int botline,
             resizeline(term, line, term->cols);
             clear_line(term, line);
             line->trusted = false;
-            addpos234(term->screen, line, botline);
+            screenbuf_insert(term->screen, line, botline);
 
             /*
              * If the selection endpoints move into the scrollback,
@@ -2719,6 +3504,16 @@ static void scroll(Terminal *term, int topline, int botline,
         }
     }
 
+    if (sb)
+        sb_trim_to_limit(term);
+
+    /*
+     * If the user is looking at the part of the screen we've just
+     * moved, the display can probably follow it by moving pixels.
+     */
+    if (shift != 0 && olddisptop == 0 && term->disptop == 0)
+        save_scroll(term, topline, botline, shift);
+
     seen_disp_event(term);
 }
 
@@ -3430,29 +4225,284 @@ static void term_display_graphic_char(Terminal *term, unsigned long c)
       default:
         return;
     }
-    term->curs.x++;
-    if (term->curs.x >= linecols) {
-        term->curs.x = linecols - 1;
+    term->curs.x++;
+    if (term->curs.x >= linecols) {
+        term->curs.x = linecols - 1;
+
+        if (term->wrap) {
+            if (!term->vt52_mode) {
+                /* Set the wrapnext flag, so that the next character
+                 * wraps, but this one doesn't. */
+                term->wrapnext = true;
+            } else {
+                /* VT52 mode expects simpler handling, and we just
+                 * wrap straight away. */
+                cline->lattr |= LATTR_WRAPPED;
+                if (term->curs.y == term->marg_b)
+                    scroll(term, term->marg_t, term->marg_b, 1, true);
+                else if (term->curs.y < term->rows - 1)
+                    term->curs.y++;
+                term->curs.x = 0;
+                term->wrapnext = false;
+            }
+        }
+    }
+    seen_disp_event(term);
+}
+
+/*
+ * Return the length of the run of printable ASCII characters (0x20 to
+ * 0x7E inclusive) at the start of p.
+ */
+static size_t printable_ascii_run(const unsigned char *p, size_t len)
+{
+    size_t i = 0;
+
+#if defined(__SSE2__)
+    /*
+     * A signed comparison against 0x1F rejects both the C0 controls
+     * and everything with the top bit set, leaving only DEL to rule
+     * out separately.
+     */
+    const __m128i below = _mm_set1_epi8(0x1F), del = _mm_set1_epi8(0x7F);
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i ok = _mm_andnot_si128(_mm_cmpeq_epi8(v, del),
+                                      _mm_cmpgt_epi8(v, below));
+        if (_mm_movemask_epi8(ok) != 0xFFFF)
+            break;               /* the scalar loop will find which byte */
+    }
+#endif
+
+    for (; i < len; i++)
+        if (p[i] < 0x20 || p[i] >= 0x7F)
+            break;
+    return i;
+}
+
+/*
+ * Decide whether term_out can hand printable ASCII straight to
+ * term_display_ascii_run, because every such byte would come out of
+ * term_translate as itself in CSET_ASCII and then be displayed by
+ * term_display_graphic_char as a plain single-width character.
+ */
+static inline bool term_ascii_fast_path_ok(Terminal *term)
+{
+    if (term->termstate != TOPLEVEL || term->printing || term->insert ||
+        term->vt52_mode)
+        return false;
+    if (in_utf(term))
+        return term->utf8.state == 0 &&
+            !(term->utf8linedraw &&
+              term->cset_attr[term->cset] == CSET_LINEDRW);
+    return !term->sco_acs && term->cset_attr[term->cset] == CSET_ASCII;
+}
+
+/*
+ * Display a run of printable ASCII, with the same effect as passing
+ * each character through term_translate and term_display_graphic_char
+ * in turn, but doing the trust and boundary checks once per line
+ * rather than once per character. Returns the number of characters
+ * consumed, which may be fewer than len if the line code page maps
+ * some of them to something else; the caller deals with the rest the
+ * slow way.
+ */
+static size_t term_display_ascii_run(
+    Terminal *term, const unsigned char *p, size_t len)
+{
+    const unsigned char *unitab_ctrl = term->ucsdata->unitab_ctrl;
+    size_t done = 0;
+
+    while (done < len) {
+        termline *cline;
+        int linecols, x, n, i;
+
+        if (term->wrapnext && term->wrap) {
+            cline = scrlineptr(term->curs.y);
+            cline->lattr |= LATTR_WRAPPED;
+            if (term->curs.y == term->marg_b)
+                scroll(term, term->marg_t, term->marg_b, 1, true);
+            else if (term->curs.y < term->rows - 1)
+                term->curs.y++;
+            term->curs.x = 0;
+            term->wrapnext = false;
+        }
+
+        cline = scrlineptr(term->curs.y);
+        check_trust_status(term, cline);
+        linecols = term->cols;
+        if (cline->trusted)
+            linecols -= TRUST_SIGIL_WIDTH;
+
+        /* Leave the odd case of the cursor beyond linecols to the
+         * slow path */
+        x = term->curs.x;
+        n = linecols - x;
+        if (n <= 0)
+            break;
+        if ((size_t)n > len - done)
+            n = len - done;
+        for (i = 0; i < n; i++)
+            if (unitab_ctrl[p[done + i]] != 0xFF)
+                break;
+        n = i;
+        if (n == 0)
+            break;
+
+        if (term->selstate != NO_SELECTION) {
+            pos from = term->curs, to = term->curs;
+            to.x += n;
+            check_selection(term, from, to);
+        }
+
+        check_boundary(term, x, term->curs.y);
+        check_boundary(term, x + n, term->curs.y);
+        for (i = 0; i < n; i++) {
+            /* FULL-TERMCHAR */
+            clear_cc(cline, x + i);
+            cline->chars[x + i].chr = p[done + i] | CSET_ASCII;
+            cline->chars[x + i].attr = term->curr_attr;
+            cline->chars[x + i].truecolour = term->curr_truecolour;
+        }
+        if (term->logctx)
+            logtraffic_data(term->logctx, p + done, n, LGTYP_ASCII);
+
+        done += n;
+        term->curs.x += n;
+        if (term->curs.x >= linecols) {
+            term->curs.x = linecols - 1;
+            if (term->wrap)
+                term->wrapnext = true;
+        }
+    }
+
+    if (done) {
+        term->last_graphic_char = p[done - 1] | CSET_ASCII;
+        if (term->selstate != NO_SELECTION) {
+            pos cursplus = term->curs;
+            incpos(cursplus);
+            check_selection(term, term->curs, cursplus);
+        }
+        seen_disp_event(term);
+    }
+    return done;
+}
+
+/*
+ * Decode a run of UTF-8 sequences of two to four bytes into 'out',
+ * stopping at the first ASCII byte, at anything malformed, at a
+ * sequence cut off by the end of the input, and at any character that
+ * term_translate would treat as other than a plain graphic character.
+ * Returns the number of characters decoded, and sets *used to the
+ * number of bytes they occupied.
+ *
+ * Whatever this stops at is left to term_translate, whose decoding
+ * state carries over from one chunk of the input bufchain to the
+ * next, so a sequence split between chunks is still handled
+ * correctly, just not quickly.
+ */
+static size_t utf8_decode_run(const unsigned char *p, size_t len,
+                              unsigned *out, size_t outlen, size_t *used)
+{
+    size_t i = 0, n = 0;
+
+    while (n < outlen && i < len) {
+#if defined(__SSE2__)
+        /*
+         * CJK text is almost entirely three-byte sequences, so check
+         * for four of those in a row at once: lead bytes 1110xxxx at
+         * offsets 0, 3, 6 and 9, continuation bytes everywhere else.
+         */
+        if (len - i >= 16 && outlen - n >= 4) {
+            __m128i v = _mm_loadu_si128((const __m128i *)(p + i));
+            unsigned leads = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_and_si128(v, _mm_set1_epi8((char)0xF0)),
+                _mm_set1_epi8((char)0xE0)));
+            unsigned conts = _mm_movemask_epi8(_mm_cmpeq_epi8(
+                _mm_and_si128(v, _mm_set1_epi8((char)0xC0)),
+                _mm_set1_epi8((char)0x80)));
+            if ((leads & 0x249) == 0x249 && (conts & 0xDB6) == 0xDB6) {
+                unsigned wc[4];
+                int k;
+                for (k = 0; k < 4; k++) {
+                    const unsigned char *q = p + i + 3*k;
+                    wc[k] = ((q[0] & 0x0F) << 12 | (q[1] & 0x3F) << 6 |
+                             (q[2] & 0x3F));
+                    if (wc[k] < 0x800 || (wc[k] >= 0xD800 && wc[k] < 0xE000) ||
+                        wc[k] == 0x2028 || wc[k] == 0x2029 ||
+                        wc[k] == 0xFEFF || wc[k] >= 0xFFFE)
+                        break;
+                }
+                if (k == 4) {
+                    memcpy(out + n, wc, sizeof(wc));
+                    n += 4;
+                    i += 12;
+                    continue;
+                }
+            }
+        }
+#endif
+
+        unsigned c = p[i], wc;
+        size_t k, j;
+        if (c < 0xC2)
+            break;          /* ASCII, continuation or overlong lead byte */
+        else if (c < 0xE0)
+            k = 2, wc = c & 0x1F;
+        else if (c < 0xF0)
+            k = 3, wc = c & 0x0F;
+        else if (c < 0xF5)
+            k = 4, wc = c & 0x07;
+        else
+            break;
+        if (len - i < k)
+            break;
+        for (j = 1; j < k; j++) {
+            if ((p[i+j] & 0xC0) != 0x80)
+                break;
+            wc = (wc << 6) | (p[i+j] & 0x3F);
+        }
+        if (j < k)
+            break;
+
+        if ((k == 3 && wc < 0x800) || (k == 4 && wc < 0x10000) ||
+            wc > 0x10FFFF || (wc >= 0xD800 && wc < 0xE000))
+            break;                     /* invalid: term_translate says so */
+        if (wc < 0xA0 || wc == 0x2028 || wc == 0x2029 ||
+            wc == 0xFEFF || wc == 0xFFFE || wc == 0xFFFF)
+            break;                     /* translated to something else */
+
+        out[n++] = wc;
+        i += k;
+    }
 
-        if (term->wrap) {
-            if (!term->vt52_mode) {
-                /* Set the wrapnext flag, so that the next character
-                 * wraps, but this one doesn't. */
-                term->wrapnext = true;
-            } else {
-                /* VT52 mode expects simpler handling, and we just
-                 * wrap straight away. */
-                cline->lattr |= LATTR_WRAPPED;
-                if (term->curs.y == term->marg_b)
-                    scroll(term, term->marg_t, term->marg_b, 1, true);
-                else if (term->curs.y < term->rows - 1)
-                    term->curs.y++;
-                term->curs.x = 0;
-                term->wrapnext = false;
-            }
+    *used = i;
+    return n;
+}
+
+/*
+ * Display a run of non-ASCII UTF-8 text, with the same effect as
+ * passing it a byte at a time through the state machine in term_out.
+ * Returns the number of bytes consumed, which is zero if the input
+ * doesn't start with anything utf8_decode_run will deal with.
+ */
+static size_t term_display_utf8_run(
+    Terminal *term, const unsigned char *p, size_t len)
+{
+    unsigned wcs[256];
+    size_t used, n, i;
+
+    n = utf8_decode_run(p, len, wcs, lenof(wcs), &used);
+    for (i = 0; i < n; i++) {
+        term_display_graphic_char(term, wcs[i]);
+        term->last_graphic_char = wcs[i];
+        if (term->selstate != NO_SELECTION) {
+            pos cursplus = term->curs;
+            incpos(cursplus);
+            check_selection(term, term->curs, cursplus);
         }
     }
-    seen_disp_event(term);
+    return used;
 }
 
 static strbuf *term_input_data_from_unicode(
@@ -3695,6 +4745,18 @@ unsigned long term_translate(
     return c;
 }
 
+/*
+ * Optionally log the session traffic to a file. Useful for debugging
+ * and possibly also useful for actual logging. term_out calls this
+ * for each chunk of inbuf as it finishes with it.
+ */
+static inline void term_log_raw(Terminal *term, const unsigned char *chars,
+                                size_t len)
+{
+    if (term->logtype == LGTYP_DEBUG && term->logctx && len)
+        logtraffic_data(term->logctx, chars, len, LGTYP_DEBUG);
+}
+
 /*
  * Remove everything currently in `inbuf' and stick it up on the
  * in-memory display. There's a big state machine in here to
@@ -3706,6 +4768,7 @@ static void term_out(Terminal *term, bool called_from_term_data)
     int unget;
     const unsigned char *chars;
     size_t nchars_got = 0, nchars_used = 0;
+    unsigned long start = GETTICKCOUNT();
 
     /*
      * During drag-selects, we do not process terminal input, because
@@ -3757,26 +4820,58 @@ static void term_out(Terminal *term, bool called_from_term_data)
 
             if (nchars_got == nchars_used) {
                 /* Delete the previous chunk from the bufchain */
+                term_log_raw(term, chars, nchars_used);
                 bufchain_consume(&term->inbuf, nchars_used);
                 nchars_used = 0;
 
                 if (bufchain_size(&term->inbuf) == 0)
                     break;             /* no more data */
 
+                /*
+                 * If we've used up our timeslice, leave the rest for
+                 * a callback, and give the front end a chance to
+                 * redraw and to deal with user input in the meantime.
+                 * Any data arriving before then is simply added to
+                 * the end of inbuf.
+                 */
+                if (term->out_timeslice &&
+                    GETTICKCOUNT() - start >= term->out_timeslice) {
+                    if (!term->out_cb_queued) {
+                        term->out_cb_queued = true;
+                        queue_toplevel_callback(term_out_cb, term);
+                    }
+                    break;
+                }
+
                 ptrlen data = bufchain_prefix(&term->inbuf);
                 chars = data.ptr;
                 nchars_got = data.len;
+                if (term->out_timeslice && nchars_got > TIMESLICE_GRANULE)
+                    nchars_got = TIMESLICE_GRANULE; /* check time often */
                 assert(chars != NULL);
                 assert(nchars_used < nchars_got);
             }
-            c = chars[nchars_used++];
 
             /*
-             * Optionally log the session traffic to a file. Useful for
-             * debugging and possibly also useful for actual logging.
+             * Runs of plain printable text, which is most of what
+             * any terminal sees, can skip the state machine. So can
+             * runs of well-formed UTF-8 in a UTF-8 session.
              */
-            if (term->logtype == LGTYP_DEBUG && term->logctx)
-                logtraffic(term->logctx, (unsigned char) c, LGTYP_DEBUG);
+            if (term_ascii_fast_path_ok(term)) {
+                const unsigned char *p = chars + nchars_used;
+                size_t avail = nchars_got - nchars_used;
+                size_t run = printable_ascii_run(p, avail);
+                if (run)
+                    run = term_display_ascii_run(term, p, run);
+                else if (in_utf(term))
+                    run = term_display_utf8_run(term, p, avail);
+                if (run) {
+                    nchars_used += run;
+                    continue;
+                }
+            }
+
+            c = chars[nchars_used++];
         }
 
         /* Note only VT220+ are 8-bit VT102 is seven bit, it shouldn't even
@@ -5727,6 +6822,7 @@ static void term_out(Terminal *term, bool called_from_term_data)
         }
     }
 
+    term_log_raw(term, chars, nchars_used);
     bufchain_consume(&term->inbuf, nchars_used);
 
     if (!called_from_term_data)
@@ -5737,10 +6833,16 @@ static void term_out(Terminal *term, bool called_from_term_data)
         logflush(term->logctx);
 }
 
-/* Wrapper on term_out with the right prototype to be a toplevel callback */
+/*
+ * Wrapper on term_out with the right prototype to be a toplevel
+ * callback. It goes through term_added_data, so that anything
+ * echoed back into term_data while it runs waits its turn in inbuf.
+ */
 void term_out_cb(void *ctx)
 {
-    term_out((Terminal *)ctx, false);
+    Terminal *term = (Terminal *)ctx;
+    term->out_cb_queued = false;
+    term_added_data(term, false);
 }
 
 /*
@@ -5758,39 +6860,36 @@ static void parse_optionalrgb(optionalrgb *out, unsigned *values)
 
 /*
  * To prevent having to run the reasonably tricky bidi algorithm
- * too many times, we maintain a cache of the last lineful of data
- * fed to the algorithm on each line of the display.
+ * too many times, we maintain a cache of the result for each line of
+ * the display. A termline's generation number changes whenever its
+ * contents might have, so if the line on display is the same one,
+ * with the same generation, as last time, the cached result is still
+ * good.
  */
 static bool term_bidi_cache_hit(Terminal *term, int line,
-                                termchar *lbefore, int width, bool trusted)
+                                termline *ldata, int width)
 {
-    int i;
-
     if (!term->pre_bidi_cache)
         return false;                  /* cache doesn't even exist yet! */
 
     if (line >= term->bidi_cache_size)
         return false;                  /* cache doesn't have this many lines */
 
-    if (!term->pre_bidi_cache[line].chars)
-        return false;                  /* cache doesn't contain _this_ line */
-
     if (term->pre_bidi_cache[line].width != width)
-        return false;                  /* line is wrong width */
+        return false;                  /* line is wrong width, or absent */
 
-    if (term->pre_bidi_cache[line].trusted != trusted)
+    if (term->pre_bidi_cache[line].trusted != ldata->trusted)
         return false;                  /* line has wrong trust state */
 
-    for (i = 0; i < width; i++)
-        if (!termchars_equal(term->pre_bidi_cache[line].chars+i, lbefore+i))
-            return false;              /* line doesn't match cache */
+    if (term->pre_bidi_cache[line].gen != ldata->gen)
+        return false;                  /* line has changed */
 
-    return true;                       /* it didn't match. */
+    return true;
 }
 
-static void term_bidi_cache_store(Terminal *term, int line, termchar *lbefore,
+static void term_bidi_cache_store(Terminal *term, int line, termline *ldata,
                                   termchar *lafter, bidi_char *wcTo,
-                                  int width, int size, bool trusted)
+                                  int width)
 {
     size_t i, j;
 
@@ -5807,6 +6906,9 @@ static void term_bidi_cache_store(Terminal *term, int line, termchar *lbefore,
                 term->post_bidi_cache[j].width = -1;
             term->pre_bidi_cache[j].trusted = false;
             term->post_bidi_cache[j].trusted = false;
+            term->pre_bidi_cache[j].gen = term->post_bidi_cache[j].gen = 0;
+            term->pre_bidi_cache[j].identity =
+                term->post_bidi_cache[j].identity = false;
             term->pre_bidi_cache[j].forward =
                 term->post_bidi_cache[j].forward = NULL;
             term->pre_bidi_cache[j].backward =
@@ -5815,22 +6917,30 @@ static void term_bidi_cache_store(Terminal *term, int line, termchar *lbefore,
         }
     }
 
-    sfree(term->pre_bidi_cache[line].chars);
     sfree(term->post_bidi_cache[line].chars);
     sfree(term->post_bidi_cache[line].forward);
     sfree(term->post_bidi_cache[line].backward);
+    term->post_bidi_cache[line].chars = NULL;
+    term->post_bidi_cache[line].forward = NULL;
+    term->post_bidi_cache[line].backward = NULL;
 
     term->pre_bidi_cache[line].width = width;
-    term->pre_bidi_cache[line].trusted = trusted;
-    term->pre_bidi_cache[line].chars = snewn(size, termchar);
+    term->pre_bidi_cache[line].trusted = ldata->trusted;
+    term->pre_bidi_cache[line].gen = ldata->gen;
+    term->pre_bidi_cache[line].identity = (lafter == NULL);
     term->post_bidi_cache[line].width = width;
-    term->post_bidi_cache[line].trusted = trusted;
-    term->post_bidi_cache[line].chars = snewn(size, termchar);
+    term->post_bidi_cache[line].trusted = ldata->trusted;
+    term->post_bidi_cache[line].identity = (lafter == NULL);
+
+    /* A line that came out unchanged needs nothing more stored */
+    if (!lafter)
+        return;
+
+    term->post_bidi_cache[line].chars = snewn(ldata->size, termchar);
     term->post_bidi_cache[line].forward = snewn(width, int);
     term->post_bidi_cache[line].backward = snewn(width, int);
 
-    memcpy(term->pre_bidi_cache[line].chars, lbefore, size * TSIZE);
-    memcpy(term->post_bidi_cache[line].chars, lafter, size * TSIZE);
+    memcpy(term->post_bidi_cache[line].chars, lafter, ldata->size * TSIZE);
     memset(term->post_bidi_cache[line].forward, 0, width * sizeof(int));
     memset(term->post_bidi_cache[line].backward, 0, width * sizeof(int));
 
@@ -5866,8 +6976,8 @@ static termchar *term_bidi_line(Terminal *term, struct termline *ldata,
     if (!term->no_bidi || !term->no_arabicshaping ||
         (ldata->trusted && term->cols > TRUST_SIGIL_WIDTH)) {
 
-        if (!term_bidi_cache_hit(term, scr_y, ldata->chars, term->cols,
-                                 ldata->trusted)) {
+        if (!term_bidi_cache_hit(term, scr_y, ldata, term->cols)) {
+            bool active = ldata->trusted && term->cols > TRUST_SIGIL_WIDTH;
 
             if (term->wcFromTo_size < term->cols) {
                 term->wcFromTo_size = term->cols;
@@ -5906,6 +7016,21 @@ static termchar *term_bidi_line(Terminal *term, struct termline *ldata,
                     (unsigned int)uc;
                 term->wcFrom[it].index = it;
                 term->wcFrom[it].nchars = 1;
+                if (!active && uc >= 0x590 && is_rtl(uc))
+                    active = true;
+            }
+
+            /*
+             * Neither the bidi algorithm nor Arabic shaping does
+             * anything to a line with no right-to-left characters on
+             * it (the only characters do_shape changes are Arabic
+             * letters), so such a line, unless it has a trust sigil
+             * to make room for, is displayed as it stands.
+             */
+            if (!active) {
+                term_bidi_cache_store(term, scr_y, ldata, NULL, NULL,
+                                      term->cols);
+                return NULL;
             }
 
             if (ldata->trusted && term->cols > TRUST_SIGIL_WIDTH) {
@@ -5972,11 +7097,12 @@ static termchar *term_bidi_line(Terminal *term, struct termline *ldata,
                 }
             }
             assert(opos == term->cols);
-            term_bidi_cache_store(term, scr_y, ldata->chars,
-                                  term->ltemp, term->wcTo,
-                                  term->cols, ldata->size, ldata->trusted);
+            term_bidi_cache_store(term, scr_y, ldata,
+                                  term->ltemp, term->wcTo, term->cols);
 
             lchars = term->ltemp;
+        } else if (term->post_bidi_cache[scr_y].identity) {
+            lchars = NULL;
         } else {
             lchars = term->post_bidi_cache[scr_y].chars;
         }
@@ -6496,6 +7622,7 @@ void term_invalidate(Terminal *term)
     for (i = 0; i < term->rows; i++)
         for (j = 0; j < term->cols; j++)
             term->disptext[i]->chars[j].attr |= ATTR_INVALID;
+    discard_scrolls(term);
 
     term_schedule_update(term);
 }
@@ -6573,6 +7700,116 @@ void term_scroll_to_selection(Terminal *term, int which_end)
     term_scroll(term, -1, y);
 }
 
+/*
+ * Search the scrollback and screen for 'pattern', going back towards
+ * older lines if dir < 0 or forward if dir > 0, starting next to the
+ * current selection if there is one, or otherwise from the end. If a
+ * match is found, select it, scroll to it if it's out of view, and
+ * return true.
+ *
+ * Scrollback lines are only decompressed and looked at if the store's
+ * index says they might match. Matches don't span line breaks.
+ */
+bool term_search(Terminal *term, const wchar_t *pattern, int dir)
+{
+    size_t wlen = wcslen(pattern), plen = 0, nkeys;
+    unsigned *pat;
+    uint32_t *keys;
+    int altlines = sblines(term) - sbstore_count(term->scrollback);
+    int top = -sblines(term), y, x;
+    bool found = false;
+
+    pat = snewn(wlen + 1, unsigned);
+    for (size_t i = 0; i < wlen; i++) {
+        if (i + 1 < wlen && IS_SURROGATE_PAIR(pattern[i], pattern[i+1])) {
+            pat[plen++] = FROM_SURROGATES(pattern[i], pattern[i+1]);
+            i++;
+        } else {
+            pat[plen++] = pattern[i];
+        }
+    }
+    if (plen == 0) {
+        sfree(pat);
+        return false;
+    }
+    nkeys = search_keys(term, pat, plen);
+    keys = snewn(nkeys + 1, uint32_t);
+    memcpy(keys, term->search_keys, nkeys * sizeof(uint32_t));
+
+    /* A match must start after x if dir > 0, or before it if dir < 0 */
+    if (term->selstate == SELECTED) {
+        y = term->selstart.y;
+        x = term->selstart.x;
+    } else if (dir > 0) {
+        y = top;
+        x = -1;
+    } else {
+        y = term->rows - 1;
+        x = INT_MAX;
+    }
+
+    while (y >= top && y < term->rows) {
+        termline *ldata;
+        size_t n, i;
+
+        if (y < -altlines && nkeys > 0) {
+            int nsb = sbstore_count(term->scrollback);
+            int idx = sbstore_find_candidate(
+                term->scrollback, y + altlines + nsb, dir, keys, nkeys);
+            if (idx < 0) {
+                /* Nothing more in the scrollback can match */
+                if (dir < 0)
+                    break;
+                idx = nsb;
+            }
+            if (idx - altlines - nsb != y) {
+                y = idx - altlines - nsb;
+                x = dir > 0 ? -1 : INT_MAX;
+                continue;
+            }
+        }
+
+        ldata = lineptr(y);
+        n = search_text(term, ldata);
+        for (size_t k = 0; k + plen <= n && !found; k++) {
+            i = dir > 0 ? k : n - plen - k;
+            if (dir > 0 ? term->search_cols[i] <= x :
+                term->search_cols[i] >= x)
+                continue;
+            found = !memcmp(term->search_text + i, pat,
+                            plen * sizeof(unsigned));
+        }
+
+        if (found) {
+            int end = term->search_cols[i + plen - 1] + 1;
+            if (end < ldata->cols && ldata->chars[end].chr == UCSWIDE)
+                end++;
+            term->selstate = SELECTED;
+            term->seltype = LEXICOGRAPHIC;
+            term->selstart.y = term->selend.y = y;
+            term->selstart.x = term->search_cols[i];
+            term->selend.x = end;
+            term->selanchor = term->selstart;
+        }
+        unlineptr(ldata);
+        if (found)
+            break;
+
+        y += dir;
+        x = dir > 0 ? -1 : INT_MAX;
+    }
+
+    sfree(pat);
+    sfree(keys);
+
+    if (found) {
+        if (y < term->disptop || y >= term->disptop + term->rows)
+            term_scroll_to_selection(term, 0);
+        term_schedule_update(term);
+    }
+    return found;
+}
+
 /*
  * Helper routine for clipme(): growing buffer.
  */
@@ -6592,36 +7829,86 @@ static void clip_addchar(clip_workbuf *b, wchar_t chr, int attr, truecolour tc)
     if (b->bufpos >= b->bufsize) {
         sgrowarray(b->textbuf, b->bufsize, b->bufpos);
         b->textptr = b->textbuf + b->bufpos;
-        b->attrbuf = sresize(b->attrbuf, b->bufsize, int);
-        b->attrptr = b->attrbuf + b->bufpos;
-        b->tcbuf = sresize(b->tcbuf, b->bufsize, truecolour);
-        b->tcptr = b->tcbuf + b->bufpos;
+        if (b->attrbuf) {
+            b->attrbuf = sresize(b->attrbuf, b->bufsize, int);
+            b->attrptr = b->attrbuf + b->bufpos;
+            b->tcbuf = sresize(b->tcbuf, b->bufsize, truecolour);
+            b->tcptr = b->tcbuf + b->bufpos;
+        }
     }
     *b->textptr++ = chr;
-    *b->attrptr++ = attr;
-    *b->tcptr++ = tc;
+    if (b->attrbuf) {
+        *b->attrptr++ = attr;
+        *b->tcptr++ = tc;
+    }
     b->bufpos++;
 }
 
-static void clipme(Terminal *term, pos top, pos bottom, bool rect, bool desel,
-                   const int *clipboards, int n_clipboards)
+/*
+ * Where clip_walk sends the text it extracts: either into a
+ * clip_workbuf for the clipboard, or, if 'bs' is set, straight out to
+ * a BinarySink as UTF-8.
+ */
+typedef struct {
+    clip_workbuf *buf;
+    BinarySink *bs;
+    wchar_t hs;                        /* pending high surrogate for bs */
+} clip_out;
+
+static void clip_emit(clip_out *out, wchar_t chr, int attr, truecolour tc)
+{
+    if (out->buf) {
+        clip_addchar(out->buf, chr, attr, tc);
+    } else if (IS_HIGH_SURROGATE(chr)) {
+        out->hs = chr;
+    } else if (out->hs) {
+        put_utf8_char(out->bs, IS_LOW_SURROGATE(chr) ?
+                      FROM_SURROGATES(out->hs, chr) : 0xFFFD);
+        out->hs = 0;
+    } else {
+        put_utf8_char(out->bs, chr);
+    }
+}
+
+/*
+ * Fetch a line for clip_walk. Lines of the scrollback proper are
+ * decoded straight from the store, bypassing the cache of
+ * decompressed lines: a walk over the whole scrollback would only
+ * flush everything else out of it, and reading the store in order
+ * decompresses each block just once anyway.
+ */
+static termline *clip_getline(Terminal *term, int y)
+{
+    int nsb = sbstore_count(term->scrollback);
+    int altlines = sblines(term) - nsb;
+    termline *line;
+
+    if (y >= -altlines)
+        return lineptr(y);
+
+    line = decompressline(sbstore_get(term->scrollback, y + altlines + nsb));
+    line->temporary = true;
+    if (term->cols > line->cols)
+        resizeline(term, line, term->cols);
+    return line;
+}
+
+/*
+ * Extract the text between two positions, as it should be copied to
+ * the clipboard, and send it to 'out' one character at a time.
+ */
+static void clip_walk(Terminal *term, pos top, pos bottom, bool rect,
+                      clip_out *out)
 {
-    clip_workbuf buf;
     int old_top_x;
     int attr;
     truecolour tc;
 
-    buf.bufsize = 5120;
-    buf.bufpos = 0;
-    buf.textptr = buf.textbuf = snewn(buf.bufsize, wchar_t);
-    buf.attrptr = buf.attrbuf = snewn(buf.bufsize, int);
-    buf.tcptr = buf.tcbuf = snewn(buf.bufsize, truecolour);
-
     old_top_x = top.x;                 /* needed for rect==1 */
 
     while (poslt(top, bottom)) {
         bool nl = false;
-        termline *ldata = lineptr(top.y);
+        termline *ldata = clip_getline(term, top.y);
         pos nlpos;
 
         /*
@@ -6746,7 +8033,7 @@ static void clipme(Terminal *term, pos top, pos bottom, bool rect, bool desel,
                 }
 
                 for (p = cbuf; *p; p++)
-                    clip_addchar(&buf, *p, attr, tc);
+                    clip_emit(out, *p, attr, tc);
 
                 if (ldata->chars[x].cc_next)
                     x += ldata->chars[x].cc_next;
@@ -6758,13 +8045,37 @@ static void clipme(Terminal *term, pos top, pos bottom, bool rect, bool desel,
         if (nl) {
             int i;
             for (i = 0; i < sel_nl_sz; i++)
-                clip_addchar(&buf, sel_nl[i], 0, term->basic_erase_char.truecolour);
+                clip_emit(out, sel_nl[i], 0, term->basic_erase_char.truecolour);
         }
         top.y++;
         top.x = rect ? old_top_x : 0;
 
         unlineptr(ldata);
     }
+}
+
+static void clipme(Terminal *term, pos top, pos bottom, bool rect, bool desel,
+                   const int *clipboards, int n_clipboards)
+{
+    clip_workbuf buf;
+    clip_out out;
+
+    buf.bufsize = 5120;
+    buf.bufpos = 0;
+    buf.textptr = buf.textbuf = snewn(buf.bufsize, wchar_t);
+    /* Only rich-text clipboard formats want the attributes */
+    if (term->clip_attrs) {
+        buf.attrptr = buf.attrbuf = snewn(buf.bufsize, int);
+        buf.tcptr = buf.tcbuf = snewn(buf.bufsize, truecolour);
+    } else {
+        buf.attrptr = buf.attrbuf = NULL;
+        buf.tcptr = buf.tcbuf = NULL;
+    }
+
+    out.buf = &buf;
+    out.bs = NULL;
+    out.hs = 0;
+    clip_walk(term, top, bottom, rect, &out);
 #if SELECTION_NUL_TERMINATED
     clip_addchar(&buf, 0, 0, term->basic_erase_char.truecolour);
 #endif
@@ -6801,7 +8112,7 @@ void term_copyall(Terminal *term, const int *clipboards, int n_clipboards)
 {
     pos top;
     pos bottom;
-    tree234 *screen = term->screen;
+    screenbuf *screen = term->screen;
     top.y = -sblines(term);
     top.x = 0;
     bottom.y = find_last_nonempty_line(term, screen);
@@ -6809,6 +8120,33 @@ void term_copyall(Terminal *term, const int *clipboards, int n_clipboards)
     clipme(term, top, bottom, false, true, clipboards, n_clipboards);
 }
 
+/*
+ * Write the text of the current selection, or if 'all' is set, of
+ * everything term_copyall would copy, to a BinarySink in UTF-8. This
+ * never holds more than a line of the terminal in memory at once, so
+ * it suits front ends that can supply clipboard data on demand or
+ * save it to a file.
+ */
+void term_export_text(Terminal *term, BinarySink *bs, bool all)
+{
+    clip_out out;
+
+    out.buf = NULL;
+    out.bs = bs;
+    out.hs = 0;
+    if (all) {
+        pos top, bottom;
+        top.y = -sblines(term);
+        top.x = 0;
+        bottom.y = find_last_nonempty_line(term, term->screen);
+        bottom.x = term->cols;
+        clip_walk(term, top, bottom, false, &out);
+    } else if (term->selstate == SELECTED) {
+        clip_walk(term, term->selstart, term->selend,
+                  term->seltype == RECTANGULAR, &out);
+    }
+}
+
 static void paste_from_clip_local(void *vterm)
 {
     Terminal *term = (Terminal *)vterm;
@@ -7055,137 +8393,255 @@ static void sel_spread(Terminal *term)
     }
 }
 
-static void term_paste_callback(void *vterm)
-{
-    Terminal *term = (Terminal *)vterm;
+static void term_paste_callback(void *vterm);
 
-    if (term->paste_len == 0)
-        return;
+static void term_paste_timer(void *ctx, unsigned long now)
+{
+    Terminal *term = (Terminal *)ctx;
 
-    while (term->paste_pos < term->paste_len) {
-        size_t n = 0;
-        while (n + term->paste_pos < term->paste_len) {
-            if (term->paste_buffer[term->paste_pos + n++] == '\015')
-                break;
-        }
-        if (term->ldisc) {
-            strbuf *buf = term_input_data_from_unicode(
-                term, term->paste_buffer + term->paste_pos, n);
-            term_keyinput_internal(term, buf->s, buf->len, false);
-            strbuf_free(buf);
-        }
-        term->paste_pos += n;
+    if (term->paste_throttled && now == term->paste_retry_time)
+        term_paste_callback(term);
+}
 
-        if (term->paste_pos < term->paste_len) {
-            queue_toplevel_callback(term_paste_callback, term);
-            return;
-        }
-    }
+static void term_paste_free(Terminal *term)
+{
     term_bracketed_paste_stop(term);
-    sfree(term->paste_buffer);
-    term->paste_buffer = NULL;
-    term->paste_len = 0;
+    strbuf_free(term->paste_data);
+    term->paste_data = NULL;
+    term->paste_pos = 0;
+    term->paste_throttled = false;
 }
 
 /*
- * Specialist string compare function. Returns true if the buffer of
- * alen wide characters starting at a has as a prefix the buffer of
- * blen characters starting at b.
+ * Send one chunk of the pending paste, converting it from UTF-8 to
+ * the terminal's input encoding on the way. The caller makes sure
+ * the chunk doesn't end partway through a character.
  */
-static bool wstartswith(const wchar_t *a, size_t alen,
-                        const wchar_t *b, size_t blen)
+static void term_paste_send(Terminal *term, const char *data, size_t len)
 {
-    return alen >= blen && !wcsncmp(a, b, blen);
+    wchar_t wbuf[PASTE_CHUNK];
+    size_t wlen = 0;
+    BinarySource src[1];
+
+    if (!term->ldisc)
+        return;
+
+    /* Each character decoded consumes at least as many bytes as it
+     * produces wide characters, so the chunk always fits */
+    assert(len <= PASTE_CHUNK);
+    BinarySource_BARE_INIT(src, data, len);
+    while (get_avail(src))
+        wlen += decode_utf8_to_wchar(src, wbuf + wlen, NULL);
+
+    strbuf *buf = term_input_data_from_unicode(term, wbuf, wlen);
+    term_keyinput_internal(term, buf->s, buf->len, false);
+    strbuf_free(buf);
 }
 
-void term_do_paste(Terminal *term, const wchar_t *data, size_t len)
+static void term_paste_callback(void *vterm)
 {
-    const wchar_t *p;
-    bool paste_controls = conf_get_bool(term->conf, CONF_paste_controls);
+    Terminal *term = (Terminal *)vterm;
+
+    if (!term->paste_data)
+        return;
 
     /*
-     * Pasting data into the terminal counts as a keyboard event (for
-     * purposes of the 'Reset scrollback on keypress' config option),
-     * unless the paste is zero-length.
+     * If the backend hasn't kept up with what we've sent so far,
+     * wait until it has. Most backends will tell us via
+     * term_backend_sent when their buffer drains, but not all do, so
+     * poll as well.
      */
-    if (len == 0)
+    term->paste_throttled = false;
+    if (term->backend && backend_sendbuffer(term->backend) > PASTE_BACKLOG) {
+        term->paste_throttled = true;
+        term->paste_retry_time = schedule_timer(
+            PASTE_RETRY_DELAY, term_paste_timer, term);
         return;
-    term_seen_key_event(term);
+    }
 
-    if (term->paste_buffer)
-        sfree(term->paste_buffer);
-    term->paste_pos = term->paste_len = 0;
-    term->paste_buffer = snewn(len + 12, wchar_t);
+    /*
+     * Send one chunk, ending after a CR if there is one, and come
+     * back for the next.
+     */
+    const char *p = term->paste_data->s + term->paste_pos;
+    size_t left = term->paste_data->len - term->paste_pos;
+    size_t n = 0;
+    while (n < left && n < PASTE_CHUNK) {
+        if (p[n++] == '\015')
+            break;
+    }
+    /* Don't split a UTF-8 character between chunks */
+    while (n > 1 && n < left && (p[n] & 0xC0) == 0x80)
+        n--;
+    term_paste_send(term, p, n);
+    term->paste_pos += n;
 
-    if (term->bracketed_paste && !term->no_bracketed_paste)
-        term_bracketed_paste_start(term);
+    if (term->paste_pos < term->paste_data->len)
+        queue_toplevel_callback(term_paste_callback, term);
+    else
+        term_paste_free(term);
+}
+
+/*
+ * Specialist string compare function. Returns true if the len bytes
+ * of UTF-8 starting at a have as a prefix the blen wide characters
+ * starting at b, which must all be ASCII.
+ */
+static bool paste_startswith(const char *a, size_t alen,
+                             const wchar_t *b, size_t blen)
+{
+    if (alen < blen)
+        return false;
+    for (size_t i = 0; i < blen; i++)
+        if ((unsigned char)a[i] != b[i])
+            return false;
+    return true;
+}
 
-    p = data;
-    while (p < data + len) {
-        wchar_t wc = *p++;
+/*
+ * Filter a paste in place, after it's been put into term->paste_data
+ * as UTF-8. This normalises the platform's clipboard newlines to CR,
+ * and removes control characters that we don't want to pass on.
+ */
+static void term_paste_filter(Terminal *term)
+{
+    bool paste_controls = conf_get_bool(term->conf, CONF_paste_controls);
+    strbuf *buf = term->paste_data;
+    const char *p = buf->s, *end = buf->s + buf->len;
+    char *q = buf->s;
+
+    while (p < end) {
+        unsigned wc = (unsigned char)*p;
+        size_t clen = 1;
+        bool control = wc < 0x20;
+
+        if (wc == 0xC2 && end - p >= 2 && (p[1] & 0xE0) == 0x80) {
+            /* A control character in the range 0x80-0x9F */
+            wc = (unsigned char)p[1];
+            clen = 2;
+            control = true;
+        }
 
         if (wc == sel_nl[0] &&
-            wstartswith(p-1, data+len-(p-1), sel_nl, sel_nl_sz)) {
+            paste_startswith(p, end - p, sel_nl, sel_nl_sz)) {
             /*
              * This is the (platform-dependent) sequence that the host
              * OS uses to represent newlines in clipboard data.
              * Normalise it to a press of CR.
              */
-            p += sel_nl_sz - 1;
-            wc = '\015';
+            p += sel_nl_sz;
+            *q++ = '\015';
+            continue;
         }
 
-        if ((wc & ~(wint_t)0x9F) == 0) {
+        if (control) {
             /*
-             * This is a control code, either in the range 0x00-0x1F
-             * or 0x80-0x9F. We reject all of these in pastecontrols
+             * We reject all control characters in pastecontrols
              * mode, except for a small set of permitted ones.
              */
             if (!paste_controls) {
                 /* In line with xterm 292, accepted control chars are:
                  * CR, LF, tab, backspace. (And DEL, i.e. 0x7F, but
-                 * that's permitted by virtue of not matching the bit
-                 * mask that got us into this if statement, so we
-                 * don't have to permit it here. */
+                 * that's permitted by virtue of not being in the
+                 * ranges that got us here, so we don't have to
+                 * permit it here. */
                 static const unsigned mask =
                     (1<<13) | (1<<10) | (1<<9) | (1<<8);
 
-                if (wc > 15 || !((mask >> wc) & 1))
+                if (wc > 15 || !((mask >> wc) & 1)) {
+                    p += clen;
                     continue;
+                }
             }
 
             if (wc == '\033' && term->bracketed_paste &&
-                wstartswith(p-1, data+len-(p-1), L"\033[201~", 6)) {
+                paste_startswith(p, end - p, L"\033[201~", 6)) {
                 /*
                  * Also, in bracketed-paste mode, reject the ESC
                  * character that begins the end-of-paste sequence.
                  */
+                p += clen;
                 continue;
             }
         }
 
-        term->paste_buffer[term->paste_len++] = wc;
+        while (clen-- > 0)
+            *q++ = *p++;
     }
 
+    strbuf_shrink_to(buf, q - buf->s);
+}
+
+/*
+ * Start a paste, once its text is in term->paste_data. The text is
+ * kept as UTF-8 until each chunk of it is sent, so that a huge paste
+ * costs no more memory than its own size.
+ */
+static void term_paste_start(Terminal *term)
+{
+    term_paste_filter(term);
+    term->paste_pos = 0;
+
+    if (term->bracketed_paste && !term->no_bracketed_paste)
+        term_bracketed_paste_start(term);
+
     /* Assume a small paste will be OK in one go. */
-    if (term->paste_len < 256) {
-        if (term->ldisc) {
-            strbuf *buf = term_input_data_from_unicode(
-                term, term->paste_buffer, term->paste_len);
-            assert(buf->len <= INT_MAX); /* because paste_len was also small */
-            term_keyinput_internal(term, buf->s, buf->len, false);
-            strbuf_free(buf);
-        }
-        if (term->paste_buffer)
-            sfree(term->paste_buffer);
-        term_bracketed_paste_stop(term);
-        term->paste_buffer = NULL;
-        term->paste_pos = term->paste_len = 0;
+    if (term->paste_data->len < 256) {
+        term_paste_send(term, term->paste_data->s, term->paste_data->len);
+        term_paste_free(term);
     }
 
     queue_toplevel_callback(term_paste_callback, term);
 }
 
+static void term_paste_new(Terminal *term)
+{
+    /*
+     * Pasting data into the terminal counts as a keyboard event (for
+     * purposes of the 'Reset scrollback on keypress' config option),
+     * unless the paste is zero-length.
+     */
+    term_seen_key_event(term);
+
+    if (term->paste_data)
+        term_paste_free(term);
+    term->paste_data = strbuf_new_nm();
+}
+
+void term_do_paste(Terminal *term, const wchar_t *data, size_t len)
+{
+    if (len == 0)
+        return;
+    term_paste_new(term);
+
+    for (size_t i = 0; i < len; i++) {
+        unsigned long ch = data[i];
+        if (IS_HIGH_SURROGATE(ch) && i+1 < len &&
+            IS_SURROGATE_PAIR(ch, data[i+1])) {
+            ch = FROM_SURROGATES(ch, data[i+1]);
+            i++;
+        }
+        if (ch > 0x10FFFF)
+            ch = 0xFFFD;
+        put_utf8_char(term->paste_data, ch);
+    }
+
+    term_paste_start(term);
+}
+
+/*
+ * Paste text that's already in UTF-8, which saves the front end from
+ * converting the whole clipboard to wide characters first.
+ */
+void term_do_paste_utf8(Terminal *term, const char *data, size_t len)
+{
+    if (len == 0)
+        return;
+    term_paste_new(term);
+    put_data(term->paste_data, data, len);
+    term_paste_start(term);
+}
+
 void term_mouse(Terminal *term, Mouse_Button braw, Mouse_Button bcooked,
                 Mouse_Action a, int x, int y, bool shift, bool ctrl, bool alt)
 {
@@ -7818,12 +9274,36 @@ void term_keyinput(Terminal *term, int codepage, const void *str, int len)
 
 void term_nopaste(Terminal *term)
 {
-    if (term->paste_len == 0)
+    if (!term->paste_data)
         return;
-    sfree(term->paste_buffer);
-    term_bracketed_paste_stop(term);
-    term->paste_buffer = NULL;
-    term->paste_len = 0;
+    term_paste_free(term);
+}
+
+/*
+ * Report how far through a paste we are, in bytes of its UTF-8 text,
+ * for front ends that want to show progress. Returns false if no
+ * paste is in progress. term_nopaste cancels one.
+ */
+bool term_paste_progress(Terminal *term, size_t *done, size_t *total)
+{
+    if (!term->paste_data)
+        return false;
+    *done = term->paste_pos;
+    *total = term->paste_data->len;
+    return true;
+}
+
+/*
+ * Called from the front end's Seat when the backend reports the new
+ * size of its outgoing buffer, so that a paste held up waiting for it
+ * to drain can carry on.
+ */
+void term_backend_sent(Terminal *term, size_t bufsize)
+{
+    if (term->paste_throttled && bufsize <= PASTE_BACKLOG) {
+        term->paste_throttled = false;
+        queue_toplevel_callback(term_paste_callback, term);
+    }
 }
 
 static void deselect(Terminal *term)
@@ -7860,6 +9340,13 @@ static void term_added_data(Terminal *term, bool called_from_term_data)
 
 size_t term_data(Terminal *term, const void *data, size_t len)
 {
+    if (term->echo_pending && !term->echo_seen) {
+        if (GETTICKCOUNT() - term->key_event_time <= ECHO_TIMEOUT)
+            term->echo_seen = true;
+        else
+            term->echo_pending = false; /* too late to be an echo */
+    }
+
     bufchain_add(&term->inbuf, data, len);
     term_added_data(term, true);
     return bufchain_size(&term->inbuf);
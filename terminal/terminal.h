@@ -7,12 +7,24 @@
 #define PUTTY_TERMINAL_H
 
 #include "tree234.h"
+#include "scrollback.h"
 
 struct beeptime {
     struct beeptime *next;
     unsigned long ticks;
 };
 
+/*
+ * A scroll of part of the screen which hasn't yet been shown on the
+ * real display. topline and botline are inclusive; lines is +ve for
+ * scrolling forward, -ve for backward, as in scroll().
+ */
+struct scrollregion {
+    struct scrollregion *next;
+    int topline, botline;
+    int lines;
+};
+
 #define TRUST_SIGIL_WIDTH 3
 #define TRUST_SIGIL_CHAR 0xDFFE
 
@@ -28,9 +40,14 @@ struct termchar {
      * Any code in terminal.c which definitely needs to be changed
      * when extra fields are added here is labelled with a comment
      * saying FULL-TERMCHAR.
+     *
+     * Every character and attribute value fits in 32 bits (they have
+     * always had to, on platforms where long is 32 bits), so the
+     * fields are declared that size everywhere, keeping a cell down
+     * to 20 bytes.
      */
-    unsigned long chr;
-    unsigned long attr;
+    uint32_t chr;
+    uint32_t attr;
     truecolour truecolour;
 
     /*
@@ -44,7 +61,7 @@ struct termchar {
      *
      * Zero means end of list.
      */
-    int cc_next;
+    int32_t cc_next;
 };
 
 struct termline {
@@ -56,11 +73,38 @@ struct termline {
     int cc_free;                       /* offset to first cc in free list */
     struct termchar *chars;
     bool trusted;
+    uint64_t gen;                      /* changes whenever chars[] may have */
+};
+
+/*
+ * The lines of the active (or alternate) screen, kept in a circular
+ * array so that looking up a line is O(1) and scrolling the whole
+ * screen only moves the start offset. Line i is lines[(start + i) %
+ * size], for 0 <= i < count.
+ */
+typedef struct screenbuf {
+    termline **lines;
+    int size, count, start;
+} screenbuf;
+
+/*
+ * A scrollback line kept in decompressed form, in the tree
+ * Terminal.sbcache and on a most-recently-used-first list. lineno
+ * counts lines since the terminal was created, so it stays the same
+ * while older lines are discarded from the scrollback.
+ */
+typedef struct sbcache_entry sbcache_entry;
+struct sbcache_entry {
+    size_t lineno;
+    termline *line;
+    sbcache_entry *prev, *next;
 };
 
 struct bidi_cache_entry {
     int width;
     bool trusted;
+    uint64_t gen;                      /* termline.gen of the line cached */
+    bool identity;                     /* nothing on the line needed bidi */
     struct termchar *chars;
     int *forward, *backward;           /* the permutations of line positions */
 };
@@ -77,9 +121,21 @@ struct terminal_tag {
 
     int compatibility_level;
 
-    tree234 *scrollback;               /* lines scrolled off top of screen */
-    tree234 *screen;                   /* lines on primary screen */
-    tree234 *alt_screen;               /* lines on alternate screen */
+    sbstore *scrollback;               /* lines scrolled off top of screen */
+    strbuf *sbline;                    /* scratch space for compressing a
+                                          line into the scrollback */
+    unsigned *search_text;             /* scratch space for indexing and */
+    int *search_cols;                  /* searching lines of text, all */
+    uint32_t *search_keys;             /* search_size long */
+    size_t search_size;
+    size_t scrollback_max_bytes;       /* memory limit on .scrollback, or 0 */
+    size_t sbfirst;                    /* lineno of the oldest line in
+                                          .scrollback */
+    tree234 *sbcache;                  /* decompressed scrollback lines */
+    sbcache_entry *sbcache_head, *sbcache_tail;
+    int sbcache_count;
+    screenbuf *screen;                 /* lines on primary screen */
+    screenbuf *alt_screen;             /* lines on alternate screen */
     int disptop;                       /* distance scrolled back (0 or -ve) */
     int tempsblines;                   /* number of lines of .scrollback that
                                           can be retrieved onto the terminal
@@ -89,6 +145,15 @@ struct terminal_tag {
     int dispcursx, dispcursy;          /* location of cursor on real screen */
     int curstype;                      /* type of cursor on real screen */
 
+    /*
+     * Scrolls of the screen made since the last repaint, which the
+     * front end may be able to reproduce by moving pixels around
+     * instead of redrawing every line that moved.
+     */
+#define MAX_PENDING_SCROLLS 32
+    struct scrollregion *scrollhead, *scrolltail;
+    int nscrolls;
+
 #define VBELL_TIMEOUT (TICKSPERSEC/10) /* visual bell lasts 1/10 sec */
 
     struct beeptime *beephead, *beeptail;
@@ -226,8 +291,20 @@ struct terminal_tag {
     /* Mask of attributes to pay attention to when painting. */
     int attr_mask;
 
-    wchar_t *paste_buffer;
-    size_t paste_len, paste_pos;
+    /*
+     * A pending paste is held as filtered UTF-8, and converted to
+     * the terminal's input encoding a chunk at a time as it's sent.
+     */
+    strbuf *paste_data;
+    size_t paste_pos;
+    /*
+     * A paste is sent a chunk at a time, and held back while the
+     * backend has too much outgoing data buffered. paste_throttled
+     * means we're waiting for term_backend_sent, or for a timer at
+     * paste_retry_time, before trying again.
+     */
+    bool paste_throttled;
+    unsigned long paste_retry_time;
 
     Backend *backend;
 
@@ -260,6 +337,16 @@ struct terminal_tag {
      */
     bool in_term_out;
 
+    /*
+     * If out_timeslice is nonzero, term_out stops after roughly that
+     * many ticks of work and queues a callback to carry on, so that a
+     * flood of output doesn't stop the front end handling its own
+     * events or repainting. out_cb_queued says that callback is
+     * already pending.
+     */
+    int out_timeslice;
+    bool out_cb_queued;
+
     /*
      * We don't permit window updates too close together, to avoid CPU
      * churn pointlessly redrawing the window faster than the user can
@@ -272,6 +359,18 @@ struct terminal_tag {
      */
     bool window_update_pending, window_update_cooldown;
     long window_update_cooldown_end;
+    int update_delay;                  /* length of the cooldown, in ticks */
+
+    /*
+     * The cooldown is waived for the echo of a keypress, so that
+     * typing is shown as soon as the server responds: echo_pending is
+     * set by a keypress, and echo_seen when output arrives soon
+     * enough after it. And an update is put off once (update_deferred)
+     * if there's already more output queued to be processed.
+     */
+    bool echo_pending, echo_seen, update_deferred;
+    unsigned long key_event_time;
+    TermUpdateStats update_stats;
 
     /*
      * Track pending blinks and tblinks.
@@ -288,6 +387,7 @@ struct terminal_tag {
     int wcFromTo_size;
     struct bidi_cache_entry *pre_bidi_cache, *post_bidi_cache;
     size_t bidi_cache_size;
+    uint64_t line_gen;                 /* last value given to a termline.gen */
 
     /*
      * Current trust state, used to annotate every line of the
@@ -334,6 +434,8 @@ struct terminal_tag {
     bool no_remote_wintitle;
     bool no_remote_clearscroll;
     bool rawcnp;
+    bool reflow_on_resize;
+    bool clip_attrs;          /* clipboard wants attributes (rich text) */
     bool utf8linedraw;
     bool rect_select;
     int remote_qtitle_action;
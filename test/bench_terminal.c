@@ -0,0 +1,439 @@
+/*
+ * Throughput benchmark for the terminal emulator.
+ *
+ * Drives a Terminal through a dummy TermWin, in the same way as
+ * test_terminal, and feeds it a series of workloads: either built-in
+ * synthetic ones imitating common kinds of output, or recordings of
+ * real sessions given as files on the command line. For each one, we
+ * report how fast the data went through term_data, how fast the
+ * terminal could paint the resulting frames, and how many memory
+ * allocations it made per megabyte of input.
+ *
+ * All the times are processor time, so the figures aren't much
+ * disturbed by whatever else the machine is doing, though they are
+ * still only comparable between runs on the same machine.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "putty.h"
+#include "terminal.h"
+
+void modalfatalbox(const char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "FATAL ERROR: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+const char *const appname = "bench_terminal";
+
+char *platform_default_s(const char *name)
+{ return NULL; }
+bool platform_default_b(const char *name, bool def)
+{ return def; }
+int platform_default_i(const char *name, int def)
+{ return def; }
+FontSpec *platform_default_fontspec(const char *name)
+{ return fontspec_new_default(); }
+Filename *platform_default_filename(const char *name)
+{ return filename_from_str(""); }
+
+const struct BackendVtable *const backends[] = { NULL };
+
+/* Input is fed to the terminal in pieces this size, like reads from
+ * a network connection, and a frame is painted after this many. */
+#define READ_SIZE 4096
+#define READS_PER_FRAME 16
+
+typedef struct Bench {
+    Terminal *term;
+    Conf *conf;
+    struct unicode_data ucsdata[1];
+
+    unsigned long paints;
+
+    TermWin tw;
+} Bench;
+
+static bool bench_setup_draw_ctx(TermWin *win)
+{
+    Bench *bn = container_of(win, Bench, tw);
+    bn->paints++;
+    return true;
+}
+static void bench_draw_text(TermWin *win, int x, int y, wchar_t *text,
+                            int len, unsigned long attrs, int lattrs,
+                            truecolour tc) {}
+static void bench_draw_cursor(TermWin *win, int x, int y, wchar_t *text,
+                              int len, unsigned long attrs, int lattrs,
+                              truecolour tc) {}
+static void bench_draw_trust_sigil(TermWin *win, int x, int y) {}
+static int bench_char_width(TermWin *win, int uc) { return 1; }
+static bool bench_scroll(TermWin *win, int topline, int botline, int lines)
+{ return true; }
+static void bench_free_draw_ctx(TermWin *win) {}
+static void bench_set_cursor_pos(TermWin *win, int x, int y) {}
+static void bench_set_raw_mouse_mode(TermWin *win, bool enable) {}
+static void bench_set_raw_mouse_mode_pointer(TermWin *win, bool enable) {}
+static void bench_set_scrollbar(TermWin *win, int total, int start, int page)
+{}
+static void bench_bell(TermWin *win, int mode) {}
+static void bench_clip_write(TermWin *win, int clipboard, wchar_t *text,
+                             int *attrs, truecolour *colours, int len,
+                             bool must_deselect) {}
+static void bench_clip_request_paste(TermWin *win, int clipboard) {}
+static void bench_refresh(TermWin *win) {}
+static void bench_request_resize(TermWin *win, int w, int h) {}
+static void bench_set_title(TermWin *win, const char *title, int codepage) {}
+static void bench_set_icon_title(TermWin *win, const char *icontitle,
+                                 int codepage) {}
+static void bench_set_minimised(TermWin *win, bool minimised) {}
+static void bench_set_maximised(TermWin *win, bool maximised) {}
+static void bench_move(TermWin *win, int x, int y) {}
+static void bench_set_zorder(TermWin *win, bool top) {}
+static void bench_palette_set(TermWin *win, unsigned start, unsigned ncolours,
+                              const rgb *colours) {}
+static void bench_palette_get_overrides(TermWin *tw, Terminal *term) {}
+static void bench_unthrottle(TermWin *win, size_t size) {}
+
+static const TermWinVtable bench_termwin_vt = {
+    .setup_draw_ctx = bench_setup_draw_ctx,
+    .draw_text = bench_draw_text,
+    .draw_cursor = bench_draw_cursor,
+    .draw_trust_sigil = bench_draw_trust_sigil,
+    .char_width = bench_char_width,
+    .scroll = bench_scroll,
+    .free_draw_ctx = bench_free_draw_ctx,
+    .set_cursor_pos = bench_set_cursor_pos,
+    .set_raw_mouse_mode = bench_set_raw_mouse_mode,
+    .set_raw_mouse_mode_pointer = bench_set_raw_mouse_mode_pointer,
+    .set_scrollbar = bench_set_scrollbar,
+    .bell = bench_bell,
+    .clip_write = bench_clip_write,
+    .clip_request_paste = bench_clip_request_paste,
+    .refresh = bench_refresh,
+    .request_resize = bench_request_resize,
+    .set_title = bench_set_title,
+    .set_icon_title = bench_set_icon_title,
+    .set_minimised = bench_set_minimised,
+    .set_maximised = bench_set_maximised,
+    .move = bench_move,
+    .set_zorder = bench_set_zorder,
+    .palette_set = bench_palette_set,
+    .palette_get_overrides = bench_palette_get_overrides,
+    .unthrottle = bench_unthrottle,
+};
+
+/*
+ * A trivial pseudo-random number generator, so that the synthetic
+ * workloads come out the same every time.
+ */
+static unsigned long rng_state;
+
+static unsigned rng(unsigned n)
+{
+    rng_state = rng_state * 1103515245 + 12345;
+    return (rng_state >> 16) % n;
+}
+
+static void put_word(strbuf *sb)
+{
+    unsigned len = 2 + rng(8);
+    for (unsigned i = 0; i < len; i++)
+        put_byte(sb, 'a' + rng(26));
+}
+
+/* Plain ASCII text, such as 'cat' of a log file. */
+static void gen_ascii(strbuf *sb)
+{
+    unsigned col = 0;
+    while (col < 72) {
+        put_word(sb);
+        put_byte(sb, ' ');
+        col += 8;
+    }
+    put_datalit(sb, "\r\n");
+}
+
+/* Colourful output from something like 'ls --color' or a compiler. */
+static void gen_sgr(strbuf *sb)
+{
+    for (unsigned i = 0; i < 8; i++) {
+        switch (rng(4)) {
+          case 0:
+            put_fmt(sb, "\033[%um", 30 + rng(8));
+            break;
+          case 1:
+            put_fmt(sb, "\033[1;38;5;%um", rng(256));
+            break;
+          case 2:
+            put_fmt(sb, "\033[38;2;%u;%u;%u;48;2;%u;%u;%um",
+                    rng(256), rng(256), rng(256),
+                    rng(256), rng(256), rng(256));
+            break;
+          case 3:
+            put_datalit(sb, "\033[4;7m");
+            break;
+        }
+        put_word(sb);
+        put_datalit(sb, "\033[m ");
+    }
+    put_datalit(sb, "\r\n");
+}
+
+/* CJK text, double-width throughout, and Latin text with combining
+ * accents. */
+static void gen_cjk(strbuf *sb)
+{
+    for (unsigned i = 0; i < 30; i++)
+        put_utf8_char(sb, 0x4E00 + rng(0x5000));
+    put_datalit(sb, "\r\n");
+    for (unsigned i = 0; i < 25; i++) {
+        put_byte(sb, 'a' + rng(26));
+        put_utf8_char(sb, 0x300 + rng(0x20));
+        if (rng(4) == 0)
+            put_utf8_char(sb, 0x300 + rng(0x20));
+        put_byte(sb, ' ');
+    }
+    put_datalit(sb, "\r\n");
+}
+
+/* A full-screen editor: cursor addressing, scrolling regions, and
+ * line insertion and deletion. */
+static void gen_vim(strbuf *sb)
+{
+    unsigned i;
+
+    switch (rng(3)) {
+      case 0:
+        /* Scroll part of the screen */
+        put_fmt(sb, "\033[1;23r\033[23;1H\n\033[r");
+        break;
+      case 1:
+        put_fmt(sb, "\033[%u;1H\033[L", 1 + rng(23));
+        break;
+      case 2:
+        put_fmt(sb, "\033[%u;1H\033[M", 1 + rng(23));
+        break;
+    }
+    for (i = 0; i < 4; i++) {
+        put_fmt(sb, "\033[%u;%uH\033[K", 1 + rng(23), 1 + rng(60));
+        put_word(sb);
+        put_byte(sb, ' ');
+        put_word(sb);
+    }
+    put_fmt(sb, "\033[24;1H\033[7m-- INSERT --\033[m\033[K"
+            "\033[24;70H%u,%u", 1 + rng(1000), 1 + rng(80));
+}
+
+/* A TUI application on the alternate screen, redrawing whole panels
+ * of the screen at a time. */
+static void gen_altscreen(strbuf *sb)
+{
+    unsigned y, x;
+
+    put_datalit(sb, "\033[?1049h\033[H\033[2J");
+    for (y = 1; y <= 24; y++) {
+        put_fmt(sb, "\033[%u;1H\033[44;37m", y);
+        for (x = 0; x < 8; x++) {
+            put_fmt(sb, "\033[%um", 30 + rng(8));
+            put_word(sb);
+            put_datalit(sb, "\xe2\x94\x82");   /* box-drawing bar */
+        }
+        put_datalit(sb, "\033[m\033[K");
+    }
+    put_datalit(sb, "\033[?1049l");
+}
+
+/* Long output into a large scrollback, with some colour so that the
+ * stored lines aren't all trivial. */
+static void gen_scrollback(strbuf *sb)
+{
+    put_fmt(sb, "\033[3%um%6u\033[m ", rng(8), rng(1000000));
+    gen_ascii(sb);
+}
+
+typedef struct Workload {
+    const char *name;
+    void (*gen)(strbuf *sb);
+    int savelines;
+} Workload;
+
+static const Workload workloads[] = {
+    { "ascii", gen_ascii, 2000 },
+    { "sgr", gen_sgr, 2000 },
+    { "cjk", gen_cjk, 2000 },
+    { "vim", gen_vim, 2000 },
+    { "altscreen", gen_altscreen, 2000 },
+    { "scrollback", gen_scrollback, 200000 },
+};
+
+static void run(Bench *bn, const char *name, ptrlen data, size_t size,
+                int savelines)
+{
+    clock_t data_time = 0, paint_time = 0, t;
+    size_t allocs, done = 0, pos = 0;
+    unsigned reads = 0;
+    double mb = size / 1048576.0;
+
+    term_pwron(bn->term, true);
+    term_size(bn->term, 24, 80, savelines);
+    term_update(bn->term);
+    bn->paints = 0;
+    allocs = allocation_count;
+
+    while (done < size) {
+        size_t len = data.len - pos;
+        if (len > READ_SIZE)
+            len = READ_SIZE;
+
+        t = clock();
+        term_data(bn->term, (const char *)data.ptr + pos, len);
+        while (run_toplevel_callbacks());
+        data_time += clock() - t;
+
+        if (++reads % READS_PER_FRAME == 0) {
+            t = clock();
+            term_update(bn->term);
+            paint_time += clock() - t;
+        }
+
+        done += len;
+        pos += len;
+        if (pos == data.len)
+            pos = 0;
+    }
+
+    t = clock();
+    term_update(bn->term);
+    paint_time += clock() - t;
+
+    allocs = allocation_count - allocs;
+    printf("%-12s %10.1f %10.0f %12.0f\n", name,
+           data_time ? mb * CLOCKS_PER_SEC / data_time : 0.0,
+           paint_time ? (double)bn->paints * CLOCKS_PER_SEC / paint_time
+           : 0.0, allocs / mb);
+    fflush(stdout);
+}
+
+int main(int argc, char **argv)
+{
+    Bench *bn;
+    size_t size = 4;
+    const char *only = NULL;
+    bool opts = true, any_files = false;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        const char *p = argv[i];
+        if (p[0] == '-' && opts) {
+            if (!strcmp(p, "-s") && i+1 < argc) {
+                size = strtoul(argv[++i], NULL, 10);
+            } else if (!strcmp(p, "-w") && i+1 < argc) {
+                only = argv[++i];
+            } else if (!strcmp(p, "--")) {
+                opts = false;
+            } else if (!strcmp(p, "--help")) {
+                printf("usage: bench_terminal [options] [file...]\n");
+                printf("options: -s MB      amount of data to feed through"
+                       " each workload (default 4)\n");
+                printf("         -w NAME    run only the named built-in"
+                       " workload\n");
+                printf("Files are replayed as workloads in their own right,"
+                       " repeated as necessary\n");
+                printf("to make up the amount of data, instead of the"
+                       " built-in workloads.\n");
+                return 0;
+            } else {
+                fprintf(stderr, "unknown command line option '%s'\n", p);
+                return 1;
+            }
+        } else {
+            any_files = true;
+        }
+    }
+    if (size < 1)
+        size = 1;
+    size *= 1048576;
+
+    bn = snew(Bench);
+    memset(bn, 0, sizeof(*bn));
+    bn->conf = conf_new();
+    do_defaults(NULL, bn->conf);
+    init_ucs_generic(bn->conf, bn->ucsdata);
+    bn->ucsdata->line_codepage = CP_UTF8;
+    bn->tw.vt = &bench_termwin_vt;
+    bn->term = term_init(bn->conf, bn->ucsdata, &bn->tw);
+    term_size(bn->term, 24, 80, 2000);
+
+    printf("%-12s %10s %10s %12s\n", "workload", "MB/s", "paints/s",
+           "allocs/MB");
+
+    if (any_files) {
+        opts = true;
+        for (i = 1; i < argc; i++) {
+            const char *p = argv[i];
+            if (p[0] == '-' && opts) {
+                if (!strcmp(p, "--"))
+                    opts = false;
+                else
+                    i++;               /* skip the option's argument */
+                continue;
+            }
+
+            FILE *fp = fopen(p, "rb");
+            if (!fp) {
+                fprintf(stderr, "unable to open '%s'\n", p);
+                return 1;
+            }
+            strbuf *sb = strbuf_new();
+            char buf[4096];
+            size_t len;
+            while ((len = fread(buf, 1, sizeof(buf), fp)) > 0)
+                put_data(sb, buf, len);
+            fclose(fp);
+
+            if (sb->len)
+                run(bn, p, ptrlen_from_strbuf(sb), size, 2000);
+            strbuf_free(sb);
+        }
+    } else {
+        bool found = false;
+        for (i = 0; i < lenof(workloads); i++) {
+            const Workload *wl = &workloads[i];
+            if (only && strcmp(only, wl->name))
+                continue;
+            found = true;
+
+            /*
+             * Generate a megabyte or so of the workload, and go
+             * round it as many times as needed. That keeps the cost
+             * of generating it out of the figures, and is plenty to
+             * make sure it isn't just the same few screenfuls.
+             */
+            strbuf *sb = strbuf_new();
+            rng_state = 1;
+            while (sb->len < 1048576)
+                wl->gen(sb);
+            run(bn, wl->name, ptrlen_from_strbuf(sb), size, wl->savelines);
+            strbuf_free(sb);
+        }
+        if (!found) {
+            fprintf(stderr, "no workload called '%s'\n", only);
+            return 1;
+        }
+    }
+
+    term_free(bn->term);
+    conf_free(bn->conf);
+    sfree(bn);
+    return 0;
+}
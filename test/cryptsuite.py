@@ -1856,16 +1856,91 @@ class crypt(MyTestBase):
                       '3b8693642db36f87')
         mac = unhex('09757178642dfc9f2c38ac5999e0fcfd')
         seqno = 3
-        c = ssh_cipher_new('chacha20_poly1305')
-        m = ssh2_mac_new('poly1305', c)
-        c.setkey(key)
-        self.assertEqualBin(c.encrypt_length(len_p, seqno), len_c)
-        self.assertEqualBin(c.encrypt(msg_p), msg_c)
-        m.start()
-        m.update(ssh_uint32(seqno) + len_c + msg_c)
-        self.assertEqualBin(m.genresult(), mac)
-        self.assertEqualBin(c.decrypt_length(len_c, seqno), len_p)
-        self.assertEqualBin(c.decrypt(msg_c), msg_p)
+        for impl in get_implementations("chacha20_poly1305"):
+            c = ssh_cipher_new(impl)
+            if c is None: continue # skip if HW implementation unavailable
+            m = ssh2_mac_new('poly1305', c)
+            c.setkey(key)
+            self.assertEqualBin(c.encrypt_length(len_p, seqno), len_c)
+            self.assertEqualBin(c.encrypt(msg_p), msg_c)
+            m.start()
+            m.update(ssh_uint32(seqno) + len_c + msg_c)
+            self.assertEqualBin(m.genresult(), mac)
+            self.assertEqualBin(c.decrypt_length(len_c, seqno), len_p)
+            self.assertEqualBin(c.decrypt(msg_c), msg_p)
+
+    def testChaCha20Poly1305Parallelism(self):
+        # Our accelerated implementations of ChaCha20-Poly1305 work on
+        # several blocks at a time, so check that they agree with the
+        # software one for a range of message lengths and however
+        # the data is divided up.
+        key = b"".join(struct.pack(">I", i * 0x9E3779B9 & 0xFFFFFFFF)
+                       for i in range(16))
+        test_data = ssh2_mpint(last(fibonacci_scattered(14)))
+        test_data = (test_data * (2200 // len(test_data) + 1))[:2200]
+
+        def run(impl, msglen, chunklen, seqno):
+            c = ssh_cipher_new(impl)
+            if c is None: return None
+            m = ssh2_mac_new('poly1305', c)
+            c.setkey(key)
+            length = c.encrypt_length(ssh_uint32(msglen), seqno)
+            ciphertext = b""
+            for pos in range(0, msglen, chunklen):
+                ciphertext += c.encrypt(test_data[pos:min(msglen,
+                                                          pos+chunklen)])
+            m.start()
+            m.update(ssh_uint32(seqno) + length + ciphertext)
+            return length + ciphertext + m.genresult()
+
+        impls = get_implementations("chacha20_poly1305")
+        for msglen in [0, 1, 63, 64, 65, 255, 256, 257, 1000, 1024, 2200]:
+            for chunklen in [1, 7, 64, 100, 1024, 4096]:
+                if chunklen == 1 and msglen > 300: continue
+                for seqno in [0, 0x7FFFFFFF, 0xFFFFFFFF]:
+                    results = [run(impl, msglen, chunklen, seqno)
+                               for impl in impls]
+                    results = [r for r in results if r is not None]
+                    for r in results:
+                        self.assertEqualBin(r, results[0])
+
+    def testChaCha20Poly1305Batch(self):
+        # Check that encrypting a whole batch of packets at once gives
+        # the same results as doing them one at a time. The lengths
+        # are chosen so that some packets are short enough to have all
+        # their keystream generated together, and some aren't, and
+        # the batch is longer than the implementation's own batches.
+        key = b"".join(struct.pack(">I", i * 0x9E3779B9 & 0xFFFFFFFF)
+                       for i in range(16))
+        test_data = ssh2_mpint(last(fibonacci_scattered(14)))
+        test_data = (test_data * (2000 // len(test_data) + 1))[:2000]
+        lengths = [12, 60, 63, 64, 65, 252, 256, 257, 1000, 16, 8, 1500]
+
+        def reference(body, seqno):
+            c = ssh_cipher_new('chacha20_poly1305_sw')
+            m = ssh2_mac_new('poly1305', c)
+            c.setkey(key)
+            length = c.encrypt_length(ssh_uint32(len(body)), seqno)
+            ciphertext = length + c.encrypt(body)
+            m.start()
+            m.update(ssh_uint32(seqno) + ciphertext)
+            return ciphertext + m.genresult()
+
+        for npackets in [1, 2, 15, 16, 17, 40]:
+            for seqno in [0, 0xFFFFFFF8]:
+                bodies = [test_data[i:i+lengths[i % len(lengths)]]
+                          for i in range(npackets)]
+                expected = b"".join(
+                    reference(body, (seqno + i) & 0xFFFFFFFF)
+                    for i, body in enumerate(bodies))
+                plaintext = b"".join(ssh_string(body) for body in bodies)
+
+                for impl in get_implementations("chacha20_poly1305"):
+                    c = ssh_cipher_new(impl)
+                    if c is None: continue
+                    c.setkey(key)
+                    self.assertEqualBin(
+                        c.encrypt_packets(plaintext, seqno), expected)
 
     def testRSAKex(self):
         # Round-trip test of the RSA key exchange functions, plus a
@@ -3447,6 +3522,71 @@ LzN/Ly+uECsga2hoc+P/ZHMULMZkCfrOyWdeXz7BR/acLZJoT579
                 # at the top
                 test(gcm, cbc, 0x27182818, 0xFFFFFFFFFFFFFFFF)
 
+    def testAESGCMEncryptThenMAC(self):
+        # Test the combined encrypt-and-MAC functions used by the
+        # SSH-2 BPP, which some implementations do in a single pass
+        # over the data, against the separate cipher and MAC calls.
+        # The block counts include some that aren't multiples of any
+        # batch size, and some that leave a partial batch at the end.
+        key = b'SomeRandomKeyValSomeRandomKeyVal'
+        iv = b'SomeRandomIV'
+        nblocks_list = [0, 1, 2, 7, 8, 9, 15, 16, 17, 31, 33, 100]
+
+        def aesgcm(aes_impl, gcm_impl):
+            c = ssh_cipher_new('aes256_gcm_{}'.format(aes_impl))
+            if c is None: return None, None # skip if HW AES unavailable
+            m = ssh2_mac_new('aesgcm_{}'.format(gcm_impl), c)
+            if m is None: return None, None # skip if HW GCM unavailable
+            c.setkey(key)
+            c.setiv(iv + b'\0'*4)
+            m.setkey(b'')
+            return c, m
+
+        # Reference results, from the software implementation called
+        # in the ordinary separate way
+        c, m = aesgcm('sw', 'sw')
+        expected = []
+        for seq, nblocks in enumerate(nblocks_list):
+            length = ssh_uint32(16 * nblocks)
+            plain = bytes(range(256)) * (nblocks // 16 + 1)
+            plain = plain[:16 * nblocks]
+            cipher = c.encrypt(plain)
+            m.start()
+            m.update(ssh_uint32(seq) + length + cipher)
+            packet = length + cipher + m.genresult()
+            expected.append((length + plain, packet))
+            c.next_message()
+            m.next_message()
+
+        for aes_impl in get_aes_impls():
+            for gcm_impl in get_aesgcm_impls():
+                with self.subTest(aes_impl=aes_impl, gcm_impl=gcm_impl):
+                    c, m = aesgcm(aes_impl, gcm_impl)
+                    if c is None: continue
+                    for seq, (plain, packet) in enumerate(expected):
+                        self.assertEqualBin(ssh2_mac_encrypt_and_generate(
+                            m, c, plain, 4, seq), packet)
+                        c.next_message()
+                        m.next_message()
+
+                    c, m = aesgcm(aes_impl, gcm_impl)
+                    for seq, (plain, packet) in enumerate(expected):
+                        self.assertEqualBin(ssh2_mac_verify_and_decrypt(
+                            m, c, packet, 4, seq), plain)
+                        c.next_message()
+                        m.next_message()
+
+                    # A corrupted packet must fail to verify
+                    c, m = aesgcm(aes_impl, gcm_impl)
+                    seq = len(expected) - 1
+                    for i in range(seq):
+                        c.next_message()
+                        m.next_message()
+                    plain, packet = expected[seq]
+                    packet = packet[:20] + bytes([packet[20] ^ 1]) + packet[21:]
+                    self.assertEqual(ssh2_mac_verify_and_decrypt(
+                        m, c, packet, 4, seq), None)
+
 class standard_test_vectors(MyTestBase):
     def testAES(self):
         def vector(cipher, key, plaintext, ciphertext):
@@ -98,6 +98,11 @@ static void fuzz_draw_trust_sigil(TermWin *tw, int x, int y)
     printf("TRUST@(%d,%d)\n", x, y);
 }
 static int fuzz_char_width(TermWin *tw, int uc) { return 1; }
+static bool fuzz_scroll(TermWin *tw, int topline, int botline, int lines)
+{
+    printf("SCROLL[%d..%d]:%d\n", topline, botline, lines);
+    return true;
+}
 static void fuzz_free_draw_ctx(TermWin *tw) {}
 static void fuzz_set_cursor_pos(TermWin *tw, int x, int y) {}
 static void fuzz_set_raw_mouse_mode(TermWin *tw, bool enable) {}
@@ -128,6 +133,7 @@ static const TermWinVtable fuzz_termwin_vt = {
     .draw_cursor = fuzz_draw_cursor,
     .draw_trust_sigil = fuzz_draw_trust_sigil,
     .char_width = fuzz_char_width,
+    .scroll = fuzz_scroll,
     .free_draw_ctx = fuzz_free_draw_ctx,
     .set_cursor_pos = fuzz_set_cursor_pos,
     .set_raw_mouse_mode = fuzz_set_raw_mouse_mode,
@@ -780,6 +780,7 @@ void test_simple(void)
     test_bool_simple(CONF_ctrlaltkeys, "CtrlAltKeys", true);
     test_str_simple(CONF_wintitle, "WinTitle", "");
     test_int_simple(CONF_savelines, "ScrollbackLines", 2000);
+    test_int_simple(CONF_scrollback_max_kb, "ScrollbackMaxKB", 0);
     test_bool_simple(CONF_dec_om, "DECOriginMode", false);
     test_bool_simple(CONF_wrap_mode, "AutoWrapMode", true);
     test_bool_simple(CONF_lfhascr, "LFImpliesCR", false);
@@ -800,6 +801,7 @@ void test_simple(void)
     test_int_translated(CONF_resize_action, "LockSize", RESIZE_TERM,
                         RESIZE_TERM, 0, RESIZE_DISABLED, 1, RESIZE_FONT, 2,
                         RESIZE_EITHER, 3, -1);
+    test_bool_simple(CONF_reflow_on_resize, "ReflowOnResize", false);
     test_bool_simple(CONF_bce, "BCE", true);
     test_bool_simple(CONF_blinktext, "BlinkText", false);
     test_bool_simple(CONF_win_name_always, "WinNameAlways", true);
@@ -817,6 +819,9 @@ void test_simple(void)
     test_int_translated(CONF_logxfovr, "LogFileClash", LGXF_ASK,
                         LGXF_OVR, 1, LGXF_APN, 0, LGXF_ASK, -1, -1);
     test_bool_simple(CONF_logflush, "LogFlush", true);
+    test_int_translated(CONF_logoverflow, "LogOverflow", LGOV_BLOCK,
+                        LGOV_BLOCK, 0, LGOV_DROP, 1, LGOV_GROW, 2, -1);
+    test_int_simple(CONF_logsyncinterval, "LogSyncInterval", 0);
     test_bool_simple(CONF_logheader, "LogHeader", true);
     test_bool_simple(CONF_logomitpass, "SSHLogOmitPasswords", true);
     test_bool_simple(CONF_logomitdata, "SSHLogOmitData", false);
@@ -0,0 +1,146 @@
+/*
+ * Test that a session log is complete even if the program exits
+ * without calling log_free, which is what most of the front ends do.
+ *
+ * The test runs itself as a subprocess with '--write', which writes
+ * a raw log through the background writer and returns from main
+ * straight away. Then it checks that every byte made it to the file.
+ */
+
+#include "putty.h"
+
+void modalfatalbox(const char *p, ...)
+{
+    va_list ap;
+    fprintf(stderr, "FATAL ERROR: ");
+    va_start(ap, p);
+    vfprintf(stderr, p, ap);
+    va_end(ap);
+    fputc('\n', stderr);
+    exit(1);
+}
+
+/* More than the writer thread is allowed to fall behind by default,
+ * and not a whole number of blocks */
+#define LOG_TEST_SIZE (6 * 1024 * 1024 + 123)
+#define LOG_TEST_CHUNK 1000
+
+static unsigned char log_test_byte(size_t i)
+{
+    return (unsigned char)(i % 251);
+}
+
+static void test_eventlog(LogPolicy *lp, const char *event) {}
+
+static int test_askappend(LogPolicy *lp, Filename *filename,
+                          void (*callback)(void *ctx, int result), void *ctx)
+{
+    return 2;
+}
+
+static void test_logging_error(LogPolicy *lp, const char *event)
+{
+    fprintf(stderr, "logging error: %s\n", event);
+}
+
+static const LogPolicyVtable test_logpolicy_vt = {
+    .eventlog = test_eventlog,
+    .askappend = test_askappend,
+    .logging_error = test_logging_error,
+    .verbose = null_lp_verbose_no,
+};
+static LogPolicy test_logpolicy[1] = {{ &test_logpolicy_vt }};
+
+static int write_log(const char *filename, int overflow)
+{
+    Conf *conf = conf_new();
+    Filename *fn = filename_from_str(filename);
+    conf_set_filename(conf, CONF_logfilename, fn);
+    filename_free(fn);
+    conf_set_int(conf, CONF_logtype, LGTYP_DEBUG);
+    conf_set_int(conf, CONF_logxfovr, LGXF_OVR);
+    conf_set_bool(conf, CONF_logheader, false);
+    conf_set_int(conf, CONF_logoverflow, overflow);
+    conf_set_int(conf, CONF_logsyncinterval, 0);
+    conf_set_int(conf, CONF_protocol, PROT_RAW);
+    conf_set_str(conf, CONF_host, "localhost");
+    conf_set_int(conf, CONF_port, 0);
+
+    LogContext *logctx = log_init(test_logpolicy, conf);
+    logfopen(logctx);
+
+    unsigned char buf[LOG_TEST_CHUNK];
+    for (size_t pos = 0; pos < LOG_TEST_SIZE; pos += LOG_TEST_CHUNK) {
+        size_t len = LOG_TEST_SIZE - pos;
+        if (len > LOG_TEST_CHUNK)
+            len = LOG_TEST_CHUNK;
+        for (size_t i = 0; i < len; i++)
+            buf[i] = log_test_byte(pos + i);
+        logtraffic_data(logctx, buf, len, LGTYP_DEBUG);
+    }
+
+    /* Deliberately no log_free or conf_free: that's the point */
+    return 0;
+}
+
+static bool check_log(const char *filename, int overflow)
+{
+    const char *what = overflow == LGOV_GROW ? "grow" : "block";
+    FILE *fp = fopen(filename, "rb");
+    if (!fp) {
+        printf("%s: log file missing\n", what);
+        return false;
+    }
+
+    size_t pos = 0;
+    bool ok = true;
+    int c;
+    while ((c = fgetc(fp)) != EOF) {
+        if (pos >= LOG_TEST_SIZE || c != log_test_byte(pos)) {
+            printf("%s: wrong data at offset %"SIZEu"\n", what, pos);
+            ok = false;
+            break;
+        }
+        pos++;
+    }
+    fclose(fp);
+
+    if (ok && pos != LOG_TEST_SIZE) {
+        printf("%s: log file has %"SIZEu" bytes, expected %d\n",
+               what, pos, LOG_TEST_SIZE);
+        ok = false;
+    }
+    return ok;
+}
+
+int main(int argc, char **argv)
+{
+    const char *filename = "test_logging.log";
+    static const int overflows[] = { LGOV_BLOCK, LGOV_GROW };
+    bool failed = false;
+
+    if (argc == 3 && !strcmp(argv[1], "--write"))
+        return write_log(filename, atoi(argv[2]));
+
+    for (size_t i = 0; i < lenof(overflows); i++) {
+        remove(filename);
+        char *cmd = dupprintf("\"%s\" --write %d", argv[0], overflows[i]);
+        int status = system(cmd);
+        sfree(cmd);
+        if (status != 0) {
+            printf("subprocess failed with status %d\n", status);
+            failed = true;
+        } else if (!check_log(filename, overflows[i])) {
+            failed = true;
+        }
+    }
+    remove(filename);
+
+    if (failed) {
+        printf("Test suite FAILED!\n");
+        return 1;
+    } else {
+        printf("Test suite passed\n");
+        return 0;
+    }
+}
@@ -36,29 +36,114 @@ typedef struct Mock {
 
     bool any_test_failed;
 
+    /* Drawing is only allowed if a test asks for it */
+    bool painting;
+    uint64_t rows_drawn;               /* bitmap of y coordinates drawn */
+    int nscrolls, scroll_top, scroll_bot, scroll_lines;
+
+    /* Only used by tests that create an Ldisc */
+    bool echo;
+    strbuf *to_backend;
+
     TermWin tw;
+    Seat seat;
+    Backend backend;
 } Mock;
 
-static bool mock_setup_draw_ctx(TermWin *win) { return false; }
+static bool mock_setup_draw_ctx(TermWin *win)
+{
+    Mock *mk = container_of(win, Mock, tw);
+    return mk->painting;
+}
 static void mock_draw_text(TermWin *win, int x, int y, wchar_t *text, int len,
-                           unsigned long attrs, int lattrs, truecolour tc) {}
+                           unsigned long attrs, int lattrs, truecolour tc)
+{
+    Mock *mk = container_of(win, Mock, tw);
+    mk->rows_drawn |= (uint64_t)1 << y;
+}
 static void mock_draw_cursor(TermWin *win, int x, int y, wchar_t *text,
                              int len, unsigned long attrs, int lattrs,
-                             truecolour tc) {}
+                             truecolour tc)
+{
+    Mock *mk = container_of(win, Mock, tw);
+    mk->rows_drawn |= (uint64_t)1 << y;
+}
+static int mock_char_width(TermWin *win, int uc) { return 1; }
+static bool mock_scroll(TermWin *win, int topline, int botline, int lines)
+{
+    Mock *mk = container_of(win, Mock, tw);
+    mk->nscrolls++;
+    mk->scroll_top = topline;
+    mk->scroll_bot = botline;
+    mk->scroll_lines = lines;
+    return true;
+}
+static void mock_free_draw_ctx(TermWin *win) {}
+static void mock_set_cursor_pos(TermWin *win, int x, int y) {}
+static void mock_set_scrollbar(TermWin *win, int total, int start, int page) {}
 static void mock_set_raw_mouse_mode(TermWin *win, bool enable) {}
 static void mock_set_raw_mouse_mode_pointer(TermWin *win, bool enable) {}
 static void mock_palette_set(TermWin *win, unsigned start, unsigned ncolours,
                              const rgb *colours) {}
 static void mock_palette_get_overrides(TermWin *tw, Terminal *term) {}
+static void mock_unthrottle(TermWin *win, size_t size) {}
 
 static const TermWinVtable mock_termwin_vt = {
     .setup_draw_ctx = mock_setup_draw_ctx,
     .draw_text = mock_draw_text,
     .draw_cursor = mock_draw_cursor,
+    .char_width = mock_char_width,
+    .scroll = mock_scroll,
+    .free_draw_ctx = mock_free_draw_ctx,
+    .set_cursor_pos = mock_set_cursor_pos,
+    .set_scrollbar = mock_set_scrollbar,
     .set_raw_mouse_mode = mock_set_raw_mouse_mode,
     .set_raw_mouse_mode_pointer = mock_set_raw_mouse_mode_pointer,
     .palette_set = mock_palette_set,
     .palette_get_overrides = mock_palette_get_overrides,
+    .unthrottle = mock_unthrottle,
+};
+
+static size_t mock_output(Seat *seat, SeatOutputType type,
+                          const void *data, size_t len)
+{
+    Mock *mk = container_of(seat, Mock, seat);
+    return term_data(mk->term, data, len);
+}
+
+static void mock_send(Backend *be, const char *buf, size_t len)
+{
+    Mock *mk = container_of(be, Mock, backend);
+    put_data(mk->to_backend, buf, len);
+}
+
+static bool mock_ldisc_option_state(Backend *be, int option)
+{
+    Mock *mk = container_of(be, Mock, backend);
+    switch (option) {
+      case LD_ECHO:
+        return mk->echo;
+      case LD_EDIT:
+        return false;
+      default:
+        unreachable("bad ldisc option");
+    }
+}
+
+static void mock_provide_ldisc(Backend *be, Ldisc *ldisc) {}
+static bool mock_sendok(Backend *be) { return true; }
+
+static const SeatVtable mock_seat_vt = {
+    .output = mock_output,
+    .echoedit_update = nullseat_echoedit_update,
+};
+
+static const BackendVtable mock_backend_vt = {
+    .sendok = mock_sendok,
+    .send = mock_send,
+    .ldisc_option_state = mock_ldisc_option_state,
+    .provide_ldisc = mock_provide_ldisc,
+    .id = "mock",
 };
 
 static Mock *mock_new(void)
@@ -74,7 +159,11 @@ static Mock *mock_new(void)
 
     mk->context = strbuf_new();
 
+    mk->to_backend = strbuf_new();
+
     mk->tw.vt = &mock_termwin_vt;
+    mk->seat.vt = &mock_seat_vt;
+    mk->backend.vt = &mock_backend_vt;
 
     return mk;
 }
@@ -82,6 +171,7 @@ static Mock *mock_new(void)
 static void mock_free(Mock *mk)
 {
     strbuf_free(mk->context);
+    strbuf_free(mk->to_backend);
     conf_free(mk->conf);
     term_free(mk->term);
     sfree(mk);
@@ -482,6 +572,568 @@ static void test_nonwrap(Mock *mk)
     IEQUAL(get_termchar(mk->term, 79, 0).chr, 0xFFFD);
 }
 
+static void test_scroll_display(Mock *mk)
+{
+    /* A scroll of the whole screen is passed on to the front end, so
+     * that the lines which only moved don't need redrawing */
+    int i;
+    mk->ucsdata->line_codepage = CP_ISO8859_1;
+
+    reset(mk);
+    mk->painting = true;
+    for (i = 0; i < 23; i++)
+        term_datapl(mk->term, PTRLEN_LITERAL("line\r\n"));
+    term_datapl(mk->term, PTRLEN_LITERAL("last"));
+    term_update(mk->term);
+    IEQUAL(mk->nscrolls, 0);
+
+    mk->rows_drawn = 0;
+    term_datapl(mk->term, PTRLEN_LITERAL("\r\nnew"));
+    term_update(mk->term);
+    IEQUAL(mk->nscrolls, 1);
+    IEQUAL(mk->scroll_top, 0);
+    IEQUAL(mk->scroll_bot, 23);
+    IEQUAL(mk->scroll_lines, 1);
+    /* Only the line the cursor left and the new bottom line are drawn */
+    IEQUAL(mk->rows_drawn, ((uint64_t)1 << 22) | ((uint64_t)1 << 23));
+
+    /* Two scrolls between repaints are merged into one */
+    mk->nscrolls = 0;
+    mk->rows_drawn = 0;
+    term_datapl(mk->term, PTRLEN_LITERAL("\r\n\r\nnewer"));
+    term_update(mk->term);
+    IEQUAL(mk->nscrolls, 1);
+    IEQUAL(mk->scroll_lines, 2);
+    IEQUAL(mk->rows_drawn, ((uint64_t)1 << 21) | ((uint64_t)1 << 22) |
+           ((uint64_t)1 << 23));
+
+    /* And now the display is up to date, only the cursor is redrawn */
+    mk->nscrolls = 0;
+    mk->rows_drawn = 0;
+    term_update(mk->term);
+    IEQUAL(mk->nscrolls, 0);
+    IEQUAL(mk->rows_drawn, (uint64_t)1 << 23);
+
+    mk->painting = false;
+}
+
+static void test_bidi_cache(Mock *mk)
+{
+    /* Lines with nothing right-to-left on them skip the bidi
+     * algorithm, and changing a line is noticed without comparing
+     * it against the cache */
+    mk->ucsdata->line_codepage = CP_UTF8;
+
+    reset(mk);
+    mk->painting = true;
+    term_datapl(mk->term, PTRLEN_LITERAL("hello\r\n\xd7\xa9\xd7\x9c"));
+    term_update(mk->term);
+    IEQUAL(mk->term->pre_bidi_cache[0].identity, true);
+    IEQUAL(mk->term->pre_bidi_cache[1].identity, false);
+
+    term_datapl(mk->term, PTRLEN_LITERAL("\033[2;1Hab\033[K"));
+    term_update(mk->term);
+    IEQUAL(mk->term->pre_bidi_cache[1].identity, true);
+
+    term_datapl(mk->term, PTRLEN_LITERAL("\033[1;1H\xd7\xa9"));
+    term_update(mk->term);
+    IEQUAL(mk->term->pre_bidi_cache[0].identity, false);
+    IEQUAL(mk->term->pre_bidi_cache[1].identity, true);
+
+    mk->painting = false;
+}
+
+/* Read back the number written by test_scrollback on line y */
+static int get_line_number(Terminal *term, int y)
+{
+    termline *tl = term_get_line(term, y);
+    int n = 0;
+    for (int x = 5; x < tl->cols; x++) {
+        unsigned long c = tl->chars[x].chr & 0xFF;
+        if (c < '0' || c > '9')
+            break;
+        n = n * 10 + (c - '0');
+    }
+    term_release_line(tl);
+    return n;
+}
+
+static void write_numbered_lines(Mock *mk, int from, int to)
+{
+    for (int i = from; i < to; i++) {
+        char buf[64];
+        sprintf(buf, "\033[3%dmline %d\033[m\r\n", i % 8, i);
+        term_data(mk->term, buf, strlen(buf));
+    }
+}
+
+static void test_scrollback(Mock *mk)
+{
+    mk->ucsdata->line_codepage = CP_ISO8859_1;
+
+    reset(mk);
+    term_size(mk->term, 24, 80, 1000);
+    write_numbered_lines(mk, 0, 1000);
+    IEQUAL(sbstore_count(mk->term->scrollback), 977);
+    IEQUAL(get_line_number(mk->term, 0), 977);
+    IEQUAL(get_line_number(mk->term, -1), 976);
+    IEQUAL(get_line_number(mk->term, -500), 477);
+    IEQUAL(get_line_number(mk->term, -977), 0);
+    IEQUAL(get_termchar(mk->term, 0, -100).attr & ATTR_FGMASK,
+           (877 % 8) << ATTR_FGSHIFT);
+
+    /* Once the scrollback is full, the oldest lines go */
+    write_numbered_lines(mk, 1000, 1300);
+    IEQUAL(sbstore_count(mk->term->scrollback), 1000);
+    IEQUAL(get_line_number(mk->term, -1), 1276);
+    IEQUAL(get_line_number(mk->term, -1000), 277);
+
+    /* Making the window taller pulls lines back out of the scrollback,
+     * and making it shorter again pushes them back */
+    term_size(mk->term, 200, 80, 1000);
+    IEQUAL(sbstore_count(mk->term->scrollback), 824);
+    IEQUAL(get_line_number(mk->term, 0), 1101);
+    IEQUAL(get_line_number(mk->term, -1), 1100);
+    IEQUAL(get_line_number(mk->term, -824), 277);
+    term_size(mk->term, 24, 80, 1000);
+    IEQUAL(sbstore_count(mk->term->scrollback), 1000);
+    IEQUAL(get_line_number(mk->term, 0), 1277);
+    IEQUAL(get_line_number(mk->term, -1000), 277);
+
+    /* Lines read back out of the scrollback are cached, but a cached
+     * line doesn't outlive the scrollback line it was a copy of */
+    {
+        termline *tl = term_get_line(mk->term, -1);
+        IEQUAL(term_get_line(mk->term, -1) == tl, true);
+        term_release_line(tl);
+        term_release_line(tl);
+    }
+    term_size(mk->term, 25, 80, 1000);
+    term_datapl(mk->term, PTRLEN_LITERAL("\033[1;1Hchanged\033[25;1H"));
+    term_size(mk->term, 24, 80, 1000);
+    IEQUAL(get_termchar(mk->term, 0, -1).chr, CSET_ASCII | 'c');
+
+    /* Reducing savelines throws away the oldest lines */
+    term_size(mk->term, 24, 80, 100);
+    IEQUAL(sbstore_count(mk->term->scrollback), 100);
+    IEQUAL(get_line_number(mk->term, -100), 1177);
+
+    /* With a memory limit, the scrollback stops growing well short of
+     * savelines, but what remains is still intact */
+    term_size(mk->term, 24, 80, 100000);
+    conf_set_int(mk->conf, CONF_scrollback_max_kb, 16);
+    term_reconfig(mk->term, mk->conf);
+    write_numbered_lines(mk, 1300, 11300);
+    IEQUAL(sbstore_bytes(mk->term->scrollback) <= 16 * 1024, true);
+    IEQUAL(sbstore_count(mk->term->scrollback) < 10000, true);
+    IEQUAL(get_line_number(mk->term, -1), 11276);
+    IEQUAL(get_line_number(mk->term, -sbstore_count(mk->term->scrollback)),
+           11277 - sbstore_count(mk->term->scrollback));
+    conf_set_int(mk->conf, CONF_scrollback_max_kb, 0);
+    term_reconfig(mk->term, mk->conf);
+
+    term_clrsb(mk->term);
+    IEQUAL(sbstore_count(mk->term->scrollback), 0);
+}
+
+static void test_search(Mock *mk)
+{
+    /* Searching finds matches in the scrollback, going either way from
+     * the last match, and selects them */
+    mk->ucsdata->line_codepage = CP_ISO8859_1;
+
+    reset(mk);
+    term_size(mk->term, 24, 80, 1000);
+    write_numbered_lines(mk, 0, 1000);
+
+    IEQUAL(term_search(mk->term, L"line 500", -1), true);
+    IEQUAL(mk->term->selstate, SELECTED);
+    IEQUAL(mk->term->selstart.y, 500 - 977);
+    IEQUAL(mk->term->selstart.x, 0);
+    IEQUAL(mk->term->selend.y, 500 - 977);
+    IEQUAL(mk->term->selend.x, 8);
+    IEQUAL(mk->term->disptop <= 500 - 977, true);
+    IEQUAL(mk->term->disptop + 24 > 500 - 977, true);
+
+    IEQUAL(term_search(mk->term, L"line 50", -1), true);
+    IEQUAL(mk->term->selstart.y, 50 - 977);
+    IEQUAL(term_search(mk->term, L"line 50", +1), true);
+    IEQUAL(mk->term->selstart.y, 500 - 977);
+    IEQUAL(term_search(mk->term, L"ne 98", +1), true);
+    IEQUAL(mk->term->selstart.y, 980 - 977);
+    IEQUAL(mk->term->selstart.x, 2);
+
+    /* Short patterns, and ones that aren't there */
+    IEQUAL(term_search(mk->term, L"7", -1), true);
+    IEQUAL(mk->term->selstart.y, 979 - 977);
+    IEQUAL(mk->term->selstart.x, 6);
+    IEQUAL(term_search(mk->term, L"line 5000", -1), false);
+    IEQUAL(mk->term->selstart.y, 979 - 977);
+    IEQUAL(term_search(mk->term, L"", -1), false);
+
+    term_clrsb(mk->term);
+}
+
+static void test_export_text(Mock *mk)
+{
+    /* Exporting the whole terminal as UTF-8 gives the same text as
+     * copying it all to the clipboard */
+    static const int clips[] = { CLIP_LOCAL };
+    strbuf *exported = strbuf_new(), *copied = strbuf_new();
+
+    mk->ucsdata->line_codepage = CP_UTF8;
+    reset(mk);
+    term_size(mk->term, 24, 80, 1000);
+    write_numbered_lines(mk, 0, 100);
+    term_datapl(mk->term, PTRLEN_LITERAL(
+        "\xe4\xb8\xad\xe6\x96\x87 caf\xc3\xa9\r\n"
+        "0123456789012345678901234567890123456789"
+        "0123456789012345678901234567890123456789wrapped\r\n"));
+
+    term_export_text(mk->term, BinarySink_UPCAST(exported), true);
+    term_copyall(mk->term, clips, lenof(clips));
+    for (size_t i = 0; i < mk->term->last_selected_len; i++)
+        put_utf8_char(copied, mk->term->last_selected_text[i]);
+    IEQUAL(exported->len, copied->len);
+    IEQUAL(memcmp(exported->s, copied->s, copied->len), 0);
+    IEQUAL(ptrlen_startswith(ptrlen_from_strbuf(exported),
+                             PTRLEN_LITERAL("line 0\nline 1\n"), NULL), true);
+    IEQUAL(mk->term->last_selected_attr == NULL, true);
+
+    /* Without 'all', just the selection */
+    strbuf_clear(exported);
+    IEQUAL(term_search(mk->term, L"\x6587 caf", -1), true);
+    term_export_text(mk->term, BinarySink_UPCAST(exported), false);
+    IEQUAL(ptrlen_eq_string(ptrlen_from_strbuf(exported),
+                            "\xe6\x96\x87 caf"), true);
+
+    strbuf_free(exported);
+    strbuf_free(copied);
+    term_clrsb(mk->term);
+}
+
+static void test_ascii_run(Mock *mk)
+{
+    /* A long run of plain text, which term_out handles in bulk,
+     * still wraps, picks up the current attributes and stops at
+     * control characters */
+    mk->ucsdata->line_codepage = CP_ISO8859_1;
+
+    reset(mk);
+    term_datapl(mk->term, PTRLEN_LITERAL("\033[31m"
+        "0123456789012345678901234567890123456789"
+        "0123456789012345678901234567890123456789"
+        "abcdef\r\nxyz"));
+    IEQUAL(get_lineattr(mk->term, 0), LATTR_WRAPPED);
+    IEQUAL(get_termchar(mk->term, 79, 0).chr, CSET_ASCII | '9');
+    IEQUAL(get_termchar(mk->term, 0, 0).attr & ATTR_FGMASK,
+           1 << ATTR_FGSHIFT);
+    IEQUAL(get_termchar(mk->term, 5, 1).chr, CSET_ASCII | 'f');
+    IEQUAL(get_termchar(mk->term, 6, 1).chr, CSET_ASCII | ' ');
+    IEQUAL(get_termchar(mk->term, 2, 2).chr, CSET_ASCII | 'z');
+    IEQUAL(mk->term->curs.x, 3);
+    IEQUAL(mk->term->curs.y, 2);
+
+    /* With autowrap off, the run piles up in the last column */
+    reset(mk);
+    term_datapl(mk->term, PTRLEN_LITERAL("\033[?7l"
+        "0123456789012345678901234567890123456789"
+        "0123456789012345678901234567890123456789"
+        "abcdef"));
+    IEQUAL(get_lineattr(mk->term, 0), 0);
+    IEQUAL(get_termchar(mk->term, 78, 0).chr, CSET_ASCII | '8');
+    IEQUAL(get_termchar(mk->term, 79, 0).chr, CSET_ASCII | 'f');
+    IEQUAL(get_termchar(mk->term, 0, 1).chr, CSET_ASCII | ' ');
+    IEQUAL(mk->term->curs.x, 79);
+    IEQUAL(mk->term->curs.y, 0);
+}
+
+static void test_utf8_run(Mock *mk)
+{
+    /* Runs of UTF-8 are decoded in bulk, but a sequence split between
+     * two lots of input, or a malformed one, still comes out right */
+    mk->ucsdata->line_codepage = CP_UTF8;
+
+    reset(mk);
+    term_datapl(mk->term, PTRLEN_LITERAL(
+        "\xe4\xb8\xad\xe6\x96\x87\xe4\xb8\xad\xe6\x96\x87"
+        "\xe4\xb8\xad\xe6\x96\x87\xe4\xb8\xad\xe6\x96\x87"
+        "\xc3\xa9\xe4\xb8"));
+    IEQUAL(get_termchar(mk->term, 0, 0).chr, 0x4E2D);
+    IEQUAL(get_termchar(mk->term, 1, 0).chr, UCSWIDE);
+    IEQUAL(get_termchar(mk->term, 14, 0).chr, 0x6587);
+    IEQUAL(get_termchar(mk->term, 16, 0).chr, 0xE9);
+    IEQUAL(mk->term->curs.x, 17);
+    term_datapl(mk->term, PTRLEN_LITERAL("\xad\xe4\xb8x"));
+    IEQUAL(get_termchar(mk->term, 17, 0).chr, 0x4E2D);
+    IEQUAL(get_termchar(mk->term, 19, 0).chr, UCSERR);
+    IEQUAL(get_termchar(mk->term, 20, 0).chr, CSET_ASCII | 'x');
+    IEQUAL(mk->term->curs.x, 21);
+
+    /* A wide character that won't fit at the end of the line wraps */
+    reset(mk);
+    mk->term->curs.x = 79;
+    term_datapl(mk->term, PTRLEN_LITERAL("\xe4\xb8\xad"));
+    IEQUAL(get_lineattr(mk->term, 0), LATTR_WRAPPED | LATTR_WRAPPED2);
+    IEQUAL(get_termchar(mk->term, 0, 1).chr, 0x4E2D);
+    IEQUAL(mk->term->curs.x, 2);
+    IEQUAL(mk->term->curs.y, 1);
+}
+
+static void test_echo_update(Mock *mk)
+{
+    /* Output that follows a keypress is drawn even during the update
+     * cooldown; other output waits for the cooldown to end */
+    TermUpdateStats st;
+    unsigned long frames;
+
+    reset(mk);
+    mk->painting = true;
+    term_update(mk->term);
+    run_toplevel_callbacks();
+    term_get_update_stats(mk->term, &st);
+    frames = st.frames;
+
+    /* As if a frame had just been drawn. The stub timers never fire,
+     * so the cooldown never ends */
+    mk->term->window_update_cooldown = true;
+    term_datapl(mk->term, PTRLEN_LITERAL("a"));
+    run_toplevel_callbacks();
+    term_get_update_stats(mk->term, &st);
+    IEQUAL(st.frames, frames);
+
+    term_seen_key_event(mk->term);
+    term_datapl(mk->term, PTRLEN_LITERAL("b"));
+    run_toplevel_callbacks();
+    term_get_update_stats(mk->term, &st);
+    IEQUAL(st.frames, frames + 1);
+    IEQUAL(mk->term->echo_pending, false);
+
+    mk->painting = false;
+}
+
+static void test_output_timeslice(Mock *mk)
+{
+    /* Output processed in timeslices ends up the same as output
+     * processed all at once, once the callbacks have run */
+    strbuf *sb = strbuf_new();
+    for (int i = 0; i < 100000; i++)
+        put_fmt(sb, "line %d\r\n", i);
+    put_datapl(sb, PTRLEN_LITERAL("\033[Hend"));
+
+    reset(mk);
+    term_set_output_timeslice(mk->term, 1);
+    term_datapl(mk->term, ptrlen_from_strbuf(sb));
+    while (run_toplevel_callbacks());
+    IEQUAL(bufchain_size(&mk->term->inbuf), 0);
+    IEQUAL(get_termchar(mk->term, 0, 0).chr, CSET_ASCII | 'e');
+    IEQUAL(get_termchar(mk->term, 5, 1).chr, CSET_ASCII | '9');
+    IEQUAL(get_termchar(mk->term, 9, 22).chr, CSET_ASCII | '9');
+    IEQUAL(get_termchar(mk->term, 0, 23).chr, CSET_ASCII | ' ');
+    term_set_output_timeslice(mk->term, 0);
+
+    strbuf_free(sb);
+}
+
+static void test_output_timeslice_echo(Mock *mk)
+{
+    /* Replies to ENQ and DA that are echoed locally while output is
+     * being processed in timeslices are queued behind the rest of the
+     * output, not processed in the middle of it */
+    strbuf *sb = strbuf_new();
+    for (int i = 0; i < 100000; i++) {
+        put_fmt(sb, "line %d\r\n", i);
+        if (i == 99990)
+            put_datapl(sb, PTRLEN_LITERAL("\005\033[c"));
+    }
+    put_datapl(sb, PTRLEN_LITERAL("\033[Hend"));
+
+    reset(mk);
+    char *answerback = dupstr(conf_get_str(mk->conf, CONF_answerback));
+    conf_set_str(mk->conf, CONF_answerback, "AB");
+    term_reconfig(mk->term, mk->conf);
+    mk->echo = true;
+    strbuf_clear(mk->to_backend);
+    Ldisc *ldisc = ldisc_create(mk->conf, mk->term, &mk->backend, &mk->seat);
+
+    term_set_output_timeslice(mk->term, 1);
+    term_datapl(mk->term, ptrlen_from_strbuf(sb));
+    while (run_toplevel_callbacks());
+    IEQUAL(bufchain_size(&mk->term->inbuf), 0);
+    /* The answerback comes first, then exactly one DA reply */
+    IEQUAL(mk->to_backend->len > 5, true);
+    IEQUAL(memcmp(mk->to_backend->s + mk->to_backend->len - 5,
+                  "\033[?6c", 5), 0);
+    IEQUAL(memchr(mk->to_backend->s, '\033', mk->to_backend->len) ==
+           mk->to_backend->s + mk->to_backend->len - 5, true);
+    IEQUAL(get_termchar(mk->term, 0, 0).chr, CSET_ASCII | 'e');
+    IEQUAL(get_termchar(mk->term, 3, 0).chr, CSET_ASCII | 'A');
+    IEQUAL(get_termchar(mk->term, 4, 0).chr, CSET_ASCII | 'B');
+    IEQUAL(get_termchar(mk->term, 5, 0).chr, CSET_ASCII | '9');
+    IEQUAL(get_termchar(mk->term, 9, 22).chr, CSET_ASCII | '9');
+    IEQUAL(get_termchar(mk->term, 10, 22).chr, CSET_ASCII | ' ');
+    IEQUAL(mk->term->curs.x, 5);
+    IEQUAL(mk->term->curs.y, 0);
+    term_set_output_timeslice(mk->term, 0);
+
+    ldisc_free(ldisc);
+    mk->echo = false;
+    conf_set_str(mk->conf, CONF_answerback, answerback);
+    term_reconfig(mk->term, mk->conf);
+    sfree(answerback);
+    strbuf_free(sb);
+}
+
+static void test_paste_chunks(Mock *mk)
+{
+    /* A long paste with no line breaks goes out in bounded chunks,
+     * and can be cancelled part way through */
+    wchar_t *data = snewn(10000, wchar_t);
+    size_t done, total;
+    for (size_t i = 0; i < 10000; i++)
+        data[i] = 'a';
+
+    reset(mk);
+    while (run_toplevel_callbacks());
+    term_do_paste(mk->term, data, 10000);
+    IEQUAL(term_paste_progress(mk->term, &done, &total), true);
+    IEQUAL(done, 0);
+    IEQUAL(total, 10000);
+    while (run_toplevel_callbacks() &&
+           term_paste_progress(mk->term, &done, &total) && done == 0);
+    IEQUAL(done, 4096);
+    while (run_toplevel_callbacks());
+    IEQUAL(term_paste_progress(mk->term, &done, &total), false);
+
+    term_do_paste(mk->term, data, 10000);
+    term_nopaste(mk->term);
+    IEQUAL(term_paste_progress(mk->term, &done, &total), false);
+    while (run_toplevel_callbacks());
+
+    /* A UTF-8 paste is held as it is, and a chunk never ends partway
+     * through a character */
+    char *utf8 = snewn(10000, char);
+    memset(utf8, 'a', 10000);
+    utf8[4095] = (char)0xC3;
+    utf8[4096] = (char)0xA9;
+    term_do_paste_utf8(mk->term, utf8, 10000);
+    IEQUAL(term_paste_progress(mk->term, &done, &total), true);
+    IEQUAL(total, 10000);
+    while (run_toplevel_callbacks() &&
+           term_paste_progress(mk->term, &done, &total) && done == 0);
+    IEQUAL(done, 4095);
+    while (run_toplevel_callbacks());
+
+    /* Control characters are filtered out before it's queued, and
+     * the clipboard's newlines become CR */
+    static const wchar_t sel_nl[] = SEL_NL;
+    size_t len = 300;
+    memcpy(utf8 + len, "x\033y\xC2\x85z", 6);
+    len += 6;
+    for (size_t i = 0; i < lenof(sel_nl); i++)
+        utf8[len++] = sel_nl[i];
+    term_do_paste_utf8(mk->term, utf8, len);
+    IEQUAL(term_paste_progress(mk->term, &done, &total), true);
+    IEQUAL(total, 304);
+    term_nopaste(mk->term);
+    while (run_toplevel_callbacks());
+
+    sfree(utf8);
+    sfree(data);
+}
+
+static void test_reflow(Mock *mk)
+{
+    /* A wrapped line is rewrapped when the width changes, and the
+     * cursor stays on the same character */
+    reset(mk);
+    mk->term->reflow_on_resize = true;
+    mk->term->wrap = true;
+    for (int i = 0; i < 100; i++) {
+        char c = 'a' + i % 26;
+        term_data(mk->term, &c, 1);
+    }
+    term_datapl(mk->term, PTRLEN_LITERAL("\r\nxyz\b"));
+    IEQUAL(get_lineattr(mk->term, 0), LATTR_WRAPPED);
+    IEQUAL(mk->term->curs.y, 2);
+    IEQUAL(mk->term->curs.x, 2);
+
+    term_size(mk->term, 24, 40, 0);
+    IEQUAL(get_lineattr(mk->term, 0), LATTR_WRAPPED);
+    IEQUAL(get_lineattr(mk->term, 1), LATTR_WRAPPED);
+    IEQUAL(get_lineattr(mk->term, 2), 0);
+    IEQUAL(get_termchar(mk->term, 0, 1).chr, CSET_ASCII | 'o');
+    IEQUAL(get_termchar(mk->term, 19, 2).chr, CSET_ASCII | 'v');
+    IEQUAL(get_termchar(mk->term, 20, 2).chr, CSET_ASCII | ' ');
+    IEQUAL(get_termchar(mk->term, 0, 3).chr, CSET_ASCII | 'x');
+    IEQUAL(mk->term->curs.y, 3);
+    IEQUAL(mk->term->curs.x, 2);
+
+    term_size(mk->term, 24, 120, 0);
+    IEQUAL(get_lineattr(mk->term, 0), 0);
+    IEQUAL(get_termchar(mk->term, 99, 0).chr, CSET_ASCII | 'v');
+    IEQUAL(get_termchar(mk->term, 100, 0).chr, CSET_ASCII | ' ');
+    IEQUAL(get_termchar(mk->term, 0, 1).chr, CSET_ASCII | 'x');
+    IEQUAL(mk->term->curs.y, 1);
+    IEQUAL(mk->term->curs.x, 2);
+
+    /* Lines that no longer fit go into the scrollback, and come back
+     * when there's room for them again */
+    term_size(mk->term, 3, 40, 100);
+    IEQUAL(sbstore_count(mk->term->scrollback), 1);
+    IEQUAL(get_termchar(mk->term, 0, 0).chr, CSET_ASCII | 'o');
+    IEQUAL(get_termchar(mk->term, 0, 2).chr, CSET_ASCII | 'x');
+    IEQUAL(mk->term->curs.y, 2);
+    term_size(mk->term, 3, 120, 100);
+    IEQUAL(sbstore_count(mk->term->scrollback), 0);
+    IEQUAL(get_lineattr(mk->term, 0), 0);
+    IEQUAL(get_termchar(mk->term, 0, 0).chr, CSET_ASCII | 'a');
+    IEQUAL(get_termchar(mk->term, 99, 0).chr, CSET_ASCII | 'v');
+    IEQUAL(get_termchar(mk->term, 0, 1).chr, CSET_ASCII | 'x');
+    IEQUAL(mk->term->curs.y, 1);
+    IEQUAL(mk->term->curs.x, 2);
+
+    /* The saved cursor follows its character in the same way */
+    reset(mk);
+    mk->term->wrap = true;
+    for (int i = 0; i < 100; i++) {
+        char c = 'a' + i % 26;
+        term_data(mk->term, &c, 1);
+    }
+    term_datapl(mk->term, PTRLEN_LITERAL("\033[2;11H\0337\033[3;1H"));
+    IEQUAL(mk->term->savecurs.y, 1);
+    IEQUAL(mk->term->savecurs.x, 10);
+    term_size(mk->term, 24, 40, 0);
+    IEQUAL(mk->term->savecurs.y, 2);
+    IEQUAL(mk->term->savecurs.x, 10);
+    term_size(mk->term, 24, 120, 0);
+    IEQUAL(mk->term->savecurs.y, 0);
+    IEQUAL(mk->term->savecurs.x, 90);
+
+    /* A double-width character that doesn't fit moves to the next
+     * line whole */
+    reset(mk);
+    mk->term->wrap = true;
+    mk->term->utf = true;
+    term_datapl(mk->term, PTRLEN_LITERAL("abc\xEA\xB0\x80"));
+    term_size(mk->term, 24, 4, 0);
+    IEQUAL(get_lineattr(mk->term, 0), LATTR_WRAPPED | LATTR_WRAPPED2);
+    IEQUAL(get_termchar(mk->term, 0, 1).chr, 0xAC00);
+    IEQUAL(get_termchar(mk->term, 1, 1).chr, UCSWIDE);
+    term_size(mk->term, 24, 80, 0);
+    IEQUAL(get_lineattr(mk->term, 0), 0);
+    IEQUAL(get_termchar(mk->term, 3, 0).chr, 0xAC00);
+
+    /* With the option off, lines are cut off as before */
+    mk->term->reflow_on_resize = false;
+    reset(mk);
+    term_datapl(mk->term, PTRLEN_LITERAL("abcdef"));
+    term_size(mk->term, 24, 4, 0);
+    IEQUAL(get_lineattr(mk->term, 0), 0);
+    IEQUAL(get_termchar(mk->term, 0, 1).chr, CSET_ASCII | ' ');
+    term_size(mk->term, 24, 80, 0);
+}
+
 int main(void)
 {
     Mock *mk = mock_new();
@@ -490,6 +1142,18 @@ int main(void)
     test_hello_world(mk);
     test_wrap(mk);
     test_nonwrap(mk);
+    test_scroll_display(mk);
+    test_bidi_cache(mk);
+    test_scrollback(mk);
+    test_search(mk);
+    test_export_text(mk);
+    test_ascii_run(mk);
+    test_utf8_run(mk);
+    test_echo_update(mk);
+    test_output_timeslice(mk);
+    test_output_timeslice_echo(mk);
+    test_paste_chunks(mk);
+    test_reflow(mk);
 
     bool failed = mk->any_test_failed;
     mock_free(mk);
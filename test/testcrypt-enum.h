@@ -19,6 +19,10 @@ BEGIN_ENUM_TYPE(hashalg)
 #if HAVE_NEON_SHA512
     ENUM_VALUE("sha384_neon", &ssh_sha384_neon)
     ENUM_VALUE("sha512_neon", &ssh_sha512_neon)
+#endif
+#if HAVE_AVX2
+    ENUM_VALUE("sha384_avx2", &ssh_sha384_avx2)
+    ENUM_VALUE("sha512_avx2", &ssh_sha512_avx2)
 #endif
     ENUM_VALUE("sha3_224", &ssh_sha3_224)
     ENUM_VALUE("sha3_256", &ssh_sha3_256)
@@ -47,6 +51,12 @@ BEGIN_ENUM_TYPE(macalg)
 #if HAVE_NEON_PMULL
     ENUM_VALUE("aesgcm_neon", &ssh2_aesgcm_mac_neon)
 #endif
+#if HAVE_AESGCM_NI
+    ENUM_VALUE("aesgcm_ni", &ssh2_aesgcm_mac_ni)
+#endif
+#if HAVE_VAES
+    ENUM_VALUE("aesgcm_vaes", &ssh2_aesgcm_mac_vaes)
+#endif
 END_ENUM_TYPE(macalg)
 
 BEGIN_ENUM_TYPE(keyalg)
@@ -116,6 +126,16 @@ BEGIN_ENUM_TYPE(cipheralg)
     ENUM_VALUE("arcfour256", &ssh_arcfour256_ssh2)
     ENUM_VALUE("arcfour128", &ssh_arcfour128_ssh2)
     ENUM_VALUE("chacha20_poly1305", &ssh2_chacha20_poly1305)
+    ENUM_VALUE("chacha20_poly1305_sw", &ssh2_chacha20_poly1305_sw)
+#if HAVE_SSE2
+    ENUM_VALUE("chacha20_poly1305_sse2", &ssh2_chacha20_poly1305_sse2)
+#endif
+#if HAVE_AVX2
+    ENUM_VALUE("chacha20_poly1305_avx2", &ssh2_chacha20_poly1305_avx2)
+#endif
+#if HAVE_AVX512
+    ENUM_VALUE("chacha20_poly1305_avx512", &ssh2_chacha20_poly1305_avx512)
+#endif
 END_ENUM_TYPE(cipheralg)
 
 BEGIN_ENUM_TYPE(dh_group)
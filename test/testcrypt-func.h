@@ -275,6 +275,12 @@ FUNC(void, ssh2_mac_start, ARG(val_mac, m))
 FUNC(void, ssh2_mac_update, ARG(val_mac, m), ARG(val_string_ptrlen, data))
 FUNC(void, ssh2_mac_next_message, ARG(val_mac, m))
 FUNC_WRAPPED(val_string, ssh2_mac_genresult, ARG(val_mac, m))
+FUNC_WRAPPED(val_string, ssh2_mac_encrypt_and_generate, ARG(val_mac, m),
+     ARG(opt_val_cipher, c), ARG(val_string_ptrlen, data),
+     ARG(uint, clearlen), ARG(uint, seq))
+FUNC_WRAPPED(opt_val_string, ssh2_mac_verify_and_decrypt, ARG(val_mac, m),
+     ARG(opt_val_cipher, c), ARG(val_string_ptrlen, data),
+     ARG(uint, clearlen), ARG(uint, seq))
 FUNC(val_string_asciz_const, ssh2_mac_text_name, ARG(val_mac, m))
 
 FUNC(void, aesgcm_set_prefix_lengths,
@@ -352,6 +358,8 @@ FUNC_WRAPPED(val_string, ssh_cipher_encrypt_length, ARG(val_cipher, c),
 FUNC_WRAPPED(val_string, ssh_cipher_decrypt_length, ARG(val_cipher, c),
              ARG(val_string_ptrlen, blk), ARG(uint, seq))
 FUNC(void, ssh_cipher_next_message, ARG(val_cipher, c))
+FUNC_WRAPPED(val_string, ssh_cipher_encrypt_packets, ARG(val_cipher, c),
+             ARG(val_string_ptrlen, pkts), ARG(uint, seq))
 
 /*
  * Integer Diffie-Hellman.
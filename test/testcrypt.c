@@ -799,6 +799,50 @@ strbuf *ssh_cipher_decrypt_length_wrapper(ssh_cipher *c, ptrlen input,
     return sb;
 }
 
+strbuf *ssh_cipher_encrypt_packets_wrapper(ssh_cipher *c, ptrlen input,
+                                           unsigned long seq)
+{
+    /*
+     * The input is a sequence of plaintext packets, each starting
+     * with its length field, and numbered consecutively from 'seq'.
+     * The output has each one encrypted and followed by its MAC.
+     */
+    if (!c->vt->encrypt_packets)
+        fatal_error("ssh_cipher_encrypt_packets: not supported by %s",
+                    c->vt->text_name);
+    size_t maclen = c->vt->required_mac->len;
+
+    strbuf *sb = strbuf_new();
+    ssh_cipher_packet *pkts = NULL;
+    size_t npkts = 0, pktsize = 0;
+
+    BinarySource src[1];
+    BinarySource_BARE_INIT_PL(src, input);
+    while (get_avail(src)) {
+        ptrlen body = get_string(src);
+        if (get_err(src))
+            fatal_error("ssh_cipher_encrypt_packets: truncated packet");
+        put_uint32(sb, body.len);
+        put_datapl(sb, body);
+        memset(strbuf_append(sb, maclen), 0, maclen);
+
+        sgrowarray(pkts, pktsize, npkts);
+        pkts[npkts].len = 4 + body.len;
+        pkts[npkts].seq = seq + npkts;
+        npkts++;
+    }
+
+    unsigned char *data = sb->u;
+    for (size_t i = 0; i < npkts; i++) {
+        pkts[i].data = data;
+        data += pkts[i].len + maclen;
+    }
+    ssh_cipher_encrypt_packets(c, pkts, npkts);
+
+    sfree(pkts);
+    return sb;
+}
+
 strbuf *ssh2_mac_genresult_wrapper(ssh2_mac *m)
 {
     strbuf *sb = strbuf_new();
@@ -807,6 +851,37 @@ strbuf *ssh2_mac_genresult_wrapper(ssh2_mac *m)
     return sb;
 }
 
+strbuf *ssh2_mac_encrypt_and_generate_wrapper(
+    ssh2_mac *m, ssh_cipher *c, ptrlen input, size_t clearlen,
+    unsigned long seq)
+{
+    if (clearlen > input.len)
+        fatal_error("ssh2_mac_encrypt_and_generate: clearlen too long");
+    strbuf *sb = strbuf_dup(input);
+    strbuf_append(sb, ssh2_mac_alg(m)->len);
+    ssh2_mac_encrypt_and_generate(m, c, sb->u, input.len, clearlen, seq);
+    return sb;
+}
+
+strbuf *ssh2_mac_verify_and_decrypt_wrapper(
+    ssh2_mac *m, ssh_cipher *c, ptrlen input, size_t clearlen,
+    unsigned long seq)
+{
+    /* Returns the decrypted data without the MAC, or NULL if the MAC
+     * didn't verify */
+    size_t maclen = ssh2_mac_alg(m)->len;
+    if (input.len < clearlen + maclen)
+        fatal_error("ssh2_mac_verify_and_decrypt: input too short");
+    strbuf *sb = strbuf_dup(input);
+    if (!ssh2_mac_verify_and_decrypt(m, c, sb->u, input.len - maclen,
+                                     clearlen, seq)) {
+        strbuf_free(sb);
+        return NULL;
+    }
+    strbuf_shrink_to(sb, input.len - maclen);
+    return sb;
+}
+
 ssh_key *ssh_key_base_key_wrapper(ssh_key *key)
 {
     /* To avoid having to explain the borrowed reference to Python,
@@ -1336,6 +1411,12 @@ strbuf *get_implementations_commasep(ptrlen alg)
 #if HAVE_CLMUL
         put_fmt(out, ",%.*s_clmul", PTRLEN_PRINTF(alg));
 #endif
+#if HAVE_AESGCM_NI
+        put_fmt(out, ",%.*s_ni", PTRLEN_PRINTF(alg));
+#endif
+#if HAVE_VAES
+        put_fmt(out, ",%.*s_vaes", PTRLEN_PRINTF(alg));
+#endif
 #if HAVE_NEON_PMULL
         put_fmt(out, ",%.*s_neon", PTRLEN_PRINTF(alg));
 #endif
@@ -1356,10 +1437,26 @@ strbuf *get_implementations_commasep(ptrlen alg)
 #if HAVE_NEON_CRYPTO
         put_fmt(out, ",%.*s_neon", PTRLEN_PRINTF(alg));
 #endif
-    } else if (ptrlen_startswith(alg, PTRLEN_LITERAL("sha512"), NULL)) {
+    } else if (ptrlen_startswith(alg, PTRLEN_LITERAL("sha512"), NULL) ||
+               ptrlen_startswith(alg, PTRLEN_LITERAL("sha384"), NULL)) {
         put_fmt(out, ",%.*s_sw", PTRLEN_PRINTF(alg));
 #if HAVE_NEON_SHA512
         put_fmt(out, ",%.*s_neon", PTRLEN_PRINTF(alg));
+#endif
+#if HAVE_AVX2
+        put_fmt(out, ",%.*s_avx2", PTRLEN_PRINTF(alg));
+#endif
+    } else if (ptrlen_startswith(alg, PTRLEN_LITERAL("chacha20_poly1305"),
+                                 NULL)) {
+        put_fmt(out, ",%.*s_sw", PTRLEN_PRINTF(alg));
+#if HAVE_SSE2
+        put_fmt(out, ",%.*s_sse2", PTRLEN_PRINTF(alg));
+#endif
+#if HAVE_AVX2
+        put_fmt(out, ",%.*s_avx2", PTRLEN_PRINTF(alg));
+#endif
+#if HAVE_AVX512
+        put_fmt(out, ",%.*s_avx512", PTRLEN_PRINTF(alg));
 #endif
     }
 
@@ -265,6 +265,36 @@ VOLATILE_WRAPPED_DEFN(static, size_t, looplimit, (size_t x))
 #define IF_CLMUL(x)
 #endif
 
+#if HAVE_SSE2
+#define IF_SSE2(x) x
+#else
+#define IF_SSE2(x)
+#endif
+
+#if HAVE_AVX2
+#define IF_AVX2(x) x
+#else
+#define IF_AVX2(x)
+#endif
+
+#if HAVE_AVX512
+#define IF_AVX512(x) x
+#else
+#define IF_AVX512(x)
+#endif
+
+#if HAVE_AESGCM_NI
+#define IF_AESGCM_NI(x) x
+#else
+#define IF_AESGCM_NI(x)
+#endif
+
+#if HAVE_VAES
+#define IF_VAES(x) x
+#else
+#define IF_VAES(x)
+#endif
+
 #if HAVE_NEON_CRYPTO
 #define IF_NEON_CRYPTO(x) x
 #else
@@ -328,6 +358,10 @@ VOLATILE_WRAPPED_DEFN(static, size_t, looplimit, (size_t x))
     IF_NEON_CRYPTO(X(Y, ssh_aes128_gcm_neon))   \
     IF_NEON_CRYPTO(X(Y, ssh_aes128_cbc_neon))   \
     X(Y, ssh2_chacha20_poly1305)                \
+    X(Y, ssh2_chacha20_poly1305_sw)             \
+    IF_SSE2(X(Y, ssh2_chacha20_poly1305_sse2))  \
+    IF_AVX2(X(Y, ssh2_chacha20_poly1305_avx2))  \
+    IF_AVX512(X(Y, ssh2_chacha20_poly1305_avx512)) \
     /* end of list */
 
 #define CIPHER_TESTLIST(X, name) X(cipher_ ## name)
@@ -345,6 +379,8 @@ VOLATILE_WRAPPED_DEFN(static, size_t, looplimit, (size_t x))
 #define ALL_MACS(X, Y)                                      \
     SIMPLE_MACS(X, Y)                                       \
     X(Y, poly1305)                                          \
+    X(Y, poly1305_sw)                                       \
+    IF_AVX2(X(Y, poly1305_avx2))                            \
     X(Y, aesgcm_sw_sw)                                      \
     X(Y, aesgcm_sw_refpoly)                                 \
     IF_AES_NI(X(Y, aesgcm_ni_sw))                           \
@@ -352,6 +388,10 @@ VOLATILE_WRAPPED_DEFN(static, size_t, looplimit, (size_t x))
     IF_CLMUL(X(Y, aesgcm_sw_clmul))                         \
     IF_NEON_PMULL(X(Y, aesgcm_sw_neon))                     \
     IF_AES_NI(IF_CLMUL(X(Y, aesgcm_ni_clmul)))              \
+    IF_AESGCM_NI(X(Y, aesgcm_sw_ni))                        \
+    IF_AESGCM_NI(X(Y, aesgcm_ni_ni))                        \
+    IF_VAES(X(Y, aesgcm_sw_vaes))                           \
+    IF_VAES(X(Y, aesgcm_ni_vaes))                           \
     IF_NEON_CRYPTO(IF_NEON_PMULL(X(Y, aesgcm_neon_neon)))   \
     /* end of list */
 
@@ -373,6 +413,8 @@ VOLATILE_WRAPPED_DEFN(static, size_t, looplimit, (size_t x))
     IF_NEON_CRYPTO(X(Y, ssh_sha1_neon))         \
     IF_NEON_SHA512(X(Y, ssh_sha384_neon))       \
     IF_NEON_SHA512(X(Y, ssh_sha512_neon))       \
+    IF_AVX2(X(Y, ssh_sha384_avx2))              \
+    IF_AVX2(X(Y, ssh_sha512_avx2))              \
     X(Y, ssh_sha3_224)                          \
     X(Y, ssh_sha3_256)                          \
     X(Y, ssh_sha3_384)                          \
@@ -1425,6 +1467,11 @@ static void test_cipher(const ssh_cipheralg *calg)
         if (calg->flags & SSH_CIPHER_SEPARATE_LENGTH)
             ssh_cipher_decrypt_length(c, data, datalen, seq);
         ssh_cipher_decrypt(c, data, datalen);
+        if (calg->encrypt_packets) {
+            ssh_cipher_packet pkt = { .data = data, .len = datalen,
+                                      .seq = seq };
+            ssh_cipher_encrypt_packets(c, &pkt, 1);
+        }
         log_end();
     }
 
@@ -1487,6 +1534,13 @@ static void test_mac(const ssh2_macalg *malg, const ssh_cipheralg *calg)
         ssh2_mac_setkey(m, make_ptrlen(mkey, malg->keylen));
         ssh2_mac_generate(m, data, datalen, seq);
         ssh2_mac_verify(m, data, datalen, seq);
+        if (c) {
+            /* Also try the encrypt-then-MAC functions, on a packet
+             * with a 4-byte length field followed by whole blocks */
+            size_t etmlen = datalen - 12;
+            ssh2_mac_encrypt_and_generate(m, c, data, etmlen, 4, seq);
+            ssh2_mac_verify_and_decrypt(m, c, data, etmlen, 4, seq);
+        }
         log_end();
     }
 
@@ -1508,6 +1562,18 @@ static void test_mac_poly1305(void)
     test_mac(&ssh2_poly1305, &ssh2_chacha20_poly1305);
 }
 
+static void test_mac_poly1305_sw(void)
+{
+    test_mac(&ssh2_poly1305, &ssh2_chacha20_poly1305_sw);
+}
+
+#if HAVE_AVX2
+static void test_mac_poly1305_avx2(void)
+{
+    test_mac(&ssh2_poly1305, &ssh2_chacha20_poly1305_avx2);
+}
+#endif
+
 static void test_mac_aesgcm_sw_sw(void)
 {
     test_mac(&ssh2_aesgcm_mac_sw, &ssh_aes128_gcm_sw);
@@ -1553,6 +1619,30 @@ static void test_mac_aesgcm_ni_clmul(void)
 }
 #endif
 
+#if HAVE_AESGCM_NI
+static void test_mac_aesgcm_sw_ni(void)
+{
+    test_mac(&ssh2_aesgcm_mac_ni, &ssh_aes128_gcm_sw);
+}
+
+static void test_mac_aesgcm_ni_ni(void)
+{
+    test_mac(&ssh2_aesgcm_mac_ni, &ssh_aes128_gcm_ni);
+}
+#endif
+
+#if HAVE_VAES
+static void test_mac_aesgcm_sw_vaes(void)
+{
+    test_mac(&ssh2_aesgcm_mac_vaes, &ssh_aes128_gcm_sw);
+}
+
+static void test_mac_aesgcm_ni_vaes(void)
+{
+    test_mac(&ssh2_aesgcm_mac_vaes, &ssh_aes128_gcm_ni);
+}
+#endif
+
 #if HAVE_NEON_CRYPTO && HAVE_NEON_PMULL
 static void test_mac_aesgcm_neon_neon(void)
 {
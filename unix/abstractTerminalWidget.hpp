@@ -37,7 +37,7 @@ class AbstractTerminalWidget : public QWidget {
   virtual ~AbstractTerminalWidget() {}
 
   virtual void init() = 0;
-  virtual void scroll(int lines) = 0;
+  virtual bool scroll(int topline, int botline, int lines) = 0;
 
   virtual void drawText(TermWin *tw, int x, int y, wchar_t *text, int len,
                         unsigned long attr, int lattr, truecolour tc) = 0;
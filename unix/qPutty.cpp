@@ -37,6 +37,7 @@
 #include <QMessageBox>
 #include <QPainter>
 #include <QProcess>
+#include <QScreen>
 #include <QTemporaryFile>
 #include <QTextLayout>
 #include <QX11Info>
@@ -135,6 +136,11 @@ static size_t qt_seat_output(Seat *seat, SeatOutputType type, const void *data,
   return term_data(inst->term, data, len);
 }
 
+static void qt_seat_sent(Seat *seat, size_t bufsize) {
+  QtFrontend *inst = container_of(seat, struct QtFrontend, seat);
+  if (inst->term) term_backend_sent(inst->term, bufsize);
+}
+
 static SeatPromptResult qt_seat_get_userpass_input(Seat *seat, prompts_t *p) {
   QtFrontend *inst = container_of(seat, struct QtFrontend, seat);
   SeatPromptResult spr;
@@ -285,7 +291,7 @@ static bool qt_seat_get_windowid(Seat *seat, long *id) {
 static const SeatVtable qt_seat_vt = {
     .output = qt_seat_output,
     .eof = qt_seat_eof,
-    .sent = nullseat_sent,
+    .sent = qt_seat_sent,
     .banner = nullseat_banner_to_stderr,
     .get_userpass_input = qt_seat_get_userpass_input,
     .notify_session_started = nullseat_notify_session_started,
@@ -351,6 +357,11 @@ static int qtwin_char_width(TermWin *tw, int uc) {
   return 1;
 }
 
+static bool qtwin_scroll(TermWin *tw, int topline, int botline, int lines) {
+  QtFrontend *inst = container_of(tw, struct QtFrontend, termwin);
+  return static_cast<QPutty *>(inst->owner)->scroll(topline, botline, lines);
+}
+
 static void qtwin_free_draw_ctx(TermWin *tw) {
   QtFrontend *inst = container_of(tw, struct QtFrontend, termwin);
   static_cast<QPutty *>(inst->owner)->freeDrawCtx(tw);
@@ -641,6 +652,7 @@ static const TermWinVtable qt_termwin_vt = {
     .draw_cursor = qtwin_draw_cursor,
     .draw_trust_sigil = qtwin_draw_trust_sigil,
     .char_width = qtwin_char_width,
+    .scroll = qtwin_scroll,
     .free_draw_ctx = qtwin_free_draw_ctx,
     .set_cursor_pos = qtwin_set_cursor_pos,
     .set_raw_mouse_mode = qtwin_set_raw_mouse_mode,
@@ -874,7 +886,9 @@ void QPutty::close(int exitCode) {
   }
 }
 
-void QPutty::scroll(int lines) { _terminalWidget->scroll(lines); }
+bool QPutty::scroll(int topline, int botline, int lines) {
+  return _terminalWidget->scroll(topline, botline, lines);
+}
 
 #ifdef Q_OS_WIN
 bool QPutty::winEvent(MSG *msg, long *result) {
@@ -1431,6 +1445,9 @@ void QPutty::setupTerminalControl() {
     _inst.term = term_init(_inst.conf, &_inst.ucsdata, &_inst.termwin);
     setupClipboards( );
     term_provide_logctx(_inst.term, _inst.logctx);
+    if (QScreen *screen = QGuiApplication::primaryScreen())
+      term_set_refresh_rate(_inst.term, qRound(screen->refreshRate()));
+    term_set_output_timeslice(_inst.term, TICKSPERSEC / 50);
   }
 
   
@@ -83,7 +83,7 @@ class QPutty : public QWidget {
   void setupClipboards();
 
   virtual void close(int exitCode);
-  virtual void scroll(int lines);
+  virtual bool scroll(int topline, int botline, int lines);
 #ifdef Q_OS_WIN
   bool winEvent(MSG* msg, long* result);
 #else
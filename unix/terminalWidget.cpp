@@ -23,6 +23,8 @@
  */
 #include "terminalWidget.h"
 
+#include <algorithm>
+
 #include <QApplication>
 #include <QBrush>
 #include <QClipboard>
@@ -66,6 +68,18 @@ void start_backend(struct QtFrontend* inst);
    QCodec.
 */
 
+/*
+ * Upper bound, in bytes of pixel data, on the rendered-glyph cache.
+ */
+#define GLYPH_CACHE_BYTES (8 * 1024 * 1024)
+
+/*
+ * Geometry of the character width cache: 256 code points to a page,
+ * and enough pages to cover U+0000 to U+10FFFF.
+ */
+#define WIDTH_PAGE_SIZE 256
+#define WIDTH_NPAGES (0x110000 / WIDTH_PAGE_SIZE)
+
 static inline bool isLineChar(wchar_t c) { return ((c & 0xFF80) == 0x2500); }
 static inline bool isLineCharString(const std::wstring& string) {
   return (string.length() > 0) && (isLineChar(string[0]));
@@ -90,7 +104,8 @@ Widget::Widget(struct ::QtFrontend* inst, QWidget* p)
       _nextNow(0),
       _timer(this),
       _minDelta(120),
-      _transform(QTransform::fromScale(1, 1)) {
+      _transform(QTransform::fromScale(1, 1)),
+      _glyphCache(GLYPH_CACHE_BYTES) {
   setFocusPolicy(Qt::StrongFocus);
   setAttribute(Qt::WA_OpaquePaintEvent);
   QWidget::setCursor(QCursor(Qt::IBeamCursor));
@@ -110,6 +125,7 @@ Widget::~Widget() {
   }
   // delete mpainter;
   delete mcanvas;
+  clearWidthCache();
 }
 
 void Widget::init() {
@@ -119,9 +135,35 @@ void Widget::init() {
   installEventFilter(this);
 }
 
-void Widget::scroll(int lines) {
-  if (lines >= _inst->term->rows - 1) return;
-  QWidget::scroll(0, -(lines * _inst->font_height * _transform.m22()));
+bool Widget::scroll(int topline, int botline, int lines) {
+  if (!mpainter) return false;
+
+  QRect rect(_inst->window_border,
+             topline * _inst->font_height + _inst->window_border,
+             _inst->term->cols * _inst->font_width,
+             (botline - topline + 1) * _inst->font_height);
+  int dy = -lines * _inst->font_height;
+
+  /*
+   * A pixmap can't be scrolled while a painter is active on it, so
+   * get anything already queued this frame on to the canvas and
+   * close the painter around the blit.
+   */
+  flushDrawList(*mpainter);
+  mpainter->end();
+  mcanvas->scroll(0, dy, rect);
+  mpainter->begin(mcanvas);
+
+  /*
+   * Damage already recorded inside the region has moved with it.
+   * What's on screen is moved the same way, which leaves Qt to
+   * repaint only the strip uncovered at the edge, and that is
+   * exactly what the terminal is about to redraw.
+   */
+  QRegion moved = (_damage & rect).translated(0, dy) & rect;
+  _damage = (_damage - rect) + moved;
+  QWidget::scroll(0, dy, rect);
+  return true;
 }
 
 // void Widget::setCursor(int, int, const QString& text, unsigned long attr) {
@@ -138,42 +180,108 @@ void Widget::setDrawCtx(TermWin* tw) {
 
   mpainter = new QPainter(mcanvas);
   // mpainter->setCompositionMode(QPainter::CompositionMode_SourceAtop);
+
+  /*
+   * Cached glyphs are only good for the fonts they were rendered
+   * from, so drop them all if any font has changed since last time.
+   */
+  QString fontKey;
+  for (int i = 0; i < 4; i++)
+    if (_inst->fonts[i]) fontKey += _inst->fonts[i]->key() + QLatin1Char('/');
+  if (fontKey != _glyphFontKey) {
+    _glyphCache.clear();
+    clearWidthCache();
+    _glyphFontKey = fontKey;
+  }
 }
 
 void Widget::freeDrawCtx(TermWin* tw) {
   if (mpainter) {
+    flushDrawList(*mpainter);
     delete mpainter;
   }
   mpainter = nullptr;
+
+  /*
+   * Ask for a repaint of just the cells that changed this frame, so
+   * that paintEvent only has to copy those parts of the canvas.
+   */
+  if (!_damage.isEmpty()) {
+    update(_damage);
+    _damage = QRegion();
+  }
 }
 
-int Widget::fontCharWidth(QFont& font, wchar_t uchr) {
+int Widget::fontCharWidth(QFont& font, uint fontslot, wchar_t uchr) {
   /*
    * Here we check whether a character has the same width as the
    * character cell it'll be drawn in. Because profiling showed that
-   * asking Pango for text sizes was a huge bottleneck when we were
-   * calling it every time we needed to know this, we instead call
-   * it only on characters we don't already know about, and cache
-   * the results.
+   * asking for text sizes was a huge bottleneck when we were calling
+   * it every time we needed to know this, we instead call it only on
+   * characters we don't already know about, and cache the results.
    */
-#if 0
-    if ((unsigned)uchr >= nwidthcache) {
-        unsigned newsize = ((int)uchr + 0x100) & ~0xFF;
-        widthcache = sresize(widthcache, newsize, int);
-        while (nwidthcache < newsize)
-            widthcache[nwidthcache++] = -1;
-    }
+  unsigned code = uchr;
+  if (code >= 0x110000)
+    return QFontMetrics(font).horizontalAdvance(
+        QString::fromWCharArray(&uchr, 1));
+
+  uint slot = (fontslot & 3) | (fontslot & GLYPH_SYNTHBOLD ? 4 : 0);
+  qint16**& pages = _widthPages[slot];
+  if (!pages) {
+    pages = snewn(WIDTH_NPAGES, qint16*);
+    memset(pages, 0, WIDTH_NPAGES * sizeof(qint16*));
+  }
 
-    if (widthcache[uchr] < 0) {
-        QFontMetrics fm(font);
-        int result = fm.width(uchr);
-        widthcache[uchr] = result;
-    }
+  qint16*& page = pages[code / WIDTH_PAGE_SIZE];
+  if (!page) {
+    page = snewn(WIDTH_PAGE_SIZE, qint16);
+    for (int i = 0; i < WIDTH_PAGE_SIZE; i++) page[i] = -1;
+  }
 
-    return result;
-#endif
+  qint16& width = page[code % WIDTH_PAGE_SIZE];
+  if (width < 0)
+    width = QFontMetrics(font).horizontalAdvance(
+        QString::fromWCharArray(&uchr, 1));
+  return width;
+}
+
+void Widget::clearWidthCache() {
+  for (int slot = 0; slot < 8; slot++) {
+    qint16** pages = _widthPages[slot];
+    if (!pages) continue;
+    for (int i = 0; i < WIDTH_NPAGES; i++) sfree(pages[i]);
+    sfree(pages);
+    _widthPages[slot] = nullptr;
+  }
+}
+
+const QPixmap* Widget::glyph(const QFont& font, uint fontslot, wchar_t chr,
+                             const QColor& fg, int cellwidth,
+                             int fontHeight) {
+  GlyphKey key = {(uint)chr, fontslot, fg.rgba()};
+  QPixmap* pm = _glyphCache.object(key);
+  if (pm) return pm;
+
+  /*
+   * Render the character once, centred in its cell in exactly the
+   * place the uncached path in drawText() would put it, and keep
+   * the result for next time.
+   */
+  QString qtext = QString::fromWCharArray(&chr, 1);
   QFontMetrics fm(font);
-  return fm.width(uchr);
+  pm = new QPixmap(cellwidth, fontHeight);
+  pm->fill(Qt::transparent);
+  {
+    QPainter p(pm);
+    p.setFont(font);
+    p.setPen(fg);
+    p.setLayoutDirection(Qt::LeftToRight);
+    p.drawText((cellwidth - fm.horizontalAdvance(qtext)) / 2,
+               _inst->font_ascent + (fontHeight - fm.height()) / 2, qtext);
+  }
+  if (!_glyphCache.insert(key, pm, cellwidth * fontHeight * 4))
+    return nullptr; /* too big to cache at all, and already deleted */
+  return pm;
 }
 
 void Widget::drawTrustSigil(TermWin* tw, int cx, int cy) {
@@ -209,16 +317,17 @@ void Widget::drawTrustSigil(TermWin* tw, int cx, int cy) {
     inst->trust_sigil_w = w;
     inst->trust_sigil_h = h;
   }
-  mpainter->drawPixmap(x, y, *inst->trust_sigil_pm);
+  _sigilOps.append(QPoint(x, y));
 
-  update(x, y, w, h);
+  _damage += QRect(x, y, w, h);
 }
 
 void Widget::drawText(QPainter& painter, int fontHeight, int x, int y,
                       const wchar_t* string, int len, bool wide, bool bold,
-                      int cellwidth) {
+                      int cellwidth, int fontid) {
   int remainlen;
   bool shadowbold = false;
+  uint fontslot = fontid;
 
   if (wide) cellwidth *= 2;
 
@@ -234,6 +343,7 @@ void Widget::drawText(QPainter& painter, int fontHeight, int x, int y,
     // }
     ft.setBold(true);
     painter.setFont(ft);
+    fontslot |= GLYPH_SYNTHBOLD;
   }
 
   /*
@@ -244,6 +354,7 @@ void Widget::drawText(QPainter& painter, int fontHeight, int x, int y,
   while (remainlen > 0) {
     size_t n;
     int desired = cellwidth;
+    bool cacheable;
 
     /*
      * We want to display every character from this string in
@@ -271,12 +382,15 @@ void Widget::drawText(QPainter& painter, int fontHeight, int x, int y,
 
     n = 1;
 
-    if (is_rtl(string[0]) || fontCharWidth(ft, string[n - 1]) != desired) {
+    if (is_rtl(string[0]) ||
+        fontCharWidth(ft, fontslot, string[n - 1]) != desired) {
       /*
        * If this character is a right-to-left one, or has an
        * unusual width, then we must display it on its own.
        */
+      cacheable = false;
     } else {
+      cacheable = true;
       /*
        * Try to amalgamate a contiguous string of characters
        * with the expected sensible width, for the common case
@@ -286,7 +400,7 @@ void Widget::drawText(QPainter& painter, int fontHeight, int x, int y,
       while (n < remainlen) {
         n++;
         if (is_rtl(string[n - 1]) ||
-            fontCharWidth(ft, string[n - 1]) != desired) {
+            fontCharWidth(ft, fontslot, string[n - 1]) != desired) {
           // clen = oldclen;
           n--;
           break;
@@ -294,12 +408,40 @@ void Widget::drawText(QPainter& painter, int fontHeight, int x, int y,
       }
     }
 
-    QString qtext = QString::fromWCharArray(string, n);
-    QFontMetrics fm(ft);
-    int hadvance = fm.horizontalAdvance(qtext);
+    /*
+     * Characters that fit their cells exactly are drawn by blitting a
+     * cached rendering of each one, which saves going through text
+     * layout and shaping for every character of every repaint. Spaces
+     * need nothing drawing over the background at all.
+     */
+    size_t done = 0;
+    if (cacheable) {
+      QColor fg = painter.pen().color();
+      for (; done < n; done++) {
+        if (string[done] == L' ') continue;
+        const QPixmap* pm =
+            glyph(ft, fontslot, string[done], fg, cellwidth, fontHeight);
+        if (!pm) break;
+        painter.drawPixmap(x + done * cellwidth, y - _inst->font_ascent, *pm);
+      }
+    }
 
-    painter.drawText(x + (n * cellwidth - hadvance) / 2,
-                     y + (fontHeight - fm.height()) / 2, qtext);
+    if (done < n) {
+      QString qtext = QString::fromWCharArray(string + done, n - done);
+      QFontMetrics fm(ft);
+      int hadvance = fm.horizontalAdvance(qtext);
+
+      /*
+       * Unlike the cached glyphs, text drawn directly can spill out of
+       * its cells, so clip it to them.
+       */
+      painter.setClipRect(x + done * cellwidth, y - _inst->font_ascent,
+                          (n - done) * cellwidth, fontHeight);
+      painter.drawText(x + done * cellwidth +
+                           ((n - done) * cellwidth - hadvance) / 2,
+                       y + (fontHeight - fm.height()) / 2, qtext);
+      painter.setClipping(false);
+    }
 
     remainlen -= n;
     string += n;
@@ -342,9 +484,9 @@ void Widget::drawCombining(QPainter& ctx, int fontHeight, int x, int y,
   sfree(tmpstring);
 }
 
-void Widget::doTextInternal(QtFrontend* inst, QPainter& painter, int x, int y,
-                            wchar_t* text, int len, unsigned long attr,
-                            int lattr, truecolour truecolour) {
+void Widget::doTextInternal(QtFrontend* inst, int x, int y, wchar_t* text,
+                            int len, unsigned long attr, int lattr,
+                            truecolour truecolour) {
   int ncombining;
   int nfg, nbg, t, fontid, rlen, widefactor;
   bool bold;
@@ -442,88 +584,128 @@ void Widget::doTextInternal(QtFrontend* inst, QPainter& painter, int x, int y,
              y * _inst->font_height + inst->window_border,
              rlen * widefactor * inst->font_width, inst->font_height);
 
-  painter.save();
-  QRect maprect = rect;
-  painter.setClipRect(maprect);
-
-  // printf("[Text::drawText]draw_stretch_after \n");
-  std::string sdtext =
-      QString::fromWCharArray(text, len).toLocal8Bit().toStdString();
-
+  QColor bg, fg;
   if (truecolour.bg.enabled) {
     bool dim = attr & ATTR_DIM;
     uint8_t r = truecolour.bg.r * 1.0 * (dim ? 2 / 3 : 1.0);
     uint8_t g = truecolour.bg.g * 1.0 * (dim ? 2 / 3 : 1.0);
     uint8_t b = truecolour.bg.b * 1.0 * (dim ? 2 / 3 : 1.0);
-
-    QColor trcol(r, g, b);
-
-    painter.fillRect(maprect, trcol);
-    // printf("bg trcolor %d is %s
-    // %d\n",nbg,trcol.name().toLocal8Bit().toStdString().c_str(),trcol.isValid());
+    bg = QColor(r, g, b);
   } else {
-    painter.fillRect(maprect, _inst->cols[nbg]);
-    // printf("bg colcolor %d is %s
-    // %d\n",nbg,_inst->cols[nbg].name().toLocal8Bit().toStdString().c_str(),_inst->cols[nbg].isValid());
+    bg = _inst->cols[nbg];
   }
-
-  painter.setFont(*_inst->fonts[fontid]);
   if (truecolour.fg.enabled) {
     bool dim = attr & ATTR_DIM;
     uint8_t r = truecolour.fg.r * 1.0 * (dim ? 2 / 3 : 1.0);
     uint8_t g = truecolour.fg.g * 1.0 * (dim ? 2 / 3 : 1.0);
     uint8_t b = truecolour.fg.b * 1.0 * (dim ? 2 / 3 : 1.0);
-    QColor trcol(r, g, b);
-    painter.setPen(trcol);
-    // printf("fg trcolor %d is %s
-    // %d\n",nfg,trcol.name().toLocal8Bit().toStdString().c_str(),trcol.isValid());
+    fg = QColor(r, g, b);
   } else {
-    painter.setPen(_inst->cols[nfg]);
-    // printf("fg colcolor %d is %s
-    // %d\n",nfg,_inst->cols[nfg].name().toLocal8Bit().toStdString().c_str(),_inst->cols[nfg].isValid());
+    fg = _inst->cols[nfg];
   }
 
-  if ((lattr & LATTR_MODE) != LATTR_NORM) {
-    // draw_stretch_before(inst,
-    //                     x*inst->font_width+inst->window_border,
-    //                     y*inst->font_height+inst->window_border,
-    //                     rlen*widefactor*inst->font_width, true,
-    //                     inst->font_height,
-    //                     ((lattr & LATTR_MODE) != LATTR_WIDE),
-    //                     ((lattr & LATTR_MODE) == LATTR_BOT));
-    //printf("[Text::drawText]draw_stretch_before\n");
+  /*
+   * Backgrounds are merged with the previous one if it is the same
+   * colour and directly to its left, which is what do_paint gives us
+   * for every run boundary that's only a foreground or font change.
+   */
+  if (!_bgOps.isEmpty() && _bgOps.last().colour == bg &&
+      _bgOps.last().rect.top() == rect.top() &&
+      _bgOps.last().rect.right() + 1 == rect.left()) {
+    _bgOps.last().rect.setRight(rect.right());
+  } else {
+    BgOp op = {rect, bg};
+    _bgOps.append(op);
   }
 
-  // qreal pxratio = mcanvas->devicePixelRatio();
+  TextOp op;
+  op.rect = rect;
+  op.fg = fg;
+  op.fontid = fontid;
+  op.bold = bold;
+  op.wide = widefactor > 1;
+  op.ncombining = ncombining;
+  op.start = _textChars.size();
+  op.len = (ncombining > 1 ? ncombining : len);
+  for (int i = 0; i < op.len; i++) _textChars.append(text[i]);
+  _textOps.append(op);
+}
+
+void Widget::flushDrawList(QPainter& painter) {
+  for (const BgOp& op : _bgOps) painter.fillRect(op.rect, op.colour);
 
+  /*
+   * Draw the text sorted by font and colour, so that the painter
+   * state only changes when one of those does rather than once per
+   * run. The runs don't overlap, so the order doesn't matter to the
+   * result.
+   */
+  QVector<int> order(_textOps.size());
+  for (int i = 0; i < order.size(); i++) order[i] = i;
+  std::stable_sort(order.begin(), order.end(), [this](int a, int b) {
+    const TextOp &ta = _textOps[a], &tb = _textOps[b];
+    if (ta.fontid != tb.fontid) return ta.fontid < tb.fontid;
+    if (ta.bold != tb.bold) return ta.bold < tb.bold;
+    return ta.fg.rgba() < tb.fg.rgba();
+  });
+
+  int curfont = -1;
+  QRgb curfg = 0;
+  bool havefg = false;
   painter.setLayoutDirection(Qt::LeftToRight);
+  for (int i : order) {
+    const TextOp& op = _textOps[i];
+    int fontkey = op.fontid | (op.bold ? GLYPH_SYNTHBOLD : 0);
+    if (fontkey != curfont) {
+      painter.setFont(*_inst->fonts[op.fontid]);
+      curfont = fontkey;
+    }
+    if (!havefg || op.fg.rgba() != curfg) {
+      painter.setPen(op.fg);
+      curfg = op.fg.rgba();
+      havefg = true;
+    }
 
-  if (ncombining > 1) {
-    assert(len == 1);
-    drawCombining(
-        painter, _inst->font_height,
-        x * _inst->font_width + inst->window_border,
-        y * _inst->font_height + inst->window_border + _inst->font_ascent, text,
-        ncombining, widefactor > 1, bold, inst->font_width);
-  } else {
-    drawText(painter, _inst->font_height,
-             x * _inst->font_width + inst->window_border,
-             y * _inst->font_height + inst->window_border + _inst->font_ascent,
-             text, len, widefactor > 1, bold, inst->font_width);
+    const wchar_t* text = _textChars.constData() + op.start;
+    if (op.ncombining > 1) {
+      painter.setClipRect(op.rect);
+      drawCombining(painter, _inst->font_height, op.rect.left(),
+                    op.rect.top() + _inst->font_ascent, text, op.len,
+                    op.wide, op.bold, _inst->font_width);
+      painter.setClipping(false);
+    } else {
+      drawText(painter, _inst->font_height, op.rect.left(),
+               op.rect.top() + _inst->font_ascent, text, op.len, op.wide,
+               op.bold, _inst->font_width, op.fontid);
+    }
   }
 
-  if ((lattr & LATTR_MODE) != LATTR_NORM) {
-    // draw_stretch_after(inst,
-    //                    x*inst->font_width+inst->window_border,
-    //                    y*inst->font_height+inst->window_border,
-    //                    rlen*widefactor*inst->font_width, true,
-    //                    inst->font_height,
-    //                    ((lattr & LATTR_MODE) != LATTR_WIDE),
-    //                    ((lattr & LATTR_MODE) == LATTR_BOT));
-    //printf("[Text::drawText]draw_stretch_after\n");
+  for (const QPoint& pt : _sigilOps)
+    painter.drawPixmap(pt, *_inst->trust_sigil_pm);
+
+  for (const CursorOp& op : _cursorOps) {
+    painter.setPen(_inst->cols[261]);
+    switch (op.kind) {
+      case CursorOp::Box:
+        painter.fillRect(op.rect, _inst->cols[261]);
+        break;
+      case CursorOp::Dotted:
+        for (int i = 0; i < op.length; i += 2)
+          painter.drawPoint(op.from.x() + i * op.dx, op.from.y() + i * op.dy);
+        break;
+      case CursorOp::Line:
+        painter.drawLine(op.from.x(), op.from.y(),
+                         op.from.x() + (op.length - 1) * op.dx,
+                         op.from.y() + (op.length - 1) * op.dy);
+        break;
+    }
   }
 
-  painter.restore();
+  _bgOps.clear();
+  _textOps.clear();
+  _textChars.clear();
+  _sigilOps.clear();
+  _cursorOps.clear();
 }
 
 void Widget::drawCursor(TermWin* tw, int x, int y, wchar_t* text, int len,
@@ -542,7 +724,7 @@ void Widget::drawCursor(TermWin* tw, int x, int y, wchar_t* text, int len,
     active = true;
   } else
     active = false;
-  doTextInternal(inst, *mpainter, x, y, text, len, attr, lattr, tc);
+  doTextInternal(inst, x, y, text, len, attr, lattr, tc);
 
   if (attr & TATTR_COMBINING) len = 1;
 
@@ -568,11 +750,13 @@ void Widget::drawCursor(TermWin* tw, int x, int y, wchar_t* text, int len,
      */
 
     if (passive) {
-      QRect rect(x * inst->font_width + inst->window_border,
-                 y * inst->font_height + inst->window_border,
-                 len * widefactor * inst->font_width - 1,
-                 inst->font_height - 1);
-      mpainter->fillRect(rect, inst->cols[261]);
+      CursorOp op;
+      op.kind = CursorOp::Box;
+      op.rect = QRect(x * inst->font_width + inst->window_border,
+                      y * inst->font_height + inst->window_border,
+                      len * widefactor * inst->font_width - 1,
+                      inst->font_height - 1);
+      _cursorOps.append(op);
 
       // draw_set_colour(inst, , false);
       // draw_rectangle(inst, false,
@@ -583,7 +767,7 @@ void Widget::drawCursor(TermWin* tw, int x, int y, wchar_t* text, int len,
     }
   } else {
     int uheight;
-    int startx, starty, dx, dy, length, i;
+    int startx, starty, dx, dy, length;
 
     int char_width;
 
@@ -611,28 +795,20 @@ void Widget::drawCursor(TermWin* tw, int x, int y, wchar_t* text, int len,
       length = inst->font_height;
     }
 
-    mpainter->setPen(inst->cols[261]);
-    // draw_set_colour(inst, 261, false);
-    if (passive) {
-      for (i = 0; i < length; i++) {
-        if (i % 2 == 0) {
-          mpainter->drawPoint(startx, starty);
-          // draw_point(inst, startx, starty);
-        }
-        startx += dx;
-        starty += dy;
-      }
-    } else if (active) {
-      mpainter->drawLine(startx, starty, startx + (length - 1) * dx,
-                         starty + (length - 1) * dy);
-      // draw_line(inst, startx, starty,
-      //           startx + (length-1) * dx, starty + (length-1) * dy);
+    if (passive || active) {
+      CursorOp op;
+      op.kind = passive ? CursorOp::Dotted : CursorOp::Line;
+      op.from = QPoint(startx, starty);
+      op.dx = dx;
+      op.dy = dy;
+      op.length = length;
+      _cursorOps.append(op);
     } /* else no cursor (e.g., blinked off) */
   }
 
-  update(x * inst->font_width + inst->window_border,
-         y * inst->font_height + inst->window_border,
-         len * widefactor * inst->font_width, inst->font_height);
+  _damage += QRect(x * inst->font_width + inst->window_border,
+                   y * inst->font_height + inst->window_border,
+                   len * widefactor * inst->font_width, inst->font_height);
 }
 
 void Widget::drawText(TermWin* tw, int x, int y, wchar_t* text, int len,
@@ -641,7 +817,7 @@ void Widget::drawText(TermWin* tw, int x, int y, wchar_t* text, int len,
   // painter.begin(mcanvas);
   QtFrontend* inst = container_of(tw, struct QtFrontend, termwin);
   int widefactor;
-  doTextInternal(inst, *mpainter, x, y, text, len, attr, lattr, truecolour);
+  doTextInternal(inst, x, y, text, len, attr, lattr, truecolour);
   if (attr & ATTR_WIDE) {
     widefactor = 2;
   } else {
@@ -655,9 +831,9 @@ void Widget::drawText(TermWin* tw, int x, int y, wchar_t* text, int len,
       len = (inst->term->cols - x) / 2 / widefactor; /* trim to LH half */
     len *= 2;
   }
-  update(x * inst->font_width + inst->window_border,
-         y * inst->font_height + inst->window_border,
-         len * widefactor * inst->font_width, inst->font_height);
+  _damage += QRect(x * inst->font_width + inst->window_border,
+                   y * inst->font_height + inst->window_border,
+                   len * widefactor * inst->font_width, inst->font_height);
 }
 
 void Widget::sendText(const QString& text) const {
@@ -930,7 +1106,7 @@ void Widget::drawBackingRect(const QColor &color,QRect &rect)
 
     mpainter->fillRect(rect, color);
 
-    update(rect);
+    _damage += rect;
 }
 
 void Widget::scale(int width, int height) {
@@ -943,6 +1119,8 @@ void Widget::scale(int width, int height) {
     _inst->fonts[0]->setStyleStrategy(QFont::NoAntialias);
   }
   setFont(*_inst->fonts[0]);
+  _glyphCache.clear();
+  clearWidthCache();
 }
 
 void* Widget::realObject() { return this; }
@@ -960,16 +1138,29 @@ void Widget::copy() {
 }
 
 void Widget::paste() {
+  QString text;
   if (QApplication::clipboard()->mimeData(QClipboard::Selection)) {
-    sendText(QApplication::clipboard()->text(QClipboard::Selection));
+    text = QApplication::clipboard()->text(QClipboard::Selection);
   } else {
-    sendText(QApplication::clipboard()->text());
+    text = QApplication::clipboard()->text();
   }
+  // Let the terminal filter the paste and feed it to the backend a
+  // chunk at a time, rather than sending it all in one go. Handing
+  // it over as UTF-8 avoids making a wide-character copy of the lot.
+  QByteArray utf8 = text.toUtf8();
+  term_do_paste_utf8(_inst->term, utf8.constData(), utf8.size());
 }
 
 void Widget::copyAll() {
-  static const int clips[] = {COPYALL_CLIPBOARDS};
-  term_copyall(_inst->term, clips, lenof(clips));
+  // Export straight to UTF-8 rather than through term_copyall, which
+  // builds wide-character, attribute and colour arrays for the lot.
+  strbuf *sb = strbuf_new();
+  term_export_text(_inst->term, BinarySink_UPCAST(sb), true);
+  _selectedText = QString::fromUtf8(sb->s, sb->len);
+  strbuf_free(sb);
+#ifndef Q_OS_WIN
+  QApplication::clipboard()->setText(_selectedText, QClipboard::Selection);
+#endif
   QApplication::clipboard()->setText(_selectedText);
 }
 
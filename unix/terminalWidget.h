@@ -24,12 +24,15 @@
 #ifndef _TERMINAL_WIDGET_H
 #define _TERMINAL_WIDGET_H
 
+#include <QCache>
 #include <QHash>
 #include <QPainter>
 #include <QPixmap>
+#include <QRegion>
 #include <QSocketNotifier>
 #include <QTimer>
 #include <QTransform>
+#include <QVector>
 #include <QWidget>
 
 #include "qtFrontend.h"
@@ -44,6 +47,24 @@ extern "C" {
 
 class QPaintEvent;
 namespace PTerminal {
+/*
+ * Key for the rendered-glyph cache: a single character, the font slot it
+ * is drawn from (with GLYPH_SYNTHBOLD set if we had to embolden it
+ * ourselves) and the colour it is drawn in.
+ */
+#define GLYPH_SYNTHBOLD 0x100
+struct GlyphKey {
+  uint chr;
+  uint font;
+  QRgb fg;
+  bool operator==(const GlyphKey& o) const {
+    return chr == o.chr && font == o.font && fg == o.fg;
+  }
+};
+inline uint qHash(const GlyphKey& k, uint seed = 0) {
+  return (k.chr * 31u + k.font) * 0x9E3779B1u ^ k.fg ^ seed;
+}
+
 class Widget : public AbstractTerminalWidget {
   Q_OBJECT
  public:
@@ -56,6 +77,7 @@ class Widget : public AbstractTerminalWidget {
   //                         unsigned long attr);
   virtual void setDrawCtx(TermWin* tw);
   virtual void freeDrawCtx(TermWin* tw);
+  virtual bool scroll(int topline, int botline, int lines);
   virtual void drawText(TermWin* tw, int x, int y, wchar_t* text, int len,
                         unsigned long attr, int lattr, truecolour tc);
   virtual void drawCursor(TermWin* tw, int x, int y, wchar_t* text, int len,
@@ -84,14 +106,17 @@ class Widget : public AbstractTerminalWidget {
   virtual QSize sizeHint() const;
 
   void drawText(QPainter& ctx, int fontHeight, int x, int y, const wchar_t* string,
-                int len, bool wide, bool bold, int cellwidth);
+                int len, bool wide, bool bold, int cellwidth, int fontid);
 
   void drawCombining(QPainter& ctx, int fontHeight, int x, int y,
                      const wchar_t* string, int len, bool wide, bool bold,
                      int cellwidth);
 
  private:
-  int fontCharWidth(QFont& font, wchar_t uchr);
+  int fontCharWidth(QFont& font, uint fontslot, wchar_t uchr);
+  void clearWidthCache();
+  const QPixmap* glyph(const QFont& font, uint fontslot, wchar_t chr,
+                       const QColor& fg, int cellwidth, int fontHeight);
   // bool fontHasGlyph( wchar_t glyph);
 
  signals:
@@ -104,7 +129,6 @@ class Widget : public AbstractTerminalWidget {
   virtual void clearScrollback();
   virtual void reset();
   virtual void restart();
-  virtual void scroll(int lines);
   virtual void scrollTermTo(int lineNo);
 
  protected:
@@ -153,9 +177,9 @@ class Widget : public AbstractTerminalWidget {
 
  private:
   void setMinDelta(int value);
-  void doTextInternal(QtFrontend* inst, QPainter& painter, int x, int y,
-                      wchar_t* text, int len, unsigned long attr, int lattr,
-                      truecolour truecolour);
+  void doTextInternal(QtFrontend* inst, int x, int y, wchar_t* text, int len,
+                      unsigned long attr, int lattr, truecolour truecolour);
+  void flushDrawList(QPainter& painter);
 
  private:
   struct ::QtFrontend* _inst;
@@ -187,12 +211,57 @@ class Widget : public AbstractTerminalWidget {
   bool bold{false};
   bool shadowalways{false};
   /*
-   * Cache of character widths, indexed by Unicode code point. In
-   * pixels; -1 means we haven't asked Pango about this character
-   * before.
+   * Cache of character widths in pixels, one per font slot that
+   * drawText() can draw from (the four fonts, each possibly with
+   * GLYPH_SYNTHBOLD). Each is a sparse two-level table over all of
+   * Unicode: a lazily allocated array of WIDTH_NPAGES pointers to
+   * pages of WIDTH_PAGE_SIZE widths, where -1 means we haven't asked
+   * QFontMetrics about that character before.
    */
-  int* widthcache{nullptr};
-  unsigned nwidthcache{0};
+  qint16** _widthPages[8]{};
+  /*
+   * Rendered glyphs, each a cell-sized pixmap with a transparent
+   * background. The cost of an entry is its size in bytes, so the
+   * least recently used glyphs are evicted once the cache grows past
+   * GLYPH_CACHE_BYTES. _glyphFontKey records the fonts the cache was
+   * filled from, so that a font change throws it away.
+   */
+  QCache<GlyphKey, QPixmap> _glyphCache;
+  QString _glyphFontKey;
+
+  /*
+   * Draw list for the frame in progress. Everything the terminal asks
+   * us to draw between setDrawCtx() and freeDrawCtx() is queued here,
+   * and flushDrawList() then paints it in one pass: all backgrounds
+   * (merged along each row), then the text sorted by font and colour,
+   * then trust sigils and finally the cursor on top.
+   */
+  struct BgOp {
+    QRect rect;
+    QColor colour;
+  };
+  struct TextOp {
+    QRect rect;
+    QColor fg;
+    int fontid;
+    bool bold, wide;
+    int ncombining;
+    int start, len; /* slice of _textChars */
+  };
+  struct CursorOp {
+    enum { Box, Dotted, Line } kind;
+    QRect rect;  /* Box */
+    QPoint from; /* Dotted and Line */
+    int dx, dy, length;
+  };
+  QVector<BgOp> _bgOps;
+  QVector<TextOp> _textOps;
+  QVector<wchar_t> _textChars;
+  QVector<QPoint> _sigilOps;
+  QVector<CursorOp> _cursorOps;
+
+  /* Union of the canvas areas drawn on in the frame in progress. */
+  QRegion _damage;
 };
 }  // namespace PTerminal
 
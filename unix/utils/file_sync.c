@@ -0,0 +1,8 @@
+#include <unistd.h>
+
+#include "putty.h"
+
+bool file_sync(FILE *fp)
+{
+    return fsync(fileno(fp)) == 0;
+}
@@ -0,0 +1,78 @@
+/*
+ * Unix implementation of the WorkerThread API, using pthreads.
+ */
+
+#include <signal.h>
+#include <pthread.h>
+
+#include "putty.h"
+
+struct WorkerThread {
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    bool started;
+    void (*fn)(void *);
+    void *ctx;
+};
+
+WorkerThread *worker_thread_new(void)
+{
+    WorkerThread *wt = snew(WorkerThread);
+    pthread_mutex_init(&wt->mutex, NULL);
+    pthread_cond_init(&wt->cond, NULL);
+    wt->started = false;
+    return wt;
+}
+
+static void *worker_thread_main(void *vwt)
+{
+    WorkerThread *wt = (WorkerThread *)vwt;
+    sigset_t set;
+
+    /* Leave all signal handling to the main thread */
+    sigfillset(&set);
+    pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+    wt->fn(wt->ctx);
+    return NULL;
+}
+
+bool worker_thread_start(WorkerThread *wt, void (*fn)(void *), void *ctx)
+{
+    assert(!wt->started);
+    wt->fn = fn;
+    wt->ctx = ctx;
+    wt->started = (pthread_create(&wt->thread, NULL,
+                                  worker_thread_main, wt) == 0);
+    return wt->started;
+}
+
+void worker_thread_free(WorkerThread *wt)
+{
+    if (wt->started)
+        pthread_join(wt->thread, NULL);
+    pthread_cond_destroy(&wt->cond);
+    pthread_mutex_destroy(&wt->mutex);
+    sfree(wt);
+}
+
+void worker_lock(WorkerThread *wt)
+{
+    pthread_mutex_lock(&wt->mutex);
+}
+
+void worker_unlock(WorkerThread *wt)
+{
+    pthread_mutex_unlock(&wt->mutex);
+}
+
+void worker_wait(WorkerThread *wt)
+{
+    pthread_cond_wait(&wt->cond, &wt->mutex);
+}
+
+void worker_wake(WorkerThread *wt)
+{
+    pthread_cond_broadcast(&wt->cond);
+}
@@ -351,6 +351,13 @@ static size_t gtk_seat_output(Seat *seat, SeatOutputType type,
     return term_data(inst->term, data, len);
 }
 
+static void gtk_seat_sent(Seat *seat, size_t bufsize)
+{
+    GtkFrontend *inst = container_of(seat, GtkFrontend, seat);
+    if (inst->term)
+        term_backend_sent(inst->term, bufsize);
+}
+
 static void gtkwin_unthrottle(TermWin *win, size_t bufsize)
 {
     GtkFrontend *inst = container_of(win, GtkFrontend, termwin);
@@ -422,7 +429,7 @@ static bool gtk_seat_get_cursor_position(Seat *seat, int *x, int *y);
 static const SeatVtable gtk_seat_vt = {
     .output = gtk_seat_output,
     .eof = gtk_seat_eof,
-    .sent = nullseat_sent,
+    .sent = gtk_seat_sent,
     .banner = nullseat_banner_to_stderr,
     .get_userpass_input = gtk_seat_get_userpass_input,
     .notify_session_started = nullseat_notify_session_started,
@@ -2955,17 +2962,11 @@ static void clipboard_text_received(GtkClipboard *clipboard,
                                     const gchar *text, gpointer data)
 {
     GtkFrontend *inst = (GtkFrontend *)data;
-    wchar_t *paste;
-    size_t paste_len;
 
     if (!text)
         return;
 
-    paste = dup_mb_to_wc(CS_UTF8, text, length, &paste_len);
-
-    term_do_paste(inst->term, paste, paste_len);
-
-    sfree(paste);
+    term_do_paste_utf8(inst->term, text, strlen(text));
 }
 
 static void gtkwin_clip_request_paste(TermWin *tw, int clipboard)
@@ -3329,9 +3330,13 @@ static void selection_received(GtkWidget *widget, GtkSelectionData *seldata,
         }
     }
 
-    paste = dup_mb_to_wc_c(charset, text, length, &paste_len);
-    term_do_paste(inst->term, paste, paste_len);
-    sfree(paste);
+    if (charset == CS_UTF8) {
+        term_do_paste_utf8(inst->term, text, length);
+    } else {
+        paste = dup_mb_to_wc_c(charset, text, length, &paste_len);
+        term_do_paste(inst->term, paste, paste_len);
+        sfree(paste);
+    }
 
 #ifndef NOT_X_WINDOWS
     if (free_list_required)
@@ -3520,6 +3525,15 @@ static int gtkwin_char_width(TermWin *tw, int uc)
     return 1;
 }
 
+static bool gtkwin_scroll(TermWin *tw, int topline, int botline, int lines)
+{
+    /*
+     * We don't try to move pixels around on the backing surface, so
+     * the terminal will simply redraw the lines that moved.
+     */
+    return false;
+}
+
 static bool gtkwin_setup_draw_ctx(TermWin *tw)
 {
     GtkFrontend *inst = container_of(tw, GtkFrontend, termwin);
@@ -5280,6 +5294,7 @@ static const TermWinVtable gtk_termwin_vt = {
     .draw_cursor = gtkwin_draw_cursor,
     .draw_trust_sigil = gtkwin_draw_trust_sigil,
     .char_width = gtkwin_char_width,
+    .scroll = gtkwin_scroll,
     .free_draw_ctx = gtkwin_free_draw_ctx,
     .set_cursor_pos = gtkwin_set_cursor_pos,
     .set_raw_mouse_mode = gtkwin_set_raw_mouse_mode,
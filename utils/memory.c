@@ -16,6 +16,10 @@
 #include "puttymem.h"
 #include "misc.h"
 
+#ifdef COUNT_ALLOCATIONS
+size_t allocation_count;
+#endif
+
 void *safemalloc(size_t factor1, size_t factor2, size_t addend)
 {
     if (factor1 > SIZE_MAX / factor2)
@@ -31,6 +35,10 @@ void *safemalloc(size_t factor1, size_t factor2, size_t addend)
     if (size == 0)
         size = 1;
 
+#ifdef COUNT_ALLOCATIONS
+    allocation_count++;
+#endif
+
     void *p;
 #ifdef MINEFIELD
     p = minefield_c_malloc(size);
@@ -57,6 +65,9 @@ void *saferealloc(void *ptr, size_t n, size_t size)
         p = NULL;
     } else {
         size *= n;
+#ifdef COUNT_ALLOCATIONS
+        allocation_count++;
+#endif
         if (!ptr) {
 #ifdef MINEFIELD
             p = minefield_c_malloc(size);
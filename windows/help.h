@@ -22,6 +22,8 @@ typedef const char *HelpCtx;
 #define WINHELP_CTX_logging_filename "config-logfilename"
 #define WINHELP_CTX_logging_exists "config-logfileexists"
 #define WINHELP_CTX_logging_flush "config-logflush"
+#define WINHELP_CTX_logging_overflow "config-logoverflow"
+#define WINHELP_CTX_logging_syncinterval "config-logsyncinterval"
 #define WINHELP_CTX_logging_header "config-logheader"
 #define WINHELP_CTX_logging_ssh_omit_password "config-logssh"
 #define WINHELP_CTX_logging_ssh_omit_data "config-logssh"
@@ -64,6 +66,7 @@ typedef const char *HelpCtx;
 #define WINHELP_CTX_bell_taskbar "config-belltaskbar"
 #define WINHELP_CTX_bell_overload "config-bellovl"
 #define WINHELP_CTX_window_size "config-winsize"
+#define WINHELP_CTX_window_reflow "config-reflow"
 #define WINHELP_CTX_window_resize "config-winsizelock"
 #define WINHELP_CTX_window_scrollback "config-scrollback"
 #define WINHELP_CTX_window_erased "config-erasetoscrollback"
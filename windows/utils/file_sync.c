@@ -0,0 +1,9 @@
+#include <io.h>
+
+#include "putty.h"
+
+bool file_sync(FILE *fp)
+{
+    HANDLE h = (HANDLE)_get_osfhandle(_fileno(fp));
+    return h != INVALID_HANDLE_VALUE && FlushFileBuffers(h);
+}
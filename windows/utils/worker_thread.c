@@ -0,0 +1,78 @@
+/*
+ * Windows implementation of the WorkerThread API.
+ *
+ * The condition is an auto-reset event rather than a condition
+ * variable, since those need Vista. That's enough for the API's
+ * promises: only one thread waits at a time, and a wake that arrives
+ * while nobody is waiting just makes the next wait return at once.
+ */
+
+#include "putty.h"
+
+struct WorkerThread {
+    HANDLE thread;
+    CRITICAL_SECTION crit;
+    HANDLE event;
+    void (*fn)(void *);
+    void *ctx;
+};
+
+WorkerThread *worker_thread_new(void)
+{
+    WorkerThread *wt = snew(WorkerThread);
+    InitializeCriticalSection(&wt->crit);
+    wt->event = CreateEvent(NULL, false, false, NULL);
+    wt->thread = NULL;
+    return wt;
+}
+
+static DWORD WINAPI worker_thread_main(void *vwt)
+{
+    WorkerThread *wt = (WorkerThread *)vwt;
+    wt->fn(wt->ctx);
+    return 0;
+}
+
+bool worker_thread_start(WorkerThread *wt, void (*fn)(void *), void *ctx)
+{
+    DWORD id;
+
+    assert(!wt->thread);
+    wt->fn = fn;
+    wt->ctx = ctx;
+    wt->thread = CreateThread(NULL, 0, worker_thread_main, wt, 0, &id);
+    return wt->thread != NULL;
+}
+
+void worker_thread_free(WorkerThread *wt)
+{
+    if (wt->thread) {
+        WaitForSingleObject(wt->thread, INFINITE);
+        CloseHandle(wt->thread);
+    }
+    CloseHandle(wt->event);
+    DeleteCriticalSection(&wt->crit);
+    sfree(wt);
+}
+
+void worker_lock(WorkerThread *wt)
+{
+    EnterCriticalSection(&wt->crit);
+}
+
+void worker_unlock(WorkerThread *wt)
+{
+    LeaveCriticalSection(&wt->crit);
+}
+
+void worker_wait(WorkerThread *wt)
+{
+    LeaveCriticalSection(&wt->crit);
+    WaitForSingleObject(wt->event, INFINITE);
+    EnterCriticalSection(&wt->crit);
+}
+
+void worker_wake(WorkerThread *wt)
+{
+    SetEvent(wt->event);
+}
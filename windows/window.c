@@ -153,6 +153,7 @@ static void wintw_draw_cursor(TermWin *, int x, int y, wchar_t *text, int len,
                               unsigned long attrs, int lattrs, truecolour tc);
 static void wintw_draw_trust_sigil(TermWin *, int x, int y);
 static int wintw_char_width(TermWin *, int uc);
+static bool wintw_scroll(TermWin *, int topline, int botline, int lines);
 static void wintw_free_draw_ctx(TermWin *);
 static void wintw_set_cursor_pos(TermWin *, int x, int y);
 static void wintw_set_raw_mouse_mode(TermWin *, bool enable);
@@ -182,6 +183,7 @@ static const TermWinVtable windows_termwin_vt = {
     .draw_cursor = wintw_draw_cursor,
     .draw_trust_sigil = wintw_draw_trust_sigil,
     .char_width = wintw_char_width,
+    .scroll = wintw_scroll,
     .free_draw_ctx = wintw_free_draw_ctx,
     .set_cursor_pos = wintw_set_cursor_pos,
     .set_raw_mouse_mode = wintw_set_raw_mouse_mode,
@@ -235,6 +237,7 @@ static StripCtrlChars *win_seat_stripctrl_new(
 static size_t win_seat_output(
     Seat *seat, SeatOutputType type, const void *, size_t);
 static bool win_seat_eof(Seat *seat);
+static void win_seat_sent(Seat *seat, size_t bufsize);
 static SeatPromptResult win_seat_get_userpass_input(Seat *seat, prompts_t *p);
 static void win_seat_notify_remote_exit(Seat *seat);
 static void win_seat_connection_fatal(Seat *seat, const char *msg);
@@ -249,7 +252,7 @@ static bool win_seat_get_window_pixel_size(Seat *seat, int *x, int *y);
 static const SeatVtable win_seat_vt = {
     .output = win_seat_output,
     .eof = win_seat_eof,
-    .sent = nullseat_sent,
+    .sent = win_seat_sent,
     .banner = nullseat_banner_to_stderr,
     .get_userpass_input = win_seat_get_userpass_input,
     .notify_session_started = nullseat_notify_session_started,
@@ -4066,6 +4069,12 @@ static void wintw_draw_trust_sigil(TermWin *tw, int x, int y)
                wgs->font_width * 2, wgs->font_height, 0, NULL, DI_NORMAL);
 }
 
+static bool wintw_scroll(TermWin *tw, int topline, int botline, int lines)
+{
+    /* Scrolled lines are redrawn from scratch by the terminal. */
+    return false;
+}
+
 /* This function gets the actual width of a character in the normal font.
  */
 static int wintw_char_width(TermWin *tw, int uc)
@@ -5044,7 +5053,7 @@ static void wintw_clip_write(
     memcpy(lock, data, len * sizeof(wchar_t));
     WideCharToMultiByte(CP_ACP, 0, data, len, lock2, len2, NULL, NULL);
 
-    if (conf_get_bool(wgs->conf, CONF_rtf_paste)) {
+    if (attr && conf_get_bool(wgs->conf, CONF_rtf_paste)) {
         wchar_t unitab[256];
         strbuf *rtf = strbuf_new();
         unsigned char *tdata = (unsigned char *)lock2;
@@ -5433,11 +5442,9 @@ static void process_clipdata(WinGuiSeat *wgs, HGLOBAL clipdata, bool unicode)
         if (p) {
             /* Unwilling to rely on Windows having wcslen() */
             for (p2 = p; *p2; p2++);
-            clipboard_length = p2 - p;
-            clipboard_contents = snewn(clipboard_length + 1, wchar_t);
-            memcpy(clipboard_contents, p, clipboard_length * sizeof(wchar_t));
-            clipboard_contents[clipboard_length] = L'\0';
-            term_do_paste(wgs->term, clipboard_contents, clipboard_length);
+            /* The terminal takes its own copy, as UTF-8, so there's
+             * no need to copy the clipboard data here first */
+            term_do_paste(wgs->term, p, p2 - p);
         }
     } else {
         char *s = GlobalLock(clipdata);
@@ -5871,6 +5878,13 @@ static size_t win_seat_output(Seat *seat, SeatOutputType type,
     return term_data(wgs->term, data, len);
 }
 
+static void win_seat_sent(Seat *seat, size_t bufsize)
+{
+    WinGuiSeat *wgs = container_of(seat, WinGuiSeat, seat);
+    if (wgs->term)
+        term_backend_sent(wgs->term, bufsize);
+}
+
 static void wintw_unthrottle(TermWin *tw, size_t bufsize)
 {
     WinGuiSeat *wgs = container_of(tw, WinGuiSeat, termwin);